@@ -0,0 +1,386 @@
+// Benchmark.cpp
+// author: Cheuk-Hang Tse
+// This file contains the implementation of the BenchmarkSuite class.
+//
+// CONSTRUCTOR:
+// BenchmarkSuite(const BenchmarkConfig& _config): define a suite with the sizes and work directory in _config
+//
+// FUNCTIONS:
+// run: run every benchmark and write the results to a JSON file
+// benchDistance: time the distance kernels
+// benchTraining: time the training on every dataset size, k and training mode
+// benchQueries: time cluster, related and nearest on a trained model
+// benchDatasetIO: time reading and writing the dataset in both formats
+// benchPoseProcessing: time pre_processPoints and findBodyPartPosition
+// writeDataset: write a synthetic pose dataset with clustered points
+// timePerCall: call a function until enough time passed and return the mean time of a call
+// record: add a result to the suite and print it
+// writeJson: write every result to a JSON file
+// elapsedSeconds: return the seconds since a point in time
+// percentile: return a percentile of sorted latencies
+
+#include "Benchmark.h"
+#include "DistanceKernel.h"
+#include "HumanPoseEstimation.h"
+#include "KMeanCluster.h"
+#include "Parallel.h"
+#include "PoseDataset.h"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <ctime>
+#include <filesystem>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <random>
+
+// elapsedSeconds
+// precondition: none
+// postcondition: return the number of seconds from start until now
+static double elapsedSeconds(const std::chrono::steady_clock::time_point start) {
+	return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+// percentile
+// precondition: sorted is sorted in increasing order and not empty, p is from 0 to 1
+// postcondition: return the value below which the fraction p of sorted lies
+static double percentile(const std::vector<double>& sorted, const double p) {
+	size_t i = (size_t)std::ceil(p * sorted.size());
+	return sorted[std::min(sorted.size() - 1, i ? i - 1 : 0)];
+}
+
+// BenchmarkSuite
+// precondition: _config.maxPoints is at least 1000 and every k is positive
+// postcondition: define a suite with the sizes and work directory in _config
+BenchmarkSuite::BenchmarkSuite(const BenchmarkConfig& _config) {
+	config = _config;
+	if (config.workDir.empty())
+		config.workDir = (std::filesystem::temp_directory_path() / "kmean-benchmark").string();
+}
+
+// run
+// precondition: none
+// postcondition: run every benchmark, print every result and write them to jsonFile. The synthetic datasets are removed
+//				  Return false if the work directory or the JSON file could not be written
+bool BenchmarkSuite::run(const std::string jsonFile) {
+	std::error_code error;
+	std::filesystem::create_directories(config.workDir, error);
+	if (!std::filesystem::is_directory(config.workDir)) {
+		std::cout << "Could not create the benchmark directory " << config.workDir << std::endl;
+		return false;
+	}
+	results.clear();
+	benchDistance();
+	benchPoseProcessing();
+	benchDatasetIO();
+	benchQueries();
+	benchTraining();
+
+	// only the files the suite wrote are removed, the directory may be shared
+	for (const auto& entry : std::filesystem::directory_iterator(config.workDir, error)) {
+		if (entry.path().filename().string().rfind("bench-", 0) == 0)
+			std::filesystem::remove(entry.path(), error);
+	}
+	if (!writeJson(jsonFile)) {
+		std::cout << "Could not write the benchmark results to " << jsonFile << std::endl;
+		return false;
+	}
+	std::cout << "Wrote " << results.size() << " benchmark results to " << jsonFile << std::endl;
+	return true;
+}
+
+// benchDistance
+// precondition: none
+// postcondition: record the time of squaredDistance and of nearestCentroid with 16 and 64 centroids for 30, 36 and 17 coordinates
+void BenchmarkSuite::benchDistance() {
+	std::mt19937 rng(1);
+	std::uniform_real_distribution<double> uniform(0, 1);
+	const size_t nPoints = 1024; // enough points that the loop does not run on one cached pair
+	const size_t dims[] = { MPI_POSE_DIMENSION, COCO_POSE_DIMENSION, 17 };
+	for (size_t dim : dims) {
+		std::vector<double> points(nPoints * dim), centroids(64 * dim);
+		for (double& x : points)
+			x = uniform(rng);
+		for (double& x : centroids)
+			x = uniform(rng);
+
+		size_t p = 0;
+		double seconds = timePerCall([&] {
+			sink += squaredDistance(&points[p * dim], &points[((p + 1) % nPoints) * dim], dim);
+			p = (p + 1) % nPoints;
+		});
+		record({ "squaredDistance", { { "dim", std::to_string(dim) }, { "kernel", std::string("\"") + distanceKernelName() + "\"" } },
+			{ { "nsPerCall", seconds * 1e9 } } });
+
+		for (size_t k : { (size_t)16, (size_t)64 }) {
+			seconds = timePerCall([&] {
+				double minDistance;
+				sink += nearestCentroid(&points[p * dim], centroids.data(), k, dim, minDistance);
+				p = (p + 1) % nPoints;
+			});
+			record({ "nearestCentroid", { { "dim", std::to_string(dim) }, { "k", std::to_string(k) } }, { { "nsPerCall", seconds * 1e9 } } });
+		}
+	}
+}
+
+// benchTraining
+// precondition: the work directory exists
+// postcondition: record the load time, the training time and the time per iteration of KMeanCluster for 1e3, 1e4, ... maxPoints
+//				  points of 30 coordinates, every k of config.ks, in Lloyd and Hamerly mode
+void BenchmarkSuite::benchTraining() {
+	for (size_t nPoints = 1000; nPoints <= std::min(config.maxPoints, (size_t)10000000); nPoints *= 10) {
+		std::string fileName = (std::filesystem::path(config.workDir) / ("bench-train-" + std::to_string(nPoints) + ".kmpose")).string();
+		if (!writeDataset(fileName, nPoints, true)) {
+			std::cout << "Could not write " << fileName << std::endl;
+			return;
+		}
+		for (int k : config.ks) {
+			for (TrainMode mode : { TrainMode::LLOYD, TrainMode::HAMERLY }) {
+				TrainConfig trainConfig;
+				trainConfig.mode = mode;
+				trainConfig.seed = 1;
+				trainConfig.maxIterations = config.trainIterations;
+				trainConfig.tolerance = -1; // only stops early when no point changes its cluster
+				auto start = std::chrono::steady_clock::now();
+				KMeanCluster model(fileName, k, trainConfig);
+				double total = elapsedSeconds(start);
+				double train = model.getTrainSeconds();
+				int iterations = std::max(1, model.getIterations());
+				record({ "trainModel", { { "points", std::to_string(nPoints) }, { "dim", std::to_string(MPI_POSE_DIMENSION) },
+					{ "k", std::to_string(k) }, { "mode", mode == TrainMode::LLOYD ? "\"lloyd\"" : "\"hamerly\"" },
+					{ "threads", std::to_string(defaultThreadCount()) } },
+					{ { "loadSeconds", total - train }, { "trainSeconds", train }, { "iterations", (double)model.getIterations() },
+					{ "secondsPerIteration", train / iterations }, { "distanceEvaluations", (double)model.getDistanceEvaluations() } } });
+			}
+		}
+		std::filesystem::remove(fileName);
+	}
+}
+
+// benchQueries
+// precondition: the work directory exists
+// postcondition: record the mean, p50 and p99 latency of cluster, related and nearest on a model of config.queryPoints points
+void BenchmarkSuite::benchQueries() {
+	std::string fileName = (std::filesystem::path(config.workDir) / "bench-query.kmpose").string();
+	if (!writeDataset(fileName, config.queryPoints, true)) {
+		std::cout << "Could not write " << fileName << std::endl;
+		return;
+	}
+	TrainConfig trainConfig;
+	trainConfig.seed = 1;
+	KMeanCluster model(fileName, 16, trainConfig);
+
+	std::mt19937 rng(2);
+	std::uniform_real_distribution<double> uniform(0, 1);
+	std::vector<std::vector<double>> queries(config.queries, std::vector<double>(MPI_POSE_DIMENSION));
+	for (std::vector<double>& query : queries)
+		for (double& x : query)
+			x = uniform(rng);
+
+	// cluster runs last, because it adds the queries to the model
+	const char* names[] = { "related", "nearest", "cluster" };
+	for (const char* name : names) {
+		std::vector<double> latencies;
+		latencies.reserve(queries.size());
+		for (size_t q = 0; q < queries.size(); q++) {
+			auto start = std::chrono::steady_clock::now();
+			if (names[0] == name)
+				sink += (double)model.related(queries[q]).size();
+			else if (names[1] == name)
+				sink += (double)model.nearest(queries[q], 10).size();
+			else
+				sink += (double)model.cluster(queries[q], "bench-query-" + std::to_string(q)).size();
+			latencies.push_back(elapsedSeconds(start));
+		}
+		std::sort(latencies.begin(), latencies.end());
+		double mean = 0;
+		for (double latency : latencies)
+			mean += latency;
+		mean /= std::max((size_t)1, latencies.size());
+		if (latencies.empty())
+			latencies.push_back(0);
+		record({ name, { { "points", std::to_string(config.queryPoints) }, { "k", "16" }, { "queries", std::to_string(config.queries) } },
+			{ { "meanMicroseconds", mean * 1e6 }, { "p50Microseconds", percentile(latencies, 0.5) * 1e6 },
+			{ "p99Microseconds", percentile(latencies, 0.99) * 1e6 } } });
+	}
+}
+
+// benchDatasetIO
+// precondition: the work directory exists
+// postcondition: record the rows per second and MB per second of reading and saving a CSV dataset and a pose dataset
+//				  of config.ioPoints points, and of converting the CSV dataset into a pose dataset
+void BenchmarkSuite::benchDatasetIO() {
+	std::filesystem::path dir(config.workDir);
+	std::string csvFile = (dir / "bench-io.csv").string();
+	std::string poseFile = (dir / "bench-io.kmpose").string();
+	if (!writeDataset(csvFile, config.ioPoints, false)) {
+		std::cout << "Could not write " << csvFile << std::endl;
+		return;
+	}
+	std::error_code error;
+	auto throughput = [&](const std::string& file, double seconds) {
+		double bytes = (double)std::filesystem::file_size(file, error);
+		seconds = std::max(seconds, 1e-9);
+		return std::vector<std::pair<std::string, double>>{ { "seconds", seconds }, { "rowsPerSecond", config.ioPoints / seconds },
+			{ "megabytesPerSecond", bytes / 1e6 / seconds } };
+	};
+
+	auto start = std::chrono::steady_clock::now();
+	long long converted = convertCsvToPoseDataset(csvFile, poseFile);
+	double seconds = elapsedSeconds(start);
+	if (converted < 0) {
+		std::cout << "Could not convert " << csvFile << std::endl;
+		return;
+	}
+	record({ "convertCsvToPoseDataset", { { "points", std::to_string(config.ioPoints) } }, throughput(csvFile, seconds) });
+
+	for (const std::string& file : { csvFile, poseFile }) {
+		std::string format = file == csvFile ? "\"csv\"" : "\"pose\"";
+		TrainConfig trainConfig;
+		trainConfig.seed = 1;
+		trainConfig.maxIterations = 1; // the training time is subtracted, so it is kept short
+		start = std::chrono::steady_clock::now();
+		KMeanCluster model(file, 1, trainConfig);
+		seconds = elapsedSeconds(start) - model.getTrainSeconds();
+		record({ "readDataSet", { { "points", std::to_string(config.ioPoints) }, { "format", format } }, throughput(file, seconds) });
+
+		start = std::chrono::steady_clock::now();
+		if (!model.compactDataSet()) {
+			std::cout << "Could not save " << file << std::endl;
+			continue;
+		}
+		record({ "saveDataSet", { { "points", std::to_string(config.ioPoints) }, { "format", format } },
+			throughput(file, elapsedSeconds(start)) });
+	}
+}
+
+// benchPoseProcessing
+// precondition: none
+// postcondition: record the time of pre_processPoints on 15 points and of findBodyPartPosition on a synthetic MPI network
+//				  output, with and without sub-pixel refinement
+void BenchmarkSuite::benchPoseProcessing() {
+	std::mt19937 rng(3);
+	std::uniform_real_distribution<float> uniform(0, 1);
+	std::vector<Point> points;
+	for (int n = 0; n < 15; n++)
+		points.push_back(Point((int)(uniform(rng) * 640), (int)(uniform(rng) * 480)));
+	double seconds = timePerCall([&] { sink += pre_processPoints(points)[0]; });
+	record({ "pre_processPoints", { { "points", "15" } }, { { "nsPerCall", seconds * 1e9 } } });
+
+	// one MPI network output with a gaussian blob per heatmap, like the one reportPeakExtraction searches
+	const int C = 44, H = 46, W = 46, scale = 8;
+	int sizes[] = { 1, C, H, W };
+	std::vector<float> data((size_t)C * H * W);
+	for (int c = 0; c < C; c++) {
+		float cx = 2 + uniform(rng) * (W - 4);
+		float cy = 2 + uniform(rng) * (H - 4);
+		float* map = data.data() + (size_t)c * H * W;
+		for (int y = 0; y < H; y++)
+			for (int x = 0; x < W; x++)
+				map[y * W + x] = std::exp(-((x - cx) * (x - cx) + (y - cy) * (y - cy)) / 4.5f) + 0.01f * uniform(rng);
+	}
+	Mat output(4, sizes, CV_32F, data.data());
+	for (bool subPixel : { false, true }) {
+		seconds = timePerCall([&] { sink += findBodyPartPosition(output, 0.1f, W * scale, H * scale, 0, subPixel)[0].x; });
+		record({ "findBodyPartPosition", { { "heatmaps", std::to_string(C) }, { "size", std::to_string(W) },
+			{ "subPixel", subPixel ? "true" : "false" } }, { { "microsecondsPerCall", seconds * 1e6 } } });
+	}
+}
+
+// writeDataset
+// precondition: nPoints is positive
+// postcondition: write nPoints points of 30 coordinates around 16 centers to fileName, as a pose dataset if binary, else as CSV
+//				  Return false if the file could not be written
+bool BenchmarkSuite::writeDataset(const std::string fileName, const size_t nPoints, const bool binary) {
+	const size_t dim = MPI_POSE_DIMENSION, nCenters = 16;
+	std::mt19937 rng(4);
+	std::uniform_real_distribution<double> uniform(0, 1);
+	std::normal_distribution<double> noise(0, 0.08);
+	std::vector<double> centers(nCenters * dim);
+	for (double& x : centers)
+		x = uniform(rng);
+
+	PoseDatasetWriter writer;
+	FILE* csv = nullptr;
+	if (binary ? !writer.open(fileName, dim) : !(csv = fopen(fileName.c_str(), "wb")))
+		return false;
+	std::vector<double> point(dim);
+	bool ok = true;
+	for (size_t i = 0; i < nPoints; i++) {
+		const double* center = &centers[(rng() % nCenters) * dim];
+		for (size_t d = 0; d < dim; d++)
+			point[d] = center[d] + noise(rng);
+		std::string name = "bench-image" + std::to_string(i) + ".jpg";
+		std::string row = formatDataSetRow(name, point.data(), dim);
+		if (binary)
+			writer.add(name, point.data(), row);
+		else {
+			row += '\n';
+			ok = fwrite(row.data(), 1, row.size(), csv) == row.size() && ok;
+		}
+	}
+	if (binary)
+		return writer.finish();
+	return fclose(csv) == 0 && ok;
+}
+
+// timePerCall
+// precondition: none
+// postcondition: call work in batches of growing size until config.minSeconds passed, return the mean seconds of a call
+double BenchmarkSuite::timePerCall(const std::function<void()>& work) {
+	work(); // warm the caches
+	size_t calls = 0;
+	size_t batch = 1;
+	auto start = std::chrono::steady_clock::now();
+	double seconds = 0;
+	while (seconds < config.minSeconds) {
+		for (size_t i = 0; i < batch; i++)
+			work();
+		calls += batch;
+		batch *= 2; // the clock is read less often as the calls turn out to be short
+		seconds = elapsedSeconds(start);
+	}
+	return seconds / calls;
+}
+
+// record
+// precondition: none
+// postcondition: add the result to the suite and print it on one line
+void BenchmarkSuite::record(const BenchmarkResult& result) {
+	std::cout << std::left << std::setw(24) << result.name;
+	for (const auto& param : result.params)
+		std::cout << " " << param.first << "=" << param.second;
+	for (const auto& metric : result.metrics)
+		std::cout << " " << metric.first << "=" << metric.second;
+	std::cout << std::endl;
+	results.push_back(result);
+}
+
+// writeJson
+// precondition: none
+// postcondition: write the machine, the settings and every result to jsonFile. Return false if it could not be written
+bool BenchmarkSuite::writeJson(const std::string jsonFile) const {
+	std::ofstream out(jsonFile, std::ios::trunc);
+	if (!out)
+		return false;
+	out << std::setprecision(9);
+	out << "{\n  \"suite\": \"kmean-pose\",\n  \"timestamp\": " << (long long)std::time(nullptr) << ",\n";
+	out << "  \"kernel\": \"" << distanceKernelName() << "\",\n  \"threads\": " << defaultThreadCount() << ",\n";
+	out << "  \"results\": [";
+	for (size_t r = 0; r < results.size(); r++) {
+		const BenchmarkResult& result = results[r];
+		out << (r ? ",\n" : "\n") << "    { \"name\": \"" << result.name << "\", \"params\": {";
+		for (size_t i = 0; i < result.params.size(); i++)
+			out << (i ? ", " : " ") << "\"" << result.params[i].first << "\": " << result.params[i].second;
+		out << " }, \"metrics\": {";
+		for (size_t i = 0; i < result.metrics.size(); i++) {
+			// JSON has no infinity or NaN
+			double value = std::isfinite(result.metrics[i].second) ? result.metrics[i].second : 0;
+			out << (i ? ", " : " ") << "\"" << result.metrics[i].first << "\": " << value;
+		}
+		out << " } }";
+	}
+	out << "\n  ]\n}\n";
+	return (bool)out;
+}
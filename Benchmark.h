@@ -0,0 +1,123 @@
+// Benchmark.h
+// author: Cheuk-Hang Tse
+// This file contains the declaration of the BenchmarkSuite class.
+// A BenchmarkSuite times the hot paths of the pose estimation and the clustering on synthetic data and writes the results to a
+// JSON file, so the numbers of two releases can be compared. It does not need the Caffe model or any image:
+// the datasets are generated 30-D poses in a work directory and the heatmaps are generated network outputs
+//
+// Benchmarks (name in the JSON file):
+// squaredDistance, nearestCentroid: the distance kernels for the MPI, COCO and an unspecialized dimension
+// trainModel: KMeanCluster training of 1e3 to maxPoints points with several k, Lloyd and Hamerly
+// cluster, related, nearest: the latency of a query against a trained model
+// readDataSet, saveDataSet, convertCsvToPoseDataset: the dataset load and save throughput, CSV and pose dataset
+// pre_processPoints, findBodyPartPosition: the pose post-processing on synthetic network outputs
+//
+// CONSTRUCTOR:
+// BenchmarkSuite(const BenchmarkConfig& _config): define a suite with the sizes and work directory in _config
+//
+// FUNCTIONS:
+// run: run every benchmark and write the results to a JSON file
+// benchDistance: time the distance kernels
+// benchTraining: time the training on every dataset size, k and training mode
+// benchQueries: time cluster, related and nearest on a trained model
+// benchDatasetIO: time reading and writing the dataset in both formats
+// benchPoseProcessing: time pre_processPoints and findBodyPartPosition
+// writeDataset: write a synthetic pose dataset with clustered points
+// timePerCall: call a function until enough time passed and return the mean time of a call
+// record: add a result to the suite and print it
+// writeJson: write every result to a JSON file
+
+#pragma once
+#include <functional>
+#include <string>
+#include <utility>
+#include <vector>
+
+// BenchmarkConfig
+// The sizes of the benchmark and where its files are written
+struct BenchmarkConfig {
+	size_t maxPoints = 1000000; // largest training dataset, the sizes are the powers of 10 from 1000 up to it (at most 1e7)
+	std::vector<int> ks = { 4, 16, 64 }; // number of clusters of every training benchmark
+	int trainIterations = 10; // iterations of every training, the time per iteration is reported too
+	size_t queries = 1000; // queries of every query latency benchmark
+	size_t queryPoints = 100000; // points of the model the queries run against
+	size_t ioPoints = 100000; // points of the dataset load and save benchmarks
+	double minSeconds = 0.2; // a micro benchmark is repeated until it ran at least this long
+	std::string workDir; // directory the synthetic datasets are written to, empty uses kmean-benchmark in the temporary directory
+};
+
+// BenchmarkResult
+// One measurement: the benchmark name, the parameters it ran with and the measured values
+struct BenchmarkResult {
+	std::string name; // name of the benchmarked function
+	std::vector<std::pair<std::string, std::string>> params; // parameter names and values, the values as JSON
+	std::vector<std::pair<std::string, double>> metrics; // measured values, the name ends with the unit
+};
+
+class BenchmarkSuite {
+public:
+	// BenchmarkSuite
+	// precondition: _config.maxPoints is at least 1000 and every k is positive
+	// postcondition: define a suite with the sizes and work directory in _config
+	BenchmarkSuite(const BenchmarkConfig& _config);
+
+	// run
+	// precondition: none
+	// postcondition: run every benchmark, print every result and write them to jsonFile. The synthetic datasets are removed
+	//				  Return false if the work directory or the JSON file could not be written
+	bool run(const std::string jsonFile);
+
+private:
+	// benchDistance
+	// precondition: none
+	// postcondition: record the time of squaredDistance and of nearestCentroid with 16 and 64 centroids for 30, 36 and 17 coordinates
+	void benchDistance();
+
+	// benchTraining
+	// precondition: the work directory exists
+	// postcondition: record the load time, the training time and the time per iteration of KMeanCluster for 1e3, 1e4, ... maxPoints
+	//				  points of 30 coordinates, every k of config.ks, in Lloyd and Hamerly mode
+	void benchTraining();
+
+	// benchQueries
+	// precondition: the work directory exists
+	// postcondition: record the mean, p50 and p99 latency of cluster, related and nearest on a model of config.queryPoints points
+	void benchQueries();
+
+	// benchDatasetIO
+	// precondition: the work directory exists
+	// postcondition: record the rows per second and MB per second of reading and saving a CSV dataset and a pose dataset
+	//				  of config.ioPoints points, and of converting the CSV dataset into a pose dataset
+	void benchDatasetIO();
+
+	// benchPoseProcessing
+	// precondition: none
+	// postcondition: record the time of pre_processPoints on 15 points and of findBodyPartPosition on a synthetic MPI network
+	//				  output, with and without sub-pixel refinement
+	void benchPoseProcessing();
+
+	// writeDataset
+	// precondition: nPoints is positive
+	// postcondition: write nPoints points of 30 coordinates around 16 centers to fileName, as a pose dataset if binary, else as CSV
+	//				  Return false if the file could not be written
+	bool writeDataset(const std::string fileName, const size_t nPoints, const bool binary);
+
+	// timePerCall
+	// precondition: none
+	// postcondition: call work in batches of growing size until config.minSeconds passed, return the mean seconds of a call
+	double timePerCall(const std::function<void()>& work);
+
+	// record
+	// precondition: none
+	// postcondition: add the result to the suite and print it on one line
+	void record(const BenchmarkResult& result);
+
+	// writeJson
+	// precondition: none
+	// postcondition: write the machine, the settings and every result to jsonFile. Return false if it could not be written
+	bool writeJson(const std::string jsonFile) const;
+
+	BenchmarkConfig config;
+	std::vector<BenchmarkResult> results; // every result so far
+	double sink = 0; // results of the timed calls, so the compiler keeps them
+};
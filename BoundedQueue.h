@@ -0,0 +1,88 @@
+// BoundedQueue.h
+// author: Cheuk-Hang Tse
+// This file contains the declaration and implementation of the BoundedQueue class template.
+// A BoundedQueue is a first in first out queue with a fixed capacity that is shared between threads.
+// A full queue blocks its producers, so a slow stage slows down the stages in front of it (backpressure)
+//
+// CONSTRUCTOR:
+// BoundedQueue(const size_t _capacity): define an empty queue that holds at most _capacity items
+//
+// FUNCTIONS:
+// push: wait until there is room in the queue and add the item to the back of the queue
+// pop: wait until there is an item in the queue and remove the item from the front of the queue
+// tryPop: remove the item from the front of the queue if there is one, without waiting
+// close: stop accepting items and wake up every waiting thread
+
+#pragma once
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+
+template <typename T>
+class BoundedQueue {
+public:
+	// BoundedQueue
+	// precondition: _capacity must be positive
+	// postcondition: define an empty queue that holds at most _capacity items
+	explicit BoundedQueue(const size_t _capacity) : capacity(_capacity), closed(false) {}
+
+	// push
+	// precondition: none
+	// postcondition: wait until there is room in the queue and add the item to the back of the queue
+	//				  Return false if the queue is closed and the item is not added
+	bool push(T item) {
+		std::unique_lock<std::mutex> lock(mtx);
+		notFull.wait(lock, [this] { return closed || items.size() < capacity; });
+		if (closed)
+			return false;
+		items.push_back(std::move(item));
+		notEmpty.notify_one();
+		return true;
+	}
+
+	// pop
+	// precondition: none
+	// postcondition: wait until there is an item in the queue and move the front item into item
+	//				  Return false if the queue is closed and there is no item left
+	bool pop(T& item) {
+		std::unique_lock<std::mutex> lock(mtx);
+		notEmpty.wait(lock, [this] { return closed || !items.empty(); });
+		if (items.empty())
+			return false;
+		item = std::move(items.front());
+		items.pop_front();
+		notFull.notify_one();
+		return true;
+	}
+
+	// tryPop
+	// precondition: none
+	// postcondition: move the front item into item without waiting. Return false if the queue is empty
+	bool tryPop(T& item) {
+		std::lock_guard<std::mutex> lock(mtx);
+		if (items.empty())
+			return false;
+		item = std::move(items.front());
+		items.pop_front();
+		notFull.notify_one();
+		return true;
+	}
+
+	// close
+	// precondition: none
+	// postcondition: stop accepting items and wake up every waiting thread. Items already in the queue can still be popped
+	void close() {
+		std::lock_guard<std::mutex> lock(mtx);
+		closed = true;
+		notEmpty.notify_all();
+		notFull.notify_all();
+	}
+
+private:
+	std::deque<T> items; // items waiting in the queue
+	size_t capacity; // maximum number of items in the queue
+	bool closed; // true if the queue no longer accepts items
+	std::mutex mtx;
+	std::condition_variable notEmpty;
+	std::condition_variable notFull;
+};
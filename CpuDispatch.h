@@ -0,0 +1,86 @@
+// CpuDispatch.h
+// author: Cheuk-Hang Tse
+// This file has 3 functions: detectInstructionSet, supportedInstructionSet, and instructionSetName
+// detectInstructionSet: ask the processor for the widest vector instruction set that it and the operating system support
+// supportedInstructionSet: return the instruction set of detectInstructionSet, detected once
+// instructionSetName: return the name of an instruction set
+// The vectorized kernels (DistanceKernel, PeakKernel) compile every instruction set into the same binary: a function marked
+// CPU_TARGET_AVX2 or CPU_TARGET_AVX512 is compiled for it by GCC and Clang, MSVC compiles the intrinsics without /arch
+// The kernels pick the one to run with supportedInstructionSet, so no -mavx2 or /arch:AVX2 build flag is needed
+
+#pragma once
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+#define CPU_X86 1
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#endif
+
+// CPU_TARGET_AVX2 and CPU_TARGET_AVX512 compile a function for the instruction set, CPU_INLINE_KERNELS inlines every function
+// it calls into it, so a kernel called in a loop is compiled for the instruction set of the loop and is never a function call
+#if defined(CPU_X86) && (defined(__GNUC__) || defined(__clang__))
+#define CPU_TARGET_AVX2 __attribute__((target("avx2")))
+#define CPU_TARGET_AVX512 __attribute__((target("avx512f,avx2")))
+#define CPU_INLINE_KERNELS __attribute__((flatten))
+#else
+#define CPU_TARGET_AVX2
+#define CPU_TARGET_AVX512
+#define CPU_INLINE_KERNELS
+#endif
+
+// InstructionSet
+// The instruction sets the kernels are compiled for, in increasing order of width
+enum InstructionSet { INSTRUCTIONS_SCALAR, INSTRUCTIONS_AVX2, INSTRUCTIONS_AVX512 };
+
+// detectInstructionSet
+// precondition: none
+// postcondition: return the widest instruction set that the processor and the operating system support
+inline InstructionSet detectInstructionSet() {
+#if defined(CPU_X86) && defined(_MSC_VER)
+	int info[4];
+	__cpuid(info, 0);
+	if (info[0] < 7)
+		return INSTRUCTIONS_SCALAR;
+	// the operating system must save the AVX registers (OSXSAVE and the XCR0 state bits) before they can be used
+	__cpuid(info, 1);
+	if (!(info[2] & (1 << 27)) || !(info[2] & (1 << 28)))
+		return INSTRUCTIONS_SCALAR;
+	unsigned long long xcr0 = _xgetbv(0);
+	__cpuidex(info, 7, 0);
+	if ((info[1] & (1 << 16)) && (xcr0 & 0xe6) == 0xe6)
+		return INSTRUCTIONS_AVX512;
+	if ((info[1] & (1 << 5)) && (xcr0 & 0x6) == 0x6)
+		return INSTRUCTIONS_AVX2;
+	return INSTRUCTIONS_SCALAR;
+#elif defined(CPU_X86)
+	// __builtin_cpu_supports also checks that the operating system saves the registers
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx512f"))
+		return INSTRUCTIONS_AVX512;
+	if (__builtin_cpu_supports("avx2"))
+		return INSTRUCTIONS_AVX2;
+	return INSTRUCTIONS_SCALAR;
+#else
+	return INSTRUCTIONS_SCALAR;
+#endif
+}
+
+// supportedInstructionSet
+// precondition: none
+// postcondition: return the widest instruction set that the processor and the operating system support, detected on the first call
+inline InstructionSet supportedInstructionSet() {
+	static const InstructionSet supported = detectInstructionSet();
+	return supported;
+}
+
+// instructionSetName
+// precondition: none
+// postcondition: return "avx512", "avx2" or "scalar"
+inline const char* instructionSetName(const InstructionSet set) {
+	if (set == INSTRUCTIONS_AVX512)
+		return "avx512";
+	if (set == INSTRUCTIONS_AVX2)
+		return "avx2";
+	return "scalar";
+}
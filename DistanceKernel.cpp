@@ -0,0 +1,286 @@
+// DistanceKernel.cpp
+// author: Cheuk-Hang Tse
+// This file has 6 functions: squaredDistance, nearestCentroid, nearestTwoCentroids, widenPoint, distanceKernelName, and setDistanceKernel
+// squaredDistance: return the squared euclidean distance between two points
+// nearestCentroid: return the index of the centroid that is closest to a point
+// nearestTwoCentroids: return the index of the closest centroid and the distances to the closest and the second closest centroid
+// widenPoint: convert a point stored as floats to doubles
+// distanceKernelName: return the name of the instruction set the kernels run with
+// setDistanceKernel: run the kernels with another instruction set
+// The vectorized kernels are selected when the program starts: AVX-512 if the processor supports it, else AVX2, else scalar
+// Every instruction set is compiled into the same binary (see CpuDispatch.h), so a build without -mavx2 still uses AVX2
+// on a processor that has it
+// The pose dimensions of the MPI (30) and COCO (36) models have their own kernels with the dimension fixed at compile time, so
+// every loop is unrolled and the tail is a single masked or narrow step. Other dimensions use the general kernels
+
+#include "DistanceKernel.h"
+#include "CpuDispatch.h"
+#include <limits>
+
+static const InstructionSet supportedKernel = supportedInstructionSet(); // widest instruction set of this processor
+static InstructionSet activeKernel = supportedKernel; // instruction set the kernels run with
+
+// ScalarKernel
+// The distance kernel without vector instructions
+struct ScalarKernel {
+	// distance
+	// precondition: a and b point to dim doubles, DIM is dim or 0
+	// postcondition: return the squared euclidean distance between a and b, with every loop unrolled if DIM is not 0
+	template <size_t DIM>
+	static inline double distance(const double* a, const double* b, const size_t dim) {
+		if (DIM == 0) {
+			double sum = 0;
+			for (size_t i = 0; i < dim; i++) {
+				double d = a[i] - b[i];
+				sum += d * d;
+			}
+			return sum;
+		}
+		// four independent sums, so the additions do not wait for each other
+		double sum[4] = { 0, 0, 0, 0 };
+		for (size_t i = 0; i < DIM; i++) {
+			double d = a[i] - b[i];
+			sum[i % 4] += d * d;
+		}
+		return (sum[0] + sum[1]) + (sum[2] + sum[3]);
+	}
+};
+
+#ifdef CPU_X86
+// Avx2Kernel
+// The distance kernel with 256 bit vectors
+struct Avx2Kernel {
+	// distance
+	// precondition: a and b point to dim doubles, DIM is dim or 0, the processor supports AVX2
+	// postcondition: return the squared euclidean distance between a and b, with every loop unrolled if DIM is not 0
+	template <size_t DIM>
+	CPU_TARGET_AVX2 static inline double distance(const double* a, const double* b, const size_t dim) {
+		const size_t n = DIM ? DIM : dim;
+		__m256d acc0 = _mm256_setzero_pd();
+		__m256d acc1 = _mm256_setzero_pd();
+		size_t i = 0;
+		for (; i + 8 <= n; i += 8) {
+			__m256d d0 = _mm256_sub_pd(_mm256_loadu_pd(a + i), _mm256_loadu_pd(b + i));
+			__m256d d1 = _mm256_sub_pd(_mm256_loadu_pd(a + i + 4), _mm256_loadu_pd(b + i + 4));
+			acc0 = _mm256_add_pd(acc0, _mm256_mul_pd(d0, d0));
+			acc1 = _mm256_add_pd(acc1, _mm256_mul_pd(d1, d1));
+		}
+		if (i + 4 <= n) {
+			__m256d d0 = _mm256_sub_pd(_mm256_loadu_pd(a + i), _mm256_loadu_pd(b + i));
+			acc0 = _mm256_add_pd(acc0, _mm256_mul_pd(d0, d0));
+			i += 4;
+		}
+		acc0 = _mm256_add_pd(acc0, acc1);
+		__m128d half = _mm_add_pd(_mm256_castpd256_pd128(acc0), _mm256_extractf128_pd(acc0, 1));
+		if (DIM && DIM % 4 >= 2) {
+			__m128d d = _mm_sub_pd(_mm_loadu_pd(a + i), _mm_loadu_pd(b + i));
+			half = _mm_add_pd(half, _mm_mul_pd(d, d));
+			i += 2;
+		}
+		double sum = _mm_cvtsd_f64(_mm_add_sd(half, _mm_unpackhi_pd(half, half)));
+		if (DIM % 2) {
+			double d = a[i] - b[i];
+			sum += d * d;
+		}
+		// scalar loop for the remaining coordinates of the general kernel
+		for (; DIM == 0 && i < n; i++) {
+			double d = a[i] - b[i];
+			sum += d * d;
+		}
+		return sum;
+	}
+};
+
+// Avx512Kernel
+// The distance kernel with 512 bit vectors
+struct Avx512Kernel {
+	// distance
+	// precondition: a and b point to dim doubles, DIM is dim or 0, the processor supports AVX-512
+	// postcondition: return the squared euclidean distance between a and b, with every loop unrolled if DIM is not 0
+	template <size_t DIM>
+	CPU_TARGET_AVX512 static inline double distance(const double* a, const double* b, const size_t dim) {
+		const size_t n = DIM ? DIM : dim;
+		__m512d acc = _mm512_setzero_pd();
+		size_t i = 0;
+		for (; i + 8 <= n; i += 8) {
+			__m512d d = _mm512_sub_pd(_mm512_loadu_pd(a + i), _mm512_loadu_pd(b + i));
+			acc = _mm512_fmadd_pd(d, d, acc);
+		}
+		if (DIM && DIM % 8) {
+			// the last coordinates in one masked step, the masked lanes are not read
+			const __mmask8 mask = (__mmask8)((1u << (DIM % 8)) - 1);
+			__m512d d = _mm512_sub_pd(_mm512_maskz_loadu_pd(mask, a + i), _mm512_maskz_loadu_pd(mask, b + i));
+			acc = _mm512_fmadd_pd(d, d, acc);
+		}
+		// the lanes are added in the order of _mm512_reduce_add_pd, which GCC 12 reports as reading an uninitialized vector
+		__m256d quarter = _mm256_add_pd(_mm512_maskz_extractf64x4_pd(0xff, acc, 0), _mm512_maskz_extractf64x4_pd(0xff, acc, 1));
+		__m128d half = _mm_add_pd(_mm256_castpd256_pd128(quarter), _mm256_extractf128_pd(quarter, 1));
+		double sum = _mm_cvtsd_f64(_mm_add_sd(half, _mm_unpackhi_pd(half, half)));
+		// scalar loop for the remaining coordinates of the general kernel
+		for (; DIM == 0 && i < n; i++) {
+			double d = a[i] - b[i];
+			sum += d * d;
+		}
+		return sum;
+	}
+};
+#endif
+
+// kernelDistance
+// precondition: a and b point to dim doubles
+// postcondition: return the squared euclidean distance between a and b with the kernel of Kernel specialized for dim
+template <class Kernel>
+static inline double kernelDistance(const double* a, const double* b, const size_t dim) {
+	if (dim == MPI_POSE_DIMENSION)
+		return Kernel::template distance<MPI_POSE_DIMENSION>(a, b, dim);
+	if (dim == COCO_POSE_DIMENSION)
+		return Kernel::template distance<COCO_POSE_DIMENSION>(a, b, dim);
+	return Kernel::template distance<0>(a, b, dim);
+}
+
+// scanCentroids
+// precondition: point points to dim doubles, centroids points to k rows of dim doubles, k is positive, DIM is dim or 0
+// postcondition: the same as nearestTwoCentroids with the kernel of Kernel. secondDistance is only computed if it is not nullptr
+template <class Kernel, size_t DIM>
+static inline int scanCentroids(const double* point, const double* centroids, const size_t k, const size_t dim, double& minDistance, double* secondDistance) {
+	int best = 0;
+	double second = std::numeric_limits<double>::max();
+	minDistance = std::numeric_limits<double>::max();
+	for (size_t c = 0; c < k; c++) {
+		double dist = Kernel::template distance<DIM>(point, centroids + c * dim, dim);
+		if (dist < minDistance) {
+			second = minDistance;
+			minDistance = dist;
+			best = (int)c;
+		}
+		else if (dist < second) {
+			second = dist;
+		}
+	}
+	if (secondDistance)
+		*secondDistance = second;
+	return best;
+}
+
+// kernelNearestTwo
+// precondition: point points to dim doubles, centroids points to k rows of dim doubles, k is positive
+// postcondition: the same as scanCentroids with the kernel of Kernel specialized for dim
+template <class Kernel>
+static inline int kernelNearestTwo(const double* point, const double* centroids, const size_t k, const size_t dim, double& minDistance, double* secondDistance) {
+	if (dim == MPI_POSE_DIMENSION)
+		return scanCentroids<Kernel, MPI_POSE_DIMENSION>(point, centroids, k, dim, minDistance, secondDistance);
+	if (dim == COCO_POSE_DIMENSION)
+		return scanCentroids<Kernel, COCO_POSE_DIMENSION>(point, centroids, k, dim, minDistance, secondDistance);
+	return scanCentroids<Kernel, 0>(point, centroids, k, dim, minDistance, secondDistance);
+}
+
+#ifdef CPU_X86
+// avx2Distance, avx2NearestTwo, avx512Distance, avx512NearestTwo
+// precondition: the same as kernelDistance and kernelNearestTwo, the processor supports the instruction set
+// postcondition: the same as kernelDistance and kernelNearestTwo, compiled for the instruction set
+CPU_TARGET_AVX2 CPU_INLINE_KERNELS static double avx2Distance(const double* a, const double* b, const size_t dim) {
+	return kernelDistance<Avx2Kernel>(a, b, dim);
+}
+
+CPU_TARGET_AVX2 CPU_INLINE_KERNELS static int avx2NearestTwo(const double* point, const double* centroids, const size_t k, const size_t dim, double& minDistance, double* secondDistance) {
+	return kernelNearestTwo<Avx2Kernel>(point, centroids, k, dim, minDistance, secondDistance);
+}
+
+CPU_TARGET_AVX512 CPU_INLINE_KERNELS static double avx512Distance(const double* a, const double* b, const size_t dim) {
+	return kernelDistance<Avx512Kernel>(a, b, dim);
+}
+
+CPU_TARGET_AVX512 CPU_INLINE_KERNELS static int avx512NearestTwo(const double* point, const double* centroids, const size_t k, const size_t dim, double& minDistance, double* secondDistance) {
+	return kernelNearestTwo<Avx512Kernel>(point, centroids, k, dim, minDistance, secondDistance);
+}
+#endif
+
+// nearestTwo
+// precondition: point points to dim doubles, centroids points to k rows of dim doubles, k is positive
+// postcondition: the same as scanCentroids with the kernels of the active instruction set
+static int nearestTwo(const double* point, const double* centroids, const size_t k, const size_t dim, double& minDistance, double* secondDistance) {
+#ifdef CPU_X86
+	if (activeKernel == INSTRUCTIONS_AVX512)
+		return avx512NearestTwo(point, centroids, k, dim, minDistance, secondDistance);
+	if (activeKernel == INSTRUCTIONS_AVX2)
+		return avx2NearestTwo(point, centroids, k, dim, minDistance, secondDistance);
+#endif
+	return kernelNearestTwo<ScalarKernel>(point, centroids, k, dim, minDistance, secondDistance);
+}
+
+// squaredDistance
+// precondition: a and b point to dim doubles
+// postcondition: return the squared euclidean distance between a and b
+double squaredDistance(const double* a, const double* b, const size_t dim) {
+#ifdef CPU_X86
+	if (activeKernel == INSTRUCTIONS_AVX512)
+		return avx512Distance(a, b, dim);
+	if (activeKernel == INSTRUCTIONS_AVX2)
+		return avx2Distance(a, b, dim);
+#endif
+	return kernelDistance<ScalarKernel>(a, b, dim);
+}
+
+// nearestCentroid
+// precondition: point points to dim doubles, centroids points to k rows of dim doubles, k is positive
+// postcondition: return the index of the closest centroid (the lowest index on a tie) and store its squared distance in minDistance
+int nearestCentroid(const double* point, const double* centroids, const size_t k, const size_t dim, double& minDistance) {
+	return nearestTwo(point, centroids, k, dim, minDistance, nullptr);
+}
+
+// nearestTwoCentroids
+// precondition: point points to dim doubles, centroids points to k rows of dim doubles, k is positive
+// postcondition: return the index of the closest centroid (the lowest index on a tie), store its squared distance in minDistance
+//				  and the squared distance of the second closest centroid in secondDistance (the maximum double if k is 1)
+int nearestTwoCentroids(const double* point, const double* centroids, const size_t k, const size_t dim, double& minDistance, double& secondDistance) {
+	return nearestTwo(point, centroids, k, dim, minDistance, &secondDistance);
+}
+
+// widenRow
+// precondition: source points to dim floats, target points to dim doubles, DIM is dim or 0
+// postcondition: copy source to target as doubles, with the loop unrolled if DIM is not 0
+template <size_t DIM>
+static inline void widenRow(const float* source, double* target, const size_t dim) {
+	const size_t n = DIM ? DIM : dim;
+	for (size_t i = 0; i < n; i++)
+		target[i] = source[i];
+}
+
+// widenPoint
+// precondition: source points to dim floats, target points to dim doubles
+// postcondition: copy the dim floats of source to target as doubles, with the loop of the pose dimensions unrolled
+void widenPoint(const float* source, double* target, const size_t dim) {
+	if (dim == MPI_POSE_DIMENSION)
+		widenRow<MPI_POSE_DIMENSION>(source, target, dim);
+	else if (dim == COCO_POSE_DIMENSION)
+		widenRow<COCO_POSE_DIMENSION>(source, target, dim);
+	else
+		widenRow<0>(source, target, dim);
+}
+
+// distanceKernelName
+// precondition: none
+// postcondition: return "avx512", "avx2" or "scalar"
+const char* distanceKernelName() {
+	return instructionSetName(activeKernel);
+}
+
+// setDistanceKernel
+// precondition: no other thread computes a distance
+// postcondition: run the kernels with the instruction set name ("avx512", "avx2" or "scalar") and return true, or keep the
+//				  current one and return false if name is unknown or the processor does not support it
+bool setDistanceKernel(const std::string& name) {
+	InstructionSet wanted;
+	if (name == "avx512")
+		wanted = INSTRUCTIONS_AVX512;
+	else if (name == "avx2")
+		wanted = INSTRUCTIONS_AVX2;
+	else if (name == "scalar")
+		wanted = INSTRUCTIONS_SCALAR;
+	else
+		return false;
+	if (wanted > supportedKernel)
+		return false;
+	activeKernel = wanted;
+	return true;
+}
@@ -0,0 +1,52 @@
+// DistanceKernel.h
+// author: Cheuk-Hang Tse
+// This file has 6 functions: squaredDistance, nearestCentroid, nearestTwoCentroids, widenPoint, distanceKernelName, and setDistanceKernel
+// These functions are the inner loops of the k mean clustering and work on points stored as contiguous rows of doubles
+// squaredDistance: return the squared euclidean distance between two points
+// nearestCentroid: return the index of the centroid that is closest to a point
+// nearestTwoCentroids: return the index of the closest centroid and the distances to the closest and the second closest centroid
+// widenPoint: convert a point stored as floats to doubles
+// distanceKernelName: return the name of the instruction set the kernels run with
+// setDistanceKernel: run the kernels with another instruction set
+// The vectorized kernels are selected when the program starts: AVX-512 if the processor supports it, else AVX2, else scalar
+// The MPI and COCO pose dimensions use kernels specialized for their dimension at compile time, other dimensions the general ones
+// The kernels compute with doubles. KMeanCluster can store its points as floats and widens a point with widenPoint before it is used
+
+#pragma once
+#include <cstddef>
+#include <string>
+
+const size_t MPI_POSE_DIMENSION = 30; // 15 MPI body parts, x and y
+const size_t COCO_POSE_DIMENSION = 36; // 18 COCO body parts, x and y
+
+// squaredDistance
+// precondition: a and b point to dim doubles
+// postcondition: return the squared euclidean distance between a and b
+double squaredDistance(const double* a, const double* b, const size_t dim);
+
+// nearestCentroid
+// precondition: point points to dim doubles, centroids points to k rows of dim doubles, k is positive
+// postcondition: return the index of the closest centroid (the lowest index on a tie) and store its squared distance in minDistance
+int nearestCentroid(const double* point, const double* centroids, const size_t k, const size_t dim, double& minDistance);
+
+// nearestTwoCentroids
+// precondition: point points to dim doubles, centroids points to k rows of dim doubles, k is positive
+// postcondition: return the index of the closest centroid (the lowest index on a tie), store its squared distance in minDistance
+//				  and the squared distance of the second closest centroid in secondDistance (the maximum double if k is 1)
+int nearestTwoCentroids(const double* point, const double* centroids, const size_t k, const size_t dim, double& minDistance, double& secondDistance);
+
+// widenPoint
+// precondition: source points to dim floats, target points to dim doubles
+// postcondition: copy the dim floats of source to target as doubles
+void widenPoint(const float* source, double* target, const size_t dim);
+
+// distanceKernelName
+// precondition: none
+// postcondition: return "avx512", "avx2" or "scalar"
+const char* distanceKernelName();
+
+// setDistanceKernel
+// precondition: no other thread computes a distance
+// postcondition: run the kernels with the instruction set name ("avx512", "avx2" or "scalar") and return true, or keep the
+//				  current one and return false if name is unknown or the processor does not support it
+bool setDistanceKernel(const std::string& name);
@@ -0,0 +1,75 @@
+// Hash.h
+// author: Cheuk-Hang Tse
+// This file has 2 functions: fnv1a64 and xxhash64
+// fnv1a64: return the 64-bit FNV-1a hash of a block of bytes, continuing from an earlier hash
+// xxhash64: return the 64-bit xxHash of a block of bytes
+// The hashes are used to tell whether a file changed. They are fast but not meant to be secure
+// fnv1a64 is used for short rows, xxhash64 for whole files, since it hashes 32 bytes per step instead of one
+
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+const uint64_t FNV1A64_OFFSET = 14695981039346656037ULL; // the hash of no bytes
+
+// fnv1a64
+// precondition: data points to size bytes
+// postcondition: return the FNV-1a hash of the bytes, starting from hash. Hashing two blocks one after the other
+//				  gives the same result as hashing the two blocks joined together
+inline uint64_t fnv1a64(const void* data, const size_t size, uint64_t hash = FNV1A64_OFFSET) {
+	const unsigned char* bytes = (const unsigned char*)data;
+	for (size_t i = 0; i < size; i++) {
+		hash ^= bytes[i];
+		hash *= 1099511628211ULL;
+	}
+	return hash;
+}
+
+// xxhash64
+// precondition: data points to size bytes
+// postcondition: return the XXH64 hash of the bytes with the given seed, the same value as the reference xxHash implementation
+inline uint64_t xxhash64(const void* data, const size_t size, const uint64_t seed = 0) {
+	const uint64_t P1 = 11400714785074694791ULL, P2 = 14029467366897019727ULL, P3 = 1609587929392839161ULL;
+	const uint64_t P4 = 9650029242287828579ULL, P5 = 2870177450012600261ULL;
+	auto rotl = [](const uint64_t x, const int r) { return (x << r) | (x >> (64 - r)); };
+	auto read64 = [](const unsigned char* p) { uint64_t v; memcpy(&v, p, 8); return v; };
+	auto read32 = [](const unsigned char* p) { uint32_t v; memcpy(&v, p, 4); return (uint64_t)v; };
+	auto round = [&](uint64_t acc, const uint64_t input) { return rotl(acc + input * P2, 31) * P1; };
+	auto merge = [&](const uint64_t acc, const uint64_t value) { return (acc ^ round(0, value)) * P1 + P4; };
+
+	const unsigned char* p = (const unsigned char*)data;
+	const unsigned char* end = p + size;
+	uint64_t hash;
+	if (size >= 32) {
+		// four independent lanes of 8 bytes each
+		uint64_t v1 = seed + P1 + P2, v2 = seed + P2, v3 = seed, v4 = seed - P1;
+		for (; p + 32 <= end; p += 32) {
+			v1 = round(v1, read64(p));
+			v2 = round(v2, read64(p + 8));
+			v3 = round(v3, read64(p + 16));
+			v4 = round(v4, read64(p + 24));
+		}
+		hash = rotl(v1, 1) + rotl(v2, 7) + rotl(v3, 12) + rotl(v4, 18);
+		hash = merge(merge(merge(merge(hash, v1), v2), v3), v4);
+	}
+	else
+		hash = seed + P5;
+	hash += (uint64_t)size;
+
+	for (; p + 8 <= end; p += 8)
+		hash = rotl(hash ^ round(0, read64(p)), 27) * P1 + P4;
+	if (p + 4 <= end) {
+		hash = rotl(hash ^ (read32(p) * P1), 23) * P2 + P3;
+		p += 4;
+	}
+	for (; p < end; p++)
+		hash = rotl(hash ^ (*p * P5), 11) * P1;
+
+	hash ^= hash >> 33;
+	hash *= P2;
+	hash ^= hash >> 29;
+	hash *= P3;
+	hash ^= hash >> 32;
+	return hash;
+}
@@ -1,139 +1,580 @@
-// HumanPoseEstimation.cpp
-// author: Cheuk-Hang Tse
-// This file has 3 functions: findBodyPartPosition, drawPointsConnection, and performHumanPoseEstimation
-// findBodyPartPosition: Return the point locations in a form of a vector
-// drawPointsConnection: draw points and make a directly straight line connection between the point pair in the inputted frame
-// performHumanPoseEstimation: use deep neural network to find point locations and display the human pose
-// Source: https://learnopencv.com/deep-learning-based-human-pose-estimation-using-opencv-cpp-python/
-
-#include "HumanPoseEstimation.h"
-
-// MPI
-// define the parameters of the deep neural network
-#ifdef MPI
-const int POSE_PAIRS[14][2] =
-{
-	{0,1}, {1,2}, {2,3},
-	{3,4}, {1,5}, {5,6},
-	{6,7}, {1,14}, {14,8}, {8,9},
-	{9,10}, {14,11}, {11,12}, {12,13}
-};
-
-string prototxt = "pose/mpi/pose_deploy_linevec_faster_4_stages.prototxt";
-string weightsModel = "pose/mpi/pose_iter_160000.caffemodel";
-
-int nPoints = 15;
-#endif
-
-// findBodyPartPosition
-// precondition: output and frameCopy is not empty, and other parameters are inputed correctly
-// postcondition: Return the point locations in a form of a vector
-vector<Point> findBodyPartPosition(Mat& output, const float thresh, const int frameWidth, const int frameHeight, const Mat& frameCopy) {
-    int H = output.size[2];
-    int W = output.size[3];
-
-    // find the position of the body parts
-    vector<Point> points(nPoints);
-    for (int n = 0; n < nPoints; n++)
-    {
-        // Probability map of corresponding body's part.
-        Mat probMap(H, W, CV_32F, output.ptr(0, n));
-
-        Point2f p(-1, -1);
-        Point maxLoc;
-        double prob;
-        minMaxLoc(probMap, 0, &prob, 0, &maxLoc);
-
-        // Check if the prob is above the inputted threshold
-        if (prob > thresh)
-        {
-            p = maxLoc;
-            p.x *= (float)frameWidth / W;
-            p.y *= (float)frameHeight / H;
-
-            circle(frameCopy, cv::Point((int)p.x, (int)p.y), 8, Scalar(0, 255, 255), -1);
-            cv::putText(frameCopy, cv::format("%d", n), cv::Point((int)p.x, (int)p.y), cv::FONT_HERSHEY_COMPLEX, 1, cv::Scalar(0, 0, 255), 2);
-
-        }
-        points[n] = p;
-    }
-    cout << points[0] << endl;
-    return points;
-}
-
-// drawpointsConnection
-// preconditions: frame is not an empty image
-// postcondition: draw points and make a directly straight line connection between the point pair in the inputted frame
-void drawPointsConnection(const int nPairs, const vector<Point>& points, const Mat& frame) {
-    for (int n = 0; n < nPairs; n++)
-    {
-        // lookup 2 connected points pair
-        Point2f partA = points[POSE_PAIRS[n][0]];
-        Point2f partB = points[POSE_PAIRS[n][1]];
-
-        if (partA.x <= 0 || partA.y <= 0 || partB.x <= 0 || partB.y <= 0)
-            continue;
-
-        line(frame, partA, partB, Scalar(0, 255, 255), 8);
-        circle(frame, partA, 8, Scalar(0, 0, 255), -1);
-        circle(frame, partB, 8, Scalar(0, 0, 255), -1);
-    }
-}
-
-// performHumanPoseEstimation
-// preconditions: input parameters are inputted correctly and not empty
-// postconditions: use deep neural network to find point locations and display the human pose
-vector<Point> performHumanPoseEstimation(const string device, const string imageFile, const int inWidth, const int inHeight, const float thresh) {
-    // Read the image file
-    Mat frame = imread(imageFile);
-
-    // Check if the file is empty
-    if (frame.empty())
-    {
-        std::cout << "Could not read the image: " << imageFile << std::endl;
-        exit(-1);
-    }
-
-    // Make a clone from the image and collect image pixels length and width
-    Mat frameCopy = frame.clone();
-    int frameWidth = frame.cols;
-    int frameHeight = frame.rows;
-
-    // Get the dnn model from caffe
-    double t = (double)cv::getTickCount();
-    Net netModel = readNetFromCaffe(prototxt, weightsModel);
-
-    // Set which device is used for the model
-    if (device == "cpu")
-    {
-        netModel.setPreferableBackend(DNN_TARGET_CPU);
-    }
-    else if (device == "gpu")
-    {
-        netModel.setPreferableBackend(DNN_BACKEND_CUDA);
-        netModel.setPreferableTarget(DNN_TARGET_CUDA);
-    }
-
-    // format the image for the network
-    Mat inpBlob = blobFromImage(frame, 1.0 / 255, Size(inWidth, inHeight), Scalar(0, 0, 0), false, false);
-
-    netModel.setInput(inpBlob);
-
-    // get the processed image from the dnn model
-    Mat output = netModel.forward();
-
-    // Find the points based on a threshold
-    vector<Point> points = findBodyPartPosition(output, thresh, frameWidth, frameHeight, frameCopy);
-
-    // Draw the pose estimation and display the image
-    int nPairs = sizeof(POSE_PAIRS) / sizeof(POSE_PAIRS[0]); 
-    drawPointsConnection(nPairs, points, frame);
-
-    t = ((double)cv::getTickCount() - t) / cv::getTickFrequency();
-    cout << "Time Taken = " << t << endl;
-    imshow("Output-Keypoints", frameCopy);
-    imshow("Output-Skeleton", frame);
-    imwrite("Output-Skeleton.jpg", frame);
-    waitKey();
-    return points;
+// HumanPoseEstimation.cpp
+// author: Cheuk-Hang Tse
+// This file has 19 functions: findBodyPartPosition, findBodyPartPositions, findPeoplePositions, drawKeypoints, drawPointsConnection, drawSkeleton, showPose, showPeople, readJpegSize, chooseDecodeScale, decodeImage, poseModelName, loadPoseNetwork, estimatePose, estimatePoses, estimatePeople, performHumanPoseEstimation, performMultiPersonEstimation, and pre_processPoints
+// findBodyPartPosition: Return the point locations in a form of a vector
+// findBodyPartPositions: Return the point locations of several images of a batched network output, searched in parallel
+// findPeoplePositions: Return the point locations of every person in an image, joined with the part affinity fields of the network output
+// drawKeypoints: draw every found point and its number in the inputted frame
+// drawPointsConnection: draw points and make a directly straight line connection between the point pair in the inputted frame
+// drawSkeleton: draw the connections of every pose pair in the inputted frame
+// showPose: draw the points and the skeleton of a pose, display them in a window and save the skeleton image
+// showPeople: draw the points and the skeleton of every person, display them in a window and save the skeleton image
+// readJpegSize: read the width and height of a JPEG file from its header without decoding it
+// chooseDecodeScale: return the largest JPEG reduction (1, 2, 4 or 8) that keeps the image at least as large as the network input
+// decodeImage: read an image at the reduced scale chosen for the network input and return its original size
+// poseModelName: return the files of the pose model, which tell apart the results of different models
+// loadPoseNetwork: read the caffe model once and set the device it runs on, so it can be reused for many images
+// estimatePose: use an already loaded network to find the point locations of one image
+// estimatePoses: use an already loaded network to find the point locations of many images with one batched forward pass
+// estimatePeople: use an already loaded network to find the point locations of every person of one image with one forward pass
+// pre_processPoints: convert the Points vector into a normalized double vector
+// performHumanPoseEstimation: use deep neural network to find point locations and display the human pose unless it runs headless
+// performMultiPersonEstimation: the same as performHumanPoseEstimation for every person in the image
+// The heatmap peaks are found with the vectorized kernels of PeakKernel.h
+// The estimation functions never draw, clone the image or open a window. Drawing is done by the draw and show functions only
+// Every stage (decode, model_load, blob, forward, peak_extraction, draw) is timed into its histogram of Metrics.h
+// Source: https://learnopencv.com/deep-learning-based-human-pose-estimation-using-opencv-cpp-python/
+
+#include "HumanPoseEstimation.h"
+#include "Metrics.h"
+#include <fstream>
+
+// MPI
+// define the parameters of the deep neural network
+#ifdef MPI
+const int POSE_PAIRS[14][2] =
+{
+	{0,1}, {1,2}, {2,3},
+	{3,4}, {1,5}, {5,6},
+	{6,7}, {1,14}, {14,8}, {8,9},
+	{9,10}, {14,11}, {11,12}, {12,13}
+};
+
+// the x and y channels of the part affinity field of POSE_PAIRS[i] are PAF_FIRST_CHANNEL + 2i and PAF_FIRST_CHANNEL + 2i + 1
+// the 15 body part heatmaps and the background heatmap come before them
+const int PAF_FIRST_CHANNEL = 16;
+
+string prototxt = "pose/mpi/pose_deploy_linevec_faster_4_stages.prototxt";
+string weightsModel = "pose/mpi/pose_iter_160000.caffemodel";
+
+int nPoints = 15;
+#endif
+
+// findBodyPartPosition
+// precondition: output is not empty, and other parameters are inputed correctly
+// postcondition: Return the point locations of the batchIndex-th image of the 4-D output in a form of a vector
+//				  A point that is not found is (-1, -1). Nothing is drawn
+//				  If subPixel is true, the peaks are refined between the heatmap cells before they are scaled to the frame
+vector<Point> findBodyPartPosition(Mat& output, const float thresh, const int frameWidth, const int frameHeight, const int batchIndex, const bool subPixel) {
+    return findBodyPartPositions(output, thresh, vector<Size>{ Size(frameWidth, frameHeight) }, subPixel, 1, batchIndex)[0];
+}
+
+// findBodyPartPositions
+// precondition: output is a 4-D network output with a batch of at least firstIndex + frameSizes.size() images
+// postcondition: Return the point locations of frameSizes.size() images of the output, starting with the firstIndex-th image
+//				  The peaks of every body part heatmap of every image are searched at the same time on up to nThreads threads
+vector<vector<Point>> findBodyPartPositions(Mat& output, const float thresh, const vector<Size>& frameSizes, const bool subPixel, const int nThreads,
+    const int firstIndex) {
+    METRICS_TIMER("peak_extraction");
+    int H = output.size[2];
+    int W = output.size[3];
+
+    // find the peak of the probability map of every body part of every image
+    vector<const float*> maps;
+    for (int i = 0; i < (int)frameSizes.size(); i++)
+        for (int n = 0; n < nPoints; n++)
+            maps.push_back((const float*)output.ptr(firstIndex + i, n));
+    vector<HeatmapPeak> peaks(maps.size());
+    findPeaks(maps.data(), maps.size(), H, W, subPixel, nThreads, peaks.data());
+
+    vector<vector<Point>> poses;
+    for (int i = 0; i < (int)frameSizes.size(); i++) {
+        vector<Point> points(nPoints);
+        for (int n = 0; n < nPoints; n++)
+        {
+            const HeatmapPeak& peak = peaks[i * nPoints + n];
+            Point2f p(-1, -1);
+
+            // Check if the prob is above the inputted threshold
+            if (peak.value > thresh)
+            {
+                p = Point2f(peak.x, peak.y);
+                p.x *= (float)frameSizes[i].width / W;
+                p.y *= (float)frameSizes[i].height / H;
+            }
+            points[n] = p;
+        }
+        poses.push_back(points);
+    }
+    return poses;
+}
+
+// findPeoplePositions
+// precondition: output is a 4-D MPI network output with the part affinity field channels after the heatmaps
+// postcondition: Return the point locations of every person of the batchIndex-th image, the person with the most body parts first
+//				  Every local maximum above thresh of a heatmap is a candidate body part. The candidates of the two body parts of
+//				  every pose pair are joined where the part affinity field points from one to the other, and the joined pairs
+//				  that share a body part form one person. A person with fewer than 3 body parts is dropped
+//				  A point that is not found is (-1, -1). Return no person if the output has no part affinity fields
+vector<vector<Point>> findPeoplePositions(Mat& output, const float thresh, const int frameWidth, const int frameHeight, const int batchIndex,
+    const bool subPixel) {
+    METRICS_TIMER("people_assembly");
+    const int nPairs = sizeof(POSE_PAIRS) / sizeof(POSE_PAIRS[0]);
+    const int samples = 10; // points of the part affinity field read along a candidate limb
+    const float pafThresh = 0.1f; // a sample counts if the field points along the limb by at least this much
+    const float minAligned = 0.8f; // fraction of the samples that have to count
+    const int minParts = 3;
+    if (output.dims != 4 || output.size[1] < PAF_FIRST_CHANNEL + 2 * nPairs)
+        return vector<vector<Point>>();
+    int H = output.size[2];
+    int W = output.size[3];
+
+    // every local maximum of every body part heatmap
+    vector<vector<HeatmapPeak>> candidates(nPoints);
+    for (int n = 0; n < nPoints; n++)
+        findLocalPeaks((const float*)output.ptr(batchIndex, n), H, W, thresh, subPixel, candidates[n]);
+
+    // people[p][n] is the candidate of body part n of person p, -1 if it was not found
+    vector<vector<int>> people;
+    auto findPerson = [&people](const int part, const int candidate) {
+        for (int p = 0; p < (int)people.size(); p++)
+            if (people[p][part] == candidate)
+                return p;
+        return -1;
+    };
+
+    for (int i = 0; i < nPairs; i++) {
+        int partA = POSE_PAIRS[i][0];
+        int partB = POSE_PAIRS[i][1];
+        const float* pafX = (const float*)output.ptr(batchIndex, PAF_FIRST_CHANNEL + 2 * i);
+        const float* pafY = (const float*)output.ptr(batchIndex, PAF_FIRST_CHANNEL + 2 * i + 1);
+
+        // score every candidate limb by how well the field along it points from A to B
+        struct Limb {
+            int a, b;
+            float score;
+        };
+        vector<Limb> limbs;
+        for (int a = 0; a < (int)candidates[partA].size(); a++) {
+            for (int b = 0; b < (int)candidates[partB].size(); b++) {
+                const HeatmapPeak& from = candidates[partA][a];
+                const HeatmapPeak& to = candidates[partB][b];
+                float dx = to.x - from.x;
+                float dy = to.y - from.y;
+                float length = std::sqrt(dx * dx + dy * dy);
+                if (length < 1e-3f)
+                    continue;
+                float sum = 0;
+                int aligned = 0;
+                for (int s = 0; s < samples; s++) {
+                    float t = (float)s / (samples - 1);
+                    int x = std::min(W - 1, std::max(0, cvRound(from.x + t * dx)));
+                    int y = std::min(H - 1, std::max(0, cvRound(from.y + t * dy)));
+                    float along = (pafX[y * W + x] * dx + pafY[y * W + x] * dy) / length;
+                    sum += along;
+                    aligned += along > pafThresh;
+                }
+                // limbs longer than half the heatmap are unlikely and lose score
+                float score = sum / samples + std::min(0.0f, 0.5f * H / length - 1);
+                if (aligned >= minAligned * samples && score > 0)
+                    limbs.push_back({ a, b, score });
+            }
+        }
+
+        // the best limbs first, every candidate is in at most one limb of a pair
+        std::sort(limbs.begin(), limbs.end(), [](const Limb& l, const Limb& r) { return l.score > r.score; });
+        vector<bool> usedA(candidates[partA].size()), usedB(candidates[partB].size());
+        for (const Limb& limb : limbs) {
+            if (usedA[limb.a] || usedB[limb.b])
+                continue;
+            usedA[limb.a] = usedB[limb.b] = true;
+
+            // POSE_PAIRS is a tree in which every pair shares a body part with an earlier pair, so a limb usually extends a person
+            int withA = findPerson(partA, limb.a);
+            int withB = findPerson(partB, limb.b);
+            if (withA >= 0 && withB >= 0) {
+                if (withA == withB)
+                    continue;
+                // two parts of one person: merge them if they do not both have a body part
+                bool disjoint = true;
+                for (int n = 0; n < nPoints; n++)
+                    disjoint = disjoint && (people[withA][n] < 0 || people[withB][n] < 0);
+                if (!disjoint)
+                    continue;
+                for (int n = 0; n < nPoints; n++)
+                    if (people[withB][n] >= 0)
+                        people[withA][n] = people[withB][n];
+                people.erase(people.begin() + withB);
+            }
+            else if (withA >= 0) {
+                if (people[withA][partB] < 0)
+                    people[withA][partB] = limb.b;
+            }
+            else if (withB >= 0) {
+                if (people[withB][partA] < 0)
+                    people[withB][partA] = limb.a;
+            }
+            else {
+                vector<int> person(nPoints, -1);
+                person[partA] = limb.a;
+                person[partB] = limb.b;
+                people.push_back(person);
+            }
+        }
+    }
+
+    // scale the candidates to the frame, keep the people with enough body parts, most complete person first
+    vector<pair<int, vector<Point>>> found;
+    for (const auto& person : people) {
+        vector<Point> points(nPoints, Point(-1, -1));
+        int nFound = 0;
+        for (int n = 0; n < nPoints; n++) {
+            if (person[n] < 0)
+                continue;
+            const HeatmapPeak& peak = candidates[n][person[n]];
+            points[n] = Point2f(peak.x * frameWidth / W, peak.y * frameHeight / H);
+            nFound++;
+        }
+        if (nFound >= minParts)
+            found.push_back(make_pair(nFound, points));
+    }
+    std::stable_sort(found.begin(), found.end(), [](const pair<int, vector<Point>>& l, const pair<int, vector<Point>>& r) {
+        return l.first > r.first;
+    });
+    vector<vector<Point>> poses;
+    for (auto& person : found)
+        poses.push_back(std::move(person.second));
+    return poses;
+}
+
+// drawKeypoints
+// preconditions: frame is not an empty image
+// postcondition: draw every found point and its number in the inputted frame
+void drawKeypoints(const vector<Point>& points, const Mat& frame) {
+    METRICS_TIMER("draw");
+    for (int n = 0; n < (int)points.size(); n++)
+    {
+        if (points[n].x < 0 || points[n].y < 0)
+            continue;
+        circle(frame, points[n], 8, Scalar(0, 255, 255), -1);
+        cv::putText(frame, cv::format("%d", n), points[n], cv::FONT_HERSHEY_COMPLEX, 1, cv::Scalar(0, 0, 255), 2);
+    }
+}
+
+// drawpointsConnection
+// preconditions: frame is not an empty image
+// postcondition: draw points and make a directly straight line connection between the point pair in the inputted frame
+void drawPointsConnection(const int nPairs, const vector<Point>& points, const Mat& frame) {
+    for (int n = 0; n < nPairs; n++)
+    {
+        // lookup 2 connected points pair
+        Point2f partA = points[POSE_PAIRS[n][0]];
+        Point2f partB = points[POSE_PAIRS[n][1]];
+
+        if (partA.x <= 0 || partA.y <= 0 || partB.x <= 0 || partB.y <= 0)
+            continue;
+
+        line(frame, partA, partB, Scalar(0, 255, 255), 8);
+        circle(frame, partA, 8, Scalar(0, 0, 255), -1);
+        circle(frame, partB, 8, Scalar(0, 0, 255), -1);
+    }
+}
+
+// drawSkeleton
+// preconditions: frame is not an empty image
+// postcondition: draw the connections of every pose pair in the inputted frame
+void drawSkeleton(const vector<Point>& points, const Mat& frame) {
+    METRICS_TIMER("draw");
+    int nPairs = sizeof(POSE_PAIRS) / sizeof(POSE_PAIRS[0]);
+    drawPointsConnection(nPairs, points, frame);
+}
+
+// showPose
+// preconditions: frame is the image the points were found in
+// postcondition: draw the points on a copy of the frame and the skeleton on the frame, display both in a window,
+//				  save the skeleton image to outputFile and wait for a key
+void showPose(const Mat& frame, const vector<Point>& points, const string outputFile) {
+    Mat frameCopy = frame.clone();
+    drawKeypoints(points, frameCopy);
+    drawSkeleton(points, frame);
+    imshow("Output-Keypoints", frameCopy);
+    imshow("Output-Skeleton", frame);
+    imwrite(outputFile, frame);
+    waitKey();
+}
+
+// showPeople
+// preconditions: frame is the image the people were found in
+// postcondition: the same as showPose with the points and the skeleton of every person
+void showPeople(const Mat& frame, const vector<vector<Point>>& people, const string outputFile) {
+    Mat frameCopy = frame.clone();
+    for (const auto& points : people) {
+        drawKeypoints(points, frameCopy);
+        drawSkeleton(points, frame);
+    }
+    imshow("Output-Keypoints", frameCopy);
+    imshow("Output-Skeleton", frame);
+    imwrite(outputFile, frame);
+    waitKey();
+}
+
+// readJpegSize
+// preconditions: none
+// postconditions: store the width and height of the JPEG file imageFile in size, read from its frame header without decoding
+//				   Return false if the file is not a JPEG file or has no frame header
+bool readJpegSize(const string imageFile, Size& size) {
+    std::ifstream in(imageFile, ios::binary);
+    unsigned char marker[4];
+    if (!in.read((char*)marker, 2) || marker[0] != 0xFF || marker[1] != 0xD8)
+        return false;
+
+    // walk the segments until the start of frame segment, which holds the size
+    while (in.read((char*)marker, 2)) {
+        if (marker[0] != 0xFF)
+            return false;
+        unsigned char type = marker[1];
+        if (type == 0xFF) {
+            // fill byte, the marker type follows
+            in.seekg(-1, ios::cur);
+            continue;
+        }
+        if (type == 0x01 || (type >= 0xD0 && type <= 0xD7))
+            continue;
+        if (type == 0xD9 || type == 0xDA)
+            return false;
+        if (!in.read((char*)marker, 2))
+            return false;
+        int length = (marker[0] << 8) | marker[1];
+        if (length < 2)
+            return false;
+        // SOF0 to SOF15, except DHT (C4), JPG (C8) and DAC (CC)
+        if (type >= 0xC0 && type <= 0xCF && type != 0xC4 && type != 0xC8 && type != 0xCC) {
+            unsigned char frame[5];
+            if (!in.read((char*)frame, 5))
+                return false;
+            size.height = (frame[1] << 8) | frame[2];
+            size.width = (frame[3] << 8) | frame[4];
+            return size.width > 0 && size.height > 0;
+        }
+        in.seekg(length - 2, ios::cur);
+    }
+    return false;
+}
+
+// chooseDecodeScale
+// preconditions: inWidth and inHeight are positive
+// postconditions: return the largest reduction of 1, 2, 4 and 8 that keeps an image of size at least inWidth x inHeight
+int chooseDecodeScale(const Size& size, const int inWidth, const int inHeight) {
+    int scale = 8;
+    while (scale > 1 && (size.width / scale < inWidth || size.height / scale < inHeight))
+        scale /= 2;
+    return scale;
+}
+
+// decodeImage
+// preconditions: inWidth and inHeight are positive
+// postconditions: read the image file and store the size of the full image in originalSize. If reduced is true and the file is
+//				   a JPEG file larger than the network input, it is decoded at the reduced scale of chooseDecodeScale, which skips
+//				   most of the decoding work. originalSize is in the orientation of the returned image, also when imread turned it
+//				   by the EXIF orientation of the file. Return an empty image if the file could not be read
+Mat decodeImage(const string imageFile, const int inWidth, const int inHeight, const bool reduced, Size& originalSize) {
+    METRICS_TIMER("decode");
+    int scale = 1;
+    if (reduced && readJpegSize(imageFile, originalSize))
+        scale = chooseDecodeScale(originalSize, inWidth, inHeight);
+    const int flags[] = { IMREAD_COLOR, IMREAD_REDUCED_COLOR_2, IMREAD_REDUCED_COLOR_4, IMREAD_REDUCED_COLOR_8 };
+    Mat frame = imread(imageFile, flags[scale == 8 ? 3 : scale / 2]);
+    if (scale == 1)
+        originalSize = Size(frame.cols, frame.rows);
+    else if (!frame.empty() && frame.cols != frame.rows && (frame.cols > frame.rows) != (originalSize.width > originalSize.height))
+        // imread turned the image by its EXIF orientation (5 to 8), which the frame header does not know about
+        std::swap(originalSize.width, originalSize.height);
+    return frame;
+}
+
+// poseModelName
+// preconditions: none
+// postconditions: return the prototxt and weights files of the pose model, separated by a comma
+string poseModelName() {
+    return prototxt + "," + weightsModel;
+}
+
+// loadPoseNetwork
+// preconditions: device is either "cpu" or "gpu", and the caffe model files exist
+// postconditions: return the pose network read from the caffe model with its preferable backend set for the device
+Net loadPoseNetwork(const string device) {
+    METRICS_TIMER("model_load");
+    // Get the dnn model from caffe
+    Net netModel = readNetFromCaffe(prototxt, weightsModel);
+
+    // Set which device is used for the model
+    if (device == "cpu")
+    {
+        netModel.setPreferableBackend(DNN_TARGET_CPU);
+    }
+    else if (device == "gpu")
+    {
+        netModel.setPreferableBackend(DNN_BACKEND_CUDA);
+        netModel.setPreferableTarget(DNN_TARGET_CUDA);
+    }
+    return netModel;
+}
+
+// estimatePose
+// preconditions: netModel is loaded by loadPoseNetwork, frame is not an empty image
+// postconditions: use the loaded network to find the point locations of the frame. Nothing is displayed
+//				   The points are in the coordinates of originalSize if it is given, else of the frame
+vector<Point> estimatePose(Net& netModel, const Mat& frame, const int inWidth, const int inHeight, const float thresh, const bool subPixel,
+    const Size& originalSize) {
+    // format the image for the network
+    Mat inpBlob;
+    {
+        METRICS_TIMER("blob");
+        inpBlob = blobFromImage(frame, 1.0 / 255, Size(inWidth, inHeight), Scalar(0, 0, 0), false, false);
+    }
+
+    // get the processed image from the dnn model
+    Mat output;
+    {
+        METRICS_TIMER("forward");
+        netModel.setInput(inpBlob);
+        output = netModel.forward();
+    }
+    METRICS_COUNT("images", 1);
+
+    // Find the points based on a threshold
+    // the points are scaled to the original image, which is larger than frame if it was decoded at a reduced scale
+    Size size = originalSize.area() > 0 ? originalSize : Size(frame.cols, frame.rows);
+    return findBodyPartPosition(output, thresh, size.width, size.height, 0, subPixel);
+}
+
+// estimatePoses
+// preconditions: netModel is loaded by loadPoseNetwork, frames is not empty and none of the frames is empty
+// postconditions: use the loaded network to find the point locations of every frame with one forward pass of a batched blob
+//				   Return one vector of points per frame, in the same order as frames. Nothing is displayed
+vector<vector<Point>> estimatePoses(Net& netModel, const vector<Mat>& frames, const int inWidth, const int inHeight, const float thresh,
+    const bool subPixel) {
+    // format all the images into one N x C x H x W blob
+    Mat inpBlob;
+    {
+        METRICS_TIMER("blob");
+        inpBlob = blobFromImages(frames, 1.0 / 255, Size(inWidth, inHeight), Scalar(0, 0, 0), false, false);
+    }
+
+    // get the processed images from the dnn model, the first dimension of the output is the image
+    Mat output;
+    {
+        METRICS_TIMER("forward");
+        netModel.setInput(inpBlob);
+        output = netModel.forward();
+    }
+    METRICS_COUNT("images", frames.size());
+
+    vector<Size> frameSizes;
+    for (const auto& frame : frames)
+        frameSizes.push_back(Size(frame.cols, frame.rows));
+    return findBodyPartPositions(output, thresh, frameSizes, subPixel, defaultThreadCount());
+}
+
+// estimatePeople
+// preconditions: netModel is loaded by loadPoseNetwork, frame is not an empty image
+// postconditions: use the loaded network to find the point locations of every person of the frame with one forward pass
+//				   The points are in the coordinates of originalSize if it is given, else of the frame. Nothing is displayed
+vector<vector<Point>> estimatePeople(Net& netModel, const Mat& frame, const int inWidth, const int inHeight, const float thresh,
+    const bool subPixel, const Size& originalSize) {
+    // format the image for the network
+    Mat inpBlob;
+    {
+        METRICS_TIMER("blob");
+        inpBlob = blobFromImage(frame, 1.0 / 255, Size(inWidth, inHeight), Scalar(0, 0, 0), false, false);
+    }
+
+    // one forward pass gives the heatmaps and the part affinity fields of every person
+    Mat output;
+    {
+        METRICS_TIMER("forward");
+        netModel.setInput(inpBlob);
+        output = netModel.forward();
+    }
+    METRICS_COUNT("images", 1);
+
+    Size size = originalSize.area() > 0 ? originalSize : Size(frame.cols, frame.rows);
+    return findPeoplePositions(output, thresh, size.width, size.height, 0, subPixel);
+}
+
+// performHumanPoseEstimation
+// preconditions: input parameters are inputted correctly and not empty
+// postconditions: use deep neural network to find point locations and display the human poses
+//				   If render is false, the image is not cloned or drawn on and no window is opened
+//				   If reducedDecode is true and nothing is rendered, a large JPEG image is decoded at a reduced scale
+vector<Point> performHumanPoseEstimation(const string device, const string imageFile, const int inWidth, const int inHeight, const float thresh,
+    const bool render, const bool subPixel, const bool reducedDecode) {
+    // Read the image file, the pose is drawn on the full image so it is only reduced when nothing is drawn
+    Size originalSize;
+    Mat frame = decodeImage(imageFile, inWidth, inHeight, reducedDecode && !render, originalSize);
+
+    // Check if the file is empty
+    if (frame.empty())
+    {
+        std::cout << "Could not read the image: " << imageFile << std::endl;
+        exit(-1);
+    }
+
+    // Get the dnn model from caffe, the time of every stage is in the metrics
+    double t = (double)cv::getTickCount();
+    Net netModel = loadPoseNetwork(device);
+
+    // Find the points based on a threshold
+    vector<Point> points = estimatePose(netModel, frame, inWidth, inHeight, thresh, subPixel, originalSize);
+
+    t = ((double)cv::getTickCount() - t) / cv::getTickFrequency();
+    cout << "Time Taken = " << t << endl;
+
+    // Draw the pose estimation and display the image
+    if (render)
+        showPose(frame, points, "Output-Skeleton.jpg");
+    return points;
+}
+
+// performMultiPersonEstimation
+// preconditions: input parameters are inputted correctly and not empty
+// postconditions: the same as performHumanPoseEstimation, but return the points of every person in the image
+vector<vector<Point>> performMultiPersonEstimation(const string device, const string imageFile, const int inWidth, const int inHeight,
+    const float thresh, const bool render, const bool subPixel, const bool reducedDecode) {
+    // Read the image file, the poses are drawn on the full image so it is only reduced when nothing is drawn
+    Size originalSize;
+    Mat frame = decodeImage(imageFile, inWidth, inHeight, reducedDecode && !render, originalSize);
+
+    // Check if the file is empty
+    if (frame.empty())
+    {
+        std::cout << "Could not read the image: " << imageFile << std::endl;
+        exit(-1);
+    }
+
+    // Get the dnn model from caffe and find every person with one forward pass
+    double t = (double)cv::getTickCount();
+    Net netModel = loadPoseNetwork(device);
+    vector<vector<Point>> people = estimatePeople(netModel, frame, inWidth, inHeight, thresh, subPixel, originalSize);
+
+    t = ((double)cv::getTickCount() - t) / cv::getTickFrequency();
+    cout << "Time Taken = " << t << ", found " << people.size() << " people" << endl;
+
+    // Draw every pose and display the image
+    if (render)
+        showPeople(frame, people, "Output-Skeleton.jpg");
+    return people;
+}
+
+// pre_processPoints
+// precondition: vector of points should not be empty
+// postcondition: convert the Points vector into a normalized double vector
+vector<double> pre_processPoints(const vector<Point>& v) {
+	// Convert points into a Cluster_Point
+	vector<double> p;
+	double maxX = 0;
+	double minX = std::numeric_limits<double>::max();
+	double maxY = 0;
+	double minY = std::numeric_limits<double>::max();
+	for (int i = 0; i < v.size(); i++) {
+		maxX = max(maxX, (double)v.at(i).x);
+		maxY = max(maxY, (double)v.at(i).y);
+		minX = min(minX, (double)v.at(i).x);
+		minY = min(minY, (double)v.at(i).y);
+	}
+	for (int i = 0; i < v.size(); i++) {
+		p.push_back(((double)v.at(i).x - minX) / (maxX - minX));
+		p.push_back(((double)v.at(i).y - minY) / (maxY - minY));
+	}
+	return p;
 }
\ No newline at end of file
@@ -1,42 +1,167 @@
-// HumanPoseEstimation.h
-// author: Cheuk-Hang Tse
-// This file has 3 functions: findBodyPartPosition, drawPointsConnection, and performHumanPoseEstimation
-// These functions allow human pose estimation on an image and return the skeleton of the human pose within the image
-// findBodyPartPosition: Return the point locations in a form of a vector
-// drawPointsConnection: draw points and make a directly straight line connection between the point pair in the inputted frame
-// performHumanPoseEstimation: use deep neural network to find point locations and display the human pose
-// Source: https://learnopencv.com/deep-learning-based-human-pose-estimation-using-opencv-cpp-python/
-
-#pragma once
-
-#include <iostream>
-#include <opencv2/dnn/dnn.hpp>
-#include <opencv2/imgproc.hpp>
-#include <opencv2/highgui.hpp>
-#include <chrono>
-#include <thread>
-
-using namespace cv;
-using namespace cv::dnn;
-using namespace std;
-using namespace std::chrono;
-using namespace std::this_thread;
-
-// MPI
-// define the parameters of the deep neural network
-#define MPI
-
-// findBodyPartPosition
-// precondition: output and frameCopy is not empty, and other parameters are inputed correctly
-// postcondition: Return the point locations in a form of a vector
-vector<Point> findBodyPartPosition(Mat& output, const float thresh, const int frameWidth, const int frameHeight, const Mat& frameCopy);
-
-// drawpointsConnection
-// preconditions: frame is not an empty image
-// postcondition: draw points and make a directly straight line connection between the point pair in the inputted frame
-void drawPointsConnection(const int nPairs, const vector<Point>& points, const Mat& frame);
-
-// performHumanPoseEstimation
-// preconditions: input parameters are inputted correctly and not empty
-// postconditions: use deep neural network to find point locations and display the human poses
-vector<Point> performHumanPoseEstimation(const string device, const string imageFile, const int inWidth, const int inHeight, const float thresh);
\ No newline at end of file
+// HumanPoseEstimation.h
+// author: Cheuk-Hang Tse
+// This file has 19 functions: findBodyPartPosition, findBodyPartPositions, findPeoplePositions, drawKeypoints, drawPointsConnection, drawSkeleton, showPose, showPeople, readJpegSize, chooseDecodeScale, decodeImage, poseModelName, loadPoseNetwork, estimatePose, estimatePoses, estimatePeople, performHumanPoseEstimation, performMultiPersonEstimation, and pre_processPoints
+// These functions allow human pose estimation on an image and return the skeleton of the human pose within the image
+// findBodyPartPosition: Return the point locations in a form of a vector
+// findBodyPartPositions: Return the point locations of several images of a batched network output, searched in parallel
+// findPeoplePositions: Return the point locations of every person in an image, joined with the part affinity fields of the network output
+// drawKeypoints: draw every found point and its number in the inputted frame
+// drawPointsConnection: draw points and make a directly straight line connection between the point pair in the inputted frame
+// drawSkeleton: draw the connections of every pose pair in the inputted frame
+// showPose: draw the points and the skeleton of a pose, display them in a window and save the skeleton image
+// showPeople: draw the points and the skeleton of every person, display them in a window and save the skeleton image
+// readJpegSize: read the width and height of a JPEG file from its header without decoding it
+// chooseDecodeScale: return the largest JPEG reduction (1, 2, 4 or 8) that keeps the image at least as large as the network input
+// decodeImage: read an image at the reduced scale chosen for the network input and return its original size
+// poseModelName: return the files of the pose model, which tell apart the results of different models
+// loadPoseNetwork: read the caffe model once and set the device it runs on, so it can be reused for many images
+// estimatePose: use an already loaded network to find the point locations of one image
+// estimatePoses: use an already loaded network to find the point locations of many images with one batched forward pass
+// estimatePeople: use an already loaded network to find the point locations of every person of one image with one forward pass
+// pre_processPoints: convert the Points vector into a normalized double vector
+// performHumanPoseEstimation: use deep neural network to find point locations and display the human pose unless it runs headless
+// performMultiPersonEstimation: the same as performHumanPoseEstimation for every person in the image
+// The heatmap peaks are found with the vectorized kernels of PeakKernel.h
+// The estimation functions never draw, clone the image or open a window. Drawing is done by the draw and show functions only
+// Source: https://learnopencv.com/deep-learning-based-human-pose-estimation-using-opencv-cpp-python/
+
+#pragma once
+
+#include <iostream>
+#include <opencv2/dnn/dnn.hpp>
+#include <opencv2/imgproc.hpp>
+#include <opencv2/highgui.hpp>
+#include "PeakKernel.h"
+#include "Parallel.h"
+#include <chrono>
+#include <thread>
+
+using namespace cv;
+using namespace cv::dnn;
+using namespace std;
+using namespace std::chrono;
+using namespace std::this_thread;
+
+// MPI
+// define the parameters of the deep neural network
+#define MPI
+
+// findBodyPartPosition
+// precondition: output is not empty, and other parameters are inputed correctly
+// postcondition: Return the point locations of the batchIndex-th image of the 4-D output in a form of a vector
+//				  A point that is not found is (-1, -1). Nothing is drawn
+//				  If subPixel is true, the peaks are refined between the heatmap cells before they are scaled to the frame
+vector<Point> findBodyPartPosition(Mat& output, const float thresh, const int frameWidth, const int frameHeight, const int batchIndex = 0,
+    const bool subPixel = false);
+
+// findBodyPartPositions
+// precondition: output is a 4-D network output with a batch of at least firstIndex + frameSizes.size() images
+// postcondition: Return the point locations of frameSizes.size() images of the output, starting with the firstIndex-th image
+//				  The peaks of every body part heatmap of every image are searched at the same time on up to nThreads threads
+vector<vector<Point>> findBodyPartPositions(Mat& output, const float thresh, const vector<Size>& frameSizes, const bool subPixel, const int nThreads,
+    const int firstIndex = 0);
+
+// findPeoplePositions
+// precondition: output is a 4-D MPI network output with the part affinity field channels after the heatmaps
+// postcondition: Return the point locations of every person of the batchIndex-th image, the person with the most body parts first
+//				  Every local maximum above thresh of a heatmap is a candidate body part. The candidates of the two body parts of
+//				  every pose pair are joined where the part affinity field points from one to the other, and the joined pairs
+//				  that share a body part form one person. A person with fewer than 3 body parts is dropped
+//				  A point that is not found is (-1, -1). Return no person if the output has no part affinity fields
+vector<vector<Point>> findPeoplePositions(Mat& output, const float thresh, const int frameWidth, const int frameHeight, const int batchIndex = 0,
+    const bool subPixel = false);
+
+// drawKeypoints
+// preconditions: frame is not an empty image
+// postcondition: draw every found point and its number in the inputted frame
+void drawKeypoints(const vector<Point>& points, const Mat& frame);
+
+// drawpointsConnection
+// preconditions: frame is not an empty image
+// postcondition: draw points and make a directly straight line connection between the point pair in the inputted frame
+void drawPointsConnection(const int nPairs, const vector<Point>& points, const Mat& frame);
+
+// drawSkeleton
+// preconditions: frame is not an empty image
+// postcondition: draw the connections of every pose pair in the inputted frame
+void drawSkeleton(const vector<Point>& points, const Mat& frame);
+
+// showPose
+// preconditions: frame is the image the points were found in
+// postcondition: draw the points on a copy of the frame and the skeleton on the frame, display both in a window,
+//				  save the skeleton image to outputFile and wait for a key
+void showPose(const Mat& frame, const vector<Point>& points, const string outputFile);
+
+// showPeople
+// preconditions: frame is the image the people were found in
+// postcondition: the same as showPose with the points and the skeleton of every person
+void showPeople(const Mat& frame, const vector<vector<Point>>& people, const string outputFile);
+
+// readJpegSize
+// preconditions: none
+// postconditions: store the width and height of the JPEG file imageFile in size, read from its frame header without decoding
+//				   Return false if the file is not a JPEG file or has no frame header
+bool readJpegSize(const string imageFile, Size& size);
+
+// chooseDecodeScale
+// preconditions: inWidth and inHeight are positive
+// postconditions: return the largest reduction of 1, 2, 4 and 8 that keeps an image of size at least inWidth x inHeight
+int chooseDecodeScale(const Size& size, const int inWidth, const int inHeight);
+
+// decodeImage
+// preconditions: inWidth and inHeight are positive
+// postconditions: read the image file and store the size of the full image in originalSize. If reduced is true and the file is
+//				   a JPEG file larger than the network input, it is decoded at the reduced scale of chooseDecodeScale, which skips
+//				   most of the decoding work. originalSize is in the orientation of the returned image, also when imread turned it
+//				   by the EXIF orientation of the file. Return an empty image if the file could not be read
+Mat decodeImage(const string imageFile, const int inWidth, const int inHeight, const bool reduced, Size& originalSize);
+
+// poseModelName
+// preconditions: none
+// postconditions: return the prototxt and weights files of the pose model, separated by a comma
+string poseModelName();
+
+// loadPoseNetwork
+// preconditions: device is either "cpu" or "gpu", and the caffe model files exist
+// postconditions: return the pose network read from the caffe model with its preferable backend set for the device
+Net loadPoseNetwork(const string device);
+
+// estimatePose
+// preconditions: netModel is loaded by loadPoseNetwork, frame is not an empty image
+// postconditions: use the loaded network to find the point locations of the frame. Nothing is displayed
+//				   The points are in the coordinates of originalSize if it is given, else of the frame
+vector<Point> estimatePose(Net& netModel, const Mat& frame, const int inWidth, const int inHeight, const float thresh, const bool subPixel = false,
+    const Size& originalSize = Size());
+
+// estimatePoses
+// preconditions: netModel is loaded by loadPoseNetwork, frames is not empty and none of the frames is empty
+// postconditions: use the loaded network to find the point locations of every frame with one forward pass of a batched blob
+//				   Return one vector of points per frame, in the same order as frames. Nothing is displayed
+vector<vector<Point>> estimatePoses(Net& netModel, const vector<Mat>& frames, const int inWidth, const int inHeight, const float thresh,
+    const bool subPixel = false);
+
+// estimatePeople
+// preconditions: netModel is loaded by loadPoseNetwork, frame is not an empty image
+// postconditions: use the loaded network to find the point locations of every person of the frame with one forward pass
+//				   The points are in the coordinates of originalSize if it is given, else of the frame. Nothing is displayed
+vector<vector<Point>> estimatePeople(Net& netModel, const Mat& frame, const int inWidth, const int inHeight, const float thresh,
+    const bool subPixel = false, const Size& originalSize = Size());
+
+// performHumanPoseEstimation
+// preconditions: input parameters are inputted correctly and not empty
+// postconditions: use deep neural network to find point locations and display the human poses
+//				   If render is false, the image is not cloned or drawn on and no window is opened
+//				   If reducedDecode is true and nothing is rendered, a large JPEG image is decoded at a reduced scale
+vector<Point> performHumanPoseEstimation(const string device, const string imageFile, const int inWidth, const int inHeight, const float thresh,
+    const bool render = true, const bool subPixel = false, const bool reducedDecode = false);
+
+// performMultiPersonEstimation
+// preconditions: input parameters are inputted correctly and not empty
+// postconditions: the same as performHumanPoseEstimation, but return the points of every person in the image
+vector<vector<Point>> performMultiPersonEstimation(const string device, const string imageFile, const int inWidth, const int inHeight,
+    const float thresh, const bool render = true, const bool subPixel = false, const bool reducedDecode = false);
+
+// pre_processPoints
+// precondition: vector of points should not be empty
+// postcondition: convert the Points vector into a normalized double vector
+vector<double> pre_processPoints(const vector<Point>& v);
\ No newline at end of file
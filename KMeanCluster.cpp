@@ -1,27 +1,74 @@
 // KMeanCluster.cpp
 // author: Cheuk-Hang Tse
 // This file contains the implementation of the KMeanCluster class.
-// This class contains 4 constructors, 1 destructor, and 5 functions
+// This class contains 6 constructors, 1 destructor, and 45 functions
 // 
 // CONSTRUCTORS:
 // KMeanCluster(): define a default clustering model with k equals 1 and train the model based on the default dataset
 // KMeanCluster(const int _k): define a default clustering model with k equals the inputted _k and train the model based on the default dataset
 // KMeanCluster(const string _fileName): define a default clustering model with k equals 1 and train the model based on the inputted file
 // KMeanCluster(const string _fileName, const int _k): define a default clustering model with k equals the inputted _k and train the model based on the inputted file
+// KMeanCluster(const string _fileName, const int _k, const TrainConfig& _config): define a clustering model with k equals the inputted _k and train the model based on the inputted file with the inputted training configuration
+// KMeanCluster(const KMeanCluster& other, const size_t nRows): define an untrained copy of the first nRows points of other, used for compaction and reassignment
 
 // DESTRUCTOR:
-// ~KMeanCluster(): clear the clusters and points vector
+// ~KMeanCluster(): wait for a running compaction and reassignment, sync and close the dataset log, and clear the clusters and points vector
 
 // FUNCTIONS:
-// cluster: cluster the inputted point to a cluster and save the new point to the dataset
+// getTrainSeconds: return the number of seconds the last training took
+// getDistanceEvaluations: return the number of point to centroid distances the last training computed
+// getLloydDistanceEvaluations: return the number of point to centroid distances plain Lloyd computes for the same training
+// getIterations: return the number of iterations the last training ran before it stopped
+// getInertia: return the sum of squared distances from every point to its centroid after the last training
+// isFromSnapshot: return true if the model was loaded from its snapshot instead of trained
+// saveSnapshot: save the centroids, the cluster of every point, k, the dimension and the dataset version to a file
+// setStorageConfig: choose how often the dataset log is synced and when it is compacted
+// compactDataSet: write every saved row to the dataset file and empty the dataset log
+// setOnlineConfig: choose whether and how new points move the centroids
+// getOnlineUpdates: return the number of points that moved a centroid
+// getReassignments: return the number of background reassignments that finished
+// getSweepResults: return the inertia, silhouette and Davies-Bouldin index of every k of the last sweep
+// getK: return the number of clusters
+// nearest: return the n stored points closest to the inputted point with their distances, searched cluster by cluster
+// getSearchEvaluations: return the number of distances the last nearest call computed
+// cluster: cluster the inputted point to a cluster and append the new point to the dataset log
 //			Then, return a vector of fileName that have the same cluster of the inputted points
-// readDataSet: read the dataset and converting the entry into Cluster_Point and store them in a vector
-// isContainFileName: return true if the fileNames contain _fileName, else false
+// related: return the file names in the cluster of the inputted point without adding the point
+// clusterMembers: return the cluster of a point and the file names in it
+// readDataSet: read the dataset and its log and converting the entry into Cluster_Point and store them in a vector
+// readPoseDataset: map a binary pose dataset and use its coordinates in place
+// acceptRow: add a parsed row to the dataset and to the dataset version
+// formatRow: return a point in the dataset format
 // saveDataSet: save the clustering points into desire format [filename, point0_x, point0_y, point1_x, ..., pointn_y]
+// appendRow: append a point to the dataset log with a checksum
+// syncLog: flush the dataset log and write it to the disk
+// startCompaction: start compacting the dataset in a background thread
+// rewriteLog: keep only the rows of the dataset log that are not in the dataset file yet
+// updateIndex: add the points that are not indexed yet to the inverted list of their cluster
 // trainModel: train the k mean cluster model based on the inputted dataset. If dataset is empty, no training is done
+// addPoint: append a point, its file name and its cluster id to the dataset
+// loadOrTrain: load the model from its snapshot if the snapshot matches the dataset, else train the model and save the snapshot
+// readSnapshot: read the header, centroids and cluster ids of a snapshot file
+// seedCentroids: pick k points as the initial centroids, uniformly or with k-means++
+// trainLloyd: assign every point to its closest centroid and recompute the centroids in every iteration
+// trainHamerly: the same as trainLloyd but skip the points whose distance bounds prove that their cluster did not change
+// trainSweep: train a model for every k of a sweep with one pass over the points per iteration and keep the best one
+// scoreSweep: compute the silhouette and the Davies-Bouldin index of every model of a sweep
+// recomputeCentroids: merge the partial sums and counts of every chunk into the new centroids
+// isConverged: return true if the training can stop after an iteration
+// trainChunkSize: return the number of points per training chunk
+// countMembers: count the points of every cluster, the starting point of the online learning rates
+// updateCentroid: move the centroid of a point towards it with the learning rate of the centroid
+// applyOnlineUpdates: move the centroids towards the points of the current mini-batch
+// startReassignment: start reassigning every point and recomputing the centroids in a background thread
 
 
 #include "KMeanCluster.h"
+#include "Metrics.h"
+#include <chrono>
+#include <random>
+#include <memory>
+#include <queue>
 
 // KMeanCluster
 // precondition: none
@@ -63,179 +110,1479 @@ KMeanCluster::KMeanCluster(const string _fileName, const int _k) {
 	trainModel();
 }
 
+// KMeanCluster
+// precondition: _k must be positive and _fileName must be a valid file
+// postcondition: define a clustering model with k equals the inputted _k and train the model based on the inputted file with the inputted training configuration
+KMeanCluster::KMeanCluster(const string _fileName, const int _k, const TrainConfig& _config) {
+	fileName = _fileName;
+	k = _k;
+	config = _config;
+	if (config.snapshotFile.empty()) {
+		readDataSet(fileName);
+		trainModel();
+	}
+	else {
+		loadOrTrain();
+	}
+}
+
 // cluster
 // precondition: point must be formatted and inputted correctly, fileN must be the corresponding file of the point
-// postcondition: cluster the inputted point to a cluster and save the new point to the dataset
+// postcondition: cluster the inputted point to a cluster and append the new point to the dataset log
 //				  Then, return a vector of fileName that have the same cluster of the inputted points
 vector<string> KMeanCluster::cluster(const vector<double>& point, const string fileN) {
-	Cluster_Point cp(point, fileN);
+	METRICS_TIMER("kmeans_cluster");
+	std::lock_guard<std::shared_mutex> lock(logMtx);
+
+	// Determine if the point or the dataset is empty
+	if (!point.size())
+		return vector<string>();
+	if (!fileNames.size()) {
+		dim = point.size();
+		addPoint(point, fileN, -1);
+		appendRow(fileNames.size() - 1);
+		return vector<string>();
+	}
+	if (point.size() != dim) {
+		cout << "Point of " << fileN << " has " << point.size() << " coordinates instead of " << dim << endl;
+		return vector<string>();
+	}
 
+	// Find which centroid it belongs to and the points's fileName in that cluster
+	int clusterTarget;
+	vector<string> fileNames = clusterMembers(point, clusterTarget);
+	bool update = online.enabled && clusterTarget >= 0;
+	if (update && centroidCounts.size() != (size_t)k)
+		countMembers();
+	addPoint(point, fileN, clusterTarget);
+	appendRow(this->fileNames.size() - 1);
 
-	// Determine if the dataset is empty
-	if (!point.size()) {
-		points.push_back(cp);
-		saveDataSet(fileName);
+	// Mini-batch k-means: the point moves its centroid once the batch is full
+	if (update) {
+		pendingRows.push_back(this->fileNames.size() - 1);
+		if (pendingRows.size() >= max(online.batchSize, (size_t)1))
+			applyOnlineUpdates();
+	}
+	return fileNames;
+}
+
+// related
+// precondition: point must be formatted like the points passed to cluster
+// postcondition: return the file names that are in the same cluster as point, like cluster, but do not add the point
+//				  Several threads can call related and nearest at the same time
+vector<string> KMeanCluster::related(const vector<double>& point) {
+	METRICS_TIMER("kmeans_related");
+	std::shared_lock<std::shared_mutex> lock(logMtx);
+	if (!point.size() || point.size() != dim)
 		return vector<string>();
+	int clusterTarget;
+	return clusterMembers(point, clusterTarget);
+}
+
+// clusterMembers
+// precondition: logMtx is locked (shared or exclusive), point has dim coordinates
+// postcondition: store the cluster of the closest centroid in clusterTarget (-1 if the model is not trained) and return the file
+//				  names of the points in that cluster
+vector<string> KMeanCluster::clusterMembers(const vector<double>& point, int& clusterTarget) const {
+	clusterTarget = -1;
+	if (centroids.size()) {
+		double minDistance;
+		clusterTarget = nearestCentroid(point.data(), centroids.data(), centroids.size() / dim, dim, minDistance);
+	}
+	vector<string> members;
+	for (size_t i = 0; i < clusterIds.size(); i++) {
+		if (clusterIds[i] == clusterTarget) {
+			members.push_back(fileNames[i]);
+		}
 	}
+	return members;
+}
 
-	// Find which centroid it belongs to
-	for (int i = 0; i < clusters.size(); i++) {
-		int clusterId = i;
-		double dist = clusters.at(i).distance(cp);
-		if (dist < cp.minDistance) {
-			cp.minDistance = dist;
-			cp.clusterId = clusterId;
+// nearest
+// precondition: point must be formatted like the points passed to cluster, n is positive
+// postcondition: return the n stored points closest to point, closest first (the lower index first on a tie)
+//				  The points are kept in one inverted list per cluster. The lists are visited from the closest centroid on, and
+//				  a cluster or a point is skipped if the triangle inequality proves it is farther than the n-th distance found so far,
+//				  so the result is exact. maxProbe > 0 visits at most maxProbe clusters, which is faster but can miss neighbours
+//				  The bounds are widened by the distance a centroid moved with online updates since its list was started
+vector<Neighbor> KMeanCluster::nearest(const vector<double>& point, const size_t n, const int maxProbe) {
+	METRICS_TIMER("kmeans_nearest");
+	std::shared_lock<std::shared_mutex> lock(logMtx);
+	if (centroids.size() == k * dim && (invertedLists.size() != (size_t)k || indexedRows < fileNames.size())) {
+		// the index only changes under the exclusive lock, the points added after that are searched one by one below
+		// A reassignment can clear the index again before the shared lock is taken back, which is checked below
+		lock.unlock();
+		{
+			std::lock_guard<std::shared_mutex> writeLock(logMtx);
+			if (centroids.size() == k * dim)
+				updateIndex();
 		}
+		lock.lock();
 	}
+	searchEvaluations = 0;
+	if (!n || point.size() != dim || !fileNames.size())
+		return vector<Neighbor>();
+	size_t evaluations = 0;
 
-	// Find points's fileName
-	int clusterTarget = cp.clusterId;
-	vector<string> fileNames;
-	for (int i = 0; i < points.size(); i++) {
-		if (points.at(i).clusterId == clusterTarget) {
-			fileNames.push_back(points.at(i).fileName);
+	// max-heap of the n closest points found so far as (squared distance, index)
+	std::priority_queue<pair<double, size_t>> best;
+	vector<double> buffer(dim);
+	auto consider = [&](const size_t i) {
+		pair<double, size_t> candidate(squaredDistance(point.data(), pointAt(i, buffer.data()), dim), i);
+		evaluations++;
+		if (best.size() < n)
+			best.push(candidate);
+		else if (candidate < best.top()) {
+			best.pop();
+			best.push(candidate);
 		}
+	};
+
+	if (centroids.size() != k * dim || invertedLists.size() != (size_t)k) {
+		// not trained yet, or a reassignment cleared the index after it was updated above, compare with every point
+		for (size_t i = 0; i < fileNames.size(); i++)
+			consider(i);
 	}
-	points.push_back(cp);
-	saveDataSet(fileName);
-	return fileNames;
-}
+	else {
+		vector<pair<double, int>> order(k);
+		for (int c = 0; c < k; c++)
+			order[c] = make_pair(sqrt(squaredDistance(point.data(), centroidAt(c), dim)), c);
+		evaluations += k;
+		sort(order.begin(), order.end());
 
-// ~KMeanCluster
-// precondition: none
-// postcondition: clear the clusters and points vector
-KMeanCluster::~KMeanCluster() {
-	clusters.clear();
-	points.clear();
+		for (size_t i : unassignedRows)
+			consider(i);
+		for (size_t i = indexedRows; i < fileNames.size(); i++)
+			consider(i);
+		int nProbed = 0;
+		for (const auto& entry : order) {
+			if (maxProbe > 0 && nProbed >= maxProbe)
+				break;
+			int c = entry.second;
+			if (invertedLists[c].empty())
+				continue;
+			// every point of the cluster is at least this far away (triangle inequality), the margin absorbs rounding
+			double drift = centroidDrift.size() == (size_t)k ? centroidDrift[c] : 0;
+			double bound = entry.first - clusterRadius[c] - drift - 1e-9;
+			if (best.size() == n && bound > 0 && bound * bound > best.top().first)
+				continue;
+			nProbed++;
+			// the same bound for a single point, with its distance to the centroid stored in the index
+			const vector<size_t>& list = invertedLists[c];
+			const vector<double>& radius = listDistances[c];
+			for (size_t j = 0; j < list.size(); j++) {
+				double pointBound = fabs(entry.first - radius[j]) - drift - 1e-9;
+				if (best.size() == n && pointBound > 0 && pointBound * pointBound > best.top().first)
+					continue;
+				consider(list[j]);
+			}
+		}
+	}
+
+	vector<Neighbor> neighbors(best.size());
+	for (size_t r = best.size(); r > 0; r--) {
+		neighbors[r - 1].fileName = fileNames[best.top().second];
+		neighbors[r - 1].distance = sqrt(best.top().first);
+		best.pop();
+	}
+	searchEvaluations = evaluations;
+	METRICS_COUNT("kmeans_search_evaluations", evaluations);
+	return neighbors;
 }
 
-// isContainFileName
-// precondition: fileNames is not empty, _fileName must be a valid string
-// postcondition: return true if the fileNames contain _fileName, else false
-bool KMeanCluster::isContainFileName(const vector<string> fileNames, const string _fileName) {
-	if (std::find(fileNames.begin(), fileNames.end(), _fileName) != fileNames.end()) {
-		return true;
+// updateIndex
+// precondition: logMtx is locked exclusively and the model is trained
+// postcondition: add the points from indexedRows on to the inverted list of their cluster with their distance to the centroid
+//				  and grow the cluster radius
+//				  Points without a cluster are kept in unassignedRows
+void KMeanCluster::updateIndex() {
+	if (invertedLists.size() != (size_t)k) {
+		invertedLists.assign(k, vector<size_t>());
+		listDistances.assign(k, vector<double>());
+		clusterRadius.assign(k, 0);
+		centroidDrift.assign(k, 0);
+		unassignedRows.clear();
+		indexedRows = 0;
 	}
-	else {
-		return false;
+	vector<double> buffer(dim);
+	for (; indexedRows < fileNames.size(); indexedRows++) {
+		int c = clusterIds[indexedRows];
+		if (c < 0 || c >= k) {
+			unassignedRows.push_back(indexedRows);
+			continue;
+		}
+		double distance = sqrt(squaredDistance(pointAt(indexedRows, buffer.data()), centroidAt(c), dim));
+		invertedLists[c].push_back(indexedRows);
+		listDistances[c].push_back(distance);
+		clusterRadius[c] = max(clusterRadius[c], distance);
 	}
+}
 
+// ~KMeanCluster
+// precondition: none
+// postcondition: wait for a running compaction and reassignment, sync and close the dataset log, and clear the centroids and points vector
+KMeanCluster::~KMeanCluster() {
+	if (reassignThread.joinable())
+		reassignThread.join();
+	if (compactThread.joinable())
+		compactThread.join();
+	if (logFile) {
+		syncLog();
+		fclose(logFile);
+	}
+	centroids.clear();
+	coords.clear();
+	floatCoords.clear();
+	fileNames.clear();
+	clusterIds.clear();
 }
 
 // readDataSet
 // precondition: _fileName should be a valid file name
-// postcondition: read the dataset and converting the entry into Cluster_Point and store them in a vector
+// postcondition: read the dataset and then replay the valid rows of its log (_fileName + ".log") that are not in the dataset yet
+//				  The coordinates of every entry are stored in one contiguous block
+//				  Entries with a different number of coordinates than the first entry are skipped
 void KMeanCluster::readDataSet(const string _fileName) {
+	METRICS_TIMER("kmeans_read");
 	try {
-		points.clear();
-		string line, word;
+		coords.clear();
+		floatCoords.clear();
+		fileNames.clear();
+		clusterIds.clear();
+		savedNames.clear();
+		logIndices.clear();
+		invertedLists.clear();
+		listDistances.clear();
+		clusterRadius.clear();
+		unassignedRows.clear();
+		indexedRows = 0;
+		mapped.close();
+		mappedCoords = nullptr;
+		mappedRows = 0;
+		dim = 0;
+		datasetVersion = FNV1A64_OFFSET;
+		checkpointVersion = FNV1A64_OFFSET;
+		string line, name;
+		vector<double> point;
 
-		fstream file(_fileName, ios::in);
+		binaryDataSet = PoseDataset::isPoseDataset(_fileName);
+		fstream file;
+		if (binaryDataSet)
+			readPoseDataset(_fileName);
+		else
+			file.open(_fileName, ios::in);
 		if (file.is_open())
 		{
 			while (getline(file, line))
 			{
-				Cluster_Point p;
-
-				stringstream str(line);
-				int i = 0;
-				while (getline(str, word, ',')) {
-					if (i == 0)
-					{
-						p.fileName = word;
-					}
-					else {
-						p.coords.push_back(stod(word));
-					}
-					i++;
-				}
-				points.push_back(p);
+				if (!line.empty() && line.back() == '\r')
+					line.pop_back();
+				if (line.empty())
+					continue;
+				parseDataSetRow(line, name, point);
+				acceptRow(name, point);
 			}
 		}
-		else
+		else if (!binaryDataSet)
 			cout << "Could not open the file\n";
+
+		// Replay the log, a row is only used if its checksum is valid, so a row cut off by a crash is ignored
+		fstream log(_fileName + ".log", ios::in);
+		size_t nBroken = 0;
+		while (log.is_open() && getline(log, line)) {
+			if (!line.empty() && line.back() == '\r')
+				line.pop_back();
+			size_t mark = line.rfind('#');
+			if (mark == string::npos || fnv1a64(line.data(), mark) != strtoull(line.c_str() + mark + 1, nullptr, 16)) {
+				nBroken += !line.empty();
+				continue;
+			}
+			line.resize(mark);
+			parseDataSetRow(line, name, point);
+			if (savedNames.count(name))
+				continue;
+			if (acceptRow(name, point))
+				logIndices.push_back(fileNames.size() - 1);
+		}
+		if (nBroken)
+			cout << "Ignored " << nBroken << " damaged rows in " << _fileName << ".log" << endl;
 	}
-	catch (exception e) {
+	catch (exception& e) {
 		cerr << e.what();
 		exit(-1);
 	}
 }
 
+// readPoseDataset
+// precondition: the dataset is empty and _fileName is a pose dataset
+// postcondition: map the pose dataset and use its coordinates in place as the first points of the dataset
+//				  Only the file names are copied out of the file, the dataset version is read from the row versions
+void KMeanCluster::readPoseDataset(const string _fileName) {
+	if (!mapped.open(_fileName)) {
+		cout << "Could not open the pose dataset " << _fileName << endl;
+		return;
+	}
+	dim = mapped.getDim();
+	mappedRows = mapped.size();
+	mappedCoords = mapped.coordinates();
+	fileNames.reserve(mappedRows);
+	savedNames.reserve(mappedRows);
+	for (size_t i = 0; i < mappedRows; i++) {
+		fileNames.push_back(mapped.nameAt(i));
+		savedNames.insert(fileNames.back());
+	}
+	clusterIds.assign(mappedRows, -1);
+	datasetVersion = mapped.versionAt(mappedRows);
+	if (checkpointRows <= mappedRows)
+		checkpointVersion = mapped.versionAt(checkpointRows);
+}
+
+// acceptRow
+// precondition: name and point are parsed from a row of the dataset or the log
+// postcondition: add the point to the dataset and its row in the format of formatRow to the dataset version, so compacting
+//				  the dataset does not change the version. Return false if the point is skipped because its number of
+//				  coordinates is different from the first point
+bool KMeanCluster::acceptRow(const string& name, const vector<double>& point) {
+	if (!dim)
+		dim = point.size();
+	if (point.size() != dim) {
+		cout << "Skipping " << name << ": " << point.size() << " coordinates instead of " << dim << endl;
+		return false;
+	}
+	addPoint(point, name, -1);
+	savedNames.insert(name);
+	string row = formatRow(fileNames.size() - 1);
+	datasetVersion = fnv1a64(row.data(), row.size(), datasetVersion);
+	datasetVersion = fnv1a64("\n", 1, datasetVersion);
+	if (fileNames.size() == checkpointRows)
+		checkpointVersion = datasetVersion;
+	return true;
+}
+
+// formatRow
+// precondition: i is smaller than the number of points
+// postcondition: return the i-th point in the dataset format [filename, point0_x, point0_y, ..., pointn_y] with a trailing comma
+string KMeanCluster::formatRow(const size_t i) const {
+	vector<double> buffer(dim);
+	return formatDataSetRow(fileNames[i], pointAt(i, buffer.data()), dim);
+}
+
 // saveDataSet
 // precondition: _fileName must be a valid file name
-// postcondition: save the clustering points into desire format [filename, point0_x, point0_y, point1_x, ..., pointn_y]
-void KMeanCluster::saveDataSet(const string _fileName) {
-	std::ofstream out(_fileName);
+// postcondition: save the first nRows clustering points into desire format [filename, point0_x, point0_y, point1_x, ..., pointn_y]
+//				  or as a pose dataset if the dataset was read from one
+//				  Only the first row of every file name is saved. The rows are written to a temporary file that replaces _fileName
+//				  Return false if the file could not be written
+bool KMeanCluster::saveDataSet(const string _fileName, const size_t nRows) const {
+	METRICS_TIMER("kmeans_save");
+	if (binaryDataSet) {
+		PoseDatasetWriter writer;
+		if (!writer.open(_fileName, dim))
+			return false;
+		std::unordered_set<string> written;
+		vector<double> buffer(dim);
+		for (size_t i = 0; i < nRows; i++) {
+			if (written.insert(fileNames[i]).second)
+				writer.add(fileNames[i], pointAt(i, buffer.data()), formatRow(i));
+		}
+		return writer.finish();
+	}
 
-	vector<string> fileNames;
-	for (auto& row : points) {
-		if (isContainFileName(fileNames, row.fileName))
-			continue;
+	string tmpName = _fileName + ".tmp";
+	FILE* out = fopen(tmpName.c_str(), "wb");
+	if (!out)
+		return false;
 
-		out << row.fileName << ',';
-		fileNames.push_back(row.fileName);
-		for (auto col : row.coords)
-			out << col << ',';
-		out << '\n';
+	std::unordered_set<string> written;
+	for (size_t i = 0; i < nRows; i++) {
+		if (!written.insert(fileNames[i]).second)
+			continue;
+		string row = formatRow(i);
+		row += '\n';
+		fwrite(row.data(), 1, row.size(), out);
 	}
+	bool ok = fflush(out) == 0 && syncFile(out);
+	ok = fclose(out) == 0 && ok;
+	if (!ok)
+		return false;
+	std::remove(_fileName.c_str());
+	return std::rename(tmpName.c_str(), _fileName.c_str()) == 0;
 }
 
 // trainModel
 // precondition: none
 // postcondition: train the k mean cluster model based on the inputted dataset. If dataset is empty, no training is done
+//				  The points are split into a fixed number of chunks that are assigned on config.nThreads threads
+//				  Every chunk keeps its own partial sums and counts, which are merged in chunk order, so the result only depends on the seed
 void KMeanCluster::trainModel() {
 	try {
 		// Determine if the dataset is empty
-		if (!points.size())
+		if (!fileNames.size() || !dim)
 			return;
+		auto start = std::chrono::steady_clock::now();
+		int nThreads = config.nThreads > 0 ? config.nThreads : defaultThreadCount();
+		distanceEvaluations = 0;
+		iterations = 0;
+		inertia = 0;
+		std::fill(clusterIds.begin(), clusterIds.end(), -1);
+
+		if (!config.sweepKs.empty())
+			trainSweep(nThreads);
+		else {
+			if (warmCentroids.size() == k * dim)
+				centroids = warmCentroids;
+			else
+				seedCentroids(nThreads);
+			if (config.mode == TrainMode::HAMERLY)
+				trainHamerly(nThreads);
+			else
+				trainLloyd(nThreads);
+		}
+		trainSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		METRICS_OBSERVE("kmeans_train", trainSeconds);
+		METRICS_COUNT("kmeans_trainings", 1);
+		METRICS_COUNT("kmeans_train_iterations", iterations);
+		METRICS_COUNT("kmeans_distance_evaluations", distanceEvaluations);
+	}
+	catch (exception& e) {
+		cerr << e.what();
+	}
+}
+
+// seedCentroids
+// precondition: the dataset is not empty
+// postcondition: pick k points as the initial centroids with config.seeding using config.seed
+void KMeanCluster::seedCentroids(const int nThreads) {
+	size_t n = fileNames.size();
+	std::mt19937 rng(config.seed ? config.seed : (unsigned int)time(0));
+	std::uniform_int_distribution<size_t> pick(0, n - 1);
+	centroids.resize(k * dim);
+	vector<double> buffer(dim);
+	for (int i = 0; i < k; i++) {
+		const double* seed = pointAt(pick(rng), buffer.data());
+		std::copy(seed, seed + dim, centroids.begin() + i * dim);
+		if (config.seeding == SeedMode::KMEANS_PLUS_PLUS)
+			break;
+	}
+	if (config.seeding != SeedMode::KMEANS_PLUS_PLUS)
+		return;
+
+	// k-means++: pick every next centroid with a probability proportional to the squared distance to the closest centroid
+	const size_t chunkSize = trainChunkSize();
+	const size_t nChunks = (n + chunkSize - 1) / chunkSize;
+	vector<double> closest(n, std::numeric_limits<double>::max());
+	vector<double> chunkTotal(nChunks);
+	for (int i = 1; i < k; i++) {
+		const double* newest = centroidAt(i - 1);
+		parallelFor(nChunks, nThreads, [&](size_t c) {
+			double total = 0;
+			vector<double> chunkBuffer(dim);
+			size_t end = std::min(n, (c + 1) * chunkSize);
+			for (size_t j = c * chunkSize; j < end; j++) {
+				closest[j] = min(closest[j], squaredDistance(pointAt(j, chunkBuffer.data()), newest, dim));
+				total += closest[j];
+			}
+			chunkTotal[c] = total;
+		});
+
+		double total = 0;
+		for (size_t c = 0; c < nChunks; c++)
+			total += chunkTotal[c];
+
+		// every point is already a centroid, so fall back to a uniform pick
+		size_t chosen = pick(rng);
+		if (total > 0) {
+			double r = std::uniform_real_distribution<double>(0, total)(rng);
+			size_t c = 0;
+			while (c + 1 < nChunks && (r >= chunkTotal[c] || chunkTotal[c] <= 0)) {
+				r -= chunkTotal[c];
+				c++;
+			}
+			size_t end = std::min(n, (c + 1) * chunkSize);
+			for (size_t j = c * chunkSize; j < end; j++) {
+				if (closest[j] <= 0)
+					continue;
+				chosen = j;
+				if (r < closest[j])
+					break;
+				r -= closest[j];
+			}
+		}
+		const double* seed = pointAt(chosen, buffer.data());
+		std::copy(seed, seed + dim, centroids.begin() + i * dim);
+	}
+}
+
+// trainLloyd
+// precondition: the centroids are seeded
+// postcondition: assign every point to its closest centroid and recompute the centroids until isConverged
+void KMeanCluster::trainLloyd(const int nThreads) {
+	size_t n = fileNames.size();
+	const size_t chunkSize = trainChunkSize();
+	const size_t nChunks = (n + chunkSize - 1) / chunkSize;
+	vector<int> chunkCount(nChunks * k);
+	vector<double> chunkSum(nChunks * k * dim);
+	vector<double> chunkInertia(nChunks);
+	vector<size_t> chunkChanged(nChunks);
+	vector<double> previous;
+	vector<double> moved(k);
+
+	// Iterate until converged or x times of the steps below
+	for (int l = 0; l < config.maxIterations; l++) {
+		// Assign points to a cluster and sum up the coordinates of every cluster within every chunk
+		parallelFor(nChunks, nThreads, [&](size_t c) {
+			int* count = chunkCount.data() + c * k;
+			double* sum = chunkSum.data() + c * k * dim;
+			std::fill(count, count + k, 0);
+			std::fill(sum, sum + k * dim, 0.0);
+			double inertiaSum = 0;
+			size_t changed = 0;
+			vector<double> buffer(dim);
+			size_t end = std::min(n, (c + 1) * chunkSize);
+			for (size_t j = c * chunkSize; j < end; j++) {
+				const double* point = pointAt(j, buffer.data());
+				double minDistance;
+				int clusterId = nearestCentroid(point, centroids.data(), k, dim, minDistance);
+				if (clusterIds[j] != clusterId)
+					changed++;
+				clusterIds[j] = clusterId;
+				inertiaSum += minDistance;
+				count[clusterId] += 1;
+				double* clusterSum = sum + clusterId * dim;
+				for (size_t d = 0; d < dim; d++)
+					clusterSum[d] += point[d];
+			}
+			chunkInertia[c] = inertiaSum;
+			chunkChanged[c] = changed;
+		});
+		distanceEvaluations += n * k;
+
+		size_t nChanged = 0;
+		double lastInertia = l ? inertia : -1;
+		inertia = 0;
+		for (size_t c = 0; c < nChunks; c++) {
+			nChanged += chunkChanged[c];
+			inertia += chunkInertia[c];
+		}
 
-		// Initialize k cluster points
-		srand((unsigned int)time(0));
-		size_t n = points.size();
+		// Recompute Centroids
+		previous = centroids;
+		recomputeCentroids(chunkCount, chunkSum, nChunks, nThreads);
+		iterations = l + 1;
+		if (isConverged(nChanged, previous, moved, lastInertia))
+			break;
+	}
+}
+
+// trainHamerly
+// precondition: the centroids are seeded
+// postcondition: the same clustering as trainLloyd, but a point is only compared with every centroid
+//				  if its upper bound to its centroid is not below its lower bound to the other centroids
+//				  and half the distance from its centroid to the closest other centroid
+void KMeanCluster::trainHamerly(const int nThreads) {
+	size_t n = fileNames.size();
+	const size_t chunkSize = trainChunkSize();
+	const size_t nChunks = (n + chunkSize - 1) / chunkSize;
+	vector<int> chunkCount(nChunks * k);
+	vector<double> chunkSum(nChunks * k * dim);
+	vector<size_t> chunkEvaluations(nChunks);
+	vector<double> chunkInertia(nChunks);
+	vector<size_t> chunkChanged(nChunks);
+
+	vector<double> upper(n); // upper bound of the distance from a point to its centroid
+	vector<double> lower(n); // lower bound of the distance from a point to every other centroid
+	vector<double> halfGap(k); // half the distance from a centroid to its closest other centroid
+	vector<double> moved(k); // distance every centroid moved in the last recomputation
+	vector<double> previous;
+	// The bounds are compared with a small relative margin so rounding can never skip a point whose cluster changed
+	const double margin = 1e-9;
+	// The inertia check needs the exact distance of the skipped points too, so it costs one distance per skipped point
+	const bool needInertia = config.inertiaTolerance > 0;
+
+	for (int l = 0; l < config.maxIterations; l++) {
+		// half the distance between every centroid and its closest other centroid
+		parallelFor(k, nThreads, [&](size_t i) {
+			double closest = std::numeric_limits<double>::max();
+			for (int j = 0; j < k; j++) {
+				if (j != (int)i)
+					closest = min(closest, squaredDistance(centroidAt(i), centroidAt(j), dim));
+			}
+			halfGap[i] = 0.5 * sqrt(closest);
+		});
+		distanceEvaluations += (size_t)k * (k - 1);
+
+		parallelFor(nChunks, nThreads, [&](size_t c) {
+			int* count = chunkCount.data() + c * k;
+			double* sum = chunkSum.data() + c * k * dim;
+			std::fill(count, count + k, 0);
+			std::fill(sum, sum + k * dim, 0.0);
+			size_t evaluations = 0;
+			size_t changed = 0;
+			double inertiaSum = 0;
+			vector<double> buffer(dim);
+			size_t end = std::min(n, (c + 1) * chunkSize);
+			for (size_t j = c * chunkSize; j < end; j++) {
+				const double* point = pointAt(j, buffer.data());
+				bool recompute = l == 0;
+				double exact = -1;
+				if (!recompute) {
+					int a = clusterIds[j];
+					double bound = max(halfGap[a], lower[j]);
+					if (upper[j] * (1 + margin) >= bound * (1 - margin)) {
+						// tighten the upper bound and test again
+						exact = squaredDistance(point, centroidAt(a), dim);
+						upper[j] = sqrt(exact);
+						evaluations++;
+						recompute = upper[j] * (1 + margin) >= bound * (1 - margin);
+					}
+				}
+				if (recompute) {
+					double minDistance, secondDistance;
+					int clusterId = nearestTwoCentroids(point, centroids.data(), k, dim, minDistance, secondDistance);
+					if (clusterIds[j] != clusterId)
+						changed++;
+					clusterIds[j] = clusterId;
+					upper[j] = sqrt(minDistance);
+					lower[j] = sqrt(secondDistance);
+					exact = minDistance;
+					evaluations += k;
+				}
+				if (needInertia) {
+					if (exact < 0) {
+						exact = squaredDistance(point, centroidAt(clusterIds[j]), dim);
+						evaluations++;
+					}
+					inertiaSum += exact;
+				}
+
+				int clusterId = clusterIds[j];
+				count[clusterId] += 1;
+				double* clusterSum = sum + clusterId * dim;
+				for (size_t d = 0; d < dim; d++)
+					clusterSum[d] += point[d];
+			}
+			chunkEvaluations[c] = evaluations;
+			chunkChanged[c] = changed;
+			chunkInertia[c] = inertiaSum;
+		});
+
+		size_t nChanged = 0;
+		double lastInertia = l ? inertia : -1;
+		inertia = 0;
+		for (size_t c = 0; c < nChunks; c++) {
+			distanceEvaluations += chunkEvaluations[c];
+			nChanged += chunkChanged[c];
+			inertia += chunkInertia[c];
+		}
+
+		previous = centroids;
+		recomputeCentroids(chunkCount, chunkSum, nChunks, nThreads);
+		iterations = l + 1;
+		bool converged = isConverged(nChanged, previous, moved, needInertia ? lastInertia : -1);
+		distanceEvaluations += k;
+		if (converged)
+			break;
+
+		// move the bounds by the distance the centroids moved
+		int farthest = 0;
+		for (int i = 0; i < k; i++) {
+			if (moved[i] > moved[farthest])
+				farthest = i;
+		}
+		double secondFarthest = 0;
 		for (int i = 0; i < k; i++) {
-			clusters.push_back(points.at(rand() % n));
-		}
-
-		// Iterate x times of the steps below
-		for (int l = 0; l < trainIteration; l++) {
-			// Assign points to a cluster
-			for (int i = 0; i < clusters.size(); i++) {
-				int clusterId = i;
-				for (int j = 0; j < points.size(); j++) {
-					double dist = clusters.at(i).distance(points.at(j));
-					if (dist < points.at(j).minDistance) {
-						points.at(j).minDistance = dist;
-						points.at(j).clusterId = clusterId;
+			if (i != farthest)
+				secondFarthest = max(secondFarthest, moved[i]);
+		}
+		parallelFor(nChunks, nThreads, [&](size_t c) {
+			size_t end = std::min(n, (c + 1) * chunkSize);
+			for (size_t j = c * chunkSize; j < end; j++) {
+				int a = clusterIds[j];
+				upper[j] += moved[a];
+				lower[j] -= a == farthest ? secondFarthest : moved[farthest];
+			}
+		});
+	}
+
+	// the inertia of the last assignment, the same value trainLloyd reports
+	if (!needInertia && iterations > 0) {
+		parallelFor(nChunks, nThreads, [&](size_t c) {
+			double inertiaSum = 0;
+			vector<double> buffer(dim);
+			size_t end = std::min(n, (c + 1) * chunkSize);
+			for (size_t j = c * chunkSize; j < end; j++)
+				inertiaSum += squaredDistance(pointAt(j, buffer.data()), previous.data() + clusterIds[j] * dim, dim);
+			chunkInertia[c] = inertiaSum;
+		});
+		inertia = 0;
+		for (size_t c = 0; c < nChunks; c++)
+			inertia += chunkInertia[c];
+	}
+}
+
+// trainSweep
+// precondition: config.sweepKs is not empty
+// postcondition: train a model for every k of config.sweepKs at the same time, with the same result as a separate training of every k.
+//				  The models share their seeding (the first k centroids of one k-means++ seeding for the largest k) and one pass over
+//				  the points per iteration, in which every point is compared with the models that did not converge yet. Every model
+//				  keeps Hamerly bounds, so a point is only compared with every centroid of a model when its cluster can change
+//				  Store the results in sweepResults and keep the model picked by config.sweepSelect as the model: k, its centroids and its clusters
+void KMeanCluster::trainSweep(const int nThreads) {
+	vector<int> ks;
+	for (int sweepK : config.sweepKs) {
+		if (sweepK > 0)
+			ks.push_back(sweepK);
+	}
+	sort(ks.begin(), ks.end());
+	ks.erase(unique(ks.begin(), ks.end()), ks.end());
+	sweepResults.clear();
+	if (ks.empty())
+		return;
+
+	// The first k centroids of a k-means++ seeding are a k-means++ seeding for k, so one seeding serves every model
+	k = ks.back();
+	seedCentroids(nThreads);
+	const size_t nModels = ks.size();
+	vector<size_t> offsets(nModels); // first centroid row of every model
+	vector<int> modelOf; // model of every centroid row
+	size_t totalK = 0;
+	for (size_t m = 0; m < nModels; m++) {
+		offsets[m] = totalK;
+		totalK += ks[m];
+		modelOf.insert(modelOf.end(), ks[m], (int)m);
+	}
+	vector<double> modelCentroids(totalK * dim);
+	for (size_t m = 0; m < nModels; m++)
+		std::copy(centroids.begin(), centroids.begin() + ks[m] * dim, modelCentroids.begin() + offsets[m] * dim);
+
+	size_t n = fileNames.size();
+	const size_t chunkSize = trainChunkSize();
+	const size_t nChunks = (n + chunkSize - 1) / chunkSize;
+	vector<vector<int>> ids(nModels, vector<int>(n, -1));
+	vector<vector<double>> upper(nModels, vector<double>(n)); // upper bound of the distance from a point to its centroid
+	vector<vector<double>> lower(nModels, vector<double>(n)); // lower bound of the distance from a point to the other centroids
+	vector<double> halfGap(totalK); // half the distance from a centroid to the closest other centroid of its model
+	vector<double> moved(totalK, 0); // distance every centroid moved in the last recomputation
+	vector<double> previous(totalK * dim); // centroids before the last recomputation of every model
+	vector<int> chunkCount(nChunks * totalK);
+	vector<double> chunkSum(nChunks * totalK * dim);
+	vector<double> chunkInertia(nChunks * nModels);
+	vector<size_t> chunkChanged(nChunks * nModels);
+	vector<size_t> chunkEvaluations(nChunks);
+	vector<char> active(nModels, 1);
+	vector<int> modelIterations(nModels, 0);
+	vector<double> modelInertia(nModels, 0);
+	size_t nActive = nModels;
+	// the same margin and inertia rule as trainHamerly
+	const double margin = 1e-9;
+	const bool needInertia = config.inertiaTolerance > 0;
+
+	for (int l = 0; l < config.maxIterations && nActive; l++) {
+		parallelFor(totalK, nThreads, [&](size_t row) {
+			size_t m = modelOf[row];
+			if (!active[m])
+				return;
+			double closest = std::numeric_limits<double>::max();
+			for (size_t other = offsets[m]; other < offsets[m] + ks[m]; other++) {
+				if (other != row)
+					closest = min(closest, squaredDistance(modelCentroids.data() + row * dim, modelCentroids.data() + other * dim, dim));
+			}
+			halfGap[row] = 0.5 * sqrt(closest);
+		});
+		for (size_t m = 0; m < nModels; m++)
+			distanceEvaluations += active[m] ? (size_t)ks[m] * (ks[m] - 1) : 0;
+
+		// One pass over the points: every point is tested against every active model while it is in the cache
+		parallelFor(nChunks, nThreads, [&](size_t c) {
+			int* count = chunkCount.data() + c * totalK;
+			double* sum = chunkSum.data() + c * totalK * dim;
+			std::fill(count, count + totalK, 0);
+			std::fill(sum, sum + totalK * dim, 0.0);
+			std::fill(chunkInertia.begin() + c * nModels, chunkInertia.begin() + (c + 1) * nModels, 0.0);
+			std::fill(chunkChanged.begin() + c * nModels, chunkChanged.begin() + (c + 1) * nModels, 0);
+			size_t evaluations = 0;
+			vector<double> buffer(dim);
+			size_t end = std::min(n, (c + 1) * chunkSize);
+			for (size_t j = c * chunkSize; j < end; j++) {
+				const double* point = pointAt(j, buffer.data());
+				for (size_t m = 0; m < nModels; m++) {
+					if (!active[m])
+						continue;
+					const double* model = modelCentroids.data() + offsets[m] * dim;
+					int& clusterId = ids[m][j];
+					bool recompute = l == 0;
+					double exact = -1;
+					if (!recompute) {
+						double bound = max(halfGap[offsets[m] + clusterId], lower[m][j]);
+						if (upper[m][j] * (1 + margin) >= bound * (1 - margin)) {
+							exact = squaredDistance(point, model + clusterId * dim, dim);
+							upper[m][j] = sqrt(exact);
+							evaluations++;
+							recompute = upper[m][j] * (1 + margin) >= bound * (1 - margin);
+						}
 					}
+					if (recompute) {
+						double minDistance, secondDistance;
+						int nearest = nearestTwoCentroids(point, model, ks[m], dim, minDistance, secondDistance);
+						if (clusterId != nearest)
+							chunkChanged[c * nModels + m]++;
+						clusterId = nearest;
+						upper[m][j] = sqrt(minDistance);
+						lower[m][j] = sqrt(secondDistance);
+						exact = minDistance;
+						evaluations += ks[m];
+					}
+					if (needInertia) {
+						if (exact < 0) {
+							exact = squaredDistance(point, model + clusterId * dim, dim);
+							evaluations++;
+						}
+						chunkInertia[c * nModels + m] += exact;
+					}
+					size_t row = offsets[m] + clusterId;
+					count[row] += 1;
+					double* clusterSum = sum + row * dim;
+					for (size_t d = 0; d < dim; d++)
+						clusterSum[d] += point[d];
 				}
 			}
-			// Recompute Centroids
-			vector<int> nPoints;
-			vector<vector<double>> sumCoord;
-			for (int i = 0; i < clusters.size(); i++) {
-				nPoints.push_back(0);
-				vector<double> v(clusters.at(i).coords.size(), 0);
-				sumCoord.push_back(v);
-			}
-			for (int i = 0; i < points.size(); i++) {
-				int clusterId = points.at(i).clusterId;
-				nPoints.at(clusterId) += 1;
-				for (int j = 0; j < points.at(i).coords.size(); j++) {
-					sumCoord.at(clusterId).at(j) += points.at(i).coords.at(j);
+			chunkEvaluations[c] = evaluations;
+		});
+		for (size_t c = 0; c < nChunks; c++)
+			distanceEvaluations += chunkEvaluations[c];
+
+		// Recompute the centroids of every active model and stop the models that converged, with the rules of isConverged
+		for (size_t m = 0; m < nModels; m++) {
+			if (!active[m])
+				continue;
+			size_t nChanged = 0;
+			double lastInertia = l ? modelInertia[m] : -1;
+			modelInertia[m] = 0;
+			for (size_t c = 0; c < nChunks; c++) {
+				nChanged += chunkChanged[c * nModels + m];
+				modelInertia[m] += chunkInertia[c * nModels + m];
+			}
+			double maxMoved = 0;
+			for (size_t row = offsets[m]; row < offsets[m] + ks[m]; row++) {
+				double* centroid = modelCentroids.data() + row * dim;
+				std::copy(centroid, centroid + dim, previous.begin() + row * dim);
+				moved[row] = 0;
+				int nPoints = 0;
+				for (size_t c = 0; c < nChunks; c++)
+					nPoints += chunkCount[c * totalK + row];
+				if (!nPoints)
+					continue;
+				for (size_t d = 0; d < dim; d++) {
+					double sumCoord = 0;
+					for (size_t c = 0; c < nChunks; c++)
+						sumCoord += chunkSum[(c * totalK + row) * dim + d];
+					centroid[d] = sumCoord / nPoints;
 				}
-				points.at(i).minDistance = std::numeric_limits<double>::max();
+				moved[row] = sqrt(squaredDistance(previous.data() + row * dim, centroid, dim));
+				maxMoved = max(maxMoved, moved[row]);
+			}
+			distanceEvaluations += ks[m];
+			modelIterations[m] = l + 1;
+			bool converged = !nChanged || maxMoved <= config.tolerance
+				|| (needInertia && lastInertia >= 0 && lastInertia - modelInertia[m] <= config.inertiaTolerance * lastInertia);
+			if (converged) {
+				active[m] = 0;
+				nActive--;
+				continue;
 			}
 
-			for (int i = 0; i < clusters.size(); i++) {
-				int clusterId = clusters.at(i).clusterId;
-				for (int j = 0; j < clusters.at(i).coords.size(); j++) {
-					clusters.at(i).coords[j] = sumCoord.at(clusterId).at(j) / nPoints.at(clusterId);
+			// move the bounds of the model by the distance its centroids moved
+			size_t farthest = offsets[m];
+			for (size_t row = offsets[m]; row < offsets[m] + ks[m]; row++) {
+				if (moved[row] > moved[farthest])
+					farthest = row;
+			}
+			double secondFarthest = 0;
+			for (size_t row = offsets[m]; row < offsets[m] + ks[m]; row++) {
+				if (row != farthest)
+					secondFarthest = max(secondFarthest, moved[row]);
+			}
+			parallelFor(nChunks, nThreads, [&](size_t c) {
+				size_t end = std::min(n, (c + 1) * chunkSize);
+				for (size_t j = c * chunkSize; j < end; j++) {
+					size_t row = offsets[m] + ids[m][j];
+					upper[m][j] += moved[row];
+					lower[m][j] -= row == farthest ? secondFarthest : moved[farthest];
 				}
+			});
+		}
+	}
+
+	// the inertia of the last assignment of every model, the same value trainLloyd reports
+	if (!needInertia) {
+		parallelFor(nChunks, nThreads, [&](size_t c) {
+			vector<double> buffer(dim);
+			size_t end = std::min(n, (c + 1) * chunkSize);
+			for (size_t m = 0; m < nModels; m++) {
+				double inertiaSum = 0;
+				for (size_t j = c * chunkSize; j < end; j++)
+					inertiaSum += squaredDistance(pointAt(j, buffer.data()), previous.data() + (offsets[m] + ids[m][j]) * dim, dim);
+				chunkInertia[c * nModels + m] = inertiaSum;
 			}
+		});
+		for (size_t m = 0; m < nModels; m++) {
+			modelInertia[m] = 0;
+			for (size_t c = 0; c < nChunks; c++)
+				modelInertia[m] += chunkInertia[c * nModels + m];
 		}
-		
 	}
-	catch (exception e) {
-		cerr << e.what();
+
+	sweepResults.resize(nModels);
+	for (size_t m = 0; m < nModels; m++) {
+		sweepResults[m].k = ks[m];
+		sweepResults[m].iterations = modelIterations[m];
+		sweepResults[m].inertia = modelInertia[m];
+	}
+	scoreSweep(ks, offsets, modelCentroids, ids, nThreads);
+
+	// Keep the best model
+	size_t best = 0;
+	for (size_t m = 1; m < nModels; m++) {
+		const SweepResult& a = sweepResults[m];
+		const SweepResult& b = sweepResults[best];
+		bool better = config.sweepSelect == SweepSelect::DAVIES_BOULDIN ? a.daviesBouldin < b.daviesBouldin
+			: a.silhouette > b.silhouette || (a.silhouette == b.silhouette && a.daviesBouldin < b.daviesBouldin);
+		if (better)
+			best = m;
+	}
+	sweepResults[best].chosen = true;
+	k = ks[best];
+	centroids.assign(modelCentroids.begin() + offsets[best] * dim, modelCentroids.begin() + (offsets[best] + k) * dim);
+	clusterIds = ids[best];
+	iterations = modelIterations[best];
+	inertia = modelInertia[best];
+}
+
+// scoreSweep
+// precondition: the models are trained, model m has ks[m] centroids starting at row offsets[m] of modelCentroids
+//				 and assigns point j to ids[m][j]
+// postcondition: store the Davies-Bouldin index of every model, computed over every point, and its silhouette, computed over
+//				  a uniform sample of config.silhouetteSample points, in sweepResults. The distance of every pair of sampled points is
+//				  computed once and used by every model
+void KMeanCluster::scoreSweep(const vector<int>& ks, const vector<size_t>& offsets, const vector<double>& modelCentroids, const vector<vector<int>>& ids,
+	const int nThreads) {
+	size_t n = fileNames.size();
+	const size_t nModels = ks.size();
+	const size_t totalK = offsets.back() + ks.back();
+	const size_t chunkSize = trainChunkSize();
+	const size_t nChunks = (n + chunkSize - 1) / chunkSize;
+
+	// Davies-Bouldin: the spread of a cluster is the mean distance of its points to its centroid
+	vector<double> chunkSpread(nChunks * totalK);
+	vector<int> chunkCount(nChunks * totalK);
+	parallelFor(nChunks, nThreads, [&](size_t c) {
+		double* spread = chunkSpread.data() + c * totalK;
+		int* count = chunkCount.data() + c * totalK;
+		std::fill(spread, spread + totalK, 0.0);
+		std::fill(count, count + totalK, 0);
+		vector<double> buffer(dim);
+		size_t end = std::min(n, (c + 1) * chunkSize);
+		for (size_t j = c * chunkSize; j < end; j++) {
+			const double* point = pointAt(j, buffer.data());
+			for (size_t m = 0; m < nModels; m++) {
+				size_t row = offsets[m] + ids[m][j];
+				spread[row] += sqrt(squaredDistance(point, modelCentroids.data() + row * dim, dim));
+				count[row] += 1;
+			}
+		}
+	});
+	for (size_t m = 0; m < nModels; m++) {
+		vector<double> spread(ks[m], 0);
+		for (int i = 0; i < ks[m]; i++) {
+			int nPoints = 0;
+			for (size_t c = 0; c < nChunks; c++) {
+				spread[i] += chunkSpread[c * totalK + offsets[m] + i];
+				nPoints += chunkCount[c * totalK + offsets[m] + i];
+			}
+			spread[i] = nPoints ? spread[i] / nPoints : 0;
+		}
+		double total = 0;
+		for (int i = 0; i < ks[m]; i++) {
+			double worst = 0;
+			for (int j = 0; j < ks[m]; j++) {
+				if (j == i)
+					continue;
+				double separation = sqrt(squaredDistance(modelCentroids.data() + (offsets[m] + i) * dim, modelCentroids.data() + (offsets[m] + j) * dim, dim));
+				if (separation > 0)
+					worst = max(worst, (spread[i] + spread[j]) / separation);
+			}
+			total += worst;
+		}
+		sweepResults[m].daviesBouldin = total / ks[m];
+	}
+
+	// Silhouette of a uniform sample: a is the mean distance to the other sampled points of the own cluster, b the lowest mean
+	// distance to the sampled points of another cluster, and the silhouette of the point is (b - a) / max(a, b)
+	size_t nSample = min(n, max(config.silhouetteSample, (size_t)2));
+	vector<size_t> sample(n);
+	for (size_t j = 0; j < n; j++)
+		sample[j] = j;
+	std::mt19937 rng(config.seed ? config.seed : (unsigned int)time(0));
+	for (size_t j = 0; j < nSample; j++)
+		std::swap(sample[j], sample[std::uniform_int_distribution<size_t>(j, n - 1)(rng)]);
+	sample.resize(nSample);
+	vector<int> sampleCount(totalK, 0);
+	for (size_t s : sample) {
+		for (size_t m = 0; m < nModels; m++)
+			sampleCount[offsets[m] + ids[m][s]]++;
+	}
+	vector<double> pointSilhouette(nSample * nModels, 0);
+	parallelFor(nSample, nThreads, [&](size_t i) {
+		vector<double> distanceSum(totalK, 0);
+		vector<double> buffer(dim), otherBuffer(dim);
+		const double* point = pointAt(sample[i], buffer.data());
+		for (size_t j = 0; j < nSample; j++) {
+			if (j == i)
+				continue;
+			double distance = sqrt(squaredDistance(point, pointAt(sample[j], otherBuffer.data()), dim));
+			for (size_t m = 0; m < nModels; m++)
+				distanceSum[offsets[m] + ids[m][sample[j]]] += distance;
+		}
+		for (size_t m = 0; m < nModels; m++) {
+			int own = ids[m][sample[i]];
+			size_t ownRow = offsets[m] + own;
+			// a point alone in its cluster has a silhouette of 0
+			if (sampleCount[ownRow] <= 1)
+				continue;
+			double a = distanceSum[ownRow] / (sampleCount[ownRow] - 1);
+			double b = std::numeric_limits<double>::max();
+			for (int c = 0; c < ks[m]; c++) {
+				size_t row = offsets[m] + c;
+				if (c != own && sampleCount[row])
+					b = min(b, distanceSum[row] / sampleCount[row]);
+			}
+			if (b == std::numeric_limits<double>::max())
+				continue;
+			double larger = max(a, b);
+			pointSilhouette[i * nModels + m] = larger > 0 ? (b - a) / larger : 0;
+		}
+	});
+	for (size_t m = 0; m < nModels; m++) {
+		double total = 0;
+		for (size_t i = 0; i < nSample; i++)
+			total += pointSilhouette[i * nModels + m];
+		sweepResults[m].silhouette = total / nSample;
+	}
+}
+
+// recomputeCentroids
+// precondition: chunkCount holds nChunks x k counts and chunkSum holds nChunks x k x dim sums
+// postcondition: merge the chunks in chunk order into the new centroids, an empty cluster keeps its previous centroid
+void KMeanCluster::recomputeCentroids(const vector<int>& chunkCount, const vector<double>& chunkSum, const size_t nChunks, const int nThreads) {
+	parallelFor(k, nThreads, [&](size_t i) {
+		int nPoints = 0;
+		for (size_t c = 0; c < nChunks; c++)
+			nPoints += chunkCount[c * k + i];
+		if (!nPoints)
+			return;
+		for (size_t d = 0; d < dim; d++) {
+			double sumCoord = 0;
+			for (size_t c = 0; c < nChunks; c++)
+				sumCoord += chunkSum[(c * k + i) * dim + d];
+			centroids[i * dim + d] = sumCoord / nPoints;
+		}
+	});
+}
+
+// isConverged
+// precondition: previous holds the centroids before the last recomputation, moved has k entries
+// postcondition: store the distance every centroid moved in moved and return true if no point changed its cluster,
+//				  no centroid moved more than config.tolerance, or the inertia improved by less than config.inertiaTolerance
+bool KMeanCluster::isConverged(const size_t nChanged, const vector<double>& previous, vector<double>& moved, const double lastInertia) {
+	double maxMoved = 0;
+	for (int i = 0; i < k; i++) {
+		moved[i] = sqrt(squaredDistance(previous.data() + i * dim, centroidAt(i), dim));
+		maxMoved = max(maxMoved, moved[i]);
 	}
-}
\ No newline at end of file
+	if (!nChanged || maxMoved <= config.tolerance)
+		return true;
+	return config.inertiaTolerance > 0 && lastInertia >= 0 && lastInertia - inertia <= config.inertiaTolerance * lastInertia;
+}
+
+// trainChunkSize
+// precondition: none
+// postcondition: return the number of points per training chunk, which only depends on the number of points
+size_t KMeanCluster::trainChunkSize() const {
+	const size_t maxChunks = 64;
+	return std::max((size_t)1024, (fileNames.size() + maxChunks - 1) / maxChunks);
+}
+
+// addPoint
+// precondition: point has dim coordinates
+// postcondition: append the point and its file name to the dataset with the given cluster id
+//				  The point is stored in coords (floatCoords with config.floatPoints) after the mapped points, the mapped file is never changed
+void KMeanCluster::addPoint(const vector<double>& point, const string name, const int clusterId) {
+	if (config.floatPoints)
+		floatCoords.insert(floatCoords.end(), point.begin(), point.end());
+	else
+		coords.insert(coords.end(), point.begin(), point.end());
+	fileNames.push_back(name);
+	clusterIds.push_back(clusterId);
+}
+
+// saveSnapshot
+// precondition: the model is trained
+// postcondition: save the centroids, the cluster of every point, k, the dimension and the dataset version to _fileName
+//				  Return false if the file could not be written
+bool KMeanCluster::saveSnapshot(const string _fileName) const {
+	SnapshotHeader header;
+	header.version = 1;
+	header.k = k;
+	header.dim = dim;
+	header.nPoints = fileNames.size();
+	header.datasetVersion = datasetVersion;
+	if (centroids.size() != k * dim)
+		return false;
+
+	// write to a temporary file first so a crash never leaves a half written snapshot
+	string tmpName = _fileName + ".tmp";
+	{
+		std::ofstream out(tmpName, ios::binary | ios::trunc);
+		if (!out.is_open())
+			return false;
+		out.write("KMSNAP01", 8);
+		out.write((const char*)&header.version, sizeof(header.version));
+		out.write((const char*)&header.k, sizeof(header.k));
+		out.write((const char*)&header.dim, sizeof(header.dim));
+		out.write((const char*)&header.nPoints, sizeof(header.nPoints));
+		out.write((const char*)&header.datasetVersion, sizeof(header.datasetVersion));
+		out.write((const char*)centroids.data(), centroids.size() * sizeof(double));
+		vector<int32_t> ids(clusterIds.begin(), clusterIds.end());
+		out.write((const char*)ids.data(), ids.size() * sizeof(int32_t));
+		if (!out.good())
+			return false;
+	}
+	std::remove(_fileName.c_str());
+	return std::rename(tmpName.c_str(), _fileName.c_str()) == 0;
+}
+
+// loadOrTrain
+// precondition: config.snapshotFile is not empty
+// postcondition: load the model from the snapshot if it has the same k and dimension and the dataset starts with the rows it was
+//				  trained on. Rows appended since then are assigned to their closest centroid and the snapshot is updated
+//				  Otherwise (or with config.forceRetrain) train the model, warm started from the snapshot if config.warmStart, and save it
+void KMeanCluster::loadOrTrain() {
+	SnapshotHeader header;
+	vector<double> snapshotCentroids;
+	vector<int> snapshotIds;
+	bool found = readSnapshot(config.snapshotFile, header, snapshotCentroids, snapshotIds);
+
+	checkpointRows = found ? (size_t)header.nPoints : 0;
+	readDataSet(fileName);
+
+	bool fits = found && header.k == k && header.dim == dim;
+	// a sweep picks its own k, so it always trains
+	if (fits && !config.forceRetrain && config.sweepKs.empty() && fileNames.size() >= header.nPoints && checkpointVersion == header.datasetVersion) {
+		centroids = snapshotCentroids;
+		std::copy(snapshotIds.begin(), snapshotIds.end(), clusterIds.begin());
+		// assign the rows appended after the snapshot was saved, like cluster does for a new point
+		vector<double> buffer(dim);
+		for (size_t i = header.nPoints; i < fileNames.size(); i++) {
+			double minDistance;
+			clusterIds[i] = nearestCentroid(pointAt(i, buffer.data()), centroids.data(), k, dim, minDistance);
+		}
+		fromSnapshot = true;
+		if (header.nPoints != fileNames.size())
+			saveSnapshot(config.snapshotFile);
+		return;
+	}
+
+	if (fits && config.warmStart)
+		warmCentroids = snapshotCentroids;
+	trainModel();
+	warmCentroids.clear();
+	if (fileNames.size() && !saveSnapshot(config.snapshotFile))
+		cout << "Could not save the snapshot " << config.snapshotFile << endl;
+}
+
+// readSnapshot
+// precondition: none
+// postcondition: read the header, centroids and cluster ids of the snapshot file. Return false if it is missing or invalid
+bool KMeanCluster::readSnapshot(const string _fileName, SnapshotHeader& header, vector<double>& snapshotCentroids, vector<int>& snapshotIds) const {
+	std::ifstream in(_fileName, ios::binary);
+	if (!in.is_open())
+		return false;
+
+	char magic[8];
+	in.read(magic, 8);
+	in.read((char*)&header.version, sizeof(header.version));
+	in.read((char*)&header.k, sizeof(header.k));
+	in.read((char*)&header.dim, sizeof(header.dim));
+	in.read((char*)&header.nPoints, sizeof(header.nPoints));
+	in.read((char*)&header.datasetVersion, sizeof(header.datasetVersion));
+	if (!in.good() || string(magic, 8) != "KMSNAP01" || header.version != 1 || header.k <= 0)
+		return false;
+
+	// the file must be exactly as long as the header says, so a truncated snapshot is never used
+	std::streampos dataStart = in.tellg();
+	in.seekg(0, ios::end);
+	uint64_t expected = header.k * header.dim * sizeof(double) + header.nPoints * sizeof(int32_t);
+	if ((uint64_t)(in.tellg() - dataStart) != expected)
+		return false;
+	in.seekg(dataStart);
+
+	snapshotCentroids.resize(header.k * header.dim);
+	in.read((char*)snapshotCentroids.data(), snapshotCentroids.size() * sizeof(double));
+	vector<int32_t> ids(header.nPoints);
+	in.read((char*)ids.data(), ids.size() * sizeof(int32_t));
+	snapshotIds.assign(ids.begin(), ids.end());
+	return in.good();
+}
+
+// appendRow
+// precondition: logMtx is locked, i is smaller than the number of points
+// postcondition: append the i-th point to the dataset log with a checksum, unless its file name is already saved
+//				  The log is synced every storage.syncEvery rows, and a background compaction starts after storage.compactAfter rows
+void KMeanCluster::appendRow(const size_t i) {
+	if (!savedNames.insert(fileNames[i]).second)
+		return;
+	if (!logFile) {
+		logFile = fopen((fileName + ".log").c_str(), "ab");
+		if (!logFile) {
+			cout << "Could not open the dataset log " << fileName << ".log" << endl;
+			return;
+		}
+	}
+
+	string row = formatRow(i);
+	char checksum[20];
+	snprintf(checksum, sizeof(checksum), "#%016llx\n", (unsigned long long)fnv1a64(row.data(), row.size()));
+	row += checksum;
+	fwrite(row.data(), 1, row.size(), logFile);
+	logIndices.push_back(i);
+
+	if (++unsyncedRows >= max(storage.syncEvery, (size_t)1))
+		syncLog();
+
+	if (storage.compactAfter && logIndices.size() >= storage.compactAfter && !compacting) {
+		if (compactThread.joinable())
+			compactThread.join();
+		startCompaction();
+	}
+}
+
+// syncLog
+// precondition: logMtx is locked or no other thread uses the model
+// postcondition: flush the dataset log and make sure it is written to the disk
+void KMeanCluster::syncLog() {
+	if (logFile && unsyncedRows) {
+		fflush(logFile);
+		syncFile(logFile);
+	}
+	unsyncedRows = 0;
+}
+
+// setStorageConfig
+// precondition: none
+// postcondition: use the inputted settings for the rows appended by cluster
+void KMeanCluster::setStorageConfig(const StorageConfig& _storage) {
+	std::lock_guard<std::shared_mutex> lock(logMtx);
+	storage = _storage;
+}
+
+// compactDataSet
+// precondition: none
+// postcondition: wait for a running background compaction, then write every saved row to the dataset file and empty the log
+//				  Return false if the dataset file could not be written
+bool KMeanCluster::compactDataSet() {
+	// the background compaction needs logMtx to finish, so it is waited for with logMtx released. Once compacting is
+	// cleared the thread no longer needs the lock, and no other compaction can start while this one holds it
+	std::unique_lock<std::shared_mutex> lock(logMtx);
+	compactDone.wait(lock, [this] { return !compacting; });
+	if (compactThread.joinable())
+		compactThread.join();
+	syncLog();
+	if (!saveDataSet(fileName, fileNames.size()))
+		return false;
+	return rewriteLog(fileNames.size());
+}
+
+// startCompaction
+// precondition: logMtx is locked and no compaction is running
+// postcondition: start a thread that writes a copy of the current rows to the dataset file. When it is done, the log
+//				  only keeps the rows appended while the thread was running
+void KMeanCluster::startCompaction() {
+	syncLog();
+	compacting = true;
+	size_t nRows = fileNames.size();
+	// the thread works on a copy, because cluster keeps appending to the points while it runs
+	std::shared_ptr<KMeanCluster> copy(new KMeanCluster(*this, nRows));
+	compactThread = std::thread([this, copy, nRows] {
+		bool ok = copy->saveDataSet(fileName, nRows);
+		{
+			std::lock_guard<std::shared_mutex> lock(logMtx);
+			if (!ok || !rewriteLog(nRows))
+				cout << "Could not compact the dataset " << fileName << endl;
+			compacting = false;
+		}
+		compactDone.notify_all();
+	});
+}
+
+// rewriteLog
+// precondition: logMtx is locked, the first nRows points are saved in the dataset file
+// postcondition: replace the log with the logged rows at index nRows and later. They are written to a temporary file that is
+//				  synced and then replaces the log, so a crash keeps either the old or the new log. Return false and keep
+//				  the old log if the temporary file could not be written
+bool KMeanCluster::rewriteLog(const size_t nRows) {
+	if (logFile) {
+		fclose(logFile);
+		logFile = nullptr;
+	}
+	unsyncedRows = 0;
+	string logName = fileName + ".log";
+	string tmpName = logName + ".tmp";
+	FILE* out = fopen(tmpName.c_str(), "wb");
+	if (!out)
+		return false;
+
+	vector<size_t> kept;
+	for (size_t i : logIndices) {
+		if (i < nRows)
+			continue;
+		kept.push_back(i);
+		string row = formatRow(i);
+		char checksum[20];
+		snprintf(checksum, sizeof(checksum), "#%016llx\n", (unsigned long long)fnv1a64(row.data(), row.size()));
+		row += checksum;
+		fwrite(row.data(), 1, row.size(), out);
+	}
+	bool ok = fflush(out) == 0 && syncFile(out);
+	ok = fclose(out) == 0 && ok;
+	// std::rename replaces the log in one step on POSIX, on Windows it fails if the log exists
+	if (ok && std::rename(tmpName.c_str(), logName.c_str()) != 0) {
+		std::remove(logName.c_str());
+		ok = std::rename(tmpName.c_str(), logName.c_str()) == 0;
+	}
+	if (!ok) {
+		std::remove(tmpName.c_str());
+		return false;
+	}
+	logIndices = kept;
+	return true;
+}
+
+// KMeanCluster
+// precondition: nRows is at most the number of points of other
+// postcondition: define an untrained copy of the dataset file name and the first nRows points of other, used for compaction
+//				  and reassignment
+KMeanCluster::KMeanCluster(const KMeanCluster& other, const size_t nRows) {
+	fileName = other.fileName;
+	k = other.k;
+	dim = other.dim;
+	binaryDataSet = other.binaryDataSet;
+	// the mapped points are shared, the file stays mapped until other is destroyed, which waits for the compaction and reassignment
+	mappedCoords = other.mappedCoords;
+	mappedRows = min(other.mappedRows, nRows);
+	config.floatPoints = other.config.floatPoints;
+	if (config.floatPoints)
+		floatCoords.assign(other.floatCoords.begin(), other.floatCoords.begin() + (nRows - mappedRows) * dim);
+	else
+		coords.assign(other.coords.begin(), other.coords.begin() + (nRows - mappedRows) * dim);
+	fileNames.assign(other.fileNames.begin(), other.fileNames.begin() + nRows);
+	clusterIds.assign(other.clusterIds.begin(), other.clusterIds.begin() + nRows);
+}
+
+// setOnlineConfig
+// precondition: _online.batchSize is positive
+// postcondition: use the inputted settings for the centroid updates of the points passed to cluster
+void KMeanCluster::setOnlineConfig(const OnlineConfig& _online) {
+	std::lock_guard<std::shared_mutex> lock(logMtx);
+	online = _online;
+	if (!online.enabled)
+		pendingRows.clear();
+}
+
+// countMembers
+// precondition: logMtx is locked exclusively
+// postcondition: store the number of points of every cluster in centroidCounts
+void KMeanCluster::countMembers() {
+	centroidCounts.assign(k, 0);
+	for (int clusterId : clusterIds) {
+		if (clusterId >= 0 && clusterId < k)
+			centroidCounts[clusterId] += 1;
+	}
+}
+
+// updateCentroid
+// precondition: logMtx is locked exclusively, the i-th point is assigned to a cluster
+// postcondition: move the centroid of the i-th point towards it by max(1 / count, online.minLearningRate), where count is the
+//				  number of points of the centroid including this one, and add the distance it moved to its drift
+void KMeanCluster::updateCentroid(const size_t i) {
+	int c = clusterIds[i];
+	if (centroidDrift.size() != (size_t)k)
+		centroidDrift.assign(k, 0);
+	centroidCounts[c] += 1;
+	// 1 / count keeps the centroid at the mean of its points, a minimum rate lets it follow poses that drift over time
+	double rate = min(1.0, max(1.0 / centroidCounts[c], online.minLearningRate));
+	vector<double> buffer(dim);
+	const double* point = pointAt(i, buffer.data());
+	double* centroid = centroids.data() + c * dim;
+	centroidDrift[c] += rate * sqrt(squaredDistance(point, centroid, dim));
+	for (size_t d = 0; d < dim; d++)
+		centroid[d] += rate * (point[d] - centroid[d]);
+	onlineUpdates++;
+}
+
+// applyOnlineUpdates
+// precondition: logMtx is locked exclusively
+// postcondition: move the centroids towards the points of the current mini-batch in the order they were clustered,
+//				  and start a reassignment after online.reassignEvery updates
+void KMeanCluster::applyOnlineUpdates() {
+	for (size_t i : pendingRows)
+		updateCentroid(i);
+	updatesSinceReassign += pendingRows.size();
+	pendingRows.clear();
+
+	if (online.reassignEvery && updatesSinceReassign >= online.reassignEvery && !reassigning) {
+		if (reassignThread.joinable())
+			reassignThread.join();
+		startReassignment();
+	}
+}
+
+// startReassignment
+// precondition: logMtx is locked exclusively and no reassignment is running
+// postcondition: start a thread that runs online.reassignIterations Lloyd passes over a copy of the current points from the current
+//				  centroids. When it is done, its centroids and clusters replace the model, the points clustered while it ran are
+//				  assigned to the new centroids and move them again, and the inverted lists are rebuilt on the next nearest call
+void KMeanCluster::startReassignment() {
+	reassigning = true;
+	updatesSinceReassign = 0;
+	size_t nRows = fileNames.size();
+	// the thread works on a copy, because cluster keeps appending to the points and moving the centroids while it runs
+	std::shared_ptr<KMeanCluster> copy(new KMeanCluster(*this, nRows));
+	copy->centroids = centroids;
+	copy->config.maxIterations = max(1, online.reassignIterations);
+	int nThreads = max(1, online.reassignThreads);
+	reassignThread = std::thread([this, copy, nRows, nThreads] {
+		copy->trainLloyd(nThreads);
+		{
+			std::lock_guard<std::shared_mutex> lock(logMtx);
+			centroids = copy->centroids;
+			std::copy(copy->clusterIds.begin(), copy->clusterIds.end(), clusterIds.begin());
+			std::fill(clusterIds.begin() + nRows, clusterIds.end(), -1);
+			countMembers();
+			// replay the points that were clustered while the thread ran, the batch they were pending in is applied with them
+			pendingRows.clear();
+			vector<double> buffer(dim);
+			for (size_t i = nRows; i < fileNames.size(); i++) {
+				double minDistance;
+				clusterIds[i] = nearestCentroid(pointAt(i, buffer.data()), centroids.data(), k, dim, minDistance);
+				updateCentroid(i);
+			}
+			invertedLists.clear();
+			listDistances.clear();
+			clusterRadius.clear();
+			unassignedRows.clear();
+			indexedRows = 0;
+			reassignments++;
+		}
+		reassigning = false;
+	});
+}
@@ -1,24 +1,71 @@
 // KMeanCluster.cpp
 // author: Cheuk-Hang Tse
 // This file contains the declaration of the KMeanCluster class.
-// This class contains 4 constructors, 1 destructor, and 5 functions
+// This class contains 6 constructors, 1 destructor, and 45 functions
 // 
 // CONSTRUCTORS:
 // KMeanCluster(): define a default clustering model with k equals 1 and train the model based on the default dataset
 // KMeanCluster(const int _k): define a default clustering model with k equals the inputted _k and train the model based on the default dataset
 // KMeanCluster(const string _fileName): define a default clustering model with k equals 1 and train the model based on the inputted file
 // KMeanCluster(const string _fileName, const int _k): define a default clustering model with k equals the inputted _k and train the model based on the inputted file
+// KMeanCluster(const string _fileName, const int _k, const TrainConfig& _config): define a clustering model with k equals the inputted _k and train the model based on the inputted file with the inputted training configuration
+// KMeanCluster(const KMeanCluster& other, const size_t nRows): define an untrained copy of the first nRows points of other, used for compaction and reassignment
 
 // DESTRUCTOR:
-// ~KMeanCluster(): clear the clusters and points vector
+// ~KMeanCluster(): wait for a running compaction and reassignment, sync and close the dataset log, and clear the clusters and points vector
 
 // FUNCTIONS:
-// cluster: cluster the inputted point to a cluster and save the new point to the dataset
+// getTrainSeconds: return the number of seconds the last training took
+// getDistanceEvaluations: return the number of point to centroid distances the last training computed
+// getLloydDistanceEvaluations: return the number of point to centroid distances plain Lloyd computes for the same training
+// getIterations: return the number of iterations the last training ran before it stopped
+// getInertia: return the sum of squared distances from every point to its centroid after the last training
+// isFromSnapshot: return true if the model was loaded from its snapshot instead of trained
+// saveSnapshot: save the centroids, the cluster of every point, k, the dimension and the dataset version to a file
+// setStorageConfig: choose how often the dataset log is synced and when it is compacted
+// compactDataSet: write every saved row to the dataset file and empty the dataset log
+// setOnlineConfig: choose whether and how new points move the centroids
+// getOnlineUpdates: return the number of points that moved a centroid
+// getReassignments: return the number of background reassignments that finished
+// getSweepResults: return the inertia, silhouette and Davies-Bouldin index of every k of the last sweep
+// getK: return the number of clusters
+// nearest: return the n stored points closest to the inputted point with their distances, searched cluster by cluster
+// getSearchEvaluations: return the number of distances the last nearest call computed
+// cluster: cluster the inputted point to a cluster and append the new point to the dataset log
 //			Then, return a vector of fileName that have the same cluster of the inputted points
-// readDataSet: read the dataset and converting the entry into Cluster_Point and store them in a vector
-// isContainFileName: return true if the fileNames contain _fileName, else false
+// related: return the file names in the cluster of the inputted point without adding the point
+// clusterMembers: return the cluster of a point and the file names in it
+// readDataSet: read the dataset and its log and converting the entry into Cluster_Point and store them in a vector
+// readPoseDataset: map a binary pose dataset and use its coordinates in place
+// acceptRow: add a parsed row to the dataset and to the dataset version
+// formatRow: return a point in the dataset format
 // saveDataSet: save the clustering points into desire format [filename, point0_x, point0_y, point1_x, ..., pointn_y]
+// appendRow: append a point to the dataset log with a checksum
+// syncLog: flush the dataset log and write it to the disk
+// startCompaction: start compacting the dataset in a background thread
+// rewriteLog: keep only the rows of the dataset log that are not in the dataset file yet
+// updateIndex: add the points that are not indexed yet to the inverted list of their cluster
 // trainModel: train the k mean cluster model based on the inputted dataset. If dataset is empty, no training is done
+// addPoint: append a point, its file name and its cluster id to the dataset
+// loadOrTrain: load the model from its snapshot if the snapshot matches the dataset, else train the model and save the snapshot
+// readSnapshot: read the header, centroids and cluster ids of a snapshot file
+// seedCentroids: pick k points as the initial centroids, uniformly or with k-means++
+// trainLloyd: assign every point to its closest centroid and recompute the centroids in every iteration
+// trainHamerly: the same as trainLloyd but skip the points whose distance bounds prove that their cluster did not change
+// trainSweep: train a model for every k of a sweep with one pass over the points per iteration and keep the best one
+// scoreSweep: compute the silhouette and the Davies-Bouldin index of every model of a sweep
+// recomputeCentroids: merge the partial sums and counts of every chunk into the new centroids
+// isConverged: return true if the training can stop after an iteration
+// trainChunkSize: return the number of points per training chunk
+// countMembers: count the points of every cluster, the starting point of the online learning rates
+// updateCentroid: move the centroid of a point towards it with the learning rate of the centroid
+// applyOnlineUpdates: move the centroids towards the points of the current mini-batch
+// startReassignment: start reassigning every point and recomputing the centroids in a background thread
+// The points are stored in one contiguous row-major block and compared with the vectorized kernels of DistanceKernel.h
+// The dataset is a CSV file or a binary pose dataset (PoseDataset.h) whose coordinates are memory mapped
+// New points are appended to the log file <dataset>.log instead of rewriting the dataset, and moved into the dataset by compaction
+// related and nearest only read the model and can run on several threads at the same time, cluster and compaction run alone
+// With online updates, every new point moves its centroid (mini-batch k-means), and a background thread reassigns every point from time to time
 
 #pragma once
 #include <iostream>
@@ -30,11 +77,104 @@
 #include <ctime>
 #include <stdlib.h>
 #include <algorithm>
+#include <sstream>
+#include "DistanceKernel.h"
+#include "Parallel.h"
+#include "Hash.h"
+#include "PoseDataset.h"
+#include <cstdint>
+#include <cstdio>
+#include <unordered_set>
+#include <mutex>
+#include <shared_mutex>
+#include <thread>
+#include <atomic>
+#include <condition_variable>
 
 using namespace cv;
 using namespace cv::dnn;
 using namespace std;
 
+// TrainMode
+// LLOYD computes the distance from every point to every centroid in every iteration
+// HAMERLY keeps an upper bound to the assigned centroid and a lower bound to every other centroid per point,
+// and skips the distance computations of the points whose bounds prove that the assignment did not change.
+// Both modes produce exactly the same clustering
+enum class TrainMode { LLOYD, HAMERLY };
+
+// SeedMode
+// RANDOM picks k points uniformly at random as the initial centroids, the same point can be picked twice
+// KMEANS_PLUS_PLUS picks the first centroid uniformly and every next one with a probability proportional to
+// its squared distance to the closest centroid picked so far
+enum class SeedMode { RANDOM, KMEANS_PLUS_PLUS };
+
+// SweepSelect
+// How a sweep picks its model: SILHOUETTE keeps the k with the highest silhouette (the lowest Davies-Bouldin index on a tie),
+// DAVIES_BOULDIN keeps the k with the lowest Davies-Bouldin index
+enum class SweepSelect { SILHOUETTE, DAVIES_BOULDIN };
+
+// TrainConfig
+// The settings of the k mean training
+// The training stops after maxIterations passes, or earlier when no point changes its cluster,
+// when no centroid moves more than tolerance, or when the inertia improves by less than inertiaTolerance (relative)
+struct TrainConfig {
+	TrainMode mode = TrainMode::LLOYD; // training algorithm
+	SeedMode seeding = SeedMode::KMEANS_PLUS_PLUS; // how the initial centroids are picked
+	int nThreads = 0; // number of threads used for training, 0 uses every hardware thread
+	unsigned int seed = 0; // seed for choosing the initial centroids, 0 uses the current time
+	int maxIterations = 100; // maximum number of assignment and centroid recomputation passes
+	double tolerance = 0; // stop when no centroid moves more than this distance
+	double inertiaTolerance = 0; // stop when the inertia improves by less than this fraction, 0 disables the check
+	string snapshotFile; // file the trained model is loaded from and saved to, empty disables snapshots
+	bool forceRetrain = false; // train even if the snapshot matches the dataset
+	bool warmStart = false; // start the training from the centroids of the snapshot instead of seeding
+	vector<int> sweepKs; // train a model for every k in the list instead of only k and keep the best one, empty trains only k
+	size_t silhouetteSample = 2000; // points the silhouette of a sweep is computed on
+	SweepSelect sweepSelect = SweepSelect::SILHOUETTE; // how a sweep picks its model
+	bool floatPoints = false; // store the points that are not mapped from a pose dataset as floats, which halves their memory
+};
+
+// SweepResult
+// The quality of the model of one k of a sweep
+struct SweepResult {
+	int k = 0; // number of clusters
+	int iterations = 0; // iterations the model ran before it converged
+	double inertia = 0; // sum of squared distances from every point to its centroid, lower for every larger k
+	double silhouette = 0; // mean silhouette of the sampled points, from -1 to 1, higher is better
+	double daviesBouldin = 0; // mean ratio of the spread of a cluster to its separation from the most similar cluster, lower is better
+	bool chosen = false; // true for the model the sweep kept
+};
+
+// StorageConfig
+// How cluster writes new points. Every new file name is appended to the log <dataset>.log with a checksum, so a row that was
+// cut off by a crash is ignored on the next start. Compaction writes every row to the dataset file and empties the log
+struct StorageConfig {
+	size_t syncEvery = 32; // rows appended to the log between two fsync calls, 1 syncs every row
+	size_t compactAfter = 0; // rows in the log that start a background compaction, 0 only compacts in compactDataSet
+};
+
+// OnlineConfig
+// How cluster updates the model with the new points. Without online updates the centroids only change when the model is trained
+// With online updates (mini-batch k-means), every batchSize new points move their centroids in O(k x dim) per point: a centroid
+// moves towards a point by the learning rate 1 / (number of points of the centroid), which decays like a running mean, but never
+// below minLearningRate. The points already stored keep their cluster until a reassignment, which runs every reassignEvery updates
+// in a background thread on a copy of the points: reassignIterations Lloyd passes from the current centroids
+struct OnlineConfig {
+	bool enabled = false; // move the centroids with every new point
+	size_t batchSize = 1; // new points that are assigned with the same centroids before the centroids move, 1 moves them after every point
+	double minLearningRate = 0; // lowest learning rate of a centroid, above 0 keeps following poses that drift over time
+	size_t reassignEvery = 0; // online updates between two background reassignments, 0 never reassigns
+	int reassignIterations = 1; // Lloyd passes of a reassignment
+	int reassignThreads = 1; // threads a reassignment runs on, so queries keep most of the cores
+};
+
+// Neighbor
+// One result of KMeanCluster::nearest
+struct Neighbor {
+	string fileName; // image file name of the stored point
+	double distance = 0; // euclidean distance from the query point
+};
+
 class KMeanCluster {
 public:
 	// KMeanCluster
@@ -57,80 +197,371 @@ public:
 	// postcondition: define a default clustering model with k equals the inputted _k and train the model based on the inputted file
 	KMeanCluster(const string _fileName, const int _k = 1);
 
+	// KMeanCluster
+	// precondition: _k must be positive and _fileName must be a valid file
+	// postcondition: define a clustering model with k equals the inputted _k and train the model based on the inputted file with the inputted training configuration
+	KMeanCluster(const string _fileName, const int _k, const TrainConfig& _config);
+
 	// cluster
 	// precondition: point must be formatted and inputted correctly, fileN must be the corresponding file of the point
-	// postcondition: cluster the inputted point to a cluster and save the new point to the dataset
+	// postcondition: cluster the inputted point to a cluster and append the new point to the dataset log
 	//				  Then, return a vector of fileName that have the same cluster of the inputted points
 	vector<string> cluster(const vector<double>& point, const string fileName);
 
+	// related
+	// precondition: point must be formatted like the points passed to cluster
+	// postcondition: return the file names that are in the same cluster as point, like cluster, but do not add the point
+	//				  Several threads can call related and nearest at the same time
+	vector<string> related(const vector<double>& point);
+
+	// nearest
+	// precondition: point must be formatted like the points passed to cluster, n is positive
+	// postcondition: return the n stored points closest to point, closest first (the lower index first on a tie)
+	//				  The points are kept in one inverted list per cluster. The lists are visited from the closest centroid on, and
+	//				  a cluster or a point is skipped if the triangle inequality proves it is farther than the n-th distance found so far,
+	//				  so the result is exact. maxProbe > 0 visits at most maxProbe clusters, which is faster but can miss neighbours
+	//				  Several threads can call related and nearest at the same time
+	vector<Neighbor> nearest(const vector<double>& point, const size_t n, const int maxProbe = 0);
+
+	// getSearchEvaluations
+	// precondition: none
+	// postcondition: return the number of point to point and point to centroid distances the last nearest call computed
+	size_t getSearchEvaluations() const { return searchEvaluations.load(); }
+
+	// getTrainSeconds
+	// precondition: none
+	// postcondition: return the number of seconds the last training took
+	double getTrainSeconds() const { return trainSeconds; }
+
+	// getDistanceEvaluations
+	// precondition: none
+	// postcondition: return the number of point to centroid and centroid to centroid distances the last training computed
+	size_t getDistanceEvaluations() const { return distanceEvaluations; }
+
+	// getLloydDistanceEvaluations
+	// precondition: none
+	// postcondition: return the number of point to centroid distances plain Lloyd computes for the last training
+	size_t getLloydDistanceEvaluations() const { return fileNames.size() * k * (size_t)iterations; }
+
+	// getIterations
+	// precondition: none
+	// postcondition: return the number of iterations the last training ran before it stopped
+	int getIterations() const { return iterations; }
+
+	// getInertia
+	// precondition: none
+	// postcondition: return the sum of squared distances from every point to the centroid it was assigned to in the last iteration
+	double getInertia() const { return inertia; }
+
+	// isFromSnapshot
+	// precondition: none
+	// postcondition: return true if the model was loaded from its snapshot instead of trained
+	bool isFromSnapshot() const { return fromSnapshot; }
+
+	// saveSnapshot
+	// precondition: the model is trained
+	// postcondition: save the centroids, the cluster of every point, k, the dimension and the dataset version to _fileName
+	//				  Return false if the file could not be written
+	bool saveSnapshot(const string _fileName) const;
+
+	// setStorageConfig
+	// precondition: none
+	// postcondition: use the inputted settings for the rows appended by cluster
+	void setStorageConfig(const StorageConfig& _storage);
+
+	// compactDataSet
+	// precondition: none
+	// postcondition: wait for a running background compaction, then write every saved row to the dataset file and empty the log
+	//				  Return false if the dataset file could not be written
+	bool compactDataSet();
+
+	// setOnlineConfig
+	// precondition: _online.batchSize is positive
+	// postcondition: use the inputted settings for the centroid updates of the points passed to cluster
+	void setOnlineConfig(const OnlineConfig& _online);
+
+	// getOnlineUpdates
+	// precondition: none
+	// postcondition: return the number of points that moved a centroid since the model was created
+	size_t getOnlineUpdates() const { return onlineUpdates.load(); }
+
+	// getReassignments
+	// precondition: none
+	// postcondition: return the number of background reassignments that finished since the model was created
+	size_t getReassignments() const { return reassignments.load(); }
+
+	// getSweepResults
+	// precondition: none
+	// postcondition: return the result of every k of the last sweep in increasing k, empty if the model was not trained by a sweep
+	const vector<SweepResult>& getSweepResults() const { return sweepResults; }
+
+	// getK
+	// precondition: none
+	// postcondition: return the number of clusters, the k a sweep kept after a sweep
+	int getK() const { return k; }
+
 	// ~KMeanCluster
 	// precondition: none
-	// postcondition: clear the clusters and points vector
+	// postcondition: wait for a running compaction and reassignment, sync and close the dataset log, and clear the clusters and points vector
 	~KMeanCluster();
 
 private:
 
-	// isContainFileName
-	// precondition: fileNames is not empty, _fileName must be a valid string
-	// postcondition: return true if the fileNames contain _fileName, else false
-	bool isContainFileName(const vector<string> fileNames, const string _fileName);
+	// KMeanCluster
+	// precondition: nRows is at most the number of points of other
+	// postcondition: define an untrained copy of the dataset file name and the first nRows points of other, used for compaction
+	//				  and reassignment
+	KMeanCluster(const KMeanCluster& other, const size_t nRows);
+
+	// clusterMembers
+	// precondition: logMtx is locked (shared or exclusive), point has dim coordinates
+	// postcondition: store the cluster of the closest centroid in clusterTarget (-1 if the model is not trained) and return the file
+	//				  names of the points in that cluster
+	vector<string> clusterMembers(const vector<double>& point, int& clusterTarget) const;
 
 	// readDataSet
 	// precondition: _fileName should be a valid file name
-	// postcondition: read the dataset and converting the entry into Cluster_Point and store them in a vector
+	// postcondition: read the dataset and then replay the valid rows of its log (_fileName + ".log") that are not in the dataset yet
+	//				  The coordinates of every entry are stored in one contiguous block
+	//				  Entries with a different number of coordinates than the first entry are skipped
 	void readDataSet(const string _fileName);
 
-	// saveDataSetsa
+	// readPoseDataset
+	// precondition: the dataset is empty and _fileName is a pose dataset
+	// postcondition: map the pose dataset and use its coordinates in place as the first points of the dataset
+	//				  Only the file names are copied out of the file, the dataset version is read from the row versions
+	void readPoseDataset(const string _fileName);
+
+	// acceptRow
+	// precondition: name and point are parsed from a row of the dataset or the log
+	// postcondition: add the point to the dataset and its row in the format of formatRow to the dataset version, so compacting
+	//				  the dataset does not change the version. Return false if the point is skipped because its number of
+	//				  coordinates is different from the first point
+	bool acceptRow(const string& name, const vector<double>& point);
+
+	// formatRow
+	// precondition: i is smaller than the number of points
+	// postcondition: return the i-th point in the dataset format [filename, point0_x, point0_y, ..., pointn_y] with a trailing comma
+	string formatRow(const size_t i) const;
+
+	// saveDataSet
 	// precondition: _fileName must be a valid file name
-	// postcondition: save the clustering points into desire format [filename, point0_x, point0_y, point1_x, ..., pointn_y]
-	void saveDataSet(const string _fileName);
+	// postcondition: save the first nRows clustering points into desire format [filename, point0_x, point0_y, point1_x, ..., pointn_y]
+	//				  or as a pose dataset if the dataset was read from one
+	//				  Only the first row of every file name is saved. The rows are written to a temporary file that replaces _fileName
+	//				  Return false if the file could not be written
+	bool saveDataSet(const string _fileName, const size_t nRows) const;
+
+	// appendRow
+	// precondition: logMtx is locked, i is smaller than the number of points
+	// postcondition: append the i-th point to the dataset log with a checksum, unless its file name is already saved
+	//				  The log is synced every storage.syncEvery rows, and a background compaction starts after storage.compactAfter rows
+	void appendRow(const size_t i);
+
+	// syncLog
+	// precondition: logMtx is locked or no other thread uses the model
+	// postcondition: flush the dataset log and make sure it is written to the disk
+	void syncLog();
+
+	// startCompaction
+	// precondition: logMtx is locked and no compaction is running
+	// postcondition: start a thread that writes a copy of the current rows to the dataset file. When it is done, the log
+	//				  only keeps the rows appended while the thread was running
+	void startCompaction();
+
+	// rewriteLog
+	// precondition: logMtx is locked, the first nRows points are saved in the dataset file
+	// postcondition: replace the log with the logged rows at index nRows and later. They are written to a temporary file that is
+	//				  synced and then replaces the log, so a crash keeps either the old or the new log. Return false and keep
+	//				  the old log if the temporary file could not be written
+	bool rewriteLog(const size_t nRows);
+
+	// updateIndex
+	// precondition: logMtx is locked exclusively and the model is trained
+	// postcondition: add the points from indexedRows on to the inverted list of their cluster with their distance to the centroid
+	//				  and grow the cluster radius
+	//				  Points without a cluster are kept in unassignedRows
+	void updateIndex();
 
 	// trainModel
 	// precondition: none
 	// postcondition: train the k mean cluster model based on the inputted dataset. If dataset is empty, no training is done
+	//				  The points are split into a fixed number of chunks that are assigned on config.nThreads threads
+	//				  Every chunk keeps its own partial sums and counts, which are merged in chunk order, so the result only depends on the seed
 	void trainModel();
 
-	// Cluster_Point
-	// A structure that store information of an image human pose points
-	struct Cluster_Point {
-		vector<double> coords;
-		int clusterId;
-		double minDistance;
-		string fileName;
-
-		// Default constructor
-		Cluster_Point() {
-			clusterId = -1;
-			minDistance = std::numeric_limits<double>::max();
-		}
-
-		// set the Cluster_Point to inputted coordinates and name of the image file
-		Cluster_Point(const vector<double>& point, const string name) {
-			coords = point;
-			clusterId = -1;
-			fileName = name;
-			minDistance = std::numeric_limits<double>::max();
-		}
-
-		// distance
-		// precondition: p is not empty
-		// postcondition: return the distance between two cluster points
-		double distance(Cluster_Point p) {
-			double sum = 0;
-			if (p.coords.size() != coords.size())
-				return -1.0;
-			int i = 0;
-			while (i < p.coords.size()) {
-				sum += pow((p.coords[i] - coords[i]), 2);
-				i += 1;
-			}
-			return sqrt(sum);
-		}
+	// seedCentroids
+	// precondition: the dataset is not empty
+	// postcondition: pick k points as the initial centroids with config.seeding using config.seed
+	void seedCentroids(const int nThreads);
+
+	// trainLloyd
+	// precondition: the centroids are seeded
+	// postcondition: assign every point to its closest centroid and recompute the centroids until isConverged
+	void trainLloyd(const int nThreads);
+
+	// trainHamerly
+	// precondition: the centroids are seeded
+	// postcondition: the same clustering as trainLloyd, but a point is only compared with every centroid
+	//				  if its upper bound to its centroid is not below its lower bound to the other centroids
+	//				  and half the distance from its centroid to the closest other centroid
+	void trainHamerly(const int nThreads);
+
+	// trainSweep
+	// precondition: config.sweepKs is not empty
+	// postcondition: train a model for every k of config.sweepKs at the same time, with the same result as a separate training of every k.
+	//				  The models share their seeding (the first k centroids of one k-means++ seeding for the largest k) and one pass over
+	//				  the points per iteration, in which every point is compared with the models that did not converge yet. Every model
+	//				  keeps Hamerly bounds, so a point is only compared with every centroid of a model when its cluster can change
+	//				  Store the results in sweepResults and keep the model picked by config.sweepSelect as the model: k, its centroids and its clusters
+	void trainSweep(const int nThreads);
+
+	// scoreSweep
+	// precondition: the models are trained, model m has ks[m] centroids starting at row offsets[m] of modelCentroids
+	//				 and assigns point j to ids[m][j]
+	// postcondition: store the Davies-Bouldin index of every model, computed over every point, and its silhouette, computed over
+	//				  a uniform sample of config.silhouetteSample points, in sweepResults. The distance of every pair of sampled points is
+	//				  computed once and used by every model
+	void scoreSweep(const vector<int>& ks, const vector<size_t>& offsets, const vector<double>& modelCentroids, const vector<vector<int>>& ids,
+		const int nThreads);
+
+	// recomputeCentroids
+	// precondition: chunkCount holds nChunks x k counts and chunkSum holds nChunks x k x dim sums
+	// postcondition: merge the chunks in chunk order into the new centroids, an empty cluster keeps its previous centroid
+	void recomputeCentroids(const vector<int>& chunkCount, const vector<double>& chunkSum, const size_t nChunks, const int nThreads);
+
+	// isConverged
+	// precondition: previous holds the centroids before the last recomputation, moved has k entries
+	// postcondition: store the distance every centroid moved in moved and return true if no point changed its cluster,
+	//				  no centroid moved more than config.tolerance, or the inertia improved by less than config.inertiaTolerance
+	bool isConverged(const size_t nChanged, const vector<double>& previous, vector<double>& moved, const double lastInertia);
+
+	// trainChunkSize
+	// precondition: none
+	// postcondition: return the number of points per training chunk, which only depends on the number of points
+	size_t trainChunkSize() const;
+
+	// countMembers
+	// precondition: logMtx is locked exclusively
+	// postcondition: store the number of points of every cluster in centroidCounts
+	void countMembers();
+
+	// updateCentroid
+	// precondition: logMtx is locked exclusively, the i-th point is assigned to a cluster
+	// postcondition: move the centroid of the i-th point towards it by max(1 / count, online.minLearningRate), where count is the
+	//				  number of points of the centroid including this one, and add the distance it moved to its drift
+	void updateCentroid(const size_t i);
+
+	// applyOnlineUpdates
+	// precondition: logMtx is locked exclusively
+	// postcondition: move the centroids towards the points of the current mini-batch in the order they were clustered,
+	//				  and start a reassignment after online.reassignEvery updates
+	void applyOnlineUpdates();
+
+	// startReassignment
+	// precondition: logMtx is locked exclusively and no reassignment is running
+	// postcondition: start a thread that runs online.reassignIterations Lloyd passes over a copy of the current points from the current
+	//				  centroids. When it is done, its centroids and clusters replace the model, the points clustered while it ran are
+	//				  assigned to the new centroids and move them again, and the inverted lists are rebuilt on the next nearest call
+	void startReassignment();
+
+	// SnapshotHeader
+	// The fields at the start of a snapshot file, followed by k x dim centroids (double) and nPoints cluster ids (int32)
+	// The numbers are stored in the byte order of the machine
+	struct SnapshotHeader {
+		uint32_t version = 0; // snapshot format version
+		int32_t k = 0; // number of clusters
+		uint64_t dim = 0; // number of coordinates of a point
+		uint64_t nPoints = 0; // number of points the model was trained or updated on
+		uint64_t datasetVersion = 0; // hash of the first nPoints rows of the dataset
 	};
 
-	vector<Cluster_Point> points; // all the Cluster_Points in the dataset
-	vector<Cluster_Point> clusters; // all the centroid of the K-Mean clustering
+	// loadOrTrain
+	// precondition: config.snapshotFile is not empty
+	// postcondition: load the model from the snapshot if it has the same k and dimension and the dataset starts with the rows it was
+	//				  trained on. Rows appended since then are assigned to their closest centroid and the snapshot is updated
+	//				  Otherwise (or with config.forceRetrain) train the model, warm started from the snapshot if config.warmStart, and save it
+	void loadOrTrain();
+
+	// readSnapshot
+	// precondition: none
+	// postcondition: read the header, centroids and cluster ids of the snapshot file. Return false if it is missing or invalid
+	bool readSnapshot(const string _fileName, SnapshotHeader& header, vector<double>& snapshotCentroids, vector<int>& snapshotIds) const;
+
+	// addPoint
+	// precondition: point has dim coordinates
+	// postcondition: append the point and its file name to the dataset with the given cluster id
+	//				  The point is stored in coords (floatCoords with config.floatPoints) after the mapped points, the mapped file is never changed
+	void addPoint(const vector<double>& point, const string name, const int clusterId);
+
+	// pointAt
+	// precondition: i is smaller than the number of points, buffer points to dim doubles
+	// postcondition: return a pointer to the dim coordinates of the i-th point. A point stored as floats is widened into buffer,
+	//				  so the pointer is only valid until buffer is used for another point
+	const double* pointAt(const size_t i, double* buffer) const {
+		if (i < mappedRows)
+			return mappedCoords + i * dim;
+		if (!config.floatPoints)
+			return coords.data() + (i - mappedRows) * dim;
+		widenPoint(floatCoords.data() + (i - mappedRows) * dim, buffer, dim);
+		return buffer;
+	}
+
+	// centroidAt
+	// precondition: i is smaller than the number of centroids
+	// postcondition: return a pointer to the dim coordinates of the i-th centroid
+	const double* centroidAt(const size_t i) const { return centroids.data() + i * dim; }
+
+	// The points are stored row-major in one contiguous block: point i uses coords[i * dim] to coords[i * dim + dim - 1]
+	// If the dataset is a pose dataset, the first mappedRows points are read in place from the mapped file and coords holds the rest
+	// With config.floatPoints the rest is held in floatCoords instead. The rows are written with 6 significant digits, which a float
+	// keeps exactly, so the dataset file, its version and the snapshots are the same as with doubles
+	// The file name and cluster id of point i are kept separately in fileNames[i] and clusterIds[i]
+	vector<double> coords; // coordinates of the points that are not mapped
+	vector<float> floatCoords; // coordinates of the points that are not mapped if config.floatPoints is set, coords is then empty
+	vector<string> fileNames; // image file name of every point
+	vector<int> clusterIds; // cluster of every point, -1 if not assigned
+	vector<double> centroids; // k rows of dim coordinates, the centroids of the K-Mean clustering
+	size_t dim = 0; // number of coordinates of a point
+	PoseDataset mapped; // pose dataset the first points are mapped from
+	const double* mappedCoords = nullptr; // coordinates of the mapped points
+	size_t mappedRows = 0; // number of mapped points
+	bool binaryDataSet = false; // true if the dataset file is a pose dataset
 	string fileName; // dataset file name
 	int k; // number of k
-	int trainIteration = 100;
+	TrainConfig config; // training settings
+	double trainSeconds = 0; // duration of the last training
+	size_t distanceEvaluations = 0; // distances computed by the last training
+	int iterations = 0; // iterations of the last training
+	uint64_t datasetVersion = FNV1A64_OFFSET; // hash of every row read from the dataset
+	size_t checkpointRows = 0; // number of rows after which readDataSet stores the dataset version in checkpointVersion
+	uint64_t checkpointVersion = FNV1A64_OFFSET; // hash of the first checkpointRows rows of the dataset
+	vector<double> warmCentroids; // centroids to start the training from instead of seeding
+	vector<SweepResult> sweepResults; // the result of every k of the last sweep
+	bool fromSnapshot = false; // true if the model was loaded from its snapshot
+	double inertia = 0; // sum of squared distances of the last training
+	vector<vector<size_t>> invertedLists; // index of every point of every cluster, for nearest
+	vector<vector<double>> listDistances; // distance from every point of an inverted list to its centroid
+	vector<double> clusterRadius; // largest distance from a centroid to a point of its inverted list
+	vector<size_t> unassignedRows; // points without a cluster, always searched
+	size_t indexedRows = 0; // number of points in the inverted lists
+	std::atomic<size_t> searchEvaluations{ 0 }; // distances computed by the last nearest call
+	OnlineConfig online; // how new points move the centroids
+	vector<double> centroidCounts; // number of points of every centroid, the learning rate of a centroid is 1 / its count
+	vector<double> centroidDrift; // distance every centroid moved since its inverted list was started, widens the search bounds
+	vector<size_t> pendingRows; // points of the current mini-batch that did not move their centroid yet
+	size_t updatesSinceReassign = 0; // online updates since the last reassignment started
+	std::atomic<size_t> onlineUpdates{ 0 }; // points that moved a centroid
+	std::atomic<size_t> reassignments{ 0 }; // background reassignments that finished
+	std::thread reassignThread; // background reassignment
+	std::atomic<bool> reassigning{ false }; // true while reassignThread runs
+	StorageConfig storage; // how new points are written
+	std::unordered_set<string> savedNames; // file names in the dataset file or the log
+	vector<size_t> logIndices; // index of every point in the log
+	FILE* logFile = nullptr; // dataset log, opened on the first append
+	size_t unsyncedRows = 0; // rows appended since the last sync
+	mutable std::shared_mutex logMtx; // guards the points, the index, the log and savedNames. Shared by related and nearest, exclusive for every change
+	std::thread compactThread; // background compaction, only started, joined or replaced with logMtx locked
+	std::atomic<bool> compacting{ false }; // true while compactThread runs, only cleared with logMtx locked
+	std::condition_variable_any compactDone; // notified when compacting is cleared
 };
\ No newline at end of file
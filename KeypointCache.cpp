@@ -0,0 +1,207 @@
+// KeypointCache.cpp
+// author: Cheuk-Hang Tse
+// This file contains the implementation of the KeypointCache class
+//
+// CONSTRUCTOR:
+// KeypointCache(const std::string _fileName, const size_t _capacity, const std::string& settings):
+//		load the cache file and define a cache of at most _capacity entries for the given settings
+//
+// DESTRUCTOR:
+// ~KeypointCache(): save the cache file
+//
+// FUNCTIONS:
+// hashFile: return the content hash of a file
+// lookup: find the points of an image by its content hash
+// insert: add the points of an image
+// save: write the cache file, least recently used entries first
+// getHits: return the number of lookups that found their image
+// getMisses: return the number of lookups that did not find their image
+// getEvictions: return the number of entries that were evicted to stay within the capacity
+// evict: remove entries until the cache is within its capacity
+
+#include "KeypointCache.h"
+#include "Hash.h"
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+
+// KeypointCache
+// precondition: _capacity is positive, settings describes everything besides the image that changes the points
+// postcondition: load the entries of _fileName, only the ones stored with the same settings can be looked up
+//				  An empty _fileName keeps the cache in memory only
+KeypointCache::KeypointCache(const std::string _fileName, const size_t _capacity, const std::string& settings) {
+	fileName = _fileName;
+	capacity = _capacity;
+	settingsKey = fnv1a64(settings.data(), settings.size());
+	if (fileName.empty())
+		return;
+
+	std::ifstream in(fileName);
+	std::string line, word;
+	while (getline(in, line)) {
+		if (!line.empty() && line.back() == '\r')
+			line.pop_back();
+		std::stringstream str(line);
+		Entry entry;
+		uint64_t lineSettings;
+		std::vector<int> values;
+		try {
+			if (!getline(str, word, ','))
+				continue;
+			entry.key = std::stoull(word, nullptr, 16);
+			if (!getline(str, word, ','))
+				continue;
+			lineSettings = std::stoull(word, nullptr, 16);
+			while (getline(str, word, ','))
+				values.push_back(std::stoi(word));
+		}
+		catch (const std::exception&) {
+			// a line cut off by a crash, or not written by a cache
+			continue;
+		}
+		if (values.empty() || values.size() % 2)
+			continue;
+		if (lineSettings != settingsKey) {
+			otherLines.push_back(line);
+			continue;
+		}
+		for (size_t i = 0; i < values.size(); i += 2)
+			entry.points.push_back(cv::Point(values[i], values[i + 1]));
+		// a later line of the same image is more recent
+		auto found = index.find(entry.key);
+		if (found != index.end())
+			entries.erase(found->second);
+		index[entry.key] = entries.insert(entries.end(), entry);
+	}
+	std::lock_guard<std::mutex> lock(mtx);
+	evict();
+}
+
+// ~KeypointCache
+// precondition: none
+// postcondition: save the cache file
+KeypointCache::~KeypointCache() {
+	save();
+}
+
+// hashFile
+// precondition: none
+// postcondition: store the content hash of the file in key. Return false if the file could not be read
+bool KeypointCache::hashFile(const std::string fileName, uint64_t& key) {
+	std::ifstream in(fileName, std::ios::binary | std::ios::ate);
+	if (!in.is_open())
+		return false;
+	std::string content((size_t)in.tellg(), '\0');
+	in.seekg(0);
+	if (!in.read(&content[0], content.size()))
+		return false;
+	key = xxhash64(content.data(), content.size());
+	return true;
+}
+
+// lookup
+// precondition: none
+// postcondition: if an image with the content hash key is cached, store its points in points, mark it as the most recently used
+//				  entry and return true. Else return false. The hit or miss is counted
+bool KeypointCache::lookup(const uint64_t key, std::vector<cv::Point>& points) {
+	std::lock_guard<std::mutex> lock(mtx);
+	auto found = index.find(key);
+	if (found == index.end()) {
+		misses++;
+		return false;
+	}
+	hits++;
+	entries.splice(entries.end(), entries, found->second);
+	points = found->second->points;
+	dirty = true;
+	return true;
+}
+
+// insert
+// precondition: none
+// postcondition: store the points of the image with the content hash key as the most recently used entry
+//				  An entry is evicted if the cache is over its capacity
+void KeypointCache::insert(const uint64_t key, const std::vector<cv::Point>& points) {
+	std::lock_guard<std::mutex> lock(mtx);
+	auto found = index.find(key);
+	if (found != index.end())
+		entries.erase(found->second);
+	index[key] = entries.insert(entries.end(), Entry{ key, points });
+	dirty = true;
+	evict();
+}
+
+// save
+// precondition: none
+// postcondition: write every entry to the cache file through a temporary file, the entries of other settings first, then the
+//				  entries of these settings from least to most recently used. Return false if the file could not be written
+bool KeypointCache::save() {
+	std::lock_guard<std::mutex> lock(mtx);
+	if (fileName.empty() || !dirty)
+		return true;
+
+	std::string tmpName = fileName + ".tmp";
+	std::ofstream out(tmpName, std::ios::binary | std::ios::trunc);
+	if (!out.is_open())
+		return false;
+	for (const auto& line : otherLines)
+		out << line << '\n';
+	char hex[40];
+	for (const auto& entry : entries) {
+		snprintf(hex, sizeof(hex), "%016llx,%016llx", (unsigned long long)entry.key, (unsigned long long)settingsKey);
+		out << hex;
+		for (const auto& point : entry.points)
+			out << ',' << point.x << ',' << point.y;
+		out << '\n';
+	}
+	out.close();
+	if (!out.good()) {
+		std::remove(tmpName.c_str());
+		return false;
+	}
+	std::remove(fileName.c_str());
+	if (std::rename(tmpName.c_str(), fileName.c_str()) != 0)
+		return false;
+	dirty = false;
+	return true;
+}
+
+// getHits
+// precondition: none
+// postcondition: return the number of lookups that found their image
+size_t KeypointCache::getHits() {
+	std::lock_guard<std::mutex> lock(mtx);
+	return hits;
+}
+
+// getMisses
+// precondition: none
+// postcondition: return the number of lookups that did not find their image
+size_t KeypointCache::getMisses() {
+	std::lock_guard<std::mutex> lock(mtx);
+	return misses;
+}
+
+// getEvictions
+// precondition: none
+// postcondition: return the number of entries that were evicted to stay within the capacity
+size_t KeypointCache::getEvictions() {
+	std::lock_guard<std::mutex> lock(mtx);
+	return evictions;
+}
+
+// evict
+// precondition: mtx is locked
+// postcondition: remove entries of other settings, then the least recently used entries, until the cache is within its capacity
+void KeypointCache::evict() {
+	while (otherLines.size() + entries.size() > capacity) {
+		if (!otherLines.empty())
+			otherLines.pop_front();
+		else {
+			index.erase(entries.front().key);
+			entries.pop_front();
+		}
+		evictions++;
+		dirty = true;
+	}
+}
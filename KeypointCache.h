@@ -0,0 +1,115 @@
+// KeypointCache.h
+// author: Cheuk-Hang Tse
+// This file contains the declaration of the KeypointCache class
+// A KeypointCache remembers the body part locations found in an image, keyed by a hash of the image file content and of the
+// settings that change the result (model, network input size, threshold, ...). An image that was already estimated with the same
+// settings is neither decoded nor run through the network again, even if it was renamed or copied
+// The cache is kept in a text file, one entry per line, least recently used first:
+// content hash, settings hash, point0_x, point0_y, ..., pointn_y
+// When the file holds more than capacity entries, the entries of other settings are evicted first, then the least recently used ones
+// Every function can be called from several threads at the same time
+//
+// CONSTRUCTOR:
+// KeypointCache(const std::string _fileName, const size_t _capacity, const std::string& settings):
+//		load the cache file and define a cache of at most _capacity entries for the given settings
+//
+// DESTRUCTOR:
+// ~KeypointCache(): save the cache file
+//
+// FUNCTIONS:
+// hashFile: return the content hash of a file
+// lookup: find the points of an image by its content hash
+// insert: add the points of an image
+// save: write the cache file, least recently used entries first
+// getHits: return the number of lookups that found their image
+// getMisses: return the number of lookups that did not find their image
+// getEvictions: return the number of entries that were evicted to stay within the capacity
+
+#pragma once
+#include <opencv2/core.hpp>
+#include <cstdint>
+#include <list>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+class KeypointCache {
+public:
+	// KeypointCache
+	// precondition: _capacity is positive, settings describes everything besides the image that changes the points
+	// postcondition: load the entries of _fileName, only the ones stored with the same settings can be looked up
+	//				  An empty _fileName keeps the cache in memory only
+	KeypointCache(const std::string _fileName, const size_t _capacity, const std::string& settings);
+
+	// ~KeypointCache
+	// precondition: none
+	// postcondition: save the cache file
+	~KeypointCache();
+
+	KeypointCache(const KeypointCache&) = delete;
+	KeypointCache& operator=(const KeypointCache&) = delete;
+
+	// hashFile
+	// precondition: none
+	// postcondition: store the content hash of the file in key. Return false if the file could not be read
+	static bool hashFile(const std::string fileName, uint64_t& key);
+
+	// lookup
+	// precondition: none
+	// postcondition: if an image with the content hash key is cached, store its points in points, mark it as the most recently used
+	//				  entry and return true. Else return false. The hit or miss is counted
+	bool lookup(const uint64_t key, std::vector<cv::Point>& points);
+
+	// insert
+	// precondition: none
+	// postcondition: store the points of the image with the content hash key as the most recently used entry
+	//				  An entry is evicted if the cache is over its capacity
+	void insert(const uint64_t key, const std::vector<cv::Point>& points);
+
+	// save
+	// precondition: none
+	// postcondition: write every entry to the cache file through a temporary file, the entries of other settings first, then the
+	//				  entries of these settings from least to most recently used. Return false if the file could not be written
+	bool save();
+
+	// getHits
+	// precondition: none
+	// postcondition: return the number of lookups that found their image
+	size_t getHits();
+
+	// getMisses
+	// precondition: none
+	// postcondition: return the number of lookups that did not find their image
+	size_t getMisses();
+
+	// getEvictions
+	// precondition: none
+	// postcondition: return the number of entries that were evicted to stay within the capacity
+	size_t getEvictions();
+
+private:
+	// Entry
+	// The points of one image
+	struct Entry {
+		uint64_t key; // content hash of the image file
+		std::vector<cv::Point> points; // body part locations in the image
+	};
+
+	// evict
+	// precondition: mtx is locked
+	// postcondition: remove entries of other settings, then the least recently used entries, until the cache is within its capacity
+	void evict();
+
+	std::string fileName; // cache file, empty if the cache is not saved
+	size_t capacity; // maximum number of entries
+	uint64_t settingsKey; // hash of the settings, entries of other settings are never returned
+	std::list<Entry> entries; // least recently used first
+	std::unordered_map<uint64_t, std::list<Entry>::iterator> index; // content hash to entry
+	std::list<std::string> otherLines; // entries of other settings in file order, written back unchanged
+	bool dirty = false; // true if the entries changed since the last save
+	size_t hits = 0;
+	size_t misses = 0;
+	size_t evictions = 0;
+	std::mutex mtx;
+};
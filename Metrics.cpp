@@ -0,0 +1,204 @@
+// Metrics.cpp
+// author: Cheuk-Hang Tse
+// This file contains the implementation of the Histogram and MetricsRegistry classes.
+//
+// Histogram FUNCTIONS:
+// observe: add a duration to its bucket
+// upperBound: return the largest duration of a bucket
+// quantile: return the upper bound of the bucket a quantile falls into
+// reset: remove every duration
+//
+// MetricsRegistry FUNCTIONS:
+// instance: return the registry of the process
+// counter: return the counter of a name, created on first use
+// histogram: return the histogram of a name, created on first use
+// toJson: return every metric as one line of JSON
+// toPrometheus: return every metric in the Prometheus text format
+// writeFile: write every metric to a file, as JSON if its name ends with .json, else as Prometheus text
+// reset: set every metric to 0
+
+#include "Metrics.h"
+#include <algorithm>
+#include <fstream>
+#include <limits>
+#include <sstream>
+
+// upper bounds of the histogram buckets in seconds, the last bucket has no upper bound
+static const double BUCKET_BOUNDS[Histogram::BUCKETS - 1] = {
+	1e-6, 2.5e-6, 5e-6, 1e-5, 2.5e-5, 5e-5, 1e-4, 2.5e-4, 5e-4, 1e-3, 2.5e-3, 5e-3,
+	1e-2, 2.5e-2, 5e-2, 0.1, 0.25, 0.5, 1, 2.5, 5, 10, 25, 50
+};
+
+// observe
+// precondition: seconds is not negative
+// postcondition: add seconds to the count, the sum and the first bucket whose upper bound is at least seconds
+//				  Safe to call from several threads
+void Histogram::observe(const double seconds) {
+	size_t bucket = std::lower_bound(BUCKET_BOUNDS, BUCKET_BOUNDS + BUCKETS - 1, seconds) - BUCKET_BOUNDS;
+	buckets[bucket].fetch_add(1, std::memory_order_relaxed);
+	count.fetch_add(1, std::memory_order_relaxed);
+	sumNanoseconds.fetch_add((uint64_t)(std::max(seconds, 0.0) * 1e9), std::memory_order_relaxed);
+}
+
+// upperBound
+// precondition: bucket is less than BUCKETS
+// postcondition: return the largest duration of bucket in seconds, infinity for the last bucket
+double Histogram::upperBound(const size_t bucket) {
+	return bucket < BUCKETS - 1 ? BUCKET_BOUNDS[bucket] : std::numeric_limits<double>::infinity();
+}
+
+// quantile
+// precondition: q is from 0 to 1
+// postcondition: return the upper bound of the bucket the q-th quantile of the durations falls into, 0 if there are none
+//				  A quantile in the last bucket returns the largest finite bound
+double Histogram::quantile(const double q) const {
+	uint64_t total = getCount();
+	if (!total)
+		return 0;
+	uint64_t rank = std::max((uint64_t)1, (uint64_t)(q * total + 0.5));
+	uint64_t seen = 0;
+	for (size_t b = 0; b < BUCKETS - 1; b++) {
+		seen += getBucket(b);
+		if (seen >= rank)
+			return BUCKET_BOUNDS[b];
+	}
+	return BUCKET_BOUNDS[BUCKETS - 2];
+}
+
+// reset
+// precondition: none
+// postcondition: remove every duration
+void Histogram::reset() {
+	for (auto& bucket : buckets)
+		bucket.store(0, std::memory_order_relaxed);
+	count.store(0, std::memory_order_relaxed);
+	sumNanoseconds.store(0, std::memory_order_relaxed);
+}
+
+// instance
+// precondition: none
+// postcondition: return the registry every METRICS_ macro of the process records to
+MetricsRegistry& MetricsRegistry::instance() {
+	// never destroyed, so a metric can still be recorded or exported while the static objects of the process are destroyed
+	static MetricsRegistry* registry = new MetricsRegistry();
+	return *registry;
+}
+
+// counter
+// precondition: name only has letters, digits and underscores
+// postcondition: return the counter of name, created on first use. The reference stays valid until the process ends
+Counter& MetricsRegistry::counter(const std::string& name) {
+	std::lock_guard<std::mutex> lock(mtx);
+	std::unique_ptr<Counter>& entry = counters[name];
+	if (!entry)
+		entry.reset(new Counter());
+	return *entry;
+}
+
+// histogram
+// precondition: name only has letters, digits and underscores
+// postcondition: return the histogram of name, created on first use. The reference stays valid until the process ends
+Histogram& MetricsRegistry::histogram(const std::string& name) {
+	std::lock_guard<std::mutex> lock(mtx);
+	std::unique_ptr<Histogram>& entry = histograms[name];
+	if (!entry)
+		entry.reset(new Histogram());
+	return *entry;
+}
+
+// toJson
+// precondition: none
+// postcondition: return {"counters": {name: value, ...}, "histograms": {name: {count, sum, mean, p50, p90, p99, buckets}, ...}}
+//				  on one line, the durations in seconds. The percentiles are the upper bounds of their buckets
+std::string MetricsRegistry::toJson() {
+	std::lock_guard<std::mutex> lock(mtx);
+	std::stringstream out;
+	out.precision(9);
+	out << "{\"counters\": {";
+	const char* separator = "";
+	for (const auto& entry : counters) {
+		out << separator << "\"" << entry.first << "\": " << entry.second->get();
+		separator = ", ";
+	}
+	out << "}, \"histograms\": {";
+	separator = "";
+	for (const auto& entry : histograms) {
+		const Histogram& h = *entry.second;
+		uint64_t count = h.getCount();
+		out << separator << "\"" << entry.first << "\": {\"count\": " << count << ", \"sum\": " << h.getSum()
+			<< ", \"mean\": " << (count ? h.getSum() / count : 0) << ", \"p50\": " << h.quantile(0.5) << ", \"p90\": " << h.quantile(0.9)
+			<< ", \"p99\": " << h.quantile(0.99) << ", \"buckets\": [";
+		// only the buckets that were used, as [upper bound, count], the last bound is null
+		const char* bucketSeparator = "";
+		for (size_t b = 0; b < Histogram::BUCKETS; b++) {
+			if (!h.getBucket(b))
+				continue;
+			out << bucketSeparator << "[";
+			if (b < Histogram::BUCKETS - 1)
+				out << Histogram::upperBound(b);
+			else
+				out << "null";
+			out << ", " << h.getBucket(b) << "]";
+			bucketSeparator = ", ";
+		}
+		out << "]}";
+		separator = ", ";
+	}
+	out << "}}";
+	return out.str();
+}
+
+// toPrometheus
+// precondition: none
+// postcondition: return every counter as kmean_pose_<name>_total and every histogram as kmean_pose_<name>_seconds
+//				  in the Prometheus text exposition format
+std::string MetricsRegistry::toPrometheus() {
+	std::lock_guard<std::mutex> lock(mtx);
+	std::stringstream out;
+	out.precision(9);
+	for (const auto& entry : counters) {
+		std::string name = "kmean_pose_" + entry.first + "_total";
+		out << "# TYPE " << name << " counter\n" << name << " " << entry.second->get() << "\n";
+	}
+	for (const auto& entry : histograms) {
+		const Histogram& h = *entry.second;
+		std::string name = "kmean_pose_" + entry.first + "_seconds";
+		out << "# TYPE " << name << " histogram\n";
+		// Prometheus buckets are cumulative
+		uint64_t cumulative = 0;
+		for (size_t b = 0; b < Histogram::BUCKETS; b++) {
+			cumulative += h.getBucket(b);
+			out << name << "_bucket{le=\"";
+			if (b < Histogram::BUCKETS - 1)
+				out << Histogram::upperBound(b);
+			else
+				out << "+Inf";
+			out << "\"} " << cumulative << "\n";
+		}
+		out << name << "_sum " << h.getSum() << "\n" << name << "_count " << h.getCount() << "\n";
+	}
+	return out.str();
+}
+
+// writeFile
+// precondition: none
+// postcondition: write toJson to fileName if it ends with .json, else toPrometheus. Return false if it could not be written
+bool MetricsRegistry::writeFile(const std::string fileName) {
+	bool json = fileName.size() >= 5 && fileName.compare(fileName.size() - 5, 5, ".json") == 0;
+	std::ofstream out(fileName, std::ios::trunc);
+	if (!out)
+		return false;
+	out << (json ? toJson() + "\n" : toPrometheus());
+	return (bool)out;
+}
+
+// reset
+// precondition: none
+// postcondition: set every counter and histogram to 0, the names are kept
+void MetricsRegistry::reset() {
+	std::lock_guard<std::mutex> lock(mtx);
+	for (auto& entry : counters)
+		entry.second->reset();
+	for (auto& entry : histograms)
+		entry.second->reset();
+}
@@ -0,0 +1,205 @@
+// Metrics.h
+// author: Cheuk-Hang Tse
+// This file contains the declaration of the Counter, Histogram, MetricsRegistry and ScopedTimer classes.
+// They measure where the time of a request goes: every stage (decode, model load, blob, forward, peak extraction, drawing,
+// dataset read, training, cluster, related, nearest, dataset save) has a latency histogram, and the work done (images,
+// trainings, iterations to converge, distance evaluations) is counted. The metrics are exported as JSON or as Prometheus text.
+// The stages are instrumented with the METRICS_TIMER, METRICS_COUNT and METRICS_OBSERVE macros. Every call site looks its
+// metric up once and then only updates atomics, so the instrumentation is cheap enough for every request.
+// Building with POSE_METRICS defined as 0 turns every macro into nothing, the registry is then always empty
+//
+// Counter FUNCTIONS:
+// add: add to the counter
+// get: return the value of the counter
+// reset: set the counter to 0
+//
+// Histogram FUNCTIONS:
+// observe: add a duration to its bucket
+// getCount: return the number of durations
+// getSum: return the sum of the durations
+// getBucket: return the number of durations in a bucket
+// upperBound: return the largest duration of a bucket
+// quantile: return the upper bound of the bucket a quantile falls into
+// reset: remove every duration
+//
+// MetricsRegistry FUNCTIONS:
+// instance: return the registry of the process
+// counter: return the counter of a name, created on first use
+// histogram: return the histogram of a name, created on first use
+// toJson: return every metric as one line of JSON
+// toPrometheus: return every metric in the Prometheus text format
+// writeFile: write every metric to a file, as JSON if its name ends with .json, else as Prometheus text
+// reset: set every metric to 0
+//
+// ScopedTimer FUNCTIONS:
+// ScopedTimer: start timing
+// ~ScopedTimer: add the time since the start to the histogram
+
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+
+// POSE_METRICS
+// 1 records the metrics, 0 compiles every METRICS_ macro to nothing
+#ifndef POSE_METRICS
+#define POSE_METRICS 1
+#endif
+
+class Counter {
+public:
+	// add
+	// precondition: none
+	// postcondition: add n to the counter, safe to call from several threads
+	void add(const uint64_t n) { value.fetch_add(n, std::memory_order_relaxed); }
+
+	// get
+	// precondition: none
+	// postcondition: return the value of the counter
+	uint64_t get() const { return value.load(std::memory_order_relaxed); }
+
+	// reset
+	// precondition: none
+	// postcondition: set the counter to 0
+	void reset() { value.store(0, std::memory_order_relaxed); }
+
+private:
+	std::atomic<uint64_t> value{ 0 };
+};
+
+class Histogram {
+public:
+	static const size_t BUCKETS = 25; // 1, 2.5 and 5 of every decade from 1 microsecond to 50 seconds, and one for longer
+
+	// observe
+	// precondition: seconds is not negative
+	// postcondition: add seconds to the count, the sum and the first bucket whose upper bound is at least seconds
+	//				  Safe to call from several threads
+	void observe(const double seconds);
+
+	// getCount
+	// precondition: none
+	// postcondition: return the number of durations observed
+	uint64_t getCount() const { return count.load(std::memory_order_relaxed); }
+
+	// getSum
+	// precondition: none
+	// postcondition: return the sum of the durations observed in seconds
+	double getSum() const { return sumNanoseconds.load(std::memory_order_relaxed) * 1e-9; }
+
+	// getBucket
+	// precondition: bucket is less than BUCKETS
+	// postcondition: return the number of durations in bucket (not cumulative)
+	uint64_t getBucket(const size_t bucket) const { return buckets[bucket].load(std::memory_order_relaxed); }
+
+	// upperBound
+	// precondition: bucket is less than BUCKETS
+	// postcondition: return the largest duration of bucket in seconds, infinity for the last bucket
+	static double upperBound(const size_t bucket);
+
+	// quantile
+	// precondition: q is from 0 to 1
+	// postcondition: return the upper bound of the bucket the q-th quantile of the durations falls into, 0 if there are none
+	double quantile(const double q) const;
+
+	// reset
+	// precondition: none
+	// postcondition: remove every duration
+	void reset();
+
+private:
+	std::atomic<uint64_t> buckets[BUCKETS] = {};
+	std::atomic<uint64_t> count{ 0 };
+	std::atomic<uint64_t> sumNanoseconds{ 0 }; // an integer sum, so it can be added to without a compare and swap loop
+};
+
+class MetricsRegistry {
+public:
+	// instance
+	// precondition: none
+	// postcondition: return the registry every METRICS_ macro of the process records to
+	static MetricsRegistry& instance();
+
+	// counter
+	// precondition: name only has letters, digits and underscores
+	// postcondition: return the counter of name, created on first use. The reference stays valid until the process ends
+	Counter& counter(const std::string& name);
+
+	// histogram
+	// precondition: name only has letters, digits and underscores
+	// postcondition: return the histogram of name, created on first use. The reference stays valid until the process ends
+	Histogram& histogram(const std::string& name);
+
+	// toJson
+	// precondition: none
+	// postcondition: return {"counters": {name: value, ...}, "histograms": {name: {count, sum, mean, p50, p90, p99, buckets}, ...}}
+	//				  on one line, the durations in seconds. The percentiles are the upper bounds of their buckets
+	std::string toJson();
+
+	// toPrometheus
+	// precondition: none
+	// postcondition: return every counter as kmean_pose_<name>_total and every histogram as kmean_pose_<name>_seconds
+	//				  in the Prometheus text exposition format
+	std::string toPrometheus();
+
+	// writeFile
+	// precondition: none
+	// postcondition: write toJson to fileName if it ends with .json, else toPrometheus. Return false if it could not be written
+	bool writeFile(const std::string fileName);
+
+	// reset
+	// precondition: none
+	// postcondition: set every counter and histogram to 0, the names are kept
+	void reset();
+
+private:
+	MetricsRegistry() {}
+
+	std::mutex mtx; // guards the maps, not the metrics themselves
+	std::map<std::string, std::unique_ptr<Counter>> counters;
+	std::map<std::string, std::unique_ptr<Histogram>> histograms;
+};
+
+class ScopedTimer {
+public:
+	// ScopedTimer
+	// precondition: _histogram outlives the timer
+	// postcondition: start timing
+	explicit ScopedTimer(Histogram& _histogram) : histogram(_histogram), start(std::chrono::steady_clock::now()) {}
+
+	// ~ScopedTimer
+	// precondition: none
+	// postcondition: add the seconds since the timer started to the histogram
+	~ScopedTimer() { histogram.observe(std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count()); }
+
+	ScopedTimer(const ScopedTimer&) = delete;
+	ScopedTimer& operator=(const ScopedTimer&) = delete;
+
+private:
+	Histogram& histogram;
+	std::chrono::steady_clock::time_point start;
+};
+
+// METRICS_TIMER(name): time the rest of the enclosing scope into the histogram name
+// METRICS_COUNT(name, n): add n to the counter name, n is not evaluated when the metrics are compiled out
+// METRICS_OBSERVE(name, seconds): add a duration measured elsewhere to the histogram name
+// name must be a string literal, every call site looks it up once
+#if POSE_METRICS
+#define METRICS_CONCAT_(a, b) a##b
+#define METRICS_CONCAT(a, b) METRICS_CONCAT_(a, b)
+#define METRICS_TIMER(name) \
+	static Histogram& METRICS_CONCAT(metricsHistogram, __LINE__) = MetricsRegistry::instance().histogram(name); \
+	ScopedTimer METRICS_CONCAT(metricsTimer, __LINE__)(METRICS_CONCAT(metricsHistogram, __LINE__))
+#define METRICS_COUNT(name, n) \
+	do { static Counter& metricsCounter = MetricsRegistry::instance().counter(name); metricsCounter.add((uint64_t)(n)); } while (0)
+#define METRICS_OBSERVE(name, seconds) \
+	do { static Histogram& metricsHistogram = MetricsRegistry::instance().histogram(name); metricsHistogram.observe(seconds); } while (0)
+#else
+#define METRICS_TIMER(name) ((void)0)
+#define METRICS_COUNT(name, n) ((void)0)
+#define METRICS_OBSERVE(name, seconds) ((void)0)
+#endif
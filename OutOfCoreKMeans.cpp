@@ -0,0 +1,444 @@
+// OutOfCoreKMeans.cpp
+// author: Cheuk-Hang Tse
+// This file contains the implementation of the OutOfCoreKMeans class.
+//
+// CONSTRUCTOR:
+// OutOfCoreKMeans(const string _fileName, const int _k, const OutOfCoreConfig& _config): define a training of _k clusters
+//		over the dataset _fileName with the memory budget and stopping rules in _config
+//
+// FUNCTIONS:
+// train: stream the dataset until the clustering converges and write the assignment file
+// saveSnapshot: save the centroids and the assignment file as a KMeanCluster snapshot
+// getCentroids: return the trained centroids
+// getRows: return the number of rows that were clustered
+// getDim: return the number of coordinates of a row
+// getChunkRows: return the number of rows in a chunk
+// getIterations: return the number of assignment passes
+// getInertia: return the sum of squared distances from every row to its centroid in the last pass
+// getTrainSeconds: return the number of seconds the training took
+// getWaitSeconds: return the number of seconds the assignment waited for the reader thread
+// openDataset: read the dimension, the number of rows and the format of the dataset
+// readRows: read the next chunk of rows from the dataset
+// streamPass: read every chunk on a reader thread and hand it to a function as soon as it is read
+// sampleSeeds: pick the initial centroids with k-means++ from a uniform sample of the rows
+// assignChunk: assign every row of a chunk to its closest centroid and add it to the sums of its cluster
+// seekFile: move a file to a 64-bit position
+
+#include "OutOfCoreKMeans.h"
+#include <algorithm>
+#include <charconv>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <ctime>
+#include <limits>
+#include <random>
+#include <thread>
+
+// seekFile
+// precondition: file is open
+// postcondition: move file to the byte position offset, which can be beyond 2 GB. Return false if it failed
+static bool seekFile(FILE* file, const uint64_t offset) {
+#ifdef _WIN32
+	return _fseeki64(file, (long long)offset, SEEK_SET) == 0;
+#else
+	return fseeko(file, (off_t)offset, SEEK_SET) == 0;
+#endif
+}
+
+// OutOfCoreKMeans
+// precondition: _k is positive
+// postcondition: define a training of _k clusters over the dataset _fileName with the memory budget and stopping rules in _config
+OutOfCoreKMeans::OutOfCoreKMeans(const std::string _fileName, const int _k, const OutOfCoreConfig& _config) {
+	fileName = _fileName;
+	k = _k;
+	config = _config;
+	if (config.assignmentFile.empty())
+		config.assignmentFile = fileName + ".clusters";
+}
+
+// train
+// precondition: none
+// postcondition: stream the dataset once to sample the initial centroids, then once per iteration to assign every row to its
+//				  closest centroid and recompute the centroids, until no row changes its cluster, no centroid moves more than
+//				  tolerance, or maxIterations passes ran. The cluster of every row is in the assignment file afterwards
+//				  Rows with a different number of coordinates than the first row are skipped, like KMeanCluster does
+//				  Return false if the dataset is empty or could not be read, or the assignment file could not be written
+bool OutOfCoreKMeans::train() {
+	auto start = std::chrono::steady_clock::now();
+	iterations = 0;
+	inertia = 0;
+	waitSeconds = 0;
+	if (!openDataset() || !sampleSeeds())
+		return false;
+
+	FILE* ids = fopen(config.assignmentFile.c_str(), "w+b");
+	if (!ids)
+		return false;
+	std::vector<double> sums(k * dim);
+	std::vector<int64_t> counts(k);
+	std::vector<int32_t> chunkIds(chunkRows);
+	std::vector<double> previous;
+	bool ok = true;
+	for (int l = 0; l < std::max(1, config.maxIterations); l++) {
+		std::fill(sums.begin(), sums.end(), 0.0);
+		std::fill(counts.begin(), counts.end(), 0);
+		double inertiaSum = 0;
+		size_t changed = 0;
+		ok = streamPass(false, [&](const Chunk& chunk) {
+			// the clusters of the last pass are read back from where the new ones are written
+			std::fill(chunkIds.begin(), chunkIds.begin() + chunk.nRows, -1);
+			if (l > 0 && (!seekFile(ids, chunk.firstRow * sizeof(int32_t))
+				|| fread(chunkIds.data(), sizeof(int32_t), chunk.nRows, ids) != chunk.nRows))
+				return false;
+			assignChunk(chunk, chunkIds, sums, counts, inertiaSum, changed);
+			return seekFile(ids, chunk.firstRow * sizeof(int32_t))
+				&& fwrite(chunkIds.data(), sizeof(int32_t), chunk.nRows, ids) == chunk.nRows;
+		});
+		if (!ok)
+			break;
+
+		// Recompute the centroids, an empty cluster keeps its previous centroid
+		previous = centroids;
+		double maxMoved = 0;
+		for (int c = 0; c < k; c++) {
+			if (counts[c]) {
+				for (size_t d = 0; d < dim; d++)
+					centroids[c * dim + d] = sums[c * dim + d] / counts[c];
+			}
+			maxMoved = std::max(maxMoved, sqrt(squaredDistance(previous.data() + c * dim, centroids.data() + c * dim, dim)));
+		}
+		iterations = l + 1;
+		inertia = inertiaSum;
+		if (!changed || maxMoved <= config.tolerance)
+			break;
+	}
+	ok = fflush(ids) == 0 && ok;
+	ok = fclose(ids) == 0 && ok;
+	trainSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	return ok;
+}
+
+// saveSnapshot
+// precondition: train returned true
+// postcondition: write the centroids and the cluster of every row to _fileName in the KMeanCluster snapshot format, so a
+//				  KMeanCluster of the same dataset and k loads it instead of training. Return false if it could not be written
+bool OutOfCoreKMeans::saveSnapshot(const std::string _fileName) const {
+	if (centroids.size() != k * dim)
+		return false;
+	FILE* ids = fopen(config.assignmentFile.c_str(), "rb");
+	if (!ids)
+		return false;
+
+	// the same layout as KMeanCluster::saveSnapshot: magic, version, k, dim, number of points, dataset version, centroids, cluster ids
+	std::string tmpName = _fileName + ".tmp";
+	bool ok;
+	{
+		std::ofstream out(tmpName, std::ios::binary | std::ios::trunc);
+		if (!out.is_open()) {
+			fclose(ids);
+			return false;
+		}
+		uint32_t version = 1;
+		int32_t clusters = k;
+		uint64_t dimension = dim;
+		uint64_t nPoints = nRows;
+		out.write("KMSNAP01", 8);
+		out.write((const char*)&version, sizeof(version));
+		out.write((const char*)&clusters, sizeof(clusters));
+		out.write((const char*)&dimension, sizeof(dimension));
+		out.write((const char*)&nPoints, sizeof(nPoints));
+		out.write((const char*)&datasetVersion, sizeof(datasetVersion));
+		out.write((const char*)centroids.data(), centroids.size() * sizeof(double));
+		// the cluster ids are copied one chunk at a time, so the snapshot of a large dataset is written in bounded memory
+		std::vector<int32_t> block(chunkRows);
+		size_t copied = 0;
+		while (copied < nRows) {
+			size_t n = fread(block.data(), sizeof(int32_t), std::min(chunkRows, nRows - copied), ids);
+			if (!n)
+				break;
+			out.write((const char*)block.data(), n * sizeof(int32_t));
+			copied += n;
+		}
+		ok = copied == nRows && out.good();
+	}
+	fclose(ids);
+	if (!ok) {
+		std::remove(tmpName.c_str());
+		return false;
+	}
+	std::remove(_fileName.c_str());
+	return std::rename(tmpName.c_str(), _fileName.c_str()) == 0;
+}
+
+// openDataset
+// precondition: none
+// postcondition: find out whether the dataset is a pose dataset and read its dimension (and number of rows for a pose dataset)
+//				  Return false if it could not be read
+bool OutOfCoreKMeans::openDataset() {
+	binaryDataSet = PoseDataset::isPoseDataset(fileName);
+	dim = 0;
+	nRows = 0;
+	if (binaryDataSet) {
+		FILE* in = fopen(fileName.c_str(), "rb");
+		if (!in)
+			return false;
+		bool read = fread(&header, sizeof(header), 1, in) == 1;
+		fclose(in);
+		if (!read || header.version != 1 || header.coordOffset != sizeof(PoseDatasetHeader)
+			|| header.versionOffset != header.coordOffset + header.nRows * header.dim * sizeof(double))
+			return false;
+		dim = (size_t)header.dim;
+	}
+	else {
+		std::ifstream csv(fileName);
+		std::string line, name;
+		std::vector<double> point;
+		while (!dim && getline(csv, line)) {
+			if (!line.empty() && line.back() == '\r')
+				line.pop_back();
+			if (line.empty())
+				continue;
+			try {
+				parseDataSetRow(line, name, point);
+			}
+			catch (const std::exception&) {
+				continue;
+			}
+			dim = point.size();
+			if (!dim)
+				return false;
+		}
+	}
+	if (!dim)
+		return false;
+	// three chunk buffers (one read, one waiting, one assigned) and the seeding sample share the budget
+	chunkRows = std::max((size_t)1, config.memoryBudget / (4 * dim * sizeof(double)));
+	return true;
+}
+
+// readRows
+// precondition: the dataset file is open and positioned after the rows read so far
+// postcondition: read up to chunkRows rows into chunk, hashing the rows in the format of formatDataSetRow
+//				  into datasetVersion if hashRows
+//				  Return the number of rows read, 0 at the end of the dataset
+size_t OutOfCoreKMeans::readRows(std::ifstream& csv, FILE* binary, Chunk& chunk, const bool hashRows) {
+	if (binary) {
+		size_t remaining = chunk.firstRow < header.nRows ? (size_t)header.nRows - chunk.firstRow : 0;
+		return fread(chunk.coords.data(), dim * sizeof(double), std::min(chunkRows, remaining), binary);
+	}
+
+	size_t n = 0;
+	std::string line;
+	while (n < chunkRows && getline(csv, line)) {
+		if (!line.empty() && line.back() == '\r')
+			line.pop_back();
+		if (line.empty())
+			continue;
+		// the CSV is parsed again in every pass, so the coordinates are read with from_chars straight into the chunk
+		// instead of through parseDataSetRow. A row is skipped like KMeanCluster skips it, or if a coordinate is not a number
+		double* row = chunk.coords.data() + n * dim;
+		size_t nCoords = 0;
+		bool valid = true;
+		const char* lineEnd = line.c_str() + line.size();
+		const char* p = strchr(line.c_str(), ',');
+		while (p && valid) {
+			p++;
+			if (*p == ',' || *p == '\0') {
+				// an empty word, like the trailing comma
+				p = *p ? p : nullptr;
+				continue;
+			}
+			while (*p == ' ')
+				p++;
+			double value;
+			std::from_chars_result parsed = std::from_chars(p, lineEnd, value);
+			valid = parsed.ec == std::errc() && (*parsed.ptr == ',' || *parsed.ptr == '\0') && nCoords < dim;
+			if (valid)
+				row[nCoords++] = value;
+			p = valid && *parsed.ptr ? parsed.ptr : nullptr;
+		}
+		if (!valid || nCoords != dim)
+			continue;
+		n++;
+		if (hashRows) {
+			// hashed in the format KMeanCluster hashes, which does not depend on how the numbers were written
+			std::string canonical = formatDataSetRow(line.substr(0, line.find(',')), row, dim);
+			datasetVersion = fnv1a64(canonical.data(), canonical.size(), datasetVersion);
+			datasetVersion = fnv1a64("\n", 1, datasetVersion);
+		}
+	}
+	return n;
+}
+
+// streamPass
+// precondition: openDataset returned true
+// postcondition: read the dataset from the start on a reader thread into the chunk buffers and call process for every chunk
+//				  in order while the next one is read. Stop early if process returns false
+//				  Return false if the dataset could not be opened or process failed
+bool OutOfCoreKMeans::streamPass(const bool hashRows, const std::function<bool(const Chunk&)>& process) {
+	std::ifstream csv;
+	FILE* binary = nullptr;
+	if (binaryDataSet) {
+		binary = fopen(fileName.c_str(), "rb");
+		if (!binary || !seekFile(binary, header.coordOffset)) {
+			if (binary)
+				fclose(binary);
+			return false;
+		}
+	}
+	else {
+		csv.open(fileName);
+		if (!csv.is_open())
+			return false;
+	}
+
+	// the buffers go around in a circle: the reader fills a free one, process empties a read one and frees it again
+	const size_t nBuffers = 3;
+	std::vector<Chunk> buffers(nBuffers);
+	BoundedQueue<Chunk*> freeChunks(nBuffers);
+	BoundedQueue<Chunk*> readChunks(nBuffers);
+	for (auto& buffer : buffers) {
+		buffer.coords.resize(chunkRows * dim);
+		freeChunks.push(&buffer);
+	}
+	std::thread reader([&] {
+		size_t firstRow = 0;
+		Chunk* chunk;
+		while (freeChunks.pop(chunk)) {
+			chunk->firstRow = firstRow;
+			chunk->nRows = readRows(csv, binary, *chunk, hashRows);
+			if (!chunk->nRows || !readChunks.push(chunk))
+				break;
+			firstRow += chunk->nRows;
+		}
+		readChunks.close();
+	});
+
+	bool ok = true;
+	Chunk* chunk;
+	auto waitStart = std::chrono::steady_clock::now();
+	while (readChunks.pop(chunk)) {
+		waitSeconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - waitStart).count();
+		if (ok && !process(*chunk)) {
+			// stop the reader, the chunks it already read are dropped
+			ok = false;
+			freeChunks.close();
+		}
+		freeChunks.push(chunk);
+		waitStart = std::chrono::steady_clock::now();
+	}
+	reader.join();
+	if (binary)
+		fclose(binary);
+	return ok;
+}
+
+// sampleSeeds
+// precondition: openDataset returned true
+// postcondition: stream the dataset once to count the rows and keep a uniform sample of at most chunkRows rows, then pick
+//				  k centroids from the sample with k-means++. Return false if the dataset has no rows
+bool OutOfCoreKMeans::sampleSeeds() {
+	std::mt19937_64 rng(config.seed ? config.seed : (unsigned int)time(0));
+	std::vector<double> sample;
+	size_t seen = 0;
+	datasetVersion = FNV1A64_OFFSET;
+	// reservoir sampling: after n rows every row is in the sample with the same probability
+	bool ok = streamPass(!binaryDataSet, [&](const Chunk& chunk) {
+		for (size_t r = 0; r < chunk.nRows; r++, seen++) {
+			const double* row = chunk.coords.data() + r * dim;
+			if (seen < chunkRows)
+				sample.insert(sample.end(), row, row + dim);
+			else {
+				size_t slot = std::uniform_int_distribution<size_t>(0, seen)(rng);
+				if (slot < chunkRows)
+					std::copy(row, row + dim, sample.begin() + slot * dim);
+			}
+		}
+		return true;
+	});
+	nRows = seen;
+	if (!ok || !nRows)
+		return false;
+	if (binaryDataSet) {
+		// the row versions of a pose dataset already hold the hash of the CSV rows
+		FILE* in = fopen(fileName.c_str(), "rb");
+		bool read = in && seekFile(in, header.versionOffset + nRows * sizeof(uint64_t)) && fread(&datasetVersion, sizeof(uint64_t), 1, in) == 1;
+		if (in)
+			fclose(in);
+		if (!read)
+			return false;
+	}
+
+	// k-means++ on the sample: every next centroid is picked with a probability proportional to its squared distance
+	// to the closest centroid picked so far
+	size_t nSample = sample.size() / dim;
+	std::uniform_int_distribution<size_t> pick(0, nSample - 1);
+	std::vector<double> closest(nSample, std::numeric_limits<double>::max());
+	centroids.resize(k * dim);
+	size_t chosen = pick(rng);
+	for (int i = 0; i < k; i++) {
+		std::copy(sample.begin() + chosen * dim, sample.begin() + (chosen + 1) * dim, centroids.begin() + i * dim);
+		double total = 0;
+		for (size_t j = 0; j < nSample; j++) {
+			closest[j] = std::min(closest[j], squaredDistance(sample.data() + j * dim, centroids.data() + i * dim, dim));
+			total += closest[j];
+		}
+		// every sampled row is already a centroid, so fall back to a uniform pick
+		chosen = pick(rng);
+		if (total > 0) {
+			double r = std::uniform_real_distribution<double>(0, total)(rng);
+			for (size_t j = 0; j < nSample; j++) {
+				if (closest[j] <= 0)
+					continue;
+				chosen = j;
+				if (r < closest[j])
+					break;
+				r -= closest[j];
+			}
+		}
+	}
+	return true;
+}
+
+// assignChunk
+// precondition: the centroids are picked, ids holds the clusters of the rows of the last pass (or -1)
+// postcondition: assign every row of chunk to its closest centroid and store it in ids. Add the coordinates of every row to
+//				  sums and counts of its cluster, its squared distance to inertiaSum, and count the rows whose cluster changed
+void OutOfCoreKMeans::assignChunk(const Chunk& chunk, std::vector<int32_t>& ids, std::vector<double>& sums, std::vector<int64_t>& counts,
+	double& inertiaSum, size_t& changed) {
+	// the chunk is split into parts that only depend on the chunk size, and the partial sums are merged in order,
+	// so the result does not depend on the number of threads
+	const size_t partRows = std::max((size_t)1024, (chunkRows + 63) / 64);
+	const size_t nParts = (chunk.nRows + partRows - 1) / partRows;
+	std::vector<double> partSums(nParts * k * dim, 0.0);
+	std::vector<int64_t> partCounts(nParts * k, 0);
+	std::vector<double> partInertia(nParts, 0.0);
+	std::vector<size_t> partChanged(nParts, 0);
+	parallelFor(nParts, config.nThreads > 0 ? config.nThreads : defaultThreadCount(), [&](size_t p) {
+		double* sum = partSums.data() + p * k * dim;
+		int64_t* count = partCounts.data() + p * k;
+		size_t end = std::min(chunk.nRows, (p + 1) * partRows);
+		for (size_t r = p * partRows; r < end; r++) {
+			const double* row = chunk.coords.data() + r * dim;
+			double minDistance;
+			int clusterId = nearestCentroid(row, centroids.data(), k, dim, minDistance);
+			if (ids[r] != clusterId)
+				partChanged[p]++;
+			ids[r] = clusterId;
+			partInertia[p] += minDistance;
+			count[clusterId]++;
+			double* clusterSum = sum + clusterId * dim;
+			for (size_t d = 0; d < dim; d++)
+				clusterSum[d] += row[d];
+		}
+	});
+	for (size_t p = 0; p < nParts; p++) {
+		for (size_t i = 0; i < k * dim; i++)
+			sums[i] += partSums[p * k * dim + i];
+		for (int c = 0; c < k; c++)
+			counts[c] += partCounts[p * k + c];
+		inertiaSum += partInertia[p];
+		changed += partChanged[p];
+	}
+}
@@ -0,0 +1,176 @@
+// OutOfCoreKMeans.h
+// author: Cheuk-Hang Tse
+// This file contains the declaration of the OutOfCoreKMeans class.
+// An OutOfCoreKMeans trains the k mean clustering of a dataset that does not fit in memory. Every pass streams the dataset
+// (CSV or pose dataset) from the disk in chunks of a fixed number of rows, and only the centroids, the running sums and counts
+// and a few chunk buffers stay in memory. A reader thread fills the next chunk while the current one is assigned on every core,
+// so the disk and the processors work at the same time. The cluster of every row is written to an assignment file
+// (one int32 per row) during every pass.
+// The initial centroids are picked with k-means++ from a uniform sample of the rows (reservoir sampling) taken in a first pass.
+// The result can be saved as a KMeanCluster snapshot, so KMeanCluster loads it instead of training
+//
+// CONSTRUCTOR:
+// OutOfCoreKMeans(const string _fileName, const int _k, const OutOfCoreConfig& _config): define a training of _k clusters
+//		over the dataset _fileName with the memory budget and stopping rules in _config
+//
+// FUNCTIONS:
+// train: stream the dataset until the clustering converges and write the assignment file
+// saveSnapshot: save the centroids and the assignment file as a KMeanCluster snapshot
+// getCentroids: return the trained centroids
+// getRows: return the number of rows that were clustered
+// getDim: return the number of coordinates of a row
+// getChunkRows: return the number of rows in a chunk
+// getIterations: return the number of assignment passes
+// getInertia: return the sum of squared distances from every row to its centroid in the last pass
+// getTrainSeconds: return the number of seconds the training took
+// getWaitSeconds: return the number of seconds the assignment waited for the reader thread
+// openDataset: read the dimension, the number of rows and the format of the dataset
+// readRows: read the next chunk of rows from the dataset
+// streamPass: read every chunk on a reader thread and hand it to a function as soon as it is read
+// sampleSeeds: pick the initial centroids with k-means++ from a uniform sample of the rows
+// assignChunk: assign every row of a chunk to its closest centroid and add it to the sums of its cluster
+
+#pragma once
+#include "BoundedQueue.h"
+#include "DistanceKernel.h"
+#include "Hash.h"
+#include "Parallel.h"
+#include "PoseDataset.h"
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <functional>
+#include <string>
+#include <vector>
+
+// OutOfCoreConfig
+// The memory budget and the stopping rules of an out-of-core training
+// The training stops after maxIterations passes, or earlier when no row changes its cluster or no centroid moves more than tolerance
+struct OutOfCoreConfig {
+	size_t memoryBudget = 64 << 20; // bytes for the chunk buffers and the seeding sample, the rest of the training uses O(k x dim)
+	int maxIterations = 100; // maximum number of assignment passes over the dataset
+	double tolerance = 0; // stop when no centroid moves more than this distance
+	unsigned int seed = 0; // seed for the sample and the initial centroids, 0 uses the current time
+	int nThreads = 0; // number of threads a chunk is assigned on, 0 uses every hardware thread
+	std::string assignmentFile; // file the cluster of every row is written to, empty uses <dataset>.clusters
+};
+
+class OutOfCoreKMeans {
+public:
+	// OutOfCoreKMeans
+	// precondition: _k is positive
+	// postcondition: define a training of _k clusters over the dataset _fileName with the memory budget and stopping rules in _config
+	OutOfCoreKMeans(const std::string _fileName, const int _k, const OutOfCoreConfig& _config);
+
+	// train
+	// precondition: none
+	// postcondition: stream the dataset once to sample the initial centroids, then once per iteration to assign every row to its
+	//				  closest centroid and recompute the centroids, until no row changes its cluster, no centroid moves more than
+	//				  tolerance, or maxIterations passes ran. The cluster of every row is in the assignment file afterwards
+	//				  Rows with a different number of coordinates than the first row are skipped, like KMeanCluster does
+	//				  Return false if the dataset is empty or could not be read, or the assignment file could not be written
+	bool train();
+
+	// saveSnapshot
+	// precondition: train returned true
+	// postcondition: write the centroids and the cluster of every row to _fileName in the KMeanCluster snapshot format, so a
+	//				  KMeanCluster of the same dataset and k loads it instead of training. Return false if it could not be written
+	bool saveSnapshot(const std::string _fileName) const;
+
+	// getCentroids
+	// precondition: none
+	// postcondition: return the k x dim centroids, row-major
+	const std::vector<double>& getCentroids() const { return centroids; }
+
+	// getRows
+	// precondition: none
+	// postcondition: return the number of rows that were clustered
+	size_t getRows() const { return nRows; }
+
+	// getDim
+	// precondition: none
+	// postcondition: return the number of coordinates of a row
+	size_t getDim() const { return dim; }
+
+	// getChunkRows
+	// precondition: none
+	// postcondition: return the number of rows in a chunk, chosen from the memory budget
+	size_t getChunkRows() const { return chunkRows; }
+
+	// getIterations
+	// precondition: none
+	// postcondition: return the number of assignment passes the last training ran
+	int getIterations() const { return iterations; }
+
+	// getInertia
+	// precondition: none
+	// postcondition: return the sum of squared distances from every row to the centroid it was assigned to in the last pass
+	double getInertia() const { return inertia; }
+
+	// getTrainSeconds
+	// precondition: none
+	// postcondition: return the number of seconds the last training took
+	double getTrainSeconds() const { return trainSeconds; }
+
+	// getWaitSeconds
+	// precondition: none
+	// postcondition: return the number of seconds the assignment waited for the reader thread, near 0 if the reading is hidden
+	double getWaitSeconds() const { return waitSeconds; }
+
+private:
+	// Chunk
+	// Up to chunkRows consecutive rows of the dataset
+	struct Chunk {
+		std::vector<double> coords; // chunkRows x dim coordinates, the first nRows are used
+		size_t firstRow = 0; // index of the first row in the dataset
+		size_t nRows = 0; // number of rows in the chunk
+	};
+
+	// openDataset
+	// precondition: none
+	// postcondition: find out whether the dataset is a pose dataset and read its dimension (and number of rows for a pose dataset)
+	//				  Return false if it could not be read
+	bool openDataset();
+
+	// readRows
+	// precondition: the dataset file is open and positioned after the rows read so far
+	// postcondition: read up to chunkRows rows into chunk, hashing the rows in the format of formatDataSetRow
+	//				  into datasetVersion if hashRows
+	//				  Return the number of rows read, 0 at the end of the dataset
+	size_t readRows(std::ifstream& csv, FILE* binary, Chunk& chunk, const bool hashRows);
+
+	// streamPass
+	// precondition: openDataset returned true
+	// postcondition: read the dataset from the start on a reader thread into the chunk buffers and call process for every chunk
+	//				  in order while the next one is read. Stop early if process returns false
+	//				  Return false if the dataset could not be opened or process failed
+	bool streamPass(const bool hashRows, const std::function<bool(const Chunk&)>& process);
+
+	// sampleSeeds
+	// precondition: openDataset returned true
+	// postcondition: stream the dataset once to count the rows and keep a uniform sample of at most chunkRows rows, then pick
+	//				  k centroids from the sample with k-means++. Return false if the dataset has no rows
+	bool sampleSeeds();
+
+	// assignChunk
+	// precondition: the centroids are picked, ids holds the clusters of the rows of the last pass (or -1)
+	// postcondition: assign every row of chunk to its closest centroid and store it in ids. Add the coordinates of every row to
+	//				  sums and counts of its cluster, its squared distance to inertiaSum, and count the rows whose cluster changed
+	void assignChunk(const Chunk& chunk, std::vector<int32_t>& ids, std::vector<double>& sums, std::vector<int64_t>& counts,
+		double& inertiaSum, size_t& changed);
+
+	std::string fileName; // dataset file name
+	int k; // number of clusters
+	OutOfCoreConfig config; // memory budget and stopping rules
+	bool binaryDataSet = false; // true if the dataset is a pose dataset
+	PoseDatasetHeader header; // header of a pose dataset
+	size_t dim = 0; // number of coordinates of a row
+	size_t nRows = 0; // number of rows, known after the first pass
+	size_t chunkRows = 0; // rows per chunk
+	uint64_t datasetVersion = FNV1A64_OFFSET; // hash of every row, the same one KMeanCluster keeps in its snapshot
+	std::vector<double> centroids; // k rows of dim coordinates
+	int iterations = 0; // assignment passes of the last training
+	double inertia = 0; // sum of squared distances in the last pass
+	double trainSeconds = 0; // duration of the last training
+	double waitSeconds = 0; // time the assignment waited for chunks
+};
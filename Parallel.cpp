@@ -0,0 +1,46 @@
+// Parallel.cpp
+// author: Cheuk-Hang Tse
+// This file has 2 functions: parallelFor and defaultThreadCount
+// parallelFor: run a piece of work for every index of a range on several threads
+// defaultThreadCount: return the number of threads to use when the user does not choose one
+
+#include "Parallel.h"
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <vector>
+
+// parallelFor
+// precondition: none
+// postcondition: call work(i) exactly once for every i in [0, n) using at most nThreads threads, including the calling thread
+//				  The indices are handed out in increasing order. Return after every call is done
+void parallelFor(const size_t n, const int nThreads, const std::function<void(size_t)>& work) {
+	size_t nWorkers = std::min((size_t)std::max(nThreads, 1), n);
+	if (nWorkers <= 1) {
+		for (size_t i = 0; i < n; i++)
+			work(i);
+		return;
+	}
+
+	std::atomic<size_t> next(0);
+	auto worker = [&] {
+		size_t i;
+		while ((i = next++) < n)
+			work(i);
+	};
+
+	std::vector<std::thread> threads;
+	for (size_t t = 1; t < nWorkers; t++)
+		threads.emplace_back(worker);
+	worker();
+	for (auto& thread : threads)
+		thread.join();
+}
+
+// defaultThreadCount
+// precondition: none
+// postcondition: return the number of hardware threads, or 1 if it is unknown
+int defaultThreadCount() {
+	unsigned int n = std::thread::hardware_concurrency();
+	return n ? (int)n : 1;
+}
@@ -0,0 +1,20 @@
+// Parallel.h
+// author: Cheuk-Hang Tse
+// This file has 2 functions: parallelFor and defaultThreadCount
+// parallelFor: run a piece of work for every index of a range on several threads
+// defaultThreadCount: return the number of threads to use when the user does not choose one
+
+#pragma once
+#include <cstddef>
+#include <functional>
+
+// parallelFor
+// precondition: none
+// postcondition: call work(i) exactly once for every i in [0, n) using at most nThreads threads, including the calling thread
+//				  The indices are handed out in increasing order. Return after every call is done
+void parallelFor(const size_t n, const int nThreads, const std::function<void(size_t)>& work);
+
+// defaultThreadCount
+// precondition: none
+// postcondition: return the number of hardware threads, or 1 if it is unknown
+int defaultThreadCount();
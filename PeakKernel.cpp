@@ -0,0 +1,216 @@
+// PeakKernel.cpp
+// author: Cheuk-Hang Tse
+// This file has 5 functions: findMaxIndex, refinePeak, findPeaks, findLocalPeaks, and peakKernelName
+// findMaxIndex: return the index of the largest value of an array
+// refinePeak: move a heatmap peak to the top of the parabola through its neighbours
+// findPeaks: find the peak of many heatmaps on several threads
+// findLocalPeaks: find every local maximum of a heatmap, one per person in the image
+// peakKernelName: return the name of the instruction set the argmax runs with
+// The vectorized argmax is selected when the program starts: AVX-512 if the processor supports it, else AVX2, else scalar
+// The AVX2 and AVX-512 versions are compiled with the target attributes of CpuDispatch.h, like the distance kernels
+
+#include "PeakKernel.h"
+#include "CpuDispatch.h"
+#include "Parallel.h"
+#include <algorithm>
+#include <cmath>
+
+static const InstructionSet peakKernel = supportedInstructionSet(); // instruction set the argmax runs with
+
+// firstIndexOf
+// precondition: values points to n floats, one of them is best, the values before position i are not best
+// postcondition: return the first position from i on that holds best
+static inline size_t firstIndexOf(const float* values, const size_t n, size_t i, const float best) {
+	for (; i < n; i++) {
+		if (values[i] == best)
+			return i;
+	}
+	return 0;
+}
+
+// scalarMaxIndex
+// precondition: values points to n floats, n is positive
+// postcondition: the same as findMaxIndex, without vector instructions
+static size_t scalarMaxIndex(const float* values, const size_t n, float& maxValue) {
+	// four independent maxima, so the loop does not wait for the previous comparison
+	size_t i = 0;
+	float best = values[0], best1 = best, best2 = best, best3 = best;
+	for (; i + 4 <= n; i += 4) {
+		best = std::max(best, values[i]);
+		best1 = std::max(best1, values[i + 1]);
+		best2 = std::max(best2, values[i + 2]);
+		best3 = std::max(best3, values[i + 3]);
+	}
+	best = std::max(std::max(best, best1), std::max(best2, best3));
+	for (; i < n; i++)
+		best = std::max(best, values[i]);
+	maxValue = best;
+	return firstIndexOf(values, n, 0, best);
+}
+
+#ifdef CPU_X86
+// avx2MaxIndex
+// precondition: values points to n floats, n is positive, the processor supports AVX2
+// postcondition: the same as findMaxIndex, 8 values at a time
+CPU_TARGET_AVX2 static size_t avx2MaxIndex(const float* values, const size_t n, float& maxValue) {
+	// first pass: the largest value
+	size_t i = 0;
+	float best = values[0];
+	if (n >= 8) {
+		__m256 acc = _mm256_loadu_ps(values);
+		for (i = 8; i + 8 <= n; i += 8)
+			acc = _mm256_max_ps(acc, _mm256_loadu_ps(values + i));
+		__m128 half = _mm_max_ps(_mm256_castps256_ps128(acc), _mm256_extractf128_ps(acc, 1));
+		half = _mm_max_ps(half, _mm_movehl_ps(half, half));
+		half = _mm_max_ss(half, _mm_shuffle_ps(half, half, 1));
+		best = _mm_cvtss_f32(half);
+	}
+	for (; i < n; i++)
+		best = std::max(best, values[i]);
+	maxValue = best;
+
+	// second pass: the block that holds the first position of the largest value, the scalar loop finds it inside the block
+	__m256 target = _mm256_set1_ps(best);
+	for (i = 0; i + 8 <= n; i += 8) {
+		if (_mm256_movemask_ps(_mm256_cmp_ps(_mm256_loadu_ps(values + i), target, _CMP_EQ_OQ)))
+			break;
+	}
+	return firstIndexOf(values, n, i, best);
+}
+
+// avx512MaxIndex
+// precondition: values points to n floats, n is positive, the processor supports AVX-512
+// postcondition: the same as findMaxIndex, 16 values at a time
+CPU_TARGET_AVX512 static size_t avx512MaxIndex(const float* values, const size_t n, float& maxValue) {
+	// first pass: the largest value
+	size_t i = 0;
+	float best = values[0];
+	if (n >= 16) {
+		__m512 acc = _mm512_loadu_ps(values);
+		for (i = 16; i + 16 <= n; i += 16)
+			acc = _mm512_maskz_max_ps(0xffff, acc, _mm512_loadu_ps(values + i));
+		// the zero-masked maximum and the reduction by hand instead of _mm512_max_ps and _mm512_reduce_max_ps,
+		// which GCC 12 reports as reading an uninitialized vector
+		__m512d lanes = _mm512_castps_pd(acc);
+		__m256 quarter = _mm256_max_ps(_mm256_castpd_ps(_mm512_maskz_extractf64x4_pd(0xff, lanes, 0)),
+			_mm256_castpd_ps(_mm512_maskz_extractf64x4_pd(0xff, lanes, 1)));
+		__m128 half = _mm_max_ps(_mm256_castps256_ps128(quarter), _mm256_extractf128_ps(quarter, 1));
+		half = _mm_max_ps(half, _mm_movehl_ps(half, half));
+		half = _mm_max_ss(half, _mm_shuffle_ps(half, half, 1));
+		best = _mm_cvtss_f32(half);
+	}
+	for (; i < n; i++)
+		best = std::max(best, values[i]);
+	maxValue = best;
+
+	// second pass: the block that holds the first position of the largest value, the scalar loop finds it inside the block
+	__m512 target = _mm512_set1_ps(best);
+	for (i = 0; i + 16 <= n; i += 16) {
+		if (_mm512_cmpeq_ps_mask(_mm512_loadu_ps(values + i), target))
+			break;
+	}
+	return firstIndexOf(values, n, i, best);
+}
+#endif
+
+// findMaxIndex
+// precondition: values points to n floats, n is positive
+// postcondition: return the index of the largest value (the lowest index on a tie, like minMaxLoc) and store the value in maxValue
+size_t findMaxIndex(const float* values, const size_t n, float& maxValue) {
+#ifdef CPU_X86
+	if (peakKernel == INSTRUCTIONS_AVX512)
+		return avx512MaxIndex(values, n, maxValue);
+	if (peakKernel == INSTRUCTIONS_AVX2)
+		return avx2MaxIndex(values, n, maxValue);
+#endif
+	return scalarMaxIndex(values, n, maxValue);
+}
+
+// refinePeak
+// precondition: map points to a height x width heatmap, (x, y) is a cell of the map
+// postcondition: fit a parabola through the peak and its left and right (top and bottom) neighbours and store the column (row)
+//				  of its top in peakX (peakY). The shift is at most half a cell. A peak on the border or on a flat area is not moved
+void refinePeak(const float* map, const int height, const int width, const int x, const int y, float& peakX, float& peakY) {
+	// the top of the parabola through (-1, a), (0, b), (1, c) is at (a - c) / (2 (a - 2b + c))
+	auto shift = [](const float a, const float b, const float c) {
+		float curvature = a - 2 * b + c;
+		if (curvature >= 0)
+			return 0.0f;
+		return std::min(0.5f, std::max(-0.5f, 0.5f * (a - c) / curvature));
+	};
+	const float* row = map + (size_t)y * width;
+	peakX = (float)x;
+	peakY = (float)y;
+	if (x > 0 && x + 1 < width)
+		peakX += shift(row[x - 1], row[x], row[x + 1]);
+	if (y > 0 && y + 1 < height)
+		peakY += shift(row[x - width], row[x], row[x + width]);
+}
+
+// findPeaks
+// precondition: maps holds nMaps pointers to height x width heatmaps, peaks has room for nMaps peaks
+// postcondition: store the peak of every heatmap in peaks, refined with refinePeak if subPixel is true
+//				  The heatmaps are split over at most nThreads threads, including the calling thread
+void findPeaks(const float* const* maps, const size_t nMaps, const int height, const int width, const bool subPixel, const int nThreads, HeatmapPeak* peaks) {
+	size_t cells = (size_t)height * width;
+	parallelFor(nMaps, nThreads, [&](size_t m) {
+		HeatmapPeak& peak = peaks[m];
+		size_t index = findMaxIndex(maps[m], cells, peak.value);
+		int x = (int)(index % width);
+		int y = (int)(index / width);
+		if (subPixel)
+			refinePeak(maps[m], height, width, x, y, peak.x, peak.y);
+		else {
+			peak.x = (float)x;
+			peak.y = (float)y;
+		}
+	});
+}
+
+// findLocalPeaks
+// precondition: map points to a height x width heatmap
+// postcondition: append every cell above thresh that is larger than its 8 neighbours to peaks, refined with refinePeak if subPixel is true
+//				  A cell equal to a neighbour is only a peak if the neighbour comes later in row order, so a flat top gives one peak
+//				  Return the number of peaks appended
+size_t findLocalPeaks(const float* map, const int height, const int width, const float thresh, const bool subPixel, std::vector<HeatmapPeak>& peaks) {
+	size_t before = peaks.size();
+	for (int y = 0; y < height; y++) {
+		const float* row = map + (size_t)y * width;
+		for (int x = 0; x < width; x++) {
+			float value = row[x];
+			// most cells are background, so the threshold is checked before the neighbours
+			if (value <= thresh)
+				continue;
+			bool peak = true;
+			for (int dy = -1; dy <= 1 && peak; dy++) {
+				for (int dx = -1; dx <= 1 && peak; dx++) {
+					int nx = x + dx, ny = y + dy;
+					if ((!dx && !dy) || nx < 0 || ny < 0 || nx >= width || ny >= height)
+						continue;
+					float neighbour = map[(size_t)ny * width + nx];
+					bool earlier = dy < 0 || (dy == 0 && dx < 0);
+					peak = earlier ? value > neighbour : value >= neighbour;
+				}
+			}
+			if (!peak)
+				continue;
+			HeatmapPeak found;
+			found.value = value;
+			if (subPixel)
+				refinePeak(map, height, width, x, y, found.x, found.y);
+			else {
+				found.x = (float)x;
+				found.y = (float)y;
+			}
+			peaks.push_back(found);
+		}
+	}
+	return peaks.size() - before;
+}
+
+// peakKernelName
+// precondition: none
+// postcondition: return "avx512", "avx2" or "scalar"
+const char* peakKernelName() {
+	return instructionSetName(peakKernel);
+}
@@ -0,0 +1,52 @@
+// PeakKernel.h
+// author: Cheuk-Hang Tse
+// This file has 5 functions: findMaxIndex, refinePeak, findPeaks, findLocalPeaks, and peakKernelName
+// These functions find the body part locations in the heatmaps of the pose network
+// findMaxIndex: return the index of the largest value of an array
+// refinePeak: move a heatmap peak to the top of the parabola through its neighbours
+// findPeaks: find the peak of many heatmaps on several threads
+// findLocalPeaks: find every local maximum of a heatmap, one per person in the image
+// peakKernelName: return the name of the instruction set the argmax runs with
+// The vectorized argmax is selected when the program starts: AVX-512 if the processor supports it, else AVX2, else scalar
+// Every instruction set is compiled into the same binary (see CpuDispatch.h), no -mavx2 or /arch:AVX2 build flag is needed
+
+#pragma once
+#include <cstddef>
+#include <vector>
+
+// HeatmapPeak
+// The largest value of a heatmap and its location in heatmap cells
+struct HeatmapPeak {
+	float x = 0; // column of the peak, with a fraction if it was refined
+	float y = 0; // row of the peak, with a fraction if it was refined
+	float value = 0; // value of the heatmap at the peak cell
+};
+
+// findMaxIndex
+// precondition: values points to n floats, n is positive
+// postcondition: return the index of the largest value (the lowest index on a tie, like minMaxLoc) and store the value in maxValue
+size_t findMaxIndex(const float* values, const size_t n, float& maxValue);
+
+// refinePeak
+// precondition: map points to a height x width heatmap, (x, y) is a cell of the map
+// postcondition: fit a parabola through the peak and its left and right (top and bottom) neighbours and store the column (row)
+//				  of its top in peakX (peakY). The shift is at most half a cell. A peak on the border or on a flat area is not moved
+void refinePeak(const float* map, const int height, const int width, const int x, const int y, float& peakX, float& peakY);
+
+// findPeaks
+// precondition: maps holds nMaps pointers to height x width heatmaps, peaks has room for nMaps peaks
+// postcondition: store the peak of every heatmap in peaks, refined with refinePeak if subPixel is true
+//				  The heatmaps are split over at most nThreads threads, including the calling thread
+void findPeaks(const float* const* maps, const size_t nMaps, const int height, const int width, const bool subPixel, const int nThreads, HeatmapPeak* peaks);
+
+// findLocalPeaks
+// precondition: map points to a height x width heatmap
+// postcondition: append every cell above thresh that is larger than its 8 neighbours to peaks, refined with refinePeak if subPixel is true
+//				  A cell equal to a neighbour is only a peak if the neighbour comes later in row order, so a flat top gives one peak
+//				  Return the number of peaks appended
+size_t findLocalPeaks(const float* map, const int height, const int width, const float thresh, const bool subPixel, std::vector<HeatmapPeak>& peaks);
+
+// peakKernelName
+// precondition: none
+// postcondition: return "avx512", "avx2" or "scalar"
+const char* peakKernelName();
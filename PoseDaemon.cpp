@@ -0,0 +1,376 @@
+// PoseDaemon.cpp
+// author: Cheuk-Hang Tse
+// This file contains the implementation of the PoseDaemon class.
+// A PoseDaemon keeps the pose network and a trained KMeanCluster in memory and answers queries over a Unix domain socket.
+// Unix domain sockets are only used on Linux and macOS, on Windows run and sendCommand fail
+//
+// CONSTRUCTOR:
+// PoseDaemon(const string _device, const DaemonConfig& _config, const int _inWidth, const int _inHeight, const float _thresh,
+//			  KMeanCluster& _kCluster, KeypointCache* _cache): define a daemon that serves the model kCluster
+//
+// FUNCTIONS:
+// run: listen on the socket and answer queries until the daemon is stopped
+// requestStop: stop every running daemon, safe to call from a signal handler
+// sendCommand: send one command to a daemon and return its reply
+// formatStats: return the query count and latency percentiles of every command
+// serveConnection: answer every command of one connection
+// handleCommand: answer one command
+// estimate: find the body part locations of an image file
+// recordLatency: add the time a command took to its latency window
+
+#include "PoseDaemon.h"
+#include "BoundedQueue.h"
+#include "Metrics.h"
+#include <cmath>
+#include <cstring>
+#include <set>
+#include <sstream>
+#ifndef _WIN32
+#include <csignal>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+
+std::atomic<bool> PoseDaemon::stopRequested(false);
+
+// PoseDaemon
+// precondition: _device is "cpu" or "gpu", _config.workers and _config.latencyWindow are positive, _kCluster is trained,
+//				 _kCluster and _cache (nullptr if not used) outlive the daemon
+// postcondition: define a daemon that serves the model _kCluster
+PoseDaemon::PoseDaemon(const string _device, const DaemonConfig& _config, const int _inWidth, const int _inHeight, const float _thresh,
+	KMeanCluster& _kCluster, KeypointCache* _cache) : kCluster(_kCluster) {
+	device = _device;
+	config = _config;
+	inWidth = _inWidth;
+	inHeight = _inHeight;
+	thresh = _thresh;
+	cache = _cache;
+}
+
+#ifdef _WIN32
+// run
+// precondition: none
+// postcondition: Unix domain sockets are not used on Windows, so return false
+bool PoseDaemon::run() {
+	cerr << "The daemon is not supported on Windows" << endl;
+	return false;
+}
+
+// sendCommand
+// precondition: none
+// postcondition: Unix domain sockets are not used on Windows, so return false
+bool PoseDaemon::sendCommand(const string socketPath, const string command, string& reply) {
+	return false;
+}
+
+// serveConnection
+// precondition: none
+// postcondition: not used on Windows
+void PoseDaemon::serveConnection(const int fd, Net& netModel, const bool netLoaded) {
+}
+#else
+// run
+// precondition: none
+// postcondition: listen on the socket and answer queries until SHUTDOWN is received or requestStop is called
+//				  The socket file is removed at the end. Return false if the socket could not be created
+bool PoseDaemon::run() {
+	sockaddr_un address;
+	memset(&address, 0, sizeof(address));
+	address.sun_family = AF_UNIX;
+	if (config.socketPath.size() >= sizeof(address.sun_path)) {
+		cerr << "Socket path is too long: " << config.socketPath << endl;
+		return false;
+	}
+	strncpy(address.sun_path, config.socketPath.c_str(), sizeof(address.sun_path) - 1);
+
+	int listenFd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (listenFd < 0)
+		return false;
+	// a socket file left behind by a daemon that did not stop cleanly would make bind fail
+	unlink(config.socketPath.c_str());
+	if (bind(listenFd, (sockaddr*)&address, sizeof(address)) != 0 || listen(listenFd, 64) != 0) {
+		cerr << "Could not listen on " << config.socketPath << ": " << strerror(errno) << endl;
+		close(listenFd);
+		return false;
+	}
+	// only the user who started the daemon can query it
+	chmod(config.socketPath.c_str(), S_IRUSR | S_IWUSR);
+	// a client that disconnects before its reply is written must not kill the daemon
+	signal(SIGPIPE, SIG_IGN);
+
+	// Worker threads: every worker loads its own network, because a Net cannot be shared between threads
+	BoundedQueue<int> connections(config.workers * 4);
+	vector<std::thread> workers;
+	for (int w = 0; w < config.workers; w++) {
+		workers.emplace_back([this, &connections] {
+			Net netModel;
+			bool netLoaded = false;
+			try {
+				netModel = loadPoseNetwork(device);
+				netLoaded = true;
+			}
+			catch (const exception& e) {
+				cerr << e.what() << endl;
+			}
+			int fd;
+			while (connections.pop(fd))
+				serveConnection(fd, netModel, netLoaded);
+		});
+	}
+
+	// Accept loop: wake up regularly to notice a stop request
+	cout << "Listening on " << config.socketPath << endl;
+	while (!stopping && !stopRequested) {
+		pollfd pending = { listenFd, POLLIN, 0 };
+		if (poll(&pending, 1, 200) <= 0)
+			continue;
+		int fd = accept(listenFd, nullptr, nullptr);
+		if (fd >= 0 && !connections.push(fd))
+			close(fd);
+	}
+	connections.close();
+	for (auto& worker : workers)
+		worker.join();
+	// connections that were accepted but not served yet
+	int fd;
+	while (connections.tryPop(fd))
+		close(fd);
+	close(listenFd);
+	unlink(config.socketPath.c_str());
+	return true;
+}
+
+// sendCommand
+// precondition: none
+// postcondition: connect to the daemon at socketPath, send command and store the reply line in reply
+//				  Return false if the daemon could not be reached
+bool PoseDaemon::sendCommand(const string socketPath, const string command, string& reply) {
+	sockaddr_un address;
+	memset(&address, 0, sizeof(address));
+	address.sun_family = AF_UNIX;
+	if (socketPath.size() >= sizeof(address.sun_path))
+		return false;
+	strncpy(address.sun_path, socketPath.c_str(), sizeof(address.sun_path) - 1);
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0)
+		return false;
+	if (connect(fd, (sockaddr*)&address, sizeof(address)) != 0) {
+		close(fd);
+		return false;
+	}
+
+	string line = command + "\n";
+	size_t sent = 0;
+	while (sent < line.size()) {
+		ssize_t n = send(fd, line.data() + sent, line.size() - sent, 0);
+		if (n <= 0) {
+			close(fd);
+			return false;
+		}
+		sent += (size_t)n;
+	}
+	reply.clear();
+	char buffer[4096];
+	ssize_t n;
+	while ((n = recv(fd, buffer, sizeof(buffer), 0)) > 0) {
+		reply.append(buffer, (size_t)n);
+		size_t end = reply.find('\n');
+		if (end != string::npos) {
+			reply.resize(end);
+			close(fd);
+			return true;
+		}
+	}
+	close(fd);
+	return false;
+}
+
+// serveConnection
+// precondition: fd is a connected socket
+// postcondition: answer every command received on fd until the client closes it, the daemon stops, the client sends
+//				  nothing for idleSeconds or a line longer than maxLineBytes, then close fd
+void PoseDaemon::serveConnection(const int fd, Net& netModel, const bool netLoaded) {
+	const int pollMilliseconds = 200;
+	string received;
+	char buffer[4096];
+	int idleMilliseconds = 0;
+	while (!stopping && !stopRequested) {
+		// wait for a command, but wake up regularly to notice a stop request
+		pollfd pending = { fd, POLLIN, 0 };
+		int ready = poll(&pending, 1, pollMilliseconds);
+		if (ready < 0)
+			break;
+		if (ready == 0) {
+			// an idle client would hold this worker and keep every other client waiting
+			idleMilliseconds += pollMilliseconds;
+			if (config.idleSeconds > 0 && idleMilliseconds >= config.idleSeconds * 1000)
+				break;
+			continue;
+		}
+		idleMilliseconds = 0;
+		ssize_t n = recv(fd, buffer, sizeof(buffer), 0);
+		if (n <= 0)
+			break;
+		received.append(buffer, (size_t)n);
+
+		size_t end;
+		bool open = true;
+		bool tooLong = false;
+		while (open) {
+			string reply;
+			end = received.find('\n');
+			if (end == string::npos ? received.size() > config.maxLineBytes : end > config.maxLineBytes) {
+				// a client that never ends its line would make received grow without bound, so it is closed after the reply
+				reply = "ERR command longer than " + std::to_string(config.maxLineBytes) + " bytes\n";
+				received.clear();
+				tooLong = true;
+			}
+			else if (end == string::npos)
+				break;
+			else {
+				string line = received.substr(0, end);
+				received.erase(0, end + 1);
+				if (!line.empty() && line.back() == '\r')
+					line.pop_back();
+				reply = handleCommand(line, netModel, netLoaded) + "\n";
+			}
+			size_t sent = 0;
+			while (open && sent < reply.size()) {
+				ssize_t written = send(fd, reply.data() + sent, reply.size() - sent, 0);
+				if (written <= 0)
+					open = false;
+				else
+					sent += (size_t)written;
+			}
+			if (tooLong)
+				open = false;
+		}
+		if (!open)
+			break;
+	}
+	close(fd);
+}
+#endif
+
+// handleCommand
+// precondition: none
+// postcondition: return the reply to one command line without its newline
+string PoseDaemon::handleCommand(const string& line, Net& netModel, const bool netLoaded) {
+	double start = (double)cv::getTickCount();
+	std::stringstream in(line);
+	string command;
+	in >> command;
+	std::stringstream reply;
+	try {
+		if (command == "STATS")
+			reply << "OK " << formatStats();
+		else if (command == "METRICS")
+			reply << "OK " << MetricsRegistry::instance().toJson();
+		else if (command == "SHUTDOWN") {
+			stopping = true;
+			reply << "OK";
+		}
+		else if (command == "POSE" || command == "RELATED" || command == "NEAREST" || command == "INSERT") {
+			size_t n = 0;
+			if (command == "NEAREST" && !(in >> n))
+				throw std::runtime_error("NEAREST needs a count");
+			// the rest of the line is the file name, which can contain spaces
+			string imageFile;
+			getline(in >> std::ws, imageFile);
+			if (imageFile.empty())
+				throw std::runtime_error(command + " needs an image file");
+
+			vector<Point> points;
+			string error = estimate(imageFile, netModel, netLoaded, points);
+			if (!error.empty())
+				throw std::runtime_error(error);
+			reply << "OK";
+			if (command == "POSE") {
+				for (const auto& point : points)
+					reply << ' ' << point.x << ',' << point.y;
+			}
+			else if (command == "NEAREST") {
+				vector<Neighbor> neighbors = kCluster.nearest(pre_processPoints(points), n);
+				for (size_t i = 0; i < neighbors.size(); i++)
+					reply << (i ? ',' : ' ') << neighbors[i].fileName << ':' << neighbors[i].distance;
+			}
+			else {
+				vector<double> features = pre_processPoints(points);
+				vector<string> files = command == "INSERT" ? kCluster.cluster(features, imageFile) : kCluster.related(features);
+				for (size_t i = 0; i < files.size(); i++)
+					reply << (i ? ',' : ' ') << files[i];
+			}
+		}
+		else
+			throw std::runtime_error("unknown command " + command);
+	}
+	catch (const exception& e) {
+		reply.str("");
+		reply << "ERR " << e.what();
+	}
+	// unknown commands share one window, so a client cannot grow the statistics without bound
+	static const std::set<string> known = { "POSE", "RELATED", "NEAREST", "INSERT", "STATS", "METRICS", "SHUTDOWN" };
+	recordLatency(known.count(command) ? command : "UNKNOWN", ((double)cv::getTickCount() - start) / cv::getTickFrequency());
+	return reply.str();
+}
+
+// estimate
+// precondition: none
+// postcondition: store the body part locations of imageFile in points, from the keypoint cache if it has them
+//				  Return an error message, or an empty string on success
+string PoseDaemon::estimate(const string& imageFile, Net& netModel, const bool netLoaded, vector<Point>& points) {
+	uint64_t contentKey = 0;
+	bool hashed = cache && KeypointCache::hashFile(imageFile, contentKey);
+	if (hashed && cache->lookup(contentKey, points))
+		return "";
+	if (!netLoaded)
+		return "pose network is not available";
+	Size originalSize;
+	Mat frame = decodeImage(imageFile, inWidth, inHeight, config.reducedDecode, originalSize);
+	if (frame.empty())
+		return "could not read the image " + imageFile;
+	points = estimatePose(netModel, frame, inWidth, inHeight, thresh, config.subPixel, originalSize);
+	if (hashed)
+		cache->insert(contentKey, points);
+	return "";
+}
+
+// recordLatency
+// precondition: none
+// postcondition: add the time command took to the latency window of command
+void PoseDaemon::recordLatency(const string& command, const double seconds) {
+	std::lock_guard<std::mutex> lock(statsMtx);
+	LatencyWindow& window = latencies[command];
+	if (window.seconds.size() < config.latencyWindow)
+		window.seconds.push_back(seconds);
+	else {
+		window.seconds[window.next] = seconds;
+		window.next = (window.next + 1) % config.latencyWindow;
+	}
+	window.count++;
+}
+
+// formatStats
+// precondition: none
+// postcondition: return "command count=N p50=X p90=X p99=X max=X" for every command, separated by "; ", in milliseconds
+string PoseDaemon::formatStats() {
+	std::lock_guard<std::mutex> lock(statsMtx);
+	std::stringstream out;
+	for (const auto& entry : latencies) {
+		vector<double> sorted = entry.second.seconds;
+		sort(sorted.begin(), sorted.end());
+		// nearest rank percentile
+		auto percentile = [&sorted](const double p) {
+			size_t rank = (size_t)std::ceil(p * sorted.size());
+			return 1e3 * sorted[rank > 0 ? rank - 1 : 0];
+		};
+		if (out.tellp() > 0)
+			out << "; ";
+		out << entry.first << " count=" << entry.second.count << " p50=" << percentile(0.5) << " p90=" << percentile(0.9)
+			<< " p99=" << percentile(0.99) << " max=" << 1e3 * sorted.back();
+	}
+	return out.str();
+}
@@ -0,0 +1,125 @@
+// PoseDaemon.h
+// author: Cheuk-Hang Tse
+// This file contains the declaration of the PoseDaemon class.
+// A PoseDaemon keeps the pose network and a trained KMeanCluster in memory and answers queries over a Unix domain socket,
+// so a query does not pay for loading the Caffe model and training the clusters again.
+// Every worker thread owns one network and serves one connection at a time. Pose and similarity queries only take the
+// shared lock of the KMeanCluster and run at the same time, inserts take its exclusive lock and run one after the other.
+//
+// Protocol: one command per line, one reply line per command, "OK ..." or "ERR message"
+// POSE file: the body part locations of the image as x,y pairs separated by spaces, -1,-1 if not found
+// RELATED file: the file names in the cluster of the image, separated by commas. The image is not added
+// NEAREST n file: the n closest stored images as name:distance, separated by commas, closest first
+// INSERT file: the same as RELATED, then the image is added to the clusters and the dataset log
+// STATS: the number of queries and the p50, p90, p99 and largest latency in milliseconds of every command
+// METRICS: the stage timers and counters of the process as one line of JSON (see Metrics.h)
+// SHUTDOWN: stop the daemon after the running queries
+//
+// CONSTRUCTOR:
+// PoseDaemon(const string _device, const DaemonConfig& _config, const int _inWidth, const int _inHeight, const float _thresh,
+//			  KMeanCluster& _kCluster, KeypointCache* _cache): define a daemon that serves the model kCluster
+//
+// FUNCTIONS:
+// run: listen on the socket and answer queries until the daemon is stopped
+// requestStop: stop every running daemon, safe to call from a signal handler
+// sendCommand: send one command to a daemon and return its reply
+// formatStats: return the query count and latency percentiles of every command
+// serveConnection: answer every command of one connection
+// handleCommand: answer one command
+// estimate: find the body part locations of an image file
+// recordLatency: add the time a command took to its latency window
+
+#pragma once
+#include "HumanPoseEstimation.h"
+#include "KMeanCluster.h"
+#include "KeypointCache.h"
+#include <atomic>
+#include <map>
+#include <mutex>
+
+// DaemonConfig
+// Where the daemon listens and how many queries it answers at the same time
+struct DaemonConfig {
+	string socketPath = "kmean-pose.sock"; // path of the Unix domain socket
+	int workers = 2; // threads that answer queries, each one owns a loaded Net
+	size_t latencyWindow = 10000; // number of most recent latencies of every command the percentiles are computed from
+	size_t maxLineBytes = 4096; // longest command line a client can send, a longer one is answered with ERR and the connection closed
+	int idleSeconds = 30; // close a connection that sends nothing for this long so it frees its worker, 0 never closes it
+	bool subPixel = false; // refine the body part locations between the heatmap cells
+	bool reducedDecode = false; // decode large JPEG files at a reduced scale
+};
+
+class PoseDaemon {
+public:
+	// PoseDaemon
+	// precondition: _device is "cpu" or "gpu", _config.workers and _config.latencyWindow are positive, _kCluster is trained,
+	//				 _kCluster and _cache (nullptr if not used) outlive the daemon
+	// postcondition: define a daemon that serves the model _kCluster
+	PoseDaemon(const string _device, const DaemonConfig& _config, const int _inWidth, const int _inHeight, const float _thresh,
+		KMeanCluster& _kCluster, KeypointCache* _cache);
+
+	// run
+	// precondition: none
+	// postcondition: listen on the socket and answer queries until SHUTDOWN is received or requestStop is called
+	//				  The socket file is removed at the end. Return false if the socket could not be created
+	bool run();
+
+	// requestStop
+	// precondition: none
+	// postcondition: make every running daemon stop accepting connections and return from run. Safe to call from a signal handler
+	static void requestStop() { stopRequested = true; }
+
+	// sendCommand
+	// precondition: none
+	// postcondition: connect to the daemon at socketPath, send command and store the reply line in reply
+	//				  Return false if the daemon could not be reached
+	static bool sendCommand(const string socketPath, const string command, string& reply);
+
+	// formatStats
+	// precondition: none
+	// postcondition: return "command count=N p50=X p90=X p99=X max=X" for every command, separated by "; ", in milliseconds
+	string formatStats();
+
+private:
+	// LatencyWindow
+	// The most recent latencies of one command, in a ring
+	struct LatencyWindow {
+		vector<double> seconds; // latencies, at most latencyWindow of them
+		size_t next = 0; // position of the next latency once the window is full
+		size_t count = 0; // number of queries since the daemon started
+	};
+
+	// serveConnection
+	// precondition: fd is a connected socket
+	// postcondition: answer every command received on fd until the client closes it, the daemon stops, the client sends
+	//				  nothing for idleSeconds or a line longer than maxLineBytes, then close fd
+	void serveConnection(const int fd, Net& netModel, const bool netLoaded);
+
+	// handleCommand
+	// precondition: none
+	// postcondition: return the reply to one command line without its newline
+	string handleCommand(const string& line, Net& netModel, const bool netLoaded);
+
+	// estimate
+	// precondition: none
+	// postcondition: store the body part locations of imageFile in points, from the keypoint cache if it has them
+	//				  Return an error message, or an empty string on success
+	string estimate(const string& imageFile, Net& netModel, const bool netLoaded, vector<Point>& points);
+
+	// recordLatency
+	// precondition: none
+	// postcondition: add the time command took to the latency window of command
+	void recordLatency(const string& command, const double seconds);
+
+	string device;
+	DaemonConfig config;
+	int inWidth;
+	int inHeight;
+	float thresh;
+	KMeanCluster& kCluster;
+	KeypointCache* cache;
+	std::atomic<bool> stopping{ false }; // true after SHUTDOWN
+	std::map<string, LatencyWindow> latencies; // latency window of every command
+	std::mutex statsMtx; // guards latencies
+	static std::atomic<bool> stopRequested; // set by requestStop
+};
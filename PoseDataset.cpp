@@ -0,0 +1,300 @@
+// PoseDataset.cpp
+// author: Cheuk-Hang Tse
+// This file contains the implementation of the PoseDataset and PoseDatasetWriter classes and 5 functions
+// PoseDataset: a read only, memory mapped pose dataset
+// PoseDatasetWriter: write a pose dataset one row at a time
+// parseDataSetRow: split a CSV dataset row into its file name and coordinates
+// formatDataSetRow: return a point in the CSV dataset format
+// syncFile: wait until the operating system has written a file to the disk
+// convertCsvToPoseDataset: convert a CSV dataset into a pose dataset
+// exportPoseDataset: write a pose dataset back to the CSV format
+
+#include "PoseDataset.h"
+#include "Hash.h"
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#include <io.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// ~PoseDataset
+// precondition: none
+// postcondition: unmap the file
+PoseDataset::~PoseDataset() {
+	close();
+}
+
+// isPoseDataset
+// precondition: none
+// postcondition: return true if the file starts like a pose dataset
+bool PoseDataset::isPoseDataset(const std::string fileName) {
+	std::ifstream in(fileName, std::ios::binary);
+	char magic[8];
+	return in.read(magic, 8) && memcmp(magic, PoseDatasetHeader().magic, 8) == 0;
+}
+
+// open
+// precondition: none
+// postcondition: map the file into memory. Return false if it is missing, too short, or the header does not match its size
+bool PoseDataset::open(const std::string fileName) {
+	close();
+#ifdef _WIN32
+	HANDLE file = CreateFileA(fileName.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+	if (file == INVALID_HANDLE_VALUE)
+		return false;
+	LARGE_INTEGER fileSize;
+	HANDLE mapping = nullptr;
+	if (GetFileSizeEx(file, &fileSize) && fileSize.QuadPart >= (LONGLONG)sizeof(PoseDatasetHeader))
+		mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+	const void* view = mapping ? MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0) : nullptr;
+	if (!view) {
+		if (mapping)
+			CloseHandle(mapping);
+		CloseHandle(file);
+		return false;
+	}
+	fileHandle = file;
+	mappingHandle = mapping;
+	length = (size_t)fileSize.QuadPart;
+#else
+	int fd = ::open(fileName.c_str(), O_RDONLY);
+	if (fd < 0)
+		return false;
+	struct stat info;
+	void* view = MAP_FAILED;
+	if (fstat(fd, &info) == 0 && info.st_size >= (off_t)sizeof(PoseDatasetHeader))
+		view = mmap(nullptr, (size_t)info.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	// the mapping keeps the file alive, so the descriptor is not needed any more
+	::close(fd);
+	if (view == MAP_FAILED)
+		return false;
+	// the training reads the coordinates from the first to the last row
+	madvise(view, (size_t)info.st_size, MADV_SEQUENTIAL);
+	length = (size_t)info.st_size;
+#endif
+	base = (const char*)view;
+
+	// every block must be where the header says and the file must end right after the file names
+	const PoseDatasetHeader* h = (const PoseDatasetHeader*)base;
+	uint64_t nRows = h->nRows;
+	bool valid = memcmp(h->magic, PoseDatasetHeader().magic, 8) == 0 && h->version == 1 && h->dim > 0
+		&& nRows <= length / 8 && h->dim <= length / 8
+		&& h->coordOffset == sizeof(PoseDatasetHeader)
+		&& h->versionOffset == h->coordOffset + nRows * h->dim * sizeof(double)
+		&& h->nameOffset == h->versionOffset + (nRows + 1) * sizeof(uint64_t)
+		&& h->nameOffset + (nRows + 1) * sizeof(uint64_t) + h->nameBytes == length;
+	if (valid) {
+		const uint64_t* offsets = (const uint64_t*)(base + h->nameOffset);
+		valid = offsets[0] == 0 && offsets[nRows] == h->nameBytes;
+		for (uint64_t i = 0; valid && i < nRows; i++)
+			valid = offsets[i] <= offsets[i + 1];
+	}
+	if (!valid) {
+		close();
+		return false;
+	}
+	header = h;
+	return true;
+}
+
+// close
+// precondition: none
+// postcondition: unmap the file, the pointers returned before are no longer valid
+void PoseDataset::close() {
+	if (base) {
+#ifdef _WIN32
+		UnmapViewOfFile(base);
+		CloseHandle((HANDLE)mappingHandle);
+		CloseHandle((HANDLE)fileHandle);
+		mappingHandle = nullptr;
+		fileHandle = nullptr;
+#else
+		munmap((void*)base, length);
+#endif
+	}
+	base = nullptr;
+	length = 0;
+	header = nullptr;
+}
+
+// nameAt
+// precondition: the dataset is open and i is smaller than size()
+// postcondition: return the file name of the i-th point
+std::string PoseDataset::nameAt(const size_t i) const {
+	const uint64_t* offsets = (const uint64_t*)(base + header->nameOffset);
+	const char* names = (const char*)(offsets + header->nRows + 1);
+	return std::string(names + offsets[i], (size_t)(offsets[i + 1] - offsets[i]));
+}
+
+// ~PoseDatasetWriter
+// precondition: none
+// postcondition: discard an unfinished file
+PoseDatasetWriter::~PoseDatasetWriter() {
+	if (out) {
+		fclose(out);
+		std::remove(tmpName.c_str());
+	}
+}
+
+// open
+// precondition: dim is positive
+// postcondition: start writing a dataset with dim coordinates per point to a temporary file next to fileName
+//				  Return false if the file could not be created
+bool PoseDatasetWriter::open(const std::string _fileName, const size_t dim) {
+	fileName = _fileName;
+	tmpName = _fileName + ".tmp";
+	out = fopen(tmpName.c_str(), "wb");
+	if (!out)
+		return false;
+	header = PoseDatasetHeader();
+	header.dim = dim;
+	header.coordOffset = sizeof(PoseDatasetHeader);
+	versions.assign(1, FNV1A64_OFFSET);
+	nameOffsets.assign(1, 0);
+	names.clear();
+	// the header is written again by finish, once the number of rows is known
+	ok = fwrite(&header, sizeof(header), 1, out) == 1;
+	return ok;
+}
+
+// add
+// precondition: the writer is open, point points to dim doubles, row is the CSV text of the point
+// postcondition: write the point to the file and the row to the row versions. The file name is kept until finish
+void PoseDatasetWriter::add(const std::string& name, const double* point, const std::string& row) {
+	ok = fwrite(point, sizeof(double), (size_t)header.dim, out) == header.dim && ok;
+	uint64_t version = fnv1a64(row.data(), row.size(), versions.back());
+	versions.push_back(fnv1a64("\n", 1, version));
+	names += name;
+	nameOffsets.push_back(names.size());
+	header.nRows++;
+}
+
+// finish
+// precondition: the writer is open
+// postcondition: write the row versions, file names and header, sync the file and move it to fileName
+//				  Return false if any write failed
+bool PoseDatasetWriter::finish() {
+	header.versionOffset = header.coordOffset + header.nRows * header.dim * sizeof(double);
+	header.nameOffset = header.versionOffset + versions.size() * sizeof(uint64_t);
+	header.nameBytes = names.size();
+	ok = fwrite(versions.data(), sizeof(uint64_t), versions.size(), out) == versions.size() && ok;
+	ok = fwrite(nameOffsets.data(), sizeof(uint64_t), nameOffsets.size(), out) == nameOffsets.size() && ok;
+	ok = fwrite(names.data(), 1, names.size(), out) == names.size() && ok;
+	ok = fseek(out, 0, SEEK_SET) == 0 && fwrite(&header, sizeof(header), 1, out) == 1 && ok;
+	ok = fflush(out) == 0 && syncFile(out) && ok;
+	ok = fclose(out) == 0 && ok;
+	out = nullptr;
+	if (!ok) {
+		std::remove(tmpName.c_str());
+		return false;
+	}
+	std::remove(fileName.c_str());
+	return std::rename(tmpName.c_str(), fileName.c_str()) == 0;
+}
+
+// parseDataSetRow
+// precondition: line is a dataset row [filename, point0_x, point0_y, ..., pointn_y] with an optional trailing comma
+// postcondition: store the file name of the row in name and its coordinates in point
+void parseDataSetRow(const std::string& line, std::string& name, std::vector<double>& point) {
+	std::string word;
+	point.clear();
+	std::stringstream str(line);
+	int i = 0;
+	while (getline(str, word, ',')) {
+		if (i == 0)
+		{
+			name = word;
+		}
+		else if (!word.empty()) {
+			point.push_back(stod(word));
+		}
+		i++;
+	}
+}
+
+// formatDataSetRow
+// precondition: point points to dim doubles
+// postcondition: return the point in the dataset format [filename, point0_x, point0_y, ..., pointn_y] with a trailing comma
+std::string formatDataSetRow(const std::string& name, const double* point, const size_t dim) {
+	std::stringstream out;
+	out << name << ',';
+	for (size_t j = 0; j < dim; j++)
+		out << point[j] << ',';
+	return out.str();
+}
+
+// syncFile
+// precondition: file is an open, flushed file
+// postcondition: wait until the operating system has written the file to the disk. Return false if it failed
+bool syncFile(FILE* file) {
+#ifdef _WIN32
+	return _commit(_fileno(file)) == 0;
+#else
+	return fsync(fileno(file)) == 0;
+#endif
+}
+
+// convertCsvToPoseDataset
+// precondition: csvFile is a CSV dataset
+// postcondition: write the rows of csvFile to the pose dataset datasetFile, reading one row at a time
+//				  Rows with a different number of coordinates than the first row are skipped, like KMeanCluster does
+//				  Return the number of rows written, or -1 if a file could not be read or written
+long long convertCsvToPoseDataset(const std::string csvFile, const std::string datasetFile) {
+	std::ifstream in(csvFile);
+	if (!in.is_open())
+		return -1;
+
+	PoseDatasetWriter writer;
+	std::string line, name;
+	std::vector<double> point;
+	size_t dim = 0;
+	long long nRows = 0;
+	while (getline(in, line)) {
+		if (!line.empty() && line.back() == '\r')
+			line.pop_back();
+		if (line.empty())
+			continue;
+		parseDataSetRow(line, name, point);
+		if (!dim) {
+			dim = point.size();
+			if (!dim || !writer.open(datasetFile, dim))
+				return -1;
+		}
+		if (point.size() != dim)
+			continue;
+		// the row is hashed in the format KMeanCluster hashes, so the versions match the ones it computes for csvFile
+		writer.add(name, point.data(), formatDataSetRow(name, point.data(), dim));
+		nRows++;
+	}
+	if (!dim)
+		return -1;
+	return writer.finish() ? nRows : -1;
+}
+
+// exportPoseDataset
+// precondition: datasetFile is a pose dataset
+// postcondition: write every row of datasetFile to csvFile in the CSV format, one row at a time
+//				  Return the number of rows written, or -1 if a file could not be read or written
+long long exportPoseDataset(const std::string datasetFile, const std::string csvFile) {
+	PoseDataset dataset;
+	if (!dataset.open(datasetFile))
+		return -1;
+	std::ofstream out(csvFile, std::ios::binary | std::ios::trunc);
+	if (!out.is_open())
+		return -1;
+
+	size_t dim = dataset.getDim();
+	const double* coords = dataset.coordinates();
+	for (size_t i = 0; i < dataset.size(); i++)
+		out << formatDataSetRow(dataset.nameAt(i), coords + i * dim, dim) << '\n';
+	out.close();
+	return out.good() ? (long long)dataset.size() : -1;
+}
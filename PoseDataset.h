@@ -0,0 +1,177 @@
+// PoseDataset.h
+// author: Cheuk-Hang Tse
+// This file contains the declaration of the PoseDataset and PoseDatasetWriter classes and 5 functions
+// A pose dataset is the binary form of the clustering dataset. It is memory mapped, so the training runs directly over the
+// coordinates in the file without parsing or copying them
+//
+// File layout (numbers in the byte order of the machine, every block starts at a multiple of 8 bytes):
+// PoseDatasetHeader | nRows x dim coordinates (double) | nRows + 1 row versions (uint64) | nRows + 1 name offsets (uint64) | name bytes
+// Row version i is the hash of the first i rows in the CSV format, the same hash KMeanCluster keeps for its snapshot,
+// so a snapshot trained on a CSV dataset stays valid after the dataset is converted
+//
+// PoseDataset: a read only, memory mapped pose dataset
+// PoseDatasetWriter: write a pose dataset one row at a time
+//
+// FUNCTIONS:
+// parseDataSetRow: split a CSV dataset row into its file name and coordinates
+// formatDataSetRow: return a point in the CSV dataset format
+// syncFile: wait until the operating system has written a file to the disk
+// convertCsvToPoseDataset: convert a CSV dataset into a pose dataset
+// exportPoseDataset: write a pose dataset back to the CSV format
+
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+// PoseDatasetHeader
+// The first 64 bytes of a pose dataset file
+struct PoseDatasetHeader {
+	char magic[8] = { 'K', 'M', 'P', 'O', 'S', 'E', '0', '1' }; // file type
+	uint32_t version = 1; // format version
+	uint32_t reserved = 0; // always 0
+	uint64_t dim = 0; // number of coordinates of a point
+	uint64_t nRows = 0; // number of points
+	uint64_t coordOffset = 0; // position of the coordinates
+	uint64_t versionOffset = 0; // position of the row versions
+	uint64_t nameOffset = 0; // position of the name offsets, the name bytes follow them
+	uint64_t nameBytes = 0; // total length of the file names
+};
+
+class PoseDataset {
+public:
+	// PoseDataset
+	// precondition: none
+	// postcondition: define a closed dataset
+	PoseDataset() {}
+
+	// ~PoseDataset
+	// precondition: none
+	// postcondition: unmap the file
+	~PoseDataset();
+
+	PoseDataset(const PoseDataset&) = delete;
+	PoseDataset& operator=(const PoseDataset&) = delete;
+
+	// isPoseDataset
+	// precondition: none
+	// postcondition: return true if the file starts like a pose dataset
+	static bool isPoseDataset(const std::string fileName);
+
+	// open
+	// precondition: none
+	// postcondition: map the file into memory. Return false if it is missing, too short, or the header does not match its size
+	bool open(const std::string fileName);
+
+	// close
+	// precondition: none
+	// postcondition: unmap the file, the pointers returned before are no longer valid
+	void close();
+
+	// size
+	// precondition: none
+	// postcondition: return the number of points, 0 if the dataset is closed
+	size_t size() const { return header ? (size_t)header->nRows : 0; }
+
+	// getDim
+	// precondition: none
+	// postcondition: return the number of coordinates of a point, 0 if the dataset is closed
+	size_t getDim() const { return header ? (size_t)header->dim : 0; }
+
+	// coordinates
+	// precondition: the dataset is open
+	// postcondition: return a pointer to the size() x getDim() coordinates, stored row-major in the mapped file
+	const double* coordinates() const { return (const double*)(base + header->coordOffset); }
+
+	// nameAt
+	// precondition: the dataset is open and i is smaller than size()
+	// postcondition: return the file name of the i-th point
+	std::string nameAt(const size_t i) const;
+
+	// versionAt
+	// precondition: the dataset is open and nRows is at most size()
+	// postcondition: return the hash of the first nRows rows in the CSV format
+	uint64_t versionAt(const size_t nRows) const { return ((const uint64_t*)(base + header->versionOffset))[nRows]; }
+
+private:
+	const char* base = nullptr; // start of the mapping
+	size_t length = 0; // length of the mapping
+	const PoseDatasetHeader* header = nullptr; // header at the start of the mapping, nullptr if closed
+#ifdef _WIN32
+	void* fileHandle = nullptr; // file opened for the mapping
+	void* mappingHandle = nullptr; // file mapping object
+#endif
+};
+
+class PoseDatasetWriter {
+public:
+	// PoseDatasetWriter
+	// precondition: none
+	// postcondition: define a writer without an open file
+	PoseDatasetWriter() {}
+
+	// ~PoseDatasetWriter
+	// precondition: none
+	// postcondition: discard an unfinished file
+	~PoseDatasetWriter();
+
+	PoseDatasetWriter(const PoseDatasetWriter&) = delete;
+	PoseDatasetWriter& operator=(const PoseDatasetWriter&) = delete;
+
+	// open
+	// precondition: dim is positive
+	// postcondition: start writing a dataset with dim coordinates per point to a temporary file next to fileName
+	//				  Return false if the file could not be created
+	bool open(const std::string fileName, const size_t dim);
+
+	// add
+	// precondition: the writer is open, point points to dim doubles, row is the CSV text of the point
+	// postcondition: write the point to the file and the row to the row versions. The file name is kept until finish
+	void add(const std::string& name, const double* point, const std::string& row);
+
+	// finish
+	// precondition: the writer is open
+	// postcondition: write the row versions, file names and header, sync the file and move it to fileName
+	//				  Return false if any write failed
+	bool finish();
+
+private:
+	FILE* out = nullptr; // temporary file
+	std::string fileName; // final file name
+	std::string tmpName; // temporary file name
+	PoseDatasetHeader header; // header written by finish
+	std::vector<uint64_t> versions; // row versions, starting with the hash of no rows
+	std::vector<uint64_t> nameOffsets; // start of every file name in names
+	std::string names; // every file name, one after the other
+	bool ok = true; // false after a failed write
+};
+
+// parseDataSetRow
+// precondition: line is a dataset row [filename, point0_x, point0_y, ..., pointn_y] with an optional trailing comma
+// postcondition: store the file name of the row in name and its coordinates in point
+void parseDataSetRow(const std::string& line, std::string& name, std::vector<double>& point);
+
+// formatDataSetRow
+// precondition: point points to dim doubles
+// postcondition: return the point in the dataset format [filename, point0_x, point0_y, ..., pointn_y] with a trailing comma
+std::string formatDataSetRow(const std::string& name, const double* point, const size_t dim);
+
+// syncFile
+// precondition: file is an open, flushed file
+// postcondition: wait until the operating system has written the file to the disk. Return false if it failed
+bool syncFile(FILE* file);
+
+// convertCsvToPoseDataset
+// precondition: csvFile is a CSV dataset
+// postcondition: write the rows of csvFile to the pose dataset datasetFile, reading one row at a time
+//				  Rows with a different number of coordinates than the first row are skipped, like KMeanCluster does
+//				  Return the number of rows written, or -1 if a file could not be read or written
+long long convertCsvToPoseDataset(const std::string csvFile, const std::string datasetFile);
+
+// exportPoseDataset
+// precondition: datasetFile is a pose dataset
+// postcondition: write every row of datasetFile to csvFile in the CSV format, one row at a time
+//				  Return the number of rows written, or -1 if a file could not be read or written
+long long exportPoseDataset(const std::string datasetFile, const std::string csvFile);
@@ -0,0 +1,343 @@
+// PosePipeline.cpp
+// author: Cheuk-Hang Tse
+// This file contains the implementation of the PosePipeline class.
+// The pipeline runs human pose estimation on many images with one thread pool per stage:
+// decode (imread, at a reduced scale with reducedDecode) -> blob (blobFromImage) -> forward (netModel.forward) -> keypoint (findBodyPartPosition, pre_processPoints) -> clustering
+// The pipeline is headless: nothing is drawn or displayed, unless a render directory is set, which adds a render stage before clustering
+// The stages are connected with BoundedQueues, so every stage works at the same time and a slow stage applies backpressure.
+// The clustering stage runs on the calling thread and receives the results in the same order as the input images.
+// With a keypoint cache, an image whose content was estimated before skips the network stages and keeps its cached points
+//
+// CONSTRUCTOR:
+// PosePipeline(const string _device, const PipelineConfig& _config, const int _inWidth, const int _inHeight, const float _thresh):
+//		define a pipeline for the device with the number of workers and queue sizes in _config
+//
+// FUNCTIONS:
+// run: estimate the pose of every image, cluster every pose into kCluster in input order and report every result
+// setKeypointCache: look up every image in a keypoint cache before running the network on it
+// runStage: start the worker threads of one stage between two queues
+// admit: wait until an image is allowed to enter the pipeline
+// forwardBatch: stack the blobs of a batch of images and run them through the network in one forward pass
+
+#include "PosePipeline.h"
+#include "Metrics.h"
+#include <map>
+#include <memory>
+#include <cstring>
+#include <filesystem>
+#include <cassert>
+
+// PosePipeline
+// precondition: _device is "cpu" or "gpu", every worker count, the batch size and the queue sizes in _config are positive
+// postcondition: define a pipeline for the device with the number of workers and queue sizes in _config
+PosePipeline::PosePipeline(const string _device, const PipelineConfig& _config, const int _inWidth, const int _inHeight, const float _thresh) {
+	device = _device;
+	config = _config;
+	inWidth = _inWidth;
+	inHeight = _inHeight;
+	thresh = _thresh;
+	// A stage without workers never closes its output queue and a queue without room never accepts a task, so run would block
+	assert(config.decodeWorkers > 0 && config.blobWorkers > 0 && config.forwardWorkers > 0 && config.keypointWorkers > 0);
+	assert(config.renderWorkers > 0 && config.batchSize > 0 && config.queueCapacity > 0 && config.maxInFlight > 0);
+}
+
+// run
+// precondition: imageFiles is not empty
+// postcondition: estimate the pose of every image and cluster every pose into kCluster in input order
+//				  onResult is called on the calling thread for every image in input order
+//				  Return the number of images that were read successfully
+size_t PosePipeline::run(const vector<string>& imageFiles, KMeanCluster& kCluster, const std::function<void(const PoseResult&)>& onResult) {
+	nextToEmit = 0;
+	BoundedQueue<PoseTask> decoded(config.queueCapacity);
+	BoundedQueue<PoseTask> blobs(config.queueCapacity);
+	BoundedQueue<PoseTask> outputs(config.queueCapacity);
+	BoundedQueue<PoseTask> keypoints(config.queueCapacity);
+	vector<std::thread> threads;
+
+	// Decode stage: every worker takes the next image index and reads the image
+	std::atomic<size_t> nextIndex(0);
+	std::atomic<int> decodersLeft(config.decodeWorkers);
+	for (int w = 0; w < config.decodeWorkers; w++) {
+		threads.emplace_back([&] {
+			size_t i;
+			while ((i = nextIndex++) < imageFiles.size()) {
+				admit(i);
+				PoseTask task;
+				task.result.index = i;
+				task.result.imageFile = imageFiles.at(i);
+				// a cached image is only decoded if its pose is drawn
+				if (cache && (task.hashed = KeypointCache::hashFile(task.result.imageFile, task.contentKey))
+					&& cache->lookup(task.contentKey, task.result.points)) {
+					task.cached = true;
+					task.result.valid = true;
+					task.result.features = pre_processPoints(task.result.points);
+					if (config.renderDir.empty()) {
+						if (!decoded.push(std::move(task)))
+							break;
+						continue;
+					}
+				}
+
+				// the points are found in the coordinates of the original image, also when it is decoded at a reduced scale
+				Size originalSize;
+				task.frame = decodeImage(task.result.imageFile, inWidth, inHeight, config.reducedDecode, originalSize);
+				task.result.valid = task.cached || !task.frame.empty();
+				task.frameWidth = originalSize.width;
+				task.frameHeight = originalSize.height;
+				if (!decoded.push(std::move(task)))
+					break;
+			}
+			if (--decodersLeft == 0)
+				decoded.close();
+		});
+	}
+
+	// Blob stage: format the image for the network
+	runStage(config.blobWorkers, decoded, blobs, [this] {
+		return std::function<void(PoseTask&)>([this](PoseTask& task) {
+			if (task.cached)
+				return;
+			METRICS_TIMER("blob");
+			task.blob = blobFromImage(task.frame, 1.0 / 255, Size(inWidth, inHeight), Scalar(0, 0, 0), false, false);
+			// the render stage draws on the decoded image, so it is only kept when rendering
+			if (config.renderDir.empty())
+				task.frame.release();
+		});
+	}, threads);
+
+	// Forward stage: every worker owns its own network because a Net cannot be shared between threads
+	// A worker takes up to batchSize blobs that are already waiting and runs them in one forward pass
+	std::shared_ptr<std::atomic<int>> forwardersLeft = std::make_shared<std::atomic<int>>(config.forwardWorkers);
+	for (int w = 0; w < config.forwardWorkers; w++) {
+		threads.emplace_back([this, &blobs, &outputs, forwardersLeft] {
+			Net netModel;
+			bool netLoaded = false;
+			try {
+				netModel = loadPoseNetwork(device);
+				netLoaded = true;
+			}
+			catch (const exception& e) {
+				cerr << e.what() << endl;
+			}
+
+			PoseTask task;
+			bool open = true;
+			while (open && blobs.pop(task)) {
+				vector<PoseTask> batch;
+				batch.push_back(std::move(task));
+				while ((int)batch.size() < config.batchSize && blobs.tryPop(task))
+					batch.push_back(std::move(task));
+
+				forwardBatch(netModel, netLoaded, batch);
+				for (auto& item : batch) {
+					if (!outputs.push(std::move(item))) {
+						open = false;
+						break;
+					}
+				}
+			}
+			if (--*forwardersLeft == 0)
+				outputs.close();
+		});
+	}
+
+	// Keypoint stage: find the body parts and normalize them for clustering
+	runStage(config.keypointWorkers, outputs, keypoints, [this] {
+		return std::function<void(PoseTask&)>([this](PoseTask& task) {
+			if (task.cached)
+				return;
+			if (config.multiPerson) {
+				// every person of the image comes from the same forward pass
+				vector<vector<Point>> people = findPeoplePositions(task.output, thresh, task.frameWidth, task.frameHeight, task.batchIndex,
+					config.subPixel);
+				for (auto& points : people) {
+					PersonResult person;
+					person.features = pre_processPoints(points);
+					person.points = std::move(points);
+					task.result.people.push_back(std::move(person));
+				}
+				task.output.release();
+				return;
+			}
+			task.result.points = findBodyPartPosition(task.output, thresh, task.frameWidth, task.frameHeight, task.batchIndex, config.subPixel);
+			task.result.features = pre_processPoints(task.result.points);
+			task.output.release();
+			if (cache && task.hashed)
+				cache->insert(task.contentKey, task.result.points);
+		});
+	}, threads);
+
+	// Render stage (optional): draw the pose on the decoded image and save it in the render directory
+	BoundedQueue<PoseTask> rendered(config.queueCapacity);
+	if (!config.renderDir.empty()) {
+		runStage(config.renderWorkers, keypoints, rendered, [this] {
+			return std::function<void(PoseTask&)>([this](PoseTask& task) {
+				string outputFile = (std::filesystem::path(config.renderDir) / std::filesystem::path(task.result.imageFile).filename()).string();
+				try {
+					vector<vector<Point>> poses;
+					if (config.multiPerson) {
+						for (const auto& person : task.result.people)
+							poses.push_back(person.points);
+					}
+					else
+						poses.push_back(task.result.points);
+					for (vector<Point>& points : poses) {
+						// the points are in original image coordinates, the decoded image may be smaller
+						if (task.frame.cols != task.frameWidth || task.frame.rows != task.frameHeight) {
+							for (Point& point : points) {
+								if (point.x >= 0 && point.y >= 0)
+									point = Point(point.x * task.frame.cols / task.frameWidth, point.y * task.frame.rows / task.frameHeight);
+							}
+						}
+						drawKeypoints(points, task.frame);
+						drawSkeleton(points, task.frame);
+					}
+					if (!imwrite(outputFile, task.frame))
+						cerr << "Could not write " << outputFile << endl;
+				}
+				catch (const exception& e) {
+					// a failed drawing does not make the pose invalid
+					cerr << outputFile << ": " << e.what() << endl;
+				}
+				task.frame.release();
+			});
+		}, threads);
+	}
+	BoundedQueue<PoseTask>& results = config.renderDir.empty() ? keypoints : rendered;
+
+	// Clustering stage: put the results back in input order and cluster them one by one
+	std::map<size_t, PoseTask> pending;
+	size_t nValid = 0;
+	PoseTask task;
+	while (results.pop(task)) {
+		size_t index = task.result.index;
+		pending.emplace(index, std::move(task));
+		while (!pending.empty() && pending.begin()->first == nextToEmit) {
+			PoseResult& result = pending.begin()->second.result;
+			if (result.valid && config.multiPerson) {
+				for (size_t n = 0; n < result.people.size(); n++) {
+					PersonResult& person = result.people[n];
+					if (config.topN)
+						person.neighbors = kCluster.nearest(person.features, config.topN, config.maxProbe);
+					person.related = kCluster.cluster(person.features, result.imageFile + "#" + to_string(n));
+				}
+				nValid++;
+			}
+			else if (result.valid) {
+				if (config.topN)
+					result.neighbors = kCluster.nearest(result.features, config.topN, config.maxProbe);
+				result.related = kCluster.cluster(result.features, result.imageFile);
+				nValid++;
+			}
+			else {
+				cout << "Could not process the image: " << result.imageFile << endl;
+			}
+			onResult(result);
+			pending.erase(pending.begin());
+			{
+				std::lock_guard<std::mutex> lock(windowMtx);
+				nextToEmit++;
+			}
+			windowCv.notify_all();
+		}
+	}
+
+	for (auto& thread : threads)
+		thread.join();
+	return nValid;
+}
+
+// runStage
+// precondition: in and out are open queues
+// postcondition: start nWorkers threads that pop a task from in, apply work and push it to out
+//				  out is closed after the last worker is done
+void PosePipeline::runStage(const int nWorkers, BoundedQueue<PoseTask>& in, BoundedQueue<PoseTask>& out,
+	const std::function<std::function<void(PoseTask&)>()>& makeWorker, vector<std::thread>& threads) {
+	std::shared_ptr<std::atomic<int>> workersLeft = std::make_shared<std::atomic<int>>(nWorkers);
+	for (int w = 0; w < nWorkers; w++) {
+		threads.emplace_back([&in, &out, makeWorker, workersLeft] {
+			std::function<void(PoseTask&)> work;
+			try {
+				work = makeWorker();
+			}
+			catch (const exception& e) {
+				cerr << e.what() << endl;
+			}
+
+			PoseTask task;
+			while (in.pop(task)) {
+				if (task.result.valid) {
+					try {
+						if (!work)
+							throw std::runtime_error("pipeline stage worker is not available");
+						work(task);
+					}
+					catch (const exception& e) {
+						cerr << task.result.imageFile << ": " << e.what() << endl;
+						task.result.valid = false;
+					}
+				}
+				if (!out.push(std::move(task)))
+					break;
+			}
+			if (--*workersLeft == 0)
+				out.close();
+		});
+	}
+}
+
+// admit
+// precondition: none
+// postcondition: wait until index is within maxInFlight of the next result to be clustered
+void PosePipeline::admit(const size_t index) {
+	std::unique_lock<std::mutex> lock(windowMtx);
+	windowCv.wait(lock, [this, index] { return index < nextToEmit + config.maxInFlight; });
+}
+
+// forwardBatch
+// precondition: batch is not empty, every valid task that is not cached has a 1 x C x H x W blob of the same size
+// postcondition: run the valid tasks of the batch that are not cached through netModel in one forward pass
+//				  Every valid task shares the N x C x H x W output and keeps the index of its own image in batchIndex
+void PosePipeline::forwardBatch(Net& netModel, const bool netLoaded, vector<PoseTask>& batch) {
+	vector<PoseTask*> valid;
+	for (auto& task : batch) {
+		if (task.result.valid && !task.cached)
+			valid.push_back(&task);
+	}
+	if (valid.empty())
+		return;
+
+	try {
+		if (!netLoaded)
+			throw std::runtime_error("pose network is not available");
+
+		// stack the blobs along the first dimension
+		const Mat& first = valid.front()->blob;
+		int sizes[4] = { (int)valid.size(), first.size[1], first.size[2], first.size[3] };
+		Mat inpBlob(4, sizes, CV_32F);
+		size_t blobSize = first.total();
+		for (size_t i = 0; i < valid.size(); i++) {
+			CV_Assert(valid[i]->blob.total() == blobSize);
+			memcpy(inpBlob.ptr<float>((int)i), valid[i]->blob.ptr<float>(), blobSize * sizeof(float));
+		}
+
+		// the output refers to memory of the network that the next forward call reuses
+		Mat output;
+		{
+			METRICS_TIMER("forward");
+			netModel.setInput(inpBlob);
+			output = netModel.forward().clone();
+		}
+		METRICS_COUNT("images", valid.size());
+		for (size_t i = 0; i < valid.size(); i++) {
+			valid[i]->output = output;
+			valid[i]->batchIndex = (int)i;
+			valid[i]->blob.release();
+		}
+	}
+	catch (const exception& e) {
+		cerr << e.what() << endl;
+		for (auto task : valid)
+			task->result.valid = false;
+	}
+}
@@ -0,0 +1,137 @@
+// PosePipeline.h
+// author: Cheuk-Hang Tse
+// This file contains the declaration of the PosePipeline class.
+// The pipeline runs human pose estimation on many images with one thread pool per stage:
+// decode (imread) -> blob (blobFromImage) -> forward (netModel.forward, batched) -> keypoint (findBodyPartPosition, pre_processPoints) -> clustering
+// The pipeline is headless: nothing is drawn or displayed, unless a render directory is set, which adds a render stage before clustering
+// The stages are connected with BoundedQueues, so every stage works at the same time and a slow stage applies backpressure.
+// The clustering stage runs on the calling thread and receives the results in the same order as the input images.
+// With a keypoint cache, an image whose content was estimated before skips the network stages and keeps its cached points
+// In multi-person mode the keypoint stage finds every person of an image with the part affinity fields, and each one is clustered
+//
+// CONSTRUCTOR:
+// PosePipeline(const string _device, const PipelineConfig& _config, const int _inWidth, const int _inHeight, const float _thresh):
+//		define a pipeline for the device with the number of workers and queue sizes in _config
+//
+// FUNCTIONS:
+// run: estimate the pose of every image, cluster every pose into kCluster in input order and report every result
+// setKeypointCache: look up every image in a keypoint cache before running the network on it
+
+#pragma once
+#include "HumanPoseEstimation.h"
+#include "KMeanCluster.h"
+#include "KeypointCache.h"
+#include "BoundedQueue.h"
+#include <atomic>
+#include <thread>
+#include <functional>
+#include <mutex>
+#include <condition_variable>
+
+// PipelineConfig
+// The number of worker threads of every stage and the capacity of the queues between them
+struct PipelineConfig {
+	int decodeWorkers = 2; // threads that read and decode the image files
+	bool reducedDecode = false; // decode large JPEG files at the smallest scale that still covers the network input
+	int blobWorkers = 1; // threads that turn the images into network input blobs
+	int forwardWorkers = 1; // threads that run the network, each one owns a loaded Net
+	int batchSize = 1; // maximum number of images in one forward pass
+	int keypointWorkers = 1; // threads that find the body parts and normalize the points
+	bool subPixel = false; // refine the body part locations between the heatmap cells
+	bool multiPerson = false; // find every person of an image with the part affinity fields and cluster each of them
+	int renderWorkers = 1; // threads that draw the poses, only used with renderDir
+	string renderDir; // directory the image with the drawn pose of every input is saved to, empty draws nothing
+	size_t queueCapacity = 8; // maximum number of items waiting between two stages
+	size_t maxInFlight = 32; // maximum number of images between decode and clustering
+	size_t topN = 0; // number of closest stored poses to search for every image, 0 skips the search
+	int maxProbe = 0; // maximum number of clusters the search visits, 0 visits every cluster that can hold a closer pose
+};
+
+// PersonResult
+// The pose of one person of an image in multi-person mode
+struct PersonResult {
+	vector<Point> points; // body part locations of the person in the image
+	vector<double> features; // normalized points used for clustering
+	vector<string> related; // file names in the same cluster as the person
+	vector<Neighbor> neighbors; // the config.topN closest stored poses, searched before the person is clustered
+};
+
+// PoseResult
+// The result of one image of the pipeline
+struct PoseResult {
+	size_t index = 0; // position of the image in the input
+	string imageFile; // name of the image file
+	bool valid = false; // false if the image could not be read
+	vector<Point> points; // body part locations in the image
+	vector<double> features; // normalized points used for clustering
+	vector<string> related; // file names in the same cluster as the image
+	vector<Neighbor> neighbors; // the config.topN closest stored poses, searched before the image is clustered
+	vector<PersonResult> people; // with multiPerson, every person of the image clustered as imageFile#n, the others fields are empty
+};
+
+class PosePipeline {
+public:
+	// PosePipeline
+	// precondition: _device is "cpu" or "gpu", every worker count, the batch size and the queue sizes in _config are positive
+	// postcondition: define a pipeline for the device with the number of workers and queue sizes in _config
+	PosePipeline(const string _device, const PipelineConfig& _config, const int _inWidth, const int _inHeight, const float _thresh);
+
+	// run
+	// precondition: imageFiles is not empty
+	// postcondition: estimate the pose of every image and cluster every pose into kCluster in input order
+	//				  onResult is called on the calling thread for every image in input order
+	//				  Return the number of images that were read successfully
+	size_t run(const vector<string>& imageFiles, KMeanCluster& kCluster, const std::function<void(const PoseResult&)>& onResult);
+
+	// setKeypointCache
+	// precondition: _cache was made with the settings of this pipeline and outlives every run, or is nullptr
+	// postcondition: look up every image in _cache before it is decoded. A cached image skips the decode (unless it is rendered),
+	//				  blob, forward and keypoint stages, and the points of every other image are added to _cache
+	//				  The cache holds one pose per image, so it is not used in multi-person mode
+	void setKeypointCache(KeypointCache* _cache) { cache = config.multiPerson ? nullptr : _cache; }
+
+private:
+	// PoseTask
+	// An image moving through the stages of the pipeline
+	struct PoseTask {
+		PoseResult result;
+		Mat frame; // decoded image, released after the blob stage, or after the render stage when rendering
+		Mat blob; // network input, released after the forward stage
+		Mat output; // network output of the whole batch, released after the keypoint stage
+		int batchIndex = 0; // position of the image in the batch output
+		int frameWidth = 0;
+		int frameHeight = 0;
+		bool cached = false; // true if the points came from the keypoint cache, the network stages skip the task
+		bool hashed = false; // true if contentKey holds the content hash of the image file
+		uint64_t contentKey = 0;
+	};
+
+	// runStage
+	// precondition: in and out are open queues
+	// postcondition: start nWorkers threads that pop a task from in, apply work and push it to out
+	//				  out is closed after the last worker is done
+	void runStage(const int nWorkers, BoundedQueue<PoseTask>& in, BoundedQueue<PoseTask>& out,
+		const std::function<std::function<void(PoseTask&)>()>& makeWorker, vector<std::thread>& threads);
+
+	// admit
+	// precondition: none
+	// postcondition: wait until index is within maxInFlight of the next result to be clustered
+	void admit(const size_t index);
+
+	// forwardBatch
+	// precondition: batch is not empty, every valid task that is not cached has a 1 x C x H x W blob of the same size
+	// postcondition: run the valid tasks of the batch that are not cached through netModel in one forward pass
+	//				  Every valid task shares the N x C x H x W output and keeps the index of its own image in batchIndex
+	void forwardBatch(Net& netModel, const bool netLoaded, vector<PoseTask>& batch);
+
+	string device;
+	PipelineConfig config;
+	int inWidth;
+	int inHeight;
+	float thresh;
+	KeypointCache* cache = nullptr; // keypoint cache shared by the decode and keypoint stages, nullptr if not used
+
+	std::mutex windowMtx;
+	std::condition_variable windowCv;
+	size_t nextToEmit = 0; // index of the next result the clustering stage is waiting for
+};
@@ -0,0 +1,166 @@
+// PoseStream.cpp
+// author: Cheuk-Hang Tse
+// This file contains the implementation of the PoseStream class.
+// A PoseStream estimates the human pose in every frame of a video file or camera.
+// The network only runs on keyframes. Between keyframes the body parts are followed with sparse optical flow.
+//
+// CONSTRUCTOR:
+// PoseStream(const string _device, const StreamConfig& _config, const int _inWidth, const int _inHeight, const float _thresh):
+//		define a stream for the device with the keyframe and tracking settings in _config
+//
+// FUNCTIONS:
+// open: open a video file or a camera
+// run: estimate the pose of every frame, look up its related images in kCluster and report it
+// getKeyframes: return the number of frames the network ran on during the last run
+// isKeyframeNeeded: return true if the next frame has to run through the network
+// trackPoints: follow the body parts from the previous frame to the current frame with optical flow
+
+#include "PoseStream.h"
+#include <algorithm>
+#include <cctype>
+#include <cmath>
+
+// PoseStream
+// precondition: _device is "cpu" or "gpu", _config.keyframeInterval and _config.clusterEvery are positive
+// postcondition: define a stream for the device with the keyframe and tracking settings in _config
+PoseStream::PoseStream(const string _device, const StreamConfig& _config, const int _inWidth, const int _inHeight, const float _thresh) {
+	device = _device;
+	config = _config;
+	inWidth = _inWidth;
+	inHeight = _inHeight;
+	thresh = _thresh;
+}
+
+// open
+// precondition: none
+// postcondition: open source as a camera if it is a number (the camera index), else as a video file
+//				  Return false if it could not be opened
+bool PoseStream::open(const string _source) {
+	source = _source;
+	camera = !source.empty() && std::all_of(source.begin(), source.end(), [](unsigned char c) { return isdigit(c) != 0; });
+	if (camera) {
+#ifdef __linux__
+		// V4L2 opens a camera faster than the default backend and delivers the frames without extra buffering
+		if (capture.open(stoi(source), CAP_V4L2))
+			return true;
+#endif
+		return capture.open(stoi(source));
+	}
+	return capture.open(source);
+}
+
+// run
+// precondition: open returned true
+// postcondition: estimate the pose of every frame until the stream ends (or q or Esc is pressed in the window), look up
+//				  the related images of every clusterEvery-th pose in kCluster, and call onFrame for every frame
+//				  With persist, the pose is clustered into kCluster under the name source#index instead, which adds it to the dataset
+//				  Return the number of frames read
+size_t PoseStream::run(KMeanCluster& kCluster, const std::function<void(const StreamFrame&)>& onFrame) {
+	Net netModel = loadPoseNetwork(device);
+	keyframes = 0;
+
+	Mat frame, gray, previousGray;
+	vector<Point> points;
+	int keyframeParts = 0; // body parts found on the last keyframe
+	size_t framesSinceKeyframe = config.keyframeInterval; // the first frame is always a keyframe
+	float tracked = 0;
+	size_t index = 0;
+	double start = (double)cv::getTickCount();
+	while (capture.read(frame) && !frame.empty()) {
+		StreamFrame result;
+		result.index = index;
+		if (camera)
+			result.timestamp = 1000 * ((double)cv::getTickCount() - start) / cv::getTickFrequency();
+		else
+			result.timestamp = capture.get(CAP_PROP_POS_MSEC);
+		cvtColor(frame, gray, COLOR_BGR2GRAY);
+
+		// Track the body parts of the previous frame, unless the keyframe is too old
+		bool keyframe = isKeyframeNeeded(framesSinceKeyframe, tracked);
+		if (!keyframe) {
+			int found = trackPoints(previousGray, gray, points);
+			tracked = keyframeParts ? (float)found / keyframeParts : 1;
+			// too many body parts were lost, so this frame runs through the network instead
+			keyframe = isKeyframeNeeded(framesSinceKeyframe, tracked);
+		}
+		if (keyframe) {
+			points = estimatePose(netModel, frame, inWidth, inHeight, thresh, config.subPixel);
+			keyframeParts = (int)std::count_if(points.begin(), points.end(), [](const Point& p) { return p.x >= 0 && p.y >= 0; });
+			tracked = 1;
+			framesSinceKeyframe = 0;
+			keyframes++;
+		}
+		framesSinceKeyframe++;
+
+		result.keyframe = keyframe;
+		result.tracked = tracked;
+		result.points = points;
+		result.features = pre_processPoints(points);
+		// a frame is not an image file, so it is only written to the dataset when it was asked for
+		if (index % config.clusterEvery == 0 && config.persist)
+			result.related = kCluster.cluster(result.features, source + "#" + to_string(index));
+		else if (index % config.clusterEvery == 0)
+			result.related = kCluster.related(result.features);
+		onFrame(result);
+
+		if (config.render) {
+			drawKeypoints(points, frame);
+			drawSkeleton(points, frame);
+			imshow("Pose Stream", frame);
+			int key = waitKey(1);
+			if (key == 'q' || key == 27)
+				break;
+		}
+		std::swap(previousGray, gray);
+		index++;
+	}
+	return index;
+}
+
+// isKeyframeNeeded
+// precondition: none
+// postcondition: return true if there is no pose to track yet, the last keyframe is keyframeInterval frames old,
+//				  or fewer than minTracked of the keyframe body parts are still tracked
+bool PoseStream::isKeyframeNeeded(const size_t framesSinceKeyframe, const float tracked) const {
+	return framesSinceKeyframe >= (size_t)config.keyframeInterval || tracked < config.minTracked;
+}
+
+// trackPoints
+// precondition: previousGray and gray are grayscale frames of the same size, points are the body parts of previousGray
+// postcondition: move every found point of points to its location in gray. A point whose flow is not found, or that does not
+//				  come back within maxFlowError pixels when tracked backwards, becomes (-1, -1)
+//				  Return the number of points that are still found
+int PoseStream::trackPoints(const Mat& previousGray, const Mat& gray, vector<Point>& points) const {
+	vector<int> found;
+	vector<Point2f> from;
+	for (int n = 0; n < (int)points.size(); n++) {
+		if (points[n].x >= 0 && points[n].y >= 0) {
+			found.push_back(n);
+			from.push_back(Point2f((float)points[n].x, (float)points[n].y));
+		}
+	}
+	if (from.empty())
+		return 0;
+
+	// track forwards, then backwards: a point that does not return to where it started was lost or jumped to another edge
+	vector<Point2f> to, back;
+	vector<unsigned char> status, backStatus;
+	vector<float> error;
+	calcOpticalFlowPyrLK(previousGray, gray, from, to, status, error);
+	calcOpticalFlowPyrLK(gray, previousGray, to, back, backStatus, error);
+
+	int nTracked = 0;
+	for (size_t i = 0; i < found.size(); i++) {
+		Point& point = points[found[i]];
+		bool inside = to[i].x >= 0 && to[i].y >= 0 && to[i].x < gray.cols && to[i].y < gray.rows;
+		float dx = back[i].x - from[i].x;
+		float dy = back[i].y - from[i].y;
+		if (status[i] && backStatus[i] && inside && std::sqrt(dx * dx + dy * dy) <= config.maxFlowError) {
+			point = Point(cvRound(to[i].x), cvRound(to[i].y));
+			nTracked++;
+		}
+		else
+			point = Point(-1, -1);
+	}
+	return nTracked;
+}
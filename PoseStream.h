@@ -0,0 +1,101 @@
+// PoseStream.h
+// author: Cheuk-Hang Tse
+// This file contains the declaration of the PoseStream class.
+// A PoseStream estimates the human pose in every frame of a video file or camera.
+// The network only runs on keyframes. Between keyframes the body parts are followed with sparse optical flow
+// (calcOpticalFlowPyrLK), which costs a small fraction of a forward pass, so the stream keeps up with the camera on a CPU.
+// A new keyframe is taken every keyframeInterval frames, or as soon as too few body parts are tracked reliably.
+// The related images of the pose of every frame are looked up in a KMeanCluster, the frames are only added to it on request.
+//
+// CONSTRUCTOR:
+// PoseStream(const string _device, const StreamConfig& _config, const int _inWidth, const int _inHeight, const float _thresh):
+//		define a stream for the device with the keyframe and tracking settings in _config
+//
+// FUNCTIONS:
+// open: open a video file or a camera
+// run: estimate the pose of every frame, look up its related images in kCluster and report it
+// getKeyframes: return the number of frames the network ran on during the last run
+// isKeyframeNeeded: return true if the next frame has to run through the network
+// trackPoints: follow the body parts from the previous frame to the current frame with optical flow
+
+#pragma once
+#include "HumanPoseEstimation.h"
+#include "KMeanCluster.h"
+#include <opencv2/video/tracking.hpp>
+#include <opencv2/videoio.hpp>
+#include <functional>
+
+// StreamConfig
+// How often the network runs and when a tracked body part is trusted
+struct StreamConfig {
+	int keyframeInterval = 15; // maximum number of frames between two keyframes
+	float minTracked = 0.6f; // a new keyframe is taken when fewer than this fraction of the keyframe body parts are still tracked
+	float maxFlowError = 1.0f; // largest distance in pixels between a tracked point and where it is tracked back to
+	int clusterEvery = 1; // only every clusterEvery-th frame is clustered, 1 clusters every frame
+	bool persist = false; // add every clustered frame to the dataset as source#index, else the frames are only looked up
+	bool subPixel = false; // refine the body part locations between the heatmap cells on keyframes
+	bool render = true; // draw the pose on every frame and show it in a window
+};
+
+// StreamFrame
+// The result of one frame of the stream
+struct StreamFrame {
+	size_t index = 0; // position of the frame in the stream
+	double timestamp = 0; // position of the frame in milliseconds, or the time since the stream started for a camera
+	bool keyframe = false; // true if the points were found by the network, false if they were tracked
+	float tracked = 1; // fraction of the keyframe body parts that are still tracked
+	vector<Point> points; // body part locations in the frame, (-1, -1) if not found
+	vector<double> features; // normalized points used for clustering
+	vector<string> related; // file names in the same cluster as the frame, empty if the frame was not clustered
+};
+
+class PoseStream {
+public:
+	// PoseStream
+	// precondition: _device is "cpu" or "gpu", _config.keyframeInterval and _config.clusterEvery are positive
+	// postcondition: define a stream for the device with the keyframe and tracking settings in _config
+	PoseStream(const string _device, const StreamConfig& _config, const int _inWidth, const int _inHeight, const float _thresh);
+
+	// open
+	// precondition: none
+	// postcondition: open source as a camera if it is a number (the camera index), else as a video file
+	//				  Return false if it could not be opened
+	bool open(const string source);
+
+	// run
+	// precondition: open returned true
+	// postcondition: estimate the pose of every frame until the stream ends (or q or Esc is pressed in the window), look up
+	//				  the related images of every clusterEvery-th pose in kCluster, and call onFrame for every frame
+	//				  With persist, the pose is clustered into kCluster under the name source#index instead, which adds it to the dataset
+	//				  Return the number of frames read
+	size_t run(KMeanCluster& kCluster, const std::function<void(const StreamFrame&)>& onFrame);
+
+	// getKeyframes
+	// precondition: none
+	// postcondition: return the number of frames the network ran on during the last run
+	size_t getKeyframes() const { return keyframes; }
+
+private:
+	// isKeyframeNeeded
+	// precondition: none
+	// postcondition: return true if there is no pose to track yet, the last keyframe is keyframeInterval frames old,
+	//				  or fewer than minTracked of the keyframe body parts are still tracked
+	bool isKeyframeNeeded(const size_t framesSinceKeyframe, const float tracked) const;
+
+	// trackPoints
+	// precondition: previousGray and gray are grayscale frames of the same size, points are the body parts of previousGray
+	// postcondition: move every found point of points to its location in gray. A point whose flow is not found, or that does not
+	//				  come back within maxFlowError pixels when tracked backwards, becomes (-1, -1)
+	//				  Return the number of points that are still found
+	int trackPoints(const Mat& previousGray, const Mat& gray, vector<Point>& points) const;
+
+	string device;
+	StreamConfig config;
+	int inWidth;
+	int inHeight;
+	float thresh;
+	string source; // the video file or camera index the stream was opened with
+	bool camera = false; // true if the source is a camera
+	VideoCapture capture;
+	size_t keyframes = 0; // frames the network ran on during the last run
+};
@@ -0,0 +1,955 @@
+// ShardedKMeans.cpp
+// author: Cheuk-Hang Tse
+// This file contains the implementation of the ShardedKMeans class.
+// The coordinator and the workers exchange binary messages over a socket pair: a MessageHeader with the command and the
+// payload length, then the payload. Every request is answered with one message of the same command, except EXIT.
+// The workers are forked, so they are only started on Linux and macOS, on Windows start fails
+// The dataset log is read and written by the coordinator only, with the row format and checksum of KMeanCluster
+//
+// CONSTRUCTOR:
+// ShardedKMeans(const string _fileName, const int _k, const ShardConfig& _config): define a training of _k clusters
+//		over the dataset _fileName split into the shards of _config
+//
+// FUNCTIONS:
+// start: fork the workers and wait until every one has loaded its shard
+// train: run k-means over every shard until the clustering converges
+// related: return the file names of every row in the cluster of a point
+// nearest: return the closest rows to a point over every shard
+// cluster: add a point to the shard with the fewest rows and return the file names in its cluster
+// stop: ask every worker to exit and wait for it
+// clusterMembers: return the file names of every row in a cluster over every shard
+// serveShard: load a shard and answer the commands of the coordinator, run by every worker
+// loadShard: read the rows of a shard from the dataset
+// sampleSeeds: pick the initial centroids with k-means++ from a sample of rows of every shard
+// broadcast: send the same command to every worker
+// receive: wait for the reply of one worker
+// replayLog: add the valid rows of the dataset log to the shards
+// findSaved: find out which file names are already held by a shard
+// insertRow: add a point to the shard with the fewest rows
+// appendLog: append a point to the dataset log with a checksum
+// put: append a value to a payload
+// putString: append a string to a payload
+// sendMessage: write one message to a socket
+// recvMessage: read one message from a socket
+
+#include "ShardedKMeans.h"
+#include "Hash.h"
+#include "Metrics.h"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <ctime>
+#include <fstream>
+#include <iostream>
+#include <limits>
+#include <random>
+#ifndef _WIN32
+#include <cerrno>
+#include <sched.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+// ShardCommand
+// The first word of every message, the payload of the request -> the payload of the reply
+enum ShardCommand : uint32_t {
+	SHARD_LOADED = 1, // sent by a worker once it is started: -> shard rows, dim (0 if it failed), rows of the whole dataset
+	SHARD_SAMPLE, // seed, rows to sample from every shard -> count, count x dim coordinates
+	SHARD_ASSIGN, // k x dim centroids -> k x dim sums, k counts, inertia, number of rows whose cluster changed
+	SHARD_MEMBERS, // cluster -> count, count x (row index, name)
+	SHARD_NEAREST, // n, dim coordinates -> count, count x (squared distance, row index, name)
+	SHARD_INSERT, // row index, cluster (-1 for none), dim coordinates, name -> shard rows
+	SHARD_SAVED, // count, count x name -> count x (1 if the shard holds a row with the name, else 0)
+	SHARD_EXIT // no reply
+};
+
+// MessageHeader
+// The start of every message, followed by length bytes of payload
+struct MessageHeader {
+	uint32_t command = 0;
+	uint32_t reserved = 0;
+	uint64_t length = 0;
+};
+
+// PayloadReader
+// Read the values of a payload in the order they were put. ok becomes false if the payload is shorter than what is read
+struct PayloadReader {
+	const std::string& in;
+	size_t pos = 0;
+	bool ok = true;
+
+	PayloadReader(const std::string& _in) : in(_in) {}
+
+	void read(void* out, const size_t size) {
+		if (!ok || in.size() - pos < size) {
+			ok = false;
+			return;
+		}
+		memcpy(out, in.data() + pos, size);
+		pos += size;
+	}
+
+	template<typename T> T get() {
+		T value{};
+		read(&value, sizeof(T));
+		return value;
+	}
+
+	std::string getString() {
+		uint64_t n = get<uint64_t>();
+		if (!ok || in.size() - pos < n) {
+			ok = false;
+			return std::string();
+		}
+		pos += n;
+		return in.substr(pos - n, n);
+	}
+};
+
+// put
+// precondition: T is a plain value type
+// postcondition: append the bytes of value to out
+template<typename T> static void put(std::string& out, const T& value) {
+	out.append((const char*)&value, sizeof(T));
+}
+
+// putString
+// precondition: none
+// postcondition: append the length of value and its bytes to out
+static void putString(std::string& out, const std::string& value) {
+	put<uint64_t>(out, value.size());
+	out.append(value);
+}
+
+// ShardedKMeans
+// precondition: _k and _config.shards are positive
+// postcondition: define a training of _k clusters over the dataset _fileName split into the shards of _config
+ShardedKMeans::ShardedKMeans(const std::string _fileName, const int _k, const ShardConfig& _config) {
+	fileName = _fileName;
+	k = _k;
+	config = _config;
+	config.shards = std::max(1, config.shards);
+}
+
+// ~ShardedKMeans
+// precondition: none
+// postcondition: stop the workers
+ShardedKMeans::~ShardedKMeans() {
+	stop();
+}
+
+#ifdef _WIN32
+// sendMessage
+// precondition: none
+// postcondition: no socket is ever opened on Windows, so return false
+static bool sendMessage(const int fd, const uint32_t command, const std::string& payload) {
+	return false;
+}
+
+// start
+// precondition: none
+// postcondition: processes are not forked on Windows, so return false
+bool ShardedKMeans::start() {
+	std::cerr << "Sharded training is not supported on Windows" << std::endl;
+	return false;
+}
+
+// stop
+// precondition: none
+// postcondition: sync and close the dataset log, no worker is ever started on Windows
+void ShardedKMeans::stop() {
+	if (logFile) {
+		fflush(logFile);
+		syncFile(logFile);
+		fclose(logFile);
+		logFile = nullptr;
+	}
+	unsyncedRows = 0;
+	trained = false;
+}
+
+// broadcast
+// precondition: none
+// postcondition: no worker is ever started on Windows, so return false
+bool ShardedKMeans::broadcast(const uint32_t command, const std::string& payload) {
+	return false;
+}
+
+// receive
+// precondition: none
+// postcondition: no worker is ever started on Windows, so return false
+bool ShardedKMeans::receive(const size_t s, std::string& payload) {
+	return false;
+}
+
+// serveShard
+// precondition: none
+// postcondition: not used on Windows
+void ShardedKMeans::serveShard(const int fd, const int s) {
+}
+#else
+// sendMessage
+// precondition: fd is a connected socket
+// postcondition: write the header and payload of one message to fd. Return false if the other end is gone
+static bool sendMessage(const int fd, const uint32_t command, const std::string& payload) {
+	MessageHeader header;
+	header.command = command;
+	header.length = payload.size();
+	std::string message((const char*)&header, sizeof(header));
+	message += payload;
+	size_t sent = 0;
+	while (sent < message.size()) {
+		ssize_t n = send(fd, message.data() + sent, message.size() - sent, MSG_NOSIGNAL);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return false;
+		sent += (size_t)n;
+	}
+	return true;
+}
+
+// recvMessage
+// precondition: fd is a connected socket
+// postcondition: read one message from fd into command and payload. Return false if the other end is gone
+static bool recvMessage(const int fd, uint32_t& command, std::string& payload) {
+	auto readAll = [fd](char* out, size_t size) {
+		while (size) {
+			ssize_t n = recv(fd, out, size, 0);
+			if (n < 0 && errno == EINTR)
+				continue;
+			if (n <= 0)
+				return false;
+			out += n;
+			size -= (size_t)n;
+		}
+		return true;
+	};
+	MessageHeader header;
+	if (!readAll((char*)&header, sizeof(header)))
+		return false;
+	command = header.command;
+	payload.resize(header.length);
+	return readAll(&payload[0], payload.size());
+}
+
+// start
+// precondition: the workers are not started
+// postcondition: fork one worker per shard and wait until every worker has loaded its rows
+//				  Then the valid rows of the dataset log whose file name is not in the dataset yet are added to the shards
+//				  Rows with a different number of coordinates than the first row are skipped, like KMeanCluster does
+//				  Return false if a worker could not be started or the dataset is empty or could not be read
+bool ShardedKMeans::start() {
+	if (!shards.empty())
+		return false;
+	// a forked worker inherits the buffered output, which would be written twice
+	std::cout.flush();
+	std::cerr.flush();
+	fflush(nullptr);
+	for (int s = 0; s < config.shards; s++) {
+		int fds[2];
+		if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0) {
+			stop();
+			return false;
+		}
+		pid_t pid = fork();
+		if (pid < 0) {
+			close(fds[0]);
+			close(fds[1]);
+			stop();
+			return false;
+		}
+		if (pid == 0) {
+			// worker: only keep its own end of its own socket pair, and never run the exit handlers of the coordinator
+			close(fds[0]);
+			for (const Shard& shard : shards)
+				close(shard.fd);
+			serveShard(fds[1], s);
+			close(fds[1]);
+			_exit(0);
+		}
+		close(fds[1]);
+		Shard shard;
+		shard.pid = pid;
+		shard.fd = fds[0];
+		shards.push_back(shard);
+	}
+
+	// the workers load their shards at the same time
+	dim = 0;
+	nRows = 0;
+	nextRow = 0;
+	std::string reply;
+	for (size_t s = 0; s < shards.size(); s++) {
+		if (!receive(s, reply))
+			return false;
+		PayloadReader in(reply);
+		shards[s].rows = in.get<uint64_t>();
+		uint64_t shardDim = in.get<uint64_t>();
+		uint64_t totalRows = in.get<uint64_t>();
+		if (!in.ok || !shardDim || (dim && shardDim != dim)) {
+			stop();
+			return false;
+		}
+		dim = shardDim;
+		nRows += shards[s].rows;
+		nextRow = std::max(nextRow, totalRows);
+	}
+	if (!replayLog())
+		return false;
+	if (!nRows) {
+		stop();
+		return false;
+	}
+	return true;
+}
+
+// stop
+// precondition: none
+// postcondition: sync and close the dataset log, ask every worker to exit and wait for it. The rows of the shards are gone afterwards
+void ShardedKMeans::stop() {
+	if (logFile) {
+		fflush(logFile);
+		syncFile(logFile);
+		fclose(logFile);
+		logFile = nullptr;
+	}
+	unsyncedRows = 0;
+	for (const Shard& shard : shards) {
+		sendMessage(shard.fd, SHARD_EXIT, std::string());
+		close(shard.fd);
+	}
+	for (const Shard& shard : shards) {
+		while (waitpid(shard.pid, nullptr, 0) < 0 && errno == EINTR) {
+		}
+	}
+	shards.clear();
+	trained = false;
+}
+
+// broadcast
+// precondition: start returned true
+// postcondition: send command with payload to every worker. Return false and stop every worker if one could not be reached
+bool ShardedKMeans::broadcast(const uint32_t command, const std::string& payload) {
+	if (shards.empty())
+		return false;
+	for (const Shard& shard : shards) {
+		if (!sendMessage(shard.fd, command, payload)) {
+			stop();
+			return false;
+		}
+	}
+	return true;
+}
+
+// receive
+// precondition: a command was sent to shard s
+// postcondition: wait for the reply of shard s and store it in payload. Return false and stop every worker if the worker failed,
+//				  because the replies of the other workers can no longer be matched to their requests
+bool ShardedKMeans::receive(const size_t s, std::string& payload) {
+	uint32_t command;
+	if (s >= shards.size() || !recvMessage(shards[s].fd, command, payload)) {
+		stop();
+		return false;
+	}
+	return true;
+}
+
+// serveShard
+// precondition: called in a forked worker, fd is its end of the socket pair
+// postcondition: load shard s and answer the commands of the coordinator until it sends EXIT or closes the socket
+void ShardedKMeans::serveShard(const int fd, const int s) {
+#ifdef __linux__
+	// pin the worker before it touches its rows, so they are allocated in the memory next to its processor
+	cpu_set_t allowed;
+	if (config.pinCpus && sched_getaffinity(0, sizeof(allowed), &allowed) == 0 && CPU_COUNT(&allowed) > 0) {
+		int target = s % CPU_COUNT(&allowed);
+		for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+			if (CPU_ISSET(cpu, &allowed) && target-- == 0) {
+				cpu_set_t pinned;
+				CPU_ZERO(&pinned);
+				CPU_SET(cpu, &pinned);
+				sched_setaffinity(0, sizeof(pinned), &pinned);
+				break;
+			}
+		}
+	}
+#endif
+	ShardData data;
+	uint64_t totalRows = 0;
+	bool loaded = loadShard(s, data, totalRows);
+	std::string reply;
+	put<uint64_t>(reply, loaded ? data.rowIndex.size() : 0);
+	put<uint64_t>(reply, loaded ? dim : 0);
+	put<uint64_t>(reply, totalRows);
+	if (!sendMessage(fd, SHARD_LOADED, reply) || !loaded)
+		return;
+
+	uint32_t command;
+	std::string payload;
+	std::vector<double> requestCentroids;
+	std::vector<double> sums(k * dim);
+	std::vector<int64_t> counts(k);
+	std::vector<double> point(dim);
+	while (recvMessage(fd, command, payload)) {
+		PayloadReader in(payload);
+		size_t nShardRows = data.rowIndex.size();
+		reply.clear();
+		switch (command) {
+		case SHARD_SAMPLE: {
+			// reservoir sampling of the row indices, so every row is sampled with the same probability
+			std::mt19937_64 rng(in.get<uint64_t>() + s);
+			std::vector<uint64_t> quotas(config.shards);
+			in.read(quotas.data(), quotas.size() * sizeof(uint64_t));
+			size_t quota = std::min((size_t)quotas[s], nShardRows);
+			std::vector<size_t> picked;
+			for (size_t i = 0; i < nShardRows; i++) {
+				if (i < quota)
+					picked.push_back(i);
+				else {
+					size_t slot = std::uniform_int_distribution<size_t>(0, i)(rng);
+					if (slot < quota)
+						picked[slot] = i;
+				}
+			}
+			put<uint64_t>(reply, picked.size());
+			for (size_t i : picked)
+				reply.append((const char*)data.pointAt(i, dim), dim * sizeof(double));
+			break;
+		}
+		case SHARD_ASSIGN: {
+			requestCentroids.resize(k * dim);
+			in.read(requestCentroids.data(), requestCentroids.size() * sizeof(double));
+			std::fill(sums.begin(), sums.end(), 0.0);
+			std::fill(counts.begin(), counts.end(), 0);
+			double inertiaSum = 0;
+			uint64_t changed = 0;
+			for (size_t i = 0; i < nShardRows; i++) {
+				const double* row = data.pointAt(i, dim);
+				double distance;
+				int c = nearestCentroid(row, requestCentroids.data(), k, dim, distance);
+				if (data.clusterIds[i] != c)
+					changed++;
+				data.clusterIds[i] = c;
+				counts[c]++;
+				for (size_t d = 0; d < dim; d++)
+					sums[c * dim + d] += row[d];
+				inertiaSum += distance;
+			}
+			reply.append((const char*)sums.data(), sums.size() * sizeof(double));
+			reply.append((const char*)counts.data(), counts.size() * sizeof(int64_t));
+			put<double>(reply, inertiaSum);
+			put<uint64_t>(reply, changed);
+			break;
+		}
+		case SHARD_MEMBERS: {
+			int32_t c = in.get<int32_t>();
+			std::string rows;
+			uint64_t count = 0;
+			for (size_t i = 0; i < nShardRows; i++) {
+				if (data.clusterIds[i] != c)
+					continue;
+				put<uint64_t>(rows, data.rowIndex[i]);
+				putString(rows, data.nameAt(i));
+				count++;
+			}
+			put<uint64_t>(reply, count);
+			reply += rows;
+			break;
+		}
+		case SHARD_NEAREST: {
+			uint64_t n = in.get<uint64_t>();
+			in.read(point.data(), dim * sizeof(double));
+			// (squared distance, row index) orders the rows like KMeanCluster::nearest does
+			std::vector<std::pair<double, uint64_t>> best(nShardRows);
+			for (size_t i = 0; i < nShardRows; i++)
+				best[i] = std::make_pair(squaredDistance(point.data(), data.pointAt(i, dim), dim), (uint64_t)i);
+			auto byRow = [&data](const std::pair<double, uint64_t>& a, const std::pair<double, uint64_t>& b) {
+				return a.first != b.first ? a.first < b.first : data.rowIndex[a.second] < data.rowIndex[b.second];
+			};
+			size_t nBest = (size_t)std::min<uint64_t>(n, nShardRows);
+			std::partial_sort(best.begin(), best.begin() + nBest, best.end(), byRow);
+			put<uint64_t>(reply, nBest);
+			for (size_t r = 0; r < nBest; r++) {
+				put<double>(reply, best[r].first);
+				put<uint64_t>(reply, data.rowIndex[best[r].second]);
+				putString(reply, data.nameAt(best[r].second));
+			}
+			break;
+		}
+		case SHARD_INSERT: {
+			uint64_t index = in.get<uint64_t>();
+			int32_t c = in.get<int32_t>();
+			in.read(point.data(), dim * sizeof(double));
+			std::string name = in.getString();
+			if (in.ok) {
+				data.coords.insert(data.coords.end(), point.begin(), point.end());
+				data.names.push_back(name);
+				data.rowIndex.push_back(index);
+				data.clusterIds.push_back(c);
+				if (data.namesIndexed)
+					data.nameSet.insert(name);
+			}
+			put<uint64_t>(reply, data.rowIndex.size());
+			break;
+		}
+		case SHARD_SAVED: {
+			if (!data.namesIndexed) {
+				data.nameSet.reserve(nShardRows);
+				for (size_t i = 0; i < nShardRows; i++)
+					data.nameSet.insert(data.nameAt(i));
+				data.namesIndexed = true;
+			}
+			uint64_t count = in.get<uint64_t>();
+			std::string flags;
+			for (uint64_t r = 0; r < count && in.ok; r++)
+				flags.push_back(data.nameSet.count(in.getString()) ? 1 : 0);
+			put<uint64_t>(reply, flags.size());
+			reply += flags;
+			break;
+		}
+		default:
+			// SHARD_EXIT, or a command this worker does not know
+			return;
+		}
+		if (!sendMessage(fd, command, reply))
+			return;
+	}
+}
+#endif
+
+// loadShard
+// precondition: called in a forked worker
+// postcondition: read the rows of shard s into data, set dim and store the number of rows of the whole dataset in totalRows
+//				  The rows of a pose dataset are read from the memory map, or copied if the worker is pinned, so they are
+//				  allocated in the memory of its processor. Return false if the dataset could not be read
+bool ShardedKMeans::loadShard(const int s, ShardData& data, uint64_t& totalRows) {
+	totalRows = 0;
+	if (PoseDataset::isPoseDataset(fileName)) {
+		// a contiguous range of rows, so the shard is one range of the memory map
+		if (!data.mapped.open(fileName))
+			return false;
+		dim = data.mapped.getDim();
+		totalRows = data.mapped.size();
+		size_t begin = totalRows * s / config.shards;
+		size_t end = totalRows * (s + 1) / config.shards;
+		data.datasetNames = true;
+		data.datasetRows = end - begin;
+		if (config.pinCpus)
+			data.coords.assign(data.mapped.coordinates() + begin * dim, data.mapped.coordinates() + end * dim);
+		else {
+			data.mappedCoords = data.mapped.coordinates() + begin * dim;
+			data.mappedRows = end - begin;
+		}
+		for (size_t i = begin; i < end; i++)
+			data.rowIndex.push_back(i);
+	}
+	else {
+		// every shards-th row, so a CSV dataset sorted by pose is spread over every shard
+		std::ifstream in(fileName);
+		if (!in)
+			return false;
+		std::string line;
+		std::string name;
+		std::vector<double> point;
+		dim = 0;
+		while (getline(in, line)) {
+			if (!line.empty() && line.back() == '\r')
+				line.pop_back();
+			if (line.empty())
+				continue;
+			uint64_t row = totalRows++;
+			// every worker parses the first row, which sets the number of coordinates of a row
+			if (dim && row % config.shards != (uint64_t)s)
+				continue;
+			parseDataSetRow(line, name, point);
+			if (!dim)
+				dim = point.size();
+			if (row % config.shards != (uint64_t)s || point.size() != dim)
+				continue;
+			data.coords.insert(data.coords.end(), point.begin(), point.end());
+			data.names.push_back(name);
+			data.rowIndex.push_back(row);
+		}
+		data.datasetRows = data.rowIndex.size();
+		if (!dim)
+			return false;
+	}
+	data.clusterIds.assign(data.rowIndex.size(), -1);
+	return true;
+}
+
+// train
+// precondition: start returned true
+// postcondition: pick the initial centroids, then send them to every worker, add up the sums and counts the workers return
+//				  and compute the next centroids, until no row changes its cluster, no centroid moves more than tolerance,
+//				  or maxIterations rounds ran. Return false if a worker failed
+bool ShardedKMeans::train() {
+	auto start = std::chrono::steady_clock::now();
+	trained = false;
+	iterations = 0;
+	inertia = 0;
+	reduceSeconds = 0;
+	if (shards.empty() || !sampleSeeds())
+		return false;
+
+	std::vector<double> sums(k * dim);
+	std::vector<int64_t> counts(k);
+	std::vector<double> shardSums(k * dim);
+	std::vector<int64_t> shardCounts(k);
+	std::vector<double> previous;
+	std::string payload;
+	std::string reply;
+	for (int l = 0; l < std::max(1, config.maxIterations); l++) {
+		payload.assign((const char*)centroids.data(), centroids.size() * sizeof(double));
+		if (!broadcast(SHARD_ASSIGN, payload))
+			return false;
+		std::fill(sums.begin(), sums.end(), 0.0);
+		std::fill(counts.begin(), counts.end(), 0);
+		double inertiaSum = 0;
+		uint64_t changed = 0;
+		// the sums are added in shard order, so the result only depends on the number of shards
+		for (size_t s = 0; s < shards.size(); s++) {
+			if (!receive(s, reply))
+				return false;
+			auto reduceStart = std::chrono::steady_clock::now();
+			PayloadReader in(reply);
+			in.read(shardSums.data(), shardSums.size() * sizeof(double));
+			in.read(shardCounts.data(), shardCounts.size() * sizeof(int64_t));
+			inertiaSum += in.get<double>();
+			changed += in.get<uint64_t>();
+			if (!in.ok) {
+				stop();
+				return false;
+			}
+			for (size_t j = 0; j < sums.size(); j++)
+				sums[j] += shardSums[j];
+			for (int c = 0; c < k; c++)
+				counts[c] += shardCounts[c];
+			reduceSeconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - reduceStart).count();
+		}
+
+		// Recompute the centroids, an empty cluster keeps its previous centroid
+		previous = centroids;
+		double maxMoved = 0;
+		for (int c = 0; c < k; c++) {
+			if (counts[c]) {
+				for (size_t d = 0; d < dim; d++)
+					centroids[c * dim + d] = sums[c * dim + d] / counts[c];
+			}
+			maxMoved = std::max(maxMoved, sqrt(squaredDistance(previous.data() + c * dim, centroids.data() + c * dim, dim)));
+		}
+		iterations = l + 1;
+		inertia = inertiaSum;
+		if (!changed || maxMoved <= config.tolerance)
+			break;
+	}
+	trained = true;
+	trainSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	METRICS_OBSERVE("sharded_train", trainSeconds);
+	return true;
+}
+
+// sampleSeeds
+// precondition: start returned true
+// postcondition: collect about sampleRows rows from the shards, in proportion to their number of rows, and pick
+//				  k centroids from them with k-means++. Return false if a worker failed
+bool ShardedKMeans::sampleSeeds() {
+	std::mt19937_64 rng(config.seed ? config.seed : (unsigned int)time(0));
+	std::string payload;
+	put<uint64_t>(payload, rng());
+	size_t sampleRows = std::max(config.sampleRows, (size_t)k);
+	for (const Shard& shard : shards)
+		put<uint64_t>(payload, (uint64_t)std::min(shard.rows, (sampleRows * shard.rows + nRows - 1) / nRows));
+	if (!broadcast(SHARD_SAMPLE, payload))
+		return false;
+	std::vector<double> sample;
+	std::string reply;
+	for (size_t s = 0; s < shards.size(); s++) {
+		if (!receive(s, reply))
+			return false;
+		PayloadReader in(reply);
+		uint64_t count = in.get<uint64_t>();
+		if (!in.ok || count > shards[s].rows) {
+			stop();
+			return false;
+		}
+		size_t offset = sample.size();
+		sample.resize(offset + count * dim);
+		in.read(sample.data() + offset, count * dim * sizeof(double));
+		if (!in.ok) {
+			stop();
+			return false;
+		}
+	}
+
+	// k-means++ on the sample: every next centroid is picked with a probability proportional to its squared distance
+	// to the closest centroid picked so far
+	size_t nSample = sample.size() / dim;
+	std::uniform_int_distribution<size_t> pick(0, nSample - 1);
+	std::vector<double> closest(nSample, std::numeric_limits<double>::max());
+	centroids.resize(k * dim);
+	size_t chosen = pick(rng);
+	for (int i = 0; i < k; i++) {
+		std::copy(sample.begin() + chosen * dim, sample.begin() + (chosen + 1) * dim, centroids.begin() + i * dim);
+		double total = 0;
+		for (size_t j = 0; j < nSample; j++) {
+			closest[j] = std::min(closest[j], squaredDistance(sample.data() + j * dim, centroids.data() + i * dim, dim));
+			total += closest[j];
+		}
+		// every sampled row is already a centroid, so fall back to a uniform pick
+		chosen = pick(rng);
+		if (total > 0) {
+			double r = std::uniform_real_distribution<double>(0, total)(rng);
+			for (size_t j = 0; j < nSample; j++) {
+				if (closest[j] <= 0)
+					continue;
+				chosen = j;
+				if (r < closest[j])
+					break;
+				r -= closest[j];
+			}
+		}
+	}
+	return true;
+}
+
+// related
+// precondition: train returned true, point has dim coordinates
+// postcondition: return the file names of every row in the cluster of the closest centroid to point, in row order
+std::vector<std::string> ShardedKMeans::related(const std::vector<double>& point) {
+	METRICS_TIMER("sharded_related");
+	if (!trained || point.size() != dim)
+		return std::vector<std::string>();
+	double distance;
+	return clusterMembers(nearestCentroid(point.data(), centroids.data(), k, dim, distance));
+}
+
+// nearest
+// precondition: train returned true, point has dim coordinates
+// postcondition: return the n closest rows to point over every shard, the closest first. Rows at the same distance are in
+//				  row order, like KMeanCluster::nearest with every cluster visited
+std::vector<Neighbor> ShardedKMeans::nearest(const std::vector<double>& point, const size_t n) {
+	METRICS_TIMER("sharded_nearest");
+	std::vector<Neighbor> neighbors;
+	if (!trained || !n || point.size() != dim)
+		return neighbors;
+	std::string payload;
+	put<uint64_t>(payload, n);
+	payload.append((const char*)point.data(), dim * sizeof(double));
+	if (!broadcast(SHARD_NEAREST, payload))
+		return neighbors;
+
+	// every shard returns its own n closest rows, the n closest of all of them are the n closest overall
+	std::vector<std::pair<std::pair<double, uint64_t>, std::string>> best;
+	std::string reply;
+	for (size_t s = 0; s < shards.size(); s++) {
+		if (!receive(s, reply))
+			return neighbors;
+		PayloadReader in(reply);
+		uint64_t count = in.get<uint64_t>();
+		for (uint64_t r = 0; r < count && in.ok; r++) {
+			double distance = in.get<double>();
+			uint64_t index = in.get<uint64_t>();
+			std::string name = in.getString();
+			best.push_back(std::make_pair(std::make_pair(distance, index), name));
+		}
+		if (!in.ok) {
+			stop();
+			return neighbors;
+		}
+	}
+	size_t nBest = std::min(n, best.size());
+	std::partial_sort(best.begin(), best.begin() + nBest, best.end(),
+		[](const std::pair<std::pair<double, uint64_t>, std::string>& a, const std::pair<std::pair<double, uint64_t>, std::string>& b) {
+			return a.first < b.first;
+		});
+	neighbors.resize(nBest);
+	for (size_t r = 0; r < nBest; r++) {
+		neighbors[r].fileName = best[r].second;
+		neighbors[r].distance = sqrt(best[r].first.first);
+	}
+	return neighbors;
+}
+
+// cluster
+// precondition: train returned true, point has dim coordinates
+// postcondition: add point named fileName to the cluster of its closest centroid in the shard with the fewest rows and
+//				  return the file names in that cluster, fileName last. The row is only kept by the worker, not written to the dataset
+std::vector<std::string> ShardedKMeans::cluster(const std::vector<double>& point, const std::string fileName) {
+	if (!trained || point.size() != dim)
+		return std::vector<std::string>();
+	double distance;
+	int32_t c = nearestCentroid(point.data(), centroids.data(), k, dim, distance);
+	std::vector<uint8_t> saved;
+	if (!findSaved(std::vector<std::string>{ fileName }, saved) || !insertRow(point.data(), fileName, c))
+		return std::vector<std::string>();
+	// a file name is only written once, like KMeanCluster::appendRow does
+	if (!saved[0])
+		appendLog(point.data(), fileName);
+	return clusterMembers(c);
+}
+
+// replayLog
+// precondition: the workers have loaded their shards
+// postcondition: add every row of the dataset log with a valid checksum, the right number of coordinates and a file name
+//				  that is not stored yet to the shards, in log order. Return false if a worker failed
+bool ShardedKMeans::replayLog() {
+	std::ifstream log(fileName + ".log");
+	if (!log)
+		return true;
+	// a row is only used if its checksum is valid, so a row cut off by a crash is ignored
+	std::vector<std::string> names;
+	std::vector<double> points;
+	std::unordered_set<std::string> logNames;
+	std::string line;
+	std::string name;
+	std::vector<double> point;
+	size_t nBroken = 0;
+	while (getline(log, line)) {
+		if (!line.empty() && line.back() == '\r')
+			line.pop_back();
+		size_t mark = line.rfind('#');
+		if (mark == std::string::npos || fnv1a64(line.data(), mark) != strtoull(line.c_str() + mark + 1, nullptr, 16)) {
+			nBroken += !line.empty();
+			continue;
+		}
+		line.resize(mark);
+		parseDataSetRow(line, name, point);
+		if (point.size() != dim || !logNames.insert(name).second)
+			continue;
+		names.push_back(name);
+		points.insert(points.end(), point.begin(), point.end());
+	}
+	if (nBroken)
+		std::cout << "Ignored " << nBroken << " damaged rows in " << fileName << ".log" << std::endl;
+	if (names.empty())
+		return true;
+
+	// rows that are already in the dataset are left in the log until the next compaction, like KMeanCluster does
+	std::vector<uint8_t> saved;
+	if (!findSaved(names, saved))
+		return false;
+	for (size_t i = 0; i < names.size(); i++) {
+		if (!saved[i] && !insertRow(points.data() + i * dim, names[i], -1))
+			return false;
+	}
+	return true;
+}
+
+// findSaved
+// precondition: start returned true
+// postcondition: set saved[i] to 1 if a row named names[i] is held by a shard, else 0. Return false if a worker failed
+bool ShardedKMeans::findSaved(const std::vector<std::string>& names, std::vector<uint8_t>& saved) {
+	std::string payload;
+	put<uint64_t>(payload, names.size());
+	for (const auto& name : names)
+		putString(payload, name);
+	if (!broadcast(SHARD_SAVED, payload))
+		return false;
+	saved.assign(names.size(), 0);
+	std::string reply;
+	for (size_t s = 0; s < shards.size(); s++) {
+		if (!receive(s, reply))
+			return false;
+		PayloadReader in(reply);
+		if (in.get<uint64_t>() != names.size() || reply.size() != sizeof(uint64_t) + names.size()) {
+			stop();
+			return false;
+		}
+		for (size_t i = 0; i < names.size(); i++)
+			saved[i] |= (uint8_t)reply[sizeof(uint64_t) + i];
+	}
+	return true;
+}
+
+// insertRow
+// precondition: the workers have loaded their shards, point has dim coordinates
+// postcondition: add point named name with cluster c (-1 for none) to the shard with the fewest rows as the next row
+//				  of the dataset. Return false if the worker failed
+bool ShardedKMeans::insertRow(const double* point, const std::string& name, const int32_t c) {
+	if (shards.empty())
+		return false;
+	size_t s = 0;
+	for (size_t i = 1; i < shards.size(); i++) {
+		if (shards[i].rows < shards[s].rows)
+			s = i;
+	}
+	std::string payload;
+	put<uint64_t>(payload, nextRow);
+	put<int32_t>(payload, c);
+	payload.append((const char*)point, dim * sizeof(double));
+	putString(payload, name);
+	std::string reply;
+	if (!sendMessage(shards[s].fd, SHARD_INSERT, payload)) {
+		stop();
+		return false;
+	}
+	if (!receive(s, reply))
+		return false;
+	nextRow++;
+	nRows++;
+	shards[s].rows++;
+	return true;
+}
+
+// appendLog
+// precondition: point has dim coordinates
+// postcondition: append point named name to the dataset log in the format of KMeanCluster::appendRow, and sync the log
+//				  every syncEvery rows
+void ShardedKMeans::appendLog(const double* point, const std::string& name) {
+	if (!logFile) {
+		logFile = fopen((fileName + ".log").c_str(), "ab");
+		if (!logFile) {
+			std::cout << "Could not open the dataset log " << fileName << ".log" << std::endl;
+			return;
+		}
+	}
+	std::string row = formatDataSetRow(name, point, dim);
+	char checksum[20];
+	snprintf(checksum, sizeof(checksum), "#%016llx\n", (unsigned long long)fnv1a64(row.data(), row.size()));
+	row += checksum;
+	fwrite(row.data(), 1, row.size(), logFile);
+	if (++unsyncedRows >= std::max(config.syncEvery, (size_t)1)) {
+		fflush(logFile);
+		syncFile(logFile);
+		unsyncedRows = 0;
+	}
+}
+
+// clusterMembers
+// precondition: train returned true, c is less than k
+// postcondition: return the file names of every row of every shard in cluster c, in row order
+std::vector<std::string> ShardedKMeans::clusterMembers(const int c) {
+	std::vector<std::string> fileNames;
+	std::string payload;
+	put<int32_t>(payload, c);
+	if (!broadcast(SHARD_MEMBERS, payload))
+		return fileNames;
+	std::vector<std::pair<uint64_t, std::string>> members;
+	std::string reply;
+	for (size_t s = 0; s < shards.size(); s++) {
+		if (!receive(s, reply))
+			return fileNames;
+		PayloadReader in(reply);
+		uint64_t count = in.get<uint64_t>();
+		for (uint64_t r = 0; r < count && in.ok; r++) {
+			uint64_t index = in.get<uint64_t>();
+			members.push_back(std::make_pair(index, in.getString()));
+		}
+		if (!in.ok) {
+			stop();
+			return fileNames;
+		}
+	}
+	std::sort(members.begin(), members.end());
+	for (auto& member : members)
+		fileNames.push_back(std::move(member.second));
+	return fileNames;
+}
@@ -0,0 +1,276 @@
+// ShardedKMeans.h
+// author: Cheuk-Hang Tse
+// This file contains the declaration of the ShardedKMeans class.
+// A ShardedKMeans trains and serves the k mean clustering of a dataset split across several worker processes on one machine.
+// The coordinator forks one worker per shard and talks to it over a Unix socket pair. Every worker loads its own part of the
+// dataset (a contiguous range of rows of a pose dataset, or every shards-th row of a CSV dataset), so the rows are only held
+// by the workers and each worker can be pinned to its own processor, which keeps its rows in the memory of that processor.
+// In every iteration the coordinator sends the centroids to every worker, every worker assigns its rows and returns the sums
+// and counts of its clusters, and the coordinator adds them up in shard order to compute the next centroids.
+// The queries are sent to every worker at the same time and their answers are merged, so the results are the same as the
+// ones of a KMeanCluster trained on the whole dataset with the same centroids
+// Like KMeanCluster, the valid rows of the dataset log <dataset>.log are replayed after the dataset, and every new point is
+// appended to the log with a checksum, so the sharded and the single process models read and write the same rows
+// Only supported on Linux and other POSIX systems
+//
+// CONSTRUCTOR:
+// ShardedKMeans(const string _fileName, const int _k, const ShardConfig& _config): define a training of _k clusters
+//		over the dataset _fileName split into the shards of _config
+//
+// FUNCTIONS:
+// start: fork the workers and wait until every one has loaded its shard
+// train: run k-means over every shard until the clustering converges
+// related: return the file names of every row in the cluster of a point
+// nearest: return the closest rows to a point over every shard
+// cluster: add a point to the shard with the fewest rows and return the file names in its cluster
+// stop: ask every worker to exit and wait for it
+// getCentroids: return the trained centroids
+// getRows: return the number of rows over every shard
+// getShardRows: return the number of rows of one shard
+// getDim: return the number of coordinates of a row
+// getIterations: return the number of assignment rounds
+// getInertia: return the sum of squared distances from every row to its centroid in the last round
+// getTrainSeconds: return the number of seconds the training took
+// getReduceSeconds: return the number of seconds the coordinator spent adding up the sums of the workers
+// clusterMembers: return the file names of every row in a cluster over every shard
+// serveShard: load a shard and answer the commands of the coordinator, run by every worker
+// loadShard: read the rows of a shard from the dataset
+// sampleSeeds: pick the initial centroids with k-means++ from a sample of rows of every shard
+// broadcast: send the same command to every worker
+// receive: wait for the reply of one worker
+// replayLog: add the valid rows of the dataset log to the shards
+// findSaved: find out which file names are already held by a shard
+// insertRow: add a point to the shard with the fewest rows
+// appendLog: append a point to the dataset log with a checksum
+
+#pragma once
+#include "DistanceKernel.h"
+#include "KMeanCluster.h"
+#include "PoseDataset.h"
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <unordered_set>
+#include <vector>
+
+// ShardConfig
+// The number of worker processes and the stopping rules of a sharded training
+// The training stops after maxIterations rounds, or earlier when no row changes its cluster or no centroid moves more than tolerance
+struct ShardConfig {
+	int shards = 2; // number of worker processes, each one holds one shard of the dataset
+	bool pinCpus = false; // pin worker s to processor s modulo the number of processors before it loads its shard
+	int maxIterations = 100; // maximum number of assignment rounds
+	double tolerance = 0; // stop when no centroid moves more than this distance
+	unsigned int seed = 0; // seed for the sample and the initial centroids, 0 uses the current time
+	size_t sampleRows = 100000; // rows sampled over every shard to pick the initial centroids from
+	size_t syncEvery = 32; // rows appended to the dataset log between two fsync calls, the log is also synced by stop
+};
+
+class ShardedKMeans {
+public:
+	// ShardedKMeans
+	// precondition: _k and _config.shards are positive
+	// postcondition: define a training of _k clusters over the dataset _fileName split into the shards of _config
+	ShardedKMeans(const std::string _fileName, const int _k, const ShardConfig& _config);
+
+	// ~ShardedKMeans
+	// precondition: none
+	// postcondition: stop the workers
+	~ShardedKMeans();
+
+	ShardedKMeans(const ShardedKMeans&) = delete;
+	ShardedKMeans& operator=(const ShardedKMeans&) = delete;
+
+	// start
+	// precondition: the workers are not started
+	// postcondition: fork one worker per shard and wait until every worker has loaded its rows
+	//				  Then the valid rows of the dataset log whose file name is not in the dataset yet are added to the shards
+	//				  Rows with a different number of coordinates than the first row are skipped, like KMeanCluster does
+	//				  Return false if a worker could not be started or the dataset is empty or could not be read
+	bool start();
+
+	// train
+	// precondition: start returned true
+	// postcondition: pick the initial centroids, then send them to every worker, add up the sums and counts the workers return
+	//				  and compute the next centroids, until no row changes its cluster, no centroid moves more than tolerance,
+	//				  or maxIterations rounds ran. Return false if a worker failed
+	bool train();
+
+	// related
+	// precondition: train returned true, point has dim coordinates
+	// postcondition: return the file names of every row in the cluster of the closest centroid to point, in row order
+	std::vector<std::string> related(const std::vector<double>& point);
+
+	// nearest
+	// precondition: train returned true, point has dim coordinates
+	// postcondition: return the n closest rows to point over every shard, the closest first. Rows at the same distance are in
+	//				  row order, like KMeanCluster::nearest with every cluster visited
+	std::vector<Neighbor> nearest(const std::vector<double>& point, const size_t n);
+
+	// cluster
+	// precondition: train returned true, point has dim coordinates
+	// postcondition: add point named fileName to the cluster of its closest centroid in the shard with the fewest rows and
+	//				  return the file names in that cluster, fileName last. The point is appended to the dataset log unless a row
+	//				  with fileName is already stored, like KMeanCluster::cluster does
+	std::vector<std::string> cluster(const std::vector<double>& point, const std::string fileName);
+
+	// stop
+	// precondition: none
+	// postcondition: sync and close the dataset log, ask every worker to exit and wait for it. The rows of the shards are gone afterwards
+	void stop();
+
+	// getCentroids
+	// precondition: none
+	// postcondition: return the k x dim centroids, row-major
+	const std::vector<double>& getCentroids() const { return centroids; }
+
+	// getRows
+	// precondition: none
+	// postcondition: return the number of rows over every shard
+	size_t getRows() const { return nRows; }
+
+	// getShardRows
+	// precondition: s is less than the number of started shards
+	// postcondition: return the number of rows of shard s
+	size_t getShardRows(const size_t s) const { return shards[s].rows; }
+
+	// getDim
+	// precondition: none
+	// postcondition: return the number of coordinates of a row
+	size_t getDim() const { return dim; }
+
+	// getIterations
+	// precondition: none
+	// postcondition: return the number of assignment rounds the last training ran
+	int getIterations() const { return iterations; }
+
+	// getInertia
+	// precondition: none
+	// postcondition: return the sum of squared distances from every row to the centroid it was assigned to in the last round
+	double getInertia() const { return inertia; }
+
+	// getTrainSeconds
+	// precondition: none
+	// postcondition: return the number of seconds the last training took
+	double getTrainSeconds() const { return trainSeconds; }
+
+	// getReduceSeconds
+	// precondition: none
+	// postcondition: return the number of seconds the last training spent adding up the sums and counts returned by the workers
+	double getReduceSeconds() const { return reduceSeconds; }
+
+private:
+	// Shard
+	// A worker process as seen by the coordinator
+	struct Shard {
+		int pid = -1; // process id of the worker
+		int fd = -1; // coordinator end of the socket pair
+		size_t rows = 0; // number of rows the worker holds
+	};
+
+	// ShardData
+	// The rows a worker holds, only used in the worker process
+	struct ShardData {
+		PoseDataset mapped; // pose dataset the rows of a pose dataset shard are read from
+		bool datasetNames = false; // true if the names of the rows read from the dataset are read from mapped
+		size_t datasetRows = 0; // number of rows read from the dataset, the rows after them were added by cluster
+		const double* mappedCoords = nullptr; // coordinates of the first row of the shard in mapped, nullptr if they were copied
+		size_t mappedRows = 0; // number of rows whose coordinates are read from mapped
+		std::vector<double> coords; // coordinates of every other row
+		std::vector<std::string> names; // file names of the rows that are not named by mapped
+		std::vector<uint64_t> rowIndex; // index of every row in the whole dataset, rows added by cluster come after the dataset
+		std::vector<int32_t> clusterIds; // cluster of every row in the last round, -1 before the first
+		std::unordered_set<std::string> nameSet; // file name of every row, built on the first lookup
+		bool namesIndexed = false; // true once nameSet holds every row
+
+		// pointAt
+		// precondition: i is less than the number of rows of the shard
+		// postcondition: return the dim coordinates of row i of the shard
+		const double* pointAt(const size_t i, const size_t dim) const {
+			if (!mappedCoords)
+				return coords.data() + i * dim;
+			return i < mappedRows ? mappedCoords + i * dim : coords.data() + (i - mappedRows) * dim;
+		}
+
+		// nameAt
+		// precondition: i is less than the number of rows of the shard
+		// postcondition: return the file name of row i of the shard
+		std::string nameAt(const size_t i) const {
+			if (!datasetNames)
+				return names[i];
+			return i < datasetRows ? mapped.nameAt(rowIndex[i]) : names[i - datasetRows];
+		}
+	};
+
+	// serveShard
+	// precondition: called in a forked worker, fd is its end of the socket pair
+	// postcondition: load shard s and answer the commands of the coordinator until it sends EXIT or closes the socket
+	void serveShard(const int fd, const int s);
+
+	// loadShard
+	// precondition: called in a forked worker
+	// postcondition: read the rows of shard s into data, set dim and store the number of rows of the whole dataset in totalRows
+	//				  The rows of a pose dataset are read from the memory map, or copied if the worker is pinned, so they are
+	//				  allocated in the memory of its processor. Return false if the dataset could not be read
+	bool loadShard(const int s, ShardData& data, uint64_t& totalRows);
+
+	// sampleSeeds
+	// precondition: start returned true
+	// postcondition: collect about sampleRows rows from the shards, in proportion to their number of rows, and pick
+	//				  k centroids from them with k-means++. Return false if a worker failed
+	bool sampleSeeds();
+
+	// clusterMembers
+	// precondition: train returned true, c is less than k
+	// postcondition: return the file names of every row of every shard in cluster c, in row order
+	std::vector<std::string> clusterMembers(const int c);
+
+	// broadcast
+	// precondition: start returned true
+	// postcondition: send command with payload to every worker. Return false if a worker could not be reached
+	bool broadcast(const uint32_t command, const std::string& payload);
+
+	// receive
+	// precondition: a command was sent to shard s
+	// postcondition: wait for the reply of shard s and store it in payload. Return false if the worker failed
+	bool receive(const size_t s, std::string& payload);
+
+	// replayLog
+	// precondition: the workers have loaded their shards
+	// postcondition: add every row of the dataset log with a valid checksum, the right number of coordinates and a file name
+	//				  that is not stored yet to the shards, in log order. Return false if a worker failed
+	bool replayLog();
+
+	// findSaved
+	// precondition: start returned true
+	// postcondition: set saved[i] to 1 if a row named names[i] is held by a shard, else 0. Return false if a worker failed
+	bool findSaved(const std::vector<std::string>& names, std::vector<uint8_t>& saved);
+
+	// insertRow
+	// precondition: the workers have loaded their shards, point has dim coordinates
+	// postcondition: add point named name with cluster c (-1 for none) to the shard with the fewest rows as the next row
+	//				  of the dataset. Return false if the worker failed
+	bool insertRow(const double* point, const std::string& name, const int32_t c);
+
+	// appendLog
+	// precondition: point has dim coordinates
+	// postcondition: append point named name to the dataset log in the format of KMeanCluster::appendRow, and sync the log
+	//				  every syncEvery rows
+	void appendLog(const double* point, const std::string& name);
+
+	std::string fileName; // dataset file name
+	int k; // number of clusters
+	ShardConfig config; // number of shards and stopping rules
+	std::vector<Shard> shards; // started workers
+	size_t dim = 0; // number of coordinates of a row
+	size_t nRows = 0; // number of rows over every shard
+	uint64_t nextRow = 0; // index the next row added by cluster gets
+	std::vector<double> centroids; // k rows of dim coordinates
+	bool trained = false; // true after a successful training
+	int iterations = 0; // assignment rounds of the last training
+	double inertia = 0; // sum of squared distances in the last round
+	double trainSeconds = 0; // duration of the last training
+	double reduceSeconds = 0; // time the coordinator spent adding up the replies of the workers
+	FILE* logFile = nullptr; // dataset log, opened on the first append
+	size_t unsyncedRows = 0; // rows appended to the log since the last sync
+};
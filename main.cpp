@@ -1,14 +1,50 @@
 // main.cpp
 // author: Cheuk-Hang Tse
-// The code includes 3 functions: validateParameters, pre_processPoints, and showRelatedPoseImages
+// The code includes 26 functions: validateParameters, showRelatedPoseImages, isBatchInput, collectImageFiles, parseOptions, optionInt, optionDouble, datasetFile, makeTrainConfig, parseSweep, makeStorageConfig, makeOnlineConfig, makeKeypointCache, reportKeypointCache, reportTraining, reportTrainScaling, reportSweep, reportPeakExtraction, writeOrientedJpeg, reportReducedDecode, runBenchmark, runMultiPerson, runSharded, runBatch, runStream, and runDaemon
 // validateParameters: Return true if the device is "gpu" or "cpu", else false
-// pre_processPoints: convert the Points vector into a normalized double vector
 // showRelatedPoseImages: show all the image based on the file names within the fileNames vector
+// isBatchInput: Return true if the input is a directory, a glob pattern, or a file list, else false
+// collectImageFiles: return all the image file names that the batch input refers to
+// parseOptions: read the optional --name=value parameters after the 3 required parameters
+// optionInt: return the integer value of an option, or a default value if the option is not given
+// optionDouble: return the floating point value of an option, or a default value if the option is not given
+// datasetFile: return the dataset file the clustering model is trained on
+// makeTrainConfig: read the k mean training settings from the optional parameters
+// parseSweep: read the list of k a sweep trains
+// makeStorageConfig: read how new points are written to the dataset from the optional parameters
+// makeOnlineConfig: read how new points move the centroids from the optional parameters
+// makeKeypointCache: open the keypoint cache for the network settings unless it is turned off
+// reportKeypointCache: print the hits, misses and evictions of the keypoint cache
+// reportTraining: print the training time and the number of distance evaluations the training saved
+// reportTrainScaling: train the same model with 1 to N threads and report the training time and speedup
+// reportSweep: print the inertia, silhouette and Davies-Bouldin index of every k of a sweep and the k it kept
+// reportPeakExtraction: compare the time and accuracy of the body part search with minMaxLoc and with the vectorized peak kernel
+// writeOrientedJpeg: copy a JPEG file with an EXIF orientation, so readers that apply it turn the image
+// reportReducedDecode: compare the decode time and the keypoints of full and reduced scale decoding
+// runBenchmark: time the clustering and pose processing hot paths on synthetic data and write the results to a JSON file
+// runMultiPerson: find every person of one image with a single forward pass and cluster each of them
+// runSharded: train the clusters over several worker processes and query them with the pose of one image
+// runBatch: run every image through the PosePipeline and cluster all of them into one KMeanCluster
+// runStream: run a video file or camera through a PoseStream and cluster the pose of its frames
+// runDaemon: keep the network and the clusters in memory and answer queries over a Unix domain socket
 // This functions are used to perform human pose estimation and find similar images
 // Author: Cheuk-Hang Tse
 
 #include "HumanPoseEstimation.h"
 #include "KMeanCluster.h"
+#include "PosePipeline.h"
+#include "KeypointCache.h"
+#include "PoseStream.h"
+#include "PoseDaemon.h"
+#include "OutOfCoreKMeans.h"
+#include "ShardedKMeans.h"
+#include "Benchmark.h"
+#include "Metrics.h"
+#include <csignal>
+#include <filesystem>
+#include <map>
+#include <memory>
+#include <random>
 
 // validateParameters
 // precondition: device is inputted correctly
@@ -17,80 +53,933 @@ bool validateParameters(const string device) {
     return (device == "gpu" || device == "cpu");
 }
 
-// pre_processPoints
-// precondition: vector of points should not be empty
-// postcondition: convert the Points vector into a normalized double vector
-vector<double> pre_processPoints(const vector<Point>& v) {
-	// Convert points into a Cluster_Point
-	vector<double> p;
-	double maxX = 0;
-	double minX = std::numeric_limits<double>::max();
-	double maxY = 0;
-	double minY = std::numeric_limits<double>::max();
-	for (int i = 0; i < v.size(); i++) {
-		maxX = max(maxX, (double)v.at(i).x);
-		maxY = max(maxY, (double)v.at(i).y);
-		minX = min(minX, (double)v.at(i).x);
-		minY = min(minY, (double)v.at(i).y);
-	}
-	for (int i = 0; i < v.size(); i++) {
-		p.push_back(((double)v.at(i).x - minX) / (maxX - minX));
-		p.push_back(((double)v.at(i).y - minY) / (maxY - minY));
-	}
-	return p;
-}
-
 // showRelatedPoseImages
 // precondition: fileNames is not an empty string vector
 // postcondition: show all the image based on the file names within the fileNames vector
+//				  Names that cannot be read as an image, like the source#frame rows of a stream, are skipped
 void showRelatedPoseImages(const vector<string> fileNames) {
 	for (int i = 0; i < fileNames.size(); i++) {
 		Mat frame = imread(fileNames.at(i));
+		if (frame.empty())
+			continue;
 		string name = "realated-image" + to_string(i);
 		imshow(name, frame);
 	}
 	waitKey();
 }
 
+// isBatchInput
+// precondition: input is not an empty string
+// postcondition: return true if the input is a directory, a glob pattern (contains '*' or '?'), or a .txt file list, else false
+bool isBatchInput(const string input) {
+	if (input.find('*') != string::npos || input.find('?') != string::npos)
+		return true;
+	if (input.size() > 4 && input.substr(input.size() - 4) == ".txt")
+		return true;
+	return std::filesystem::is_directory(input);
+}
+
+// collectImageFiles
+// precondition: input is a directory, a glob pattern, or a .txt file with one image file name per line
+// postcondition: return all the image file names that the batch input refers to, sorted by name
+vector<string> collectImageFiles(const string input) {
+	vector<string> imageFiles;
+	if (input.size() > 4 && input.substr(input.size() - 4) == ".txt") {
+		std::ifstream list(input);
+		string line;
+		while (getline(list, line)) {
+			if (!line.empty() && line.back() == '\r')
+				line.pop_back();
+			if (!line.empty())
+				imageFiles.push_back(line);
+		}
+		return imageFiles;
+	}
+
+	vector<cv::String> matches;
+	cv::glob(input, matches, false);
+	for (const auto& file : matches) {
+		string ext = std::filesystem::path(file).extension().string();
+		std::transform(ext.begin(), ext.end(), ext.begin(), ::tolower);
+		if (ext == ".jpg" || ext == ".jpeg" || ext == ".png" || ext == ".bmp")
+			imageFiles.push_back(file);
+	}
+	std::sort(imageFiles.begin(), imageFiles.end());
+	return imageFiles;
+}
+
+// parseOptions
+// precondition: argv has argc entries
+// postcondition: return the optional --name=value parameters from argv[first] onwards as a name to value map
+//				  An option without a value (--name) is stored with the value "1"
+map<string, string> parseOptions(int argc, char* argv[], const int first) {
+	map<string, string> options;
+	for (int i = first; i < argc; i++) {
+		string arg = argv[i];
+		if (arg.rfind("--", 0) != 0) {
+			cout << "Ignoring unknown parameter " << arg << endl;
+			continue;
+		}
+		size_t eq = arg.find('=');
+		if (eq == string::npos)
+			options[arg.substr(2)] = "1";
+		else
+			options[arg.substr(2, eq - 2)] = arg.substr(eq + 1);
+	}
+	return options;
+}
+
+// optionInt
+// precondition: none
+// postcondition: return the integer value of the option name, or defaultValue if the option is not given
+int optionInt(const map<string, string>& options, const string name, const int defaultValue) {
+	auto it = options.find(name);
+	return it == options.end() ? defaultValue : stoi(it->second);
+}
+
+// optionDouble
+// precondition: none
+// postcondition: return the floating point value of the option name, or defaultValue if the option is not given
+double optionDouble(const map<string, string>& options, const string name, const double defaultValue) {
+	auto it = options.find(name);
+	return it == options.end() ? defaultValue : stod(it->second);
+}
+
+// datasetFile
+// precondition: none
+// postcondition: return the --dataset option, or test.csv if it is not given. The file can be a CSV or a pose dataset
+string datasetFile(const map<string, string>& options) {
+	return options.count("dataset") ? options.at("dataset") : "test.csv";
+}
+
+// makeTrainConfig
+// precondition: none
+// postcondition: return the k mean training settings from the --train-mode, --seeding, --train-threads, --seed, --iterations,
+//				  --tolerance, --inertia-tolerance, --snapshot, --no-snapshot, --retrain, --warm-start and --float-points options
+//				  The model is saved to and loaded from the dataset file name + ".snapshot" unless another file or --no-snapshot is given
+TrainConfig makeTrainConfig(const map<string, string>& options) {
+	TrainConfig config;
+	config.snapshotFile = options.count("snapshot") ? options.at("snapshot") : datasetFile(options) + ".snapshot";
+	if (options.count("no-snapshot"))
+		config.snapshotFile = "";
+	config.forceRetrain = options.count("retrain") > 0;
+	config.warmStart = options.count("warm-start") > 0;
+	config.floatPoints = options.count("float-points") > 0;
+	if (options.count("train-mode") && options.at("train-mode") == "hamerly")
+		config.mode = TrainMode::HAMERLY;
+	if (options.count("seeding") && options.at("seeding") == "random")
+		config.seeding = SeedMode::RANDOM;
+	config.tolerance = optionDouble(options, "tolerance", config.tolerance);
+	config.inertiaTolerance = optionDouble(options, "inertia-tolerance", config.inertiaTolerance);
+	config.nThreads = optionInt(options, "train-threads", config.nThreads);
+	config.seed = (unsigned int)optionInt(options, "seed", (int)config.seed);
+	config.maxIterations = optionInt(options, "iterations", config.maxIterations);
+	return config;
+}
+
+// parseSweep
+// precondition: none
+// postcondition: return the k values of a sweep written as a range "2-12" or a list "4,8,16", or an empty vector if it is not valid
+vector<int> parseSweep(const string sweep) {
+	vector<int> ks;
+	try {
+		size_t dash = sweep.find('-');
+		if (dash != string::npos) {
+			int first = stoi(sweep.substr(0, dash));
+			int last = stoi(sweep.substr(dash + 1));
+			for (int sweepK = max(1, first); sweepK <= last; sweepK++)
+				ks.push_back(sweepK);
+		}
+		else {
+			std::stringstream str(sweep);
+			string word;
+			while (getline(str, word, ','))
+				ks.push_back(stoi(word));
+		}
+	}
+	catch (const exception&) {
+		ks.clear();
+	}
+	return ks;
+}
+
+// makeStorageConfig
+// precondition: none
+// postcondition: return the dataset storage settings from the --sync-every and --compact-after options
+StorageConfig makeStorageConfig(const map<string, string>& options) {
+	StorageConfig storage;
+	storage.syncEvery = (size_t)optionInt(options, "sync-every", (int)storage.syncEvery);
+	storage.compactAfter = (size_t)optionInt(options, "compact-after", (int)storage.compactAfter);
+	return storage;
+}
+
+// makeOnlineConfig
+// precondition: none
+// postcondition: return the online update settings from the --online, --online-batch, --min-learning-rate and --reassign-every options
+OnlineConfig makeOnlineConfig(const map<string, string>& options) {
+	OnlineConfig online;
+	online.enabled = options.count("online") > 0;
+	online.batchSize = (size_t)max(1, optionInt(options, "online-batch", (int)online.batchSize));
+	online.minLearningRate = optionDouble(options, "min-learning-rate", online.minLearningRate);
+	online.reassignEvery = (size_t)max(0, optionInt(options, "reassign-every", (int)online.reassignEvery));
+	return online;
+}
+
+// makeKeypointCache
+// precondition: none
+// postcondition: return the keypoint cache of the --cache file (default keypoints.cache) with --cache-size entries (default 10000)
+//				  for the pose model, network input size, threshold and the --subpixel and --reduced-decode options
+//				  Return nullptr with --no-cache
+std::unique_ptr<KeypointCache> makeKeypointCache(const map<string, string>& options, const int inWidth, const int inHeight, const float thresh) {
+	if (options.count("no-cache"))
+		return nullptr;
+	string fileName = options.count("cache") ? options.at("cache") : "keypoints.cache";
+	size_t capacity = (size_t)max(1, optionInt(options, "cache-size", 10000));
+	std::stringstream settings;
+	settings << poseModelName() << ',' << inWidth << 'x' << inHeight << ',' << thresh << ",subpixel=" << options.count("subpixel")
+		<< ",reduced=" << options.count("reduced-decode");
+	return std::unique_ptr<KeypointCache>(new KeypointCache(fileName, capacity, settings.str()));
+}
+
+// reportKeypointCache
+// precondition: none
+// postcondition: print the hits, misses and evictions of cache, nothing if it is nullptr
+void reportKeypointCache(KeypointCache* cache) {
+	if (cache)
+		cout << "Keypoint cache: " << cache->getHits() << " hits, " << cache->getMisses() << " misses, " << cache->getEvictions() << " evictions" << endl;
+}
+
+// reportTraining
+// precondition: kCluster is trained
+// postcondition: print the training time, iterations, inertia and the number of distance evaluations compared with plain Lloyd
+//				  or that the model was loaded from its snapshot
+void reportTraining(const KMeanCluster& kCluster) {
+	if (kCluster.isFromSnapshot()) {
+		cout << "Clusters loaded from the snapshot, no training needed" << endl;
+		return;
+	}
+	size_t lloyd = kCluster.getLloydDistanceEvaluations();
+	size_t evaluations = kCluster.getDistanceEvaluations();
+	cout << "Clusters trained in " << kCluster.getTrainSeconds() << " s and " << kCluster.getIterations() << " iterations (inertia "
+		<< kCluster.getInertia() << ") with " << evaluations << " distance evaluations";
+	if (lloyd)
+		cout << " (" << 100.0 * ((double)lloyd - (double)evaluations) / lloyd << "% saved over Lloyd)";
+	cout << endl;
+}
+
+// reportTrainScaling
+// precondition: k and maxThreads are positive
+// postcondition: train the dataset with 1, 2, 4, ... and maxThreads threads and the same seed
+//				  Print the training time and the speedup over one thread for every thread count
+void reportTrainScaling(const string dataset, const int k, const int maxThreads, TrainConfig config) {
+	if (!config.seed)
+		config.seed = 1;
+	config.snapshotFile = "";
+	vector<int> threadCounts;
+	for (int nThreads = 1; nThreads < maxThreads; nThreads *= 2)
+		threadCounts.push_back(nThreads);
+	threadCounts.push_back(maxThreads);
+
+	double baseTime = 0;
+	for (int nThreads : threadCounts) {
+		config.nThreads = nThreads;
+		KMeanCluster kCluster(dataset, k, config);
+		double t = kCluster.getTrainSeconds();
+		if (nThreads == 1)
+			baseTime = t;
+		cout << "threads=" << nThreads << " train=" << t << " s speedup=" << (t > 0 ? baseTime / t : 0) << endl;
+	}
+}
+
+// reportSweep
+// precondition: kCluster was trained by a sweep
+// postcondition: print the iterations, inertia, silhouette and Davies-Bouldin index of every k, mark the k that was kept,
+//				  and print the training time of the whole sweep
+void reportSweep(const KMeanCluster& kCluster) {
+	cout << "k\titerations\tinertia\tsilhouette\tdavies-bouldin" << endl;
+	for (const auto& result : kCluster.getSweepResults()) {
+		cout << result.k << '\t' << result.iterations << '\t' << result.inertia << '\t' << result.silhouette << '\t' << result.daviesBouldin
+			<< (result.chosen ? "\t<- kept" : "") << endl;
+	}
+	cout << "Sweep trained in " << kCluster.getTrainSeconds() << " s with " << kCluster.getDistanceEvaluations() << " distance evaluations" << endl;
+}
+
+// reportPeakExtraction
+// precondition: batchSize is positive
+// postcondition: time the body part search on a batch of batchSize synthetic 44 x 46 x 46 network outputs with a Mat header and a
+//				  minMaxLoc per heatmap (the previous path) and with the vectorized peak kernel on one and on every thread
+//				  Also report how many peaks differ from minMaxLoc and the mean distance to the true peak with and without refinement
+void reportPeakExtraction(const int batchSize) {
+	const int C = 44, H = 46, W = 46, nParts = 15, scale = 8, repeats = 100;
+	int sizes[] = { batchSize, C, H, W };
+	vector<float> data((size_t)batchSize * C * H * W);
+	vector<Point2f> truth;
+	std::mt19937 rng(1);
+	std::uniform_real_distribution<float> uniform(0, 1);
+	for (int b = 0; b < batchSize; b++) {
+		for (int c = 0; c < C; c++) {
+			// a gaussian blob with a sub-pixel center and some noise, like a body part heatmap
+			float cx = 2 + uniform(rng) * (W - 4);
+			float cy = 2 + uniform(rng) * (H - 4);
+			if (c < nParts)
+				truth.push_back(Point2f(cx, cy));
+			float* map = data.data() + ((size_t)b * C + c) * H * W;
+			for (int y = 0; y < H; y++)
+				for (int x = 0; x < W; x++)
+					map[y * W + x] = std::exp(-((x - cx) * (x - cx) + (y - cy) * (y - cy)) / 4.5f) + 0.01f * uniform(rng);
+		}
+	}
+	Mat output(4, sizes, CV_32F, data.data());
+	vector<Size> frameSizes(batchSize, Size(W * scale, H * scale));
+
+	// previous path: a Mat header and a minMaxLoc per heatmap
+	vector<Point> reference;
+	double t = (double)cv::getTickCount();
+	for (int r = 0; r < repeats; r++) {
+		reference.clear();
+		for (int b = 0; b < batchSize; b++) {
+			for (int n = 0; n < nParts; n++) {
+				Mat probMap(H, W, CV_32F, output.ptr(b, n));
+				Point maxLoc;
+				double prob;
+				minMaxLoc(probMap, 0, &prob, 0, &maxLoc);
+				reference.push_back(maxLoc);
+			}
+		}
+	}
+	double minMaxTime = ((double)cv::getTickCount() - t) / cv::getTickFrequency() / repeats;
+
+	// vectorized kernel on one thread and on every thread, with and without refinement
+	auto timeKernel = [&](const bool subPixel, const int nThreads, vector<vector<Point>>& poses) {
+		double start = (double)cv::getTickCount();
+		for (int r = 0; r < repeats; r++)
+			poses = findBodyPartPositions(output, 0.1f, frameSizes, subPixel, nThreads);
+		return ((double)cv::getTickCount() - start) / cv::getTickFrequency() / repeats;
+	};
+	vector<vector<Point>> plain, refined;
+	double kernelTime = timeKernel(false, 1, plain);
+	double parallelTime = timeKernel(false, defaultThreadCount(), plain);
+	double refinedTime = timeKernel(true, 1, refined);
+
+	size_t nDifferent = 0;
+	double plainError = 0, refinedError = 0;
+	for (int b = 0; b < batchSize; b++) {
+		for (int n = 0; n < nParts; n++) {
+			const Point2f& expected = truth[b * nParts + n];
+			Point p = plain[b][n];
+			Point q = refined[b][n];
+			nDifferent += p != reference[b * nParts + n] * scale;
+			plainError += std::hypot(p.x / (double)scale - expected.x, p.y / (double)scale - expected.y);
+			refinedError += std::hypot(q.x / (double)scale - expected.x, q.y / (double)scale - expected.y);
+		}
+	}
+	size_t nPeaks = (size_t)batchSize * nParts;
+	cout << "minMaxLoc: " << 1e6 * minMaxTime / batchSize << " us/image" << endl;
+	cout << "peak kernel (" << peakKernelName() << ", 1 thread): " << 1e6 * kernelTime / batchSize << " us/image, "
+		<< nDifferent << " of " << nPeaks << " peaks differ from minMaxLoc" << endl;
+	cout << "peak kernel (" << defaultThreadCount() << " threads): " << 1e6 * parallelTime / batchSize << " us/image" << endl;
+	cout << "peak kernel with sub-pixel refinement: " << 1e6 * refinedTime / batchSize << " us/image" << endl;
+	cout << "mean peak error in heatmap cells: " << plainError / nPeaks << " without refinement, " << refinedError / nPeaks << " with refinement" << endl;
+}
+
+// writeOrientedJpeg
+// precondition: orientation is from 1 to 8
+// postcondition: copy the JPEG file imageFile to outputFile with an EXIF segment that only holds orientation in front of the
+//				  other segments, so imread turns the image the way a camera held sideways asks for (6 is 90 degrees clockwise)
+//				  Return false if imageFile is not a JPEG file or outputFile could not be written
+bool writeOrientedJpeg(const string imageFile, const string outputFile, const int orientation) {
+	std::ifstream in(imageFile, ios::binary);
+	string data((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+	if (data.size() < 4 || (unsigned char)data[0] != 0xFF || (unsigned char)data[1] != 0xD8)
+		return false;
+	// APP1 segment: "Exif", a little-endian TIFF header and one IFD with the orientation tag (0x0112, SHORT)
+	const unsigned char exif[] = {
+		0xFF, 0xE1, 0x00, 0x22, 'E', 'x', 'i', 'f', 0, 0,
+		'I', 'I', 0x2A, 0x00, 0x08, 0x00, 0x00, 0x00,
+		0x01, 0x00, 0x12, 0x01, 0x03, 0x00, 0x01, 0x00, 0x00, 0x00, (unsigned char)orientation, 0x00, 0x00, 0x00,
+		0x00, 0x00, 0x00, 0x00
+	};
+	std::ofstream out(outputFile, ios::binary | ios::trunc);
+	out.write(data.data(), 2);
+	out.write((const char*)exif, sizeof(exif));
+	out.write(data.data() + 2, data.size() - 2);
+	return (bool)out;
+}
+
+// reportReducedDecode
+// precondition: device is "gpu" or "cpu", imageFiles is not empty
+// postcondition: decode every image at full scale and at the reduced scale chosen for the network input and report the mean decode
+//				  time of both. The pose of both decodes is estimated and the mean distance between the keypoints found in both,
+//				  in original image pixels, is reported with the number of keypoints found in only one of them
+//				  A copy of the first JPEG image turned by its EXIF orientation is added, and its keypoint distance is reported on its own
+void reportReducedDecode(const string device, const vector<string>& imageFiles, const int inWidth, const int inHeight, const float thresh) {
+	const int repeats = 5;
+	Net netModel = loadPoseNetwork(device);
+	vector<string> samples = imageFiles;
+	string rotatedFile = (std::filesystem::temp_directory_path() / "kmean-pose-rotated.jpg").string();
+	bool rotated = false;
+	for (const auto& imageFile : imageFiles) {
+		if (writeOrientedJpeg(imageFile, rotatedFile, 6)) {
+			samples.push_back(rotatedFile);
+			rotated = true;
+			break;
+		}
+	}
+	double fullTime = 0, reducedTime = 0, distance = 0, rotatedDistance = 0;
+	size_t nImages = 0, nReduced = 0, nMatched = 0, nMissed = 0, nRotatedMatched = 0;
+	for (const auto& imageFile : samples) {
+		Mat full, reduced;
+		Size originalSize;
+		double t = (double)cv::getTickCount();
+		for (int r = 0; r < repeats; r++)
+			full = imread(imageFile);
+		fullTime += ((double)cv::getTickCount() - t) / cv::getTickFrequency() / repeats;
+		t = (double)cv::getTickCount();
+		for (int r = 0; r < repeats; r++)
+			reduced = decodeImage(imageFile, inWidth, inHeight, true, originalSize);
+		reducedTime += ((double)cv::getTickCount() - t) / cv::getTickFrequency() / repeats;
+		if (full.empty() || reduced.empty())
+			continue;
+		nImages++;
+		nReduced += reduced.cols < full.cols;
+
+		// both poses are in the coordinates of the full image
+		vector<Point> fullPoints = estimatePose(netModel, full, inWidth, inHeight, thresh);
+		vector<Point> reducedPoints = estimatePose(netModel, reduced, inWidth, inHeight, thresh, false, originalSize);
+		for (size_t n = 0; n < fullPoints.size(); n++) {
+			bool inFull = fullPoints[n].x >= 0, inReduced = reducedPoints[n].x >= 0;
+			if (inFull && inReduced) {
+				double d = std::hypot(fullPoints[n].x - reducedPoints[n].x, fullPoints[n].y - reducedPoints[n].y);
+				distance += d;
+				nMatched++;
+				if (rotated && imageFile == rotatedFile) {
+					rotatedDistance += d;
+					nRotatedMatched++;
+				}
+			}
+			else if (inFull != inReduced)
+				nMissed++;
+		}
+	}
+	std::error_code ignored;
+	if (rotated)
+		std::filesystem::remove(rotatedFile, ignored);
+	if (!nImages) {
+		cout << "No image could be read" << endl;
+		return;
+	}
+	cout << "full decode: " << 1e3 * fullTime / nImages << " ms/image" << endl;
+	cout << "reduced decode: " << 1e3 * reducedTime / nImages << " ms/image, " << nReduced << " of " << nImages << " images reduced, "
+		<< (reducedTime > 0 ? fullTime / reducedTime : 0) << "x faster" << endl;
+	cout << "keypoints: mean distance " << (nMatched ? distance / nMatched : 0) << " px over " << nMatched << " keypoints, "
+		<< nMissed << " keypoints found by only one decode" << endl;
+	if (rotated)
+		cout << "rotated sample (EXIF orientation 6): mean distance " << (nRotatedMatched ? rotatedDistance / nRotatedMatched : 0) << " px over "
+			<< nRotatedMatched << " keypoints" << endl;
+}
+
+// runMultiPerson
+// precondition: device is "gpu" or "cpu", kCluster is trained
+// postcondition: find every person of imageFile with one forward pass and the part affinity fields, cluster each person into
+//				  kCluster as imageFile#n and write one line per person with its related images (or --top=N closest poses) to test.txt
+//				  The related images of every person are shown, or printed with --headless
+int runMultiPerson(const string device, const string imageFile, KMeanCluster& kCluster, const int inWidth, const int inHeight, const float thresh,
+	const map<string, string>& options) {
+	bool headless = options.count("headless") > 0;
+	vector<vector<Point>> people = performMultiPersonEstimation(device, imageFile, inWidth, inHeight, thresh, !headless,
+		options.count("subpixel") > 0, options.count("reduced-decode") > 0);
+	int topN = optionInt(options, "top", 0);
+	std::ofstream out("test.txt");
+	vector<string> shown;
+	for (size_t n = 0; n < people.size(); n++) {
+		string name = imageFile + "#" + to_string(n);
+		vector<double> p = pre_processPoints(people[n]);
+		vector<string> files;
+		if (topN > 0) {
+			for (const auto& neighbor : kCluster.nearest(p, topN, optionInt(options, "probe", 0)))
+				files.push_back(neighbor.fileName);
+			kCluster.cluster(p, name);
+		}
+		else
+			files = kCluster.cluster(p, name);
+
+		out << name;
+		for (const auto& row : files)
+			out << ',' << row;
+		out << '\n';
+		if (headless) {
+			cout << "Person " << n << ":" << endl;
+			for (const auto& row : files)
+				cout << row << endl;
+		}
+		shown.insert(shown.end(), files.begin(), files.end());
+	}
+	out.close();
+	if (!headless)
+		showRelatedPoseImages(shown);
+	return 0;
+}
+
+// runSharded
+// precondition: device is "gpu" or "cpu"
+// postcondition: train the clusters of dataset and its log over --shards=N worker processes, find the pose of imageFile and write
+//				  the images in its cluster (or its --top=N closest poses over every shard) to test.txt. The pose is appended to the
+//				  dataset log like in the other modes. The workers are started before the network is loaded, so they are forked
+//				  from a process with a single thread
+int runSharded(const string device, const string imageFile, const string dataset, const int k, const TrainConfig& trainConfig,
+	const int inWidth, const int inHeight, const float thresh, const map<string, string>& options) {
+	ShardConfig config;
+	config.shards = max(1, optionInt(options, "shards", config.shards));
+	config.pinCpus = options.count("pin-shards") > 0;
+	config.maxIterations = trainConfig.maxIterations;
+	config.tolerance = trainConfig.tolerance;
+	config.seed = trainConfig.seed;
+	config.syncEvery = makeStorageConfig(options).syncEvery;
+	ShardedKMeans kCluster(dataset, k, config);
+	if (!kCluster.start() || !kCluster.train()) {
+		cout << "Could not train on " << dataset << " over " << config.shards << " shards" << endl;
+		return -1;
+	}
+	cout << "Clusters trained over " << config.shards << " shards in " << kCluster.getTrainSeconds() << " s and " << kCluster.getIterations()
+		<< " rounds (inertia " << kCluster.getInertia() << ") over " << kCluster.getRows() << " rows, " << kCluster.getReduceSeconds()
+		<< " s adding up the shards" << endl;
+
+	bool headless = options.count("headless") > 0;
+	vector<Point> v = performHumanPoseEstimation(device, imageFile, inWidth, inHeight, thresh, !headless, options.count("subpixel") > 0,
+		options.count("reduced-decode") > 0);
+	vector<double> p = pre_processPoints(v);
+	int topN = optionInt(options, "top", 0);
+	vector<string> files;
+	if (topN > 0) {
+		for (const auto& neighbor : kCluster.nearest(p, topN)) {
+			cout << neighbor.fileName << " distance " << neighbor.distance << endl;
+			files.push_back(neighbor.fileName);
+		}
+		kCluster.cluster(p, imageFile);
+	}
+	else
+		files = kCluster.cluster(p, imageFile);
+	kCluster.stop();
+
+	std::ofstream out("test.txt");
+	for (const auto& row : files)
+		out << row << '\n';
+	out.close();
+	if (headless) {
+		for (const auto& row : files)
+			cout << row << endl;
+	}
+	else
+		showRelatedPoseImages(files);
+	return 0;
+}
+
+// runBatch
+// precondition: device is "gpu" or "cpu", imageFiles is not empty and kCluster is trained
+// postcondition: run every image through the PosePipeline and cluster all of them into kCluster
+//				  The related images of every input are written to test.txt, one line per input image, and images/sec is reported
+//				  With config.topN, the closest stored images are written instead as name:distance, closest first
+//				  Images found in cache (if it is not nullptr) skip the network
+int runBatch(const string device, const vector<string>& imageFiles, KMeanCluster& kCluster, const int inWidth, const int inHeight, const float thresh,
+	const PipelineConfig& config, KeypointCache* cache) {
+	std::ofstream out("test.txt");
+	PosePipeline pipeline(device, config, inWidth, inHeight, thresh);
+	pipeline.setKeypointCache(cache);
+	double t = (double)cv::getTickCount();
+	size_t nProcessed = pipeline.run(imageFiles, kCluster, [&out](const PoseResult& result) {
+		// multi-person mode: one line per person
+		for (size_t n = 0; n < result.people.size(); n++) {
+			out << result.imageFile << '#' << n;
+			const PersonResult& person = result.people[n];
+			if (!person.neighbors.empty()) {
+				for (const auto& neighbor : person.neighbors)
+					out << ',' << neighbor.fileName << ':' << neighbor.distance;
+			}
+			else {
+				for (const auto& row : person.related)
+					out << ',' << row;
+			}
+			out << '\n';
+		}
+		if (!result.people.empty())
+			return;
+		out << result.imageFile;
+		if (!result.neighbors.empty()) {
+			for (const auto& neighbor : result.neighbors)
+				out << ',' << neighbor.fileName << ':' << neighbor.distance;
+		}
+		else {
+			for (const auto& row : result.related)
+				out << ',' << row;
+		}
+		out << '\n';
+	});
+	out.close();
+
+	double batchTime = ((double)cv::getTickCount() - t) / cv::getTickFrequency();
+	cout << "Processed " << nProcessed << " of " << imageFiles.size() << " images in " << batchTime << " s ("
+		<< (batchTime > 0 ? nProcessed / batchTime : 0) << " images/sec)" << endl;
+	return nProcessed == imageFiles.size() ? 0 : -1;
+}
+
+// runStream
+// precondition: device is "gpu" or "cpu", kCluster is trained
+// postcondition: estimate the pose of every frame of source (a video file, or a camera index) with keyframes and tracking,
+//				  look up the poses in kCluster (or cluster them into it with config.persist) and write the related images of every
+//				  clustered frame to test.txt
+//				  The number of frames, keyframes and the frames per second are reported
+int runStream(const string device, const string source, KMeanCluster& kCluster, const int inWidth, const int inHeight, const float thresh,
+	const StreamConfig& config) {
+	PoseStream stream(device, config, inWidth, inHeight, thresh);
+	if (!stream.open(source)) {
+		cout << "Could not open the video: " << source << endl;
+		return -1;
+	}
+	std::ofstream out("test.txt");
+	double t = (double)cv::getTickCount();
+	size_t nFrames = stream.run(kCluster, [&out](const StreamFrame& frame) {
+		if (frame.related.empty())
+			return;
+		out << frame.index << ',' << frame.timestamp << ',' << (frame.keyframe ? "keyframe" : "tracked");
+		for (const auto& row : frame.related)
+			out << ',' << row;
+		out << '\n';
+	});
+	out.close();
+
+	double streamTime = ((double)cv::getTickCount() - t) / cv::getTickFrequency();
+	cout << "Processed " << nFrames << " frames (" << stream.getKeyframes() << " keyframes) in " << streamTime << " s ("
+		<< (streamTime > 0 ? nFrames / streamTime : 0) << " frames/sec)" << endl;
+	return 0;
+}
+
+// runBenchmark
+// precondition: none
+// postcondition: run the BenchmarkSuite with the sizes of the optional parameters and write its results to the JSON file
+//				  --benchmark=FILE (default benchmark.json). Return 0, or -1 if the results could not be written
+int runBenchmark(const map<string, string>& options) {
+	BenchmarkConfig config;
+	config.maxPoints = (size_t)max(1000, optionInt(options, "benchmark-max-points", (int)config.maxPoints));
+	if (options.count("benchmark-dir"))
+		config.workDir = options.at("benchmark-dir");
+	string jsonFile = options.at("benchmark");
+	if (jsonFile.empty() || jsonFile == "1")
+		jsonFile = "benchmark.json";
+	BenchmarkSuite suite(config);
+	return suite.run(jsonFile) ? 0 : -1;
+}
+
+// runDaemon
+// precondition: device is "gpu" or "cpu", kCluster is trained
+// postcondition: answer pose and similarity queries over the Unix domain socket of config until SHUTDOWN, Ctrl+C or SIGTERM
+//				  The latency percentiles of every command are printed at the end
+int runDaemon(const string device, KMeanCluster& kCluster, KeypointCache* cache, const int inWidth, const int inHeight, const float thresh,
+	const DaemonConfig& config) {
+	PoseDaemon daemon(device, config, inWidth, inHeight, thresh, kCluster, cache);
+	signal(SIGINT, [](int) { PoseDaemon::requestStop(); });
+	signal(SIGTERM, [](int) { PoseDaemon::requestStop(); });
+	if (!daemon.run())
+		return -1;
+	cout << "Daemon stopped. Latency in ms: " << daemon.formatStats() << endl;
+	return 0;
+}
+
 // main
 // precondition: there must be 3 parameters: device (gpu/cpu), inputFile (file name with opencv readable file type), k (number of clusters in k mean)
+//				 inputFile can also be a directory, a glob pattern or a .txt file list to run in batch mode
+//				 Optional parameters: --decode-workers=N --blob-workers=N --forward-workers=N --keypoint-workers=N --queue-size=N --batch-size=N
+//									  --train-mode=lloyd|hamerly --seeding=kmeans++|random --train-threads=N --seed=N --iterations=N
+//									  --tolerance=X --inertia-tolerance=X --train-scaling=N
+//									  --sweep=KMIN-KMAX|K1,K2,... --sweep-sample=N --sweep-select=silhouette|davies-bouldin
+//									  --snapshot=FILE --no-snapshot --retrain --warm-start --float-points
+//									  --out-of-core --memory-budget=MB --shards=N --pin-shards
+//									  --sync-every=N --compact-after=N --compact --online --online-batch=N --min-learning-rate=X --reassign-every=N
+//									  --dataset=FILE --convert-dataset=FILE --export-dataset=FILE --top=N --probe=N
+//									  --headless --render=DIR --render-workers=N --subpixel --multi-person --peak-benchmark=N
+//									  --benchmark=FILE --benchmark-max-points=N --benchmark-dir=DIR --metrics=FILE --distance-kernel=NAME
+//									  --reduced-decode --decode-benchmark --cache=FILE --cache-size=N --no-cache
+//									  --stream --keyframe-interval=N --min-tracked=X --max-flow-error=X --cluster-every=N --stream-persist
+//									  --daemon --socket=PATH --daemon-workers=N --daemon-idle=S --query=COMMAND
 // postconditions: Use input parameters to get input image file and perform human pose estimation using a Multi-Person Dataset (MPII) deep neutral network model
 //					The model will produce at most 15 joint pixel locations. These points will be displayed in a window
 //					Next, use the point locations to run a k-mean clustering and find similar images
-//					All the similar images are displayed
+//					All the similar images are displayed. With --headless nothing is displayed and the similar images are printed
+//					Batch mode never displays anything, --render=DIR saves every image with its pose drawn to DIR
+//					With --stream, inputFile is a video file or a camera index and the pose of every frame is shown until q is pressed
 int main(int argc, char* argv[])
 {
-    // Code must have 3 parameters
-    if (argc != 4)
+    // Code must have 3 parameters, followed by the optional parameters
+    if (argc < 4)
         return -1;
 
     // Read parameters
     string device = argv[1];
     string inputFile = argv[2];
 	int k = stoi(argv[3]);
+	map<string, string> options = parseOptions(argc, argv, 4);
 
     // Validate parameters
     if (!validateParameters(device))
         return -1;
 
-	cout << "Start Human Pose Estimation using " << device << " on file " << inputFile << endl;
-
 	int inWidth = 368;
 	int inHeight = 368;
 	float thresh = 0.1;
-	vector<Point> v =performHumanPoseEstimation(device, inputFile, inWidth, inHeight, thresh);
+	TrainConfig trainConfig = makeTrainConfig(options);
+	string dataset = datasetFile(options);
+
+	// Metrics export: write the stage timers and counters when the program exits, on every return path
+	static string metricsFile;
+	if (options.count("metrics")) {
+		metricsFile = options.at("metrics") == "1" ? "metrics.prom" : options.at("metrics");
+		atexit([] {
+			if (!MetricsRegistry::instance().writeFile(metricsFile))
+				cout << "Could not write the metrics to " << metricsFile << endl;
+		});
+	}
+
+	// Distance kernels: run them with another instruction set than the widest one of the processor, e.g. to compare them
+	if (options.count("distance-kernel") && !setDistanceKernel(options.at("distance-kernel")))
+		cout << "Unsupported --distance-kernel " << options.at("distance-kernel") << ", using " << distanceKernelName() << endl;
+
+	// Benchmark suite: time the hot paths on synthetic data, needs neither the network nor a dataset
+	if (options.count("benchmark"))
+		return runBenchmark(options);
+
+	// Peak extraction report: compare minMaxLoc with the peak kernel on a synthetic batch
+	if (options.count("peak-benchmark")) {
+		reportPeakExtraction(max(1, optionInt(options, "peak-benchmark", 8)));
+		return 0;
+	}
+
+	// Training scaling report: train the same model on 1 to N threads
+	if (options.count("train-scaling")) {
+		reportTrainScaling(dataset, k, optionInt(options, "train-scaling", defaultThreadCount()), trainConfig);
+		return 0;
+	}
+
+	// k sweep: train a model for every k at once, report how well each one clusters the dataset and save the best one as the snapshot
+	if (options.count("sweep")) {
+		trainConfig.sweepKs = parseSweep(options.at("sweep"));
+		if (trainConfig.sweepKs.empty()) {
+			cout << "Invalid --sweep " << options.at("sweep") << ", expected a range like 2-12 or a list like 4,8,16" << endl;
+			return -1;
+		}
+		trainConfig.silhouetteSample = (size_t)max(2, optionInt(options, "sweep-sample", (int)trainConfig.silhouetteSample));
+		if (options.count("sweep-select") && options.at("sweep-select") == "davies-bouldin")
+			trainConfig.sweepSelect = SweepSelect::DAVIES_BOULDIN;
+		KMeanCluster kCluster(dataset, k, trainConfig);
+		reportSweep(kCluster);
+		if (kCluster.getSweepResults().empty())
+			return -1;
+		cout << "Kept k=" << kCluster.getK() << ", run with k=" << kCluster.getK() << " to use it" << endl;
+		return 0;
+	}
+
+	// Offline compaction: move the rows of the dataset log into the dataset file
+	if (options.count("compact")) {
+		KMeanCluster kCluster(dataset, k, trainConfig);
+		if (!kCluster.compactDataSet()) {
+			cout << "Could not compact " << dataset << endl;
+			return -1;
+		}
+		cout << "Compacted " << dataset << endl;
+		return 0;
+	}
+
+	// Out-of-core training: stream the dataset from the disk in chunks, save the clusters as the snapshot and exit
+	if (options.count("out-of-core")) {
+		OutOfCoreConfig config;
+		config.memoryBudget = (size_t)max(1, optionInt(options, "memory-budget", (int)(config.memoryBudget >> 20))) << 20;
+		config.maxIterations = trainConfig.maxIterations;
+		config.tolerance = trainConfig.tolerance;
+		config.seed = trainConfig.seed;
+		config.nThreads = trainConfig.nThreads;
+		OutOfCoreKMeans trainer(dataset, k, config);
+		if (!trainer.train()) {
+			cout << "Could not train on " << dataset << endl;
+			return -1;
+		}
+		cout << "Clusters trained out of core in " << trainer.getTrainSeconds() << " s and " << trainer.getIterations() << " passes (inertia "
+			<< trainer.getInertia() << ") over " << trainer.getRows() << " rows in chunks of " << trainer.getChunkRows() << " rows, "
+			<< trainer.getWaitSeconds() << " s waiting for the disk" << endl;
+		if (!trainConfig.snapshotFile.empty() && !trainer.saveSnapshot(trainConfig.snapshotFile)) {
+			cout << "Could not save the snapshot " << trainConfig.snapshotFile << endl;
+			return -1;
+		}
+		return 0;
+	}
+
+	// Dataset conversion: CSV dataset to pose dataset, or pose dataset back to CSV
+	if (options.count("convert-dataset") || options.count("export-dataset")) {
+		bool toBinary = options.count("convert-dataset") > 0;
+		string target = toBinary ? options.at("convert-dataset") : options.at("export-dataset");
+		long long nRows = toBinary ? convertCsvToPoseDataset(dataset, target) : exportPoseDataset(dataset, target);
+		if (nRows < 0) {
+			cout << "Could not convert " << dataset << " to " << target << endl;
+			return -1;
+		}
+		cout << "Wrote " << nRows << " rows from " << dataset << " to " << target << endl;
+		return 0;
+	}
+
+	// Reduced decode report: decode time and keypoint accuracy of full and reduced scale decoding on the input images
+	if (options.count("decode-benchmark")) {
+		vector<string> imageFiles = isBatchInput(inputFile) ? collectImageFiles(inputFile) : vector<string>{ inputFile };
+		reportReducedDecode(device, imageFiles, inWidth, inHeight, thresh);
+		return 0;
+	}
+
+	// Query mode: send one command to a running daemon and print its reply, nothing is loaded or trained
+	if (options.count("query")) {
+		string reply;
+		if (!PoseDaemon::sendCommand(options.count("socket") ? options.at("socket") : DaemonConfig().socketPath, options.at("query"), reply)) {
+			cout << "Could not reach the daemon" << endl;
+			return -1;
+		}
+		cout << reply << endl;
+		return reply.compare(0, 2, "OK") == 0 ? 0 : -1;
+	}
+
+	// Daemon mode: keep the network and the trained clusters in memory and answer queries over a Unix domain socket
+	if (options.count("daemon")) {
+		DaemonConfig config;
+		if (options.count("socket"))
+			config.socketPath = options.at("socket");
+		config.workers = max(1, optionInt(options, "daemon-workers", config.workers));
+		config.idleSeconds = max(0, optionInt(options, "daemon-idle", config.idleSeconds));
+		config.subPixel = options.count("subpixel") > 0;
+		config.reducedDecode = options.count("reduced-decode") > 0;
+		KMeanCluster kCluster(dataset, k, trainConfig);
+		kCluster.setStorageConfig(makeStorageConfig(options));
+		kCluster.setOnlineConfig(makeOnlineConfig(options));
+		reportTraining(kCluster);
+		std::unique_ptr<KeypointCache> cache = makeKeypointCache(options, inWidth, inHeight, thresh);
+		int status = runDaemon(device, kCluster, cache.get(), inWidth, inHeight, thresh, config);
+		reportKeypointCache(cache.get());
+		return status;
+	}
+
+	// Stream mode: the input is a video file or a camera index, the network only runs on keyframes
+	if (options.count("stream")) {
+		StreamConfig config;
+		config.keyframeInterval = max(1, optionInt(options, "keyframe-interval", config.keyframeInterval));
+		config.minTracked = (float)optionDouble(options, "min-tracked", config.minTracked);
+		config.maxFlowError = (float)optionDouble(options, "max-flow-error", config.maxFlowError);
+		config.clusterEvery = max(1, optionInt(options, "cluster-every", config.clusterEvery));
+		config.persist = options.count("stream-persist") > 0;
+		config.subPixel = options.count("subpixel") > 0;
+		config.render = options.count("headless") == 0;
+		cout << "Start streaming Human Pose Estimation using " << device << " on " << inputFile << endl;
+		KMeanCluster kCluster(dataset, k, trainConfig);
+		kCluster.setStorageConfig(makeStorageConfig(options));
+		kCluster.setOnlineConfig(makeOnlineConfig(options));
+		reportTraining(kCluster);
+		return runStream(device, inputFile, kCluster, inWidth, inHeight, thresh, config);
+	}
+
+	// Batch mode: one network and one clustering model for every image
+	if (isBatchInput(inputFile)) {
+		vector<string> imageFiles = collectImageFiles(inputFile);
+		if (imageFiles.empty()) {
+			cout << "No images found in " << inputFile << endl;
+			return -1;
+		}
+		cout << "Start batch Human Pose Estimation using " << device << " on " << imageFiles.size() << " images" << endl;
+		PipelineConfig config;
+		config.decodeWorkers = max(1, optionInt(options, "decode-workers", config.decodeWorkers));
+		config.blobWorkers = max(1, optionInt(options, "blob-workers", config.blobWorkers));
+		config.forwardWorkers = max(1, optionInt(options, "forward-workers", config.forwardWorkers));
+		config.keypointWorkers = max(1, optionInt(options, "keypoint-workers", config.keypointWorkers));
+		config.queueCapacity = (size_t)max(1, optionInt(options, "queue-size", (int)config.queueCapacity));
+		config.batchSize = max(1, optionInt(options, "batch-size", config.batchSize));
+		config.topN = (size_t)optionInt(options, "top", 0);
+		config.subPixel = options.count("subpixel") > 0;
+		config.multiPerson = options.count("multi-person") > 0;
+		config.reducedDecode = options.count("reduced-decode") > 0;
+		if (options.count("render"))
+			config.renderDir = options.at("render");
+		config.renderWorkers = max(1, optionInt(options, "render-workers", config.renderWorkers));
+		config.maxProbe = optionInt(options, "probe", 0);
+		KMeanCluster kCluster(dataset, k, trainConfig);
+		kCluster.setStorageConfig(makeStorageConfig(options));
+		kCluster.setOnlineConfig(makeOnlineConfig(options));
+		reportTraining(kCluster);
+		std::unique_ptr<KeypointCache> cache = makeKeypointCache(options, inWidth, inHeight, thresh);
+		int status = runBatch(device, imageFiles, kCluster, inWidth, inHeight, thresh, config, cache.get());
+		reportKeypointCache(cache.get());
+		return status;
+	}
+
+	cout << "Start Human Pose Estimation using " << device << " on file " << inputFile << endl;
+
+	// Sharded mode: the dataset is split over --shards=N worker processes that train and answer the query together
+	if (options.count("shards"))
+		return runSharded(device, inputFile, dataset, k, trainConfig, inWidth, inHeight, thresh, options);
+
+	// Multi-person mode: every person of the image from one forward pass, each one clustered on its own
+	if (options.count("multi-person")) {
+		KMeanCluster kCluster(dataset, k, trainConfig);
+		kCluster.setStorageConfig(makeStorageConfig(options));
+		kCluster.setOnlineConfig(makeOnlineConfig(options));
+		reportTraining(kCluster);
+		return runMultiPerson(device, inputFile, kCluster, inWidth, inHeight, thresh, options);
+	}
+
+	// Headless mode: no drawing and no windows, only the results are printed and written to test.txt
+	bool headless = options.count("headless") > 0;
+	// An image that is already in the keypoint cache is not run through the network, it is only read to draw its pose
+	std::unique_ptr<KeypointCache> cache = makeKeypointCache(options, inWidth, inHeight, thresh);
+	uint64_t contentKey = 0;
+	bool hashed = cache && KeypointCache::hashFile(inputFile, contentKey);
+	vector<Point> v;
+	if (hashed && cache->lookup(contentKey, v)) {
+		if (!headless) {
+			Mat frame = imread(inputFile);
+			if (!frame.empty())
+				showPose(frame, v, "Output-Skeleton.jpg");
+		}
+	}
+	else {
+		v = performHumanPoseEstimation(device, inputFile, inWidth, inHeight, thresh, !headless, options.count("subpixel") > 0,
+			options.count("reduced-decode") > 0);
+		if (hashed)
+			cache->insert(contentKey, v);
+	}
+	reportKeypointCache(cache.get());
 	// Convert points into a double
 	vector<double> p = pre_processPoints(v);
 	// Compute Clustering
-	KMeanCluster kCluster(k);
+	KMeanCluster kCluster(dataset, k, trainConfig);
+	kCluster.setStorageConfig(makeStorageConfig(options));
+	kCluster.setOnlineConfig(makeOnlineConfig(options));
+	reportTraining(kCluster);
+	int topN = optionInt(options, "top", 0);
+	vector<Neighbor> neighbors;
+	if (topN > 0)
+		neighbors = kCluster.nearest(p, topN, optionInt(options, "probe", 0));
 	vector<string> files = kCluster.cluster(p, inputFile);
 	std::ofstream out("test.txt");
 
+	// With --top=N, the closest stored images are shown in order instead of the whole cluster
+	if (topN > 0) {
+		files.clear();
+		for (const auto& neighbor : neighbors) {
+			cout << neighbor.fileName << " distance " << neighbor.distance << endl;
+			files.push_back(neighbor.fileName);
+		}
+		cout << "Searched " << kCluster.getSearchEvaluations() << " distances" << endl;
+	}
 	for (const auto& row : files) {
 		out << row << '\n';
 	}
 	out.close();
 
-	showRelatedPoseImages(files);
+	if (headless) {
+		for (const auto& row : files)
+			cout << row << endl;
+	}
+	else
+		showRelatedPoseImages(files);
     return 0;
 }
\ No newline at end of file